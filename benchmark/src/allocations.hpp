@@ -0,0 +1,13 @@
+#ifndef RD_BENCH_ALLOCATIONS_HPP
+#define RD_BENCH_ALLOCATIONS_HPP
+#include <cstdint>
+
+/*
+ * The number of times the global operator new has been called so far. The
+ * benchmarks replace operator new to count calls, so that the hot paths can
+ * report their allocations per call. Memory from malloc, which is what libpll
+ * uses, is not counted.
+ */
+uint64_t allocation_count();
+
+#endif
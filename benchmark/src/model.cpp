@@ -1,3 +1,4 @@
+#include "allocations.hpp"
 #include <benchmark/benchmark.h>
 #include <data.hpp>
 #include <model.hpp>
@@ -61,6 +62,110 @@ BENCHMARK(BM_DLH_computation)
     ->Args({1lu, 20})
     ->Args({1lu, 120});
 
+static void BM_D2LH_computation(benchmark::State &state) {
+  std::vector<msa_t> msa;
+  size_t data_index = static_cast<size_t>(state.range(0));
+  msa.emplace_back(data_files_dna[data_keys[data_index]].first);
+  rooted_tree_t tree{data_files_dna[data_keys[data_index]].second};
+  uint32_t seed = (uint32_t)std::rand();
+  model_t model{tree, msa, {1}, true, seed, false};
+  model.initialize_partitions_uniform_freqs(msa);
+  auto rl = tree.root_location(static_cast<size_t>(state.range(1)));
+  model.compute_lh(rl);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(model.compute_d2lh(rl));
+  }
+}
+
+BENCHMARK(BM_D2LH_computation)
+    ->Args({0lu, 0})
+    ->Args({0lu, 2})
+    ->Args({1lu, 0})
+    ->Args({1lu, 20})
+    ->Args({1lu, 120});
+
+/* Compare with BM_DLH_computation, which is a single ratio */
+static void BM_DLH_batch_computation(benchmark::State &state) {
+  std::vector<msa_t> msa;
+  size_t data_index = static_cast<size_t>(state.range(0));
+  msa.emplace_back(data_files_dna[data_keys[data_index]].first);
+  rooted_tree_t tree{data_files_dna[data_keys[data_index]].second};
+  uint32_t seed = (uint32_t)std::rand();
+  model_t model{tree, msa, {1}, true, seed, false};
+  model.initialize_partitions_uniform_freqs(msa);
+  auto rl = tree.root_location(0);
+  model.compute_lh(rl);
+  size_t              count = static_cast<size_t>(state.range(1));
+  std::vector<double> ratios;
+  for (size_t i = 1; i <= count; ++i) {
+    ratios.push_back(static_cast<double>(i) / static_cast<double>(count + 1));
+  }
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(model.compute_dlh_batch(rl, ratios));
+  }
+}
+
+BENCHMARK(BM_DLH_batch_computation)
+    ->Args({0lu, 1})
+    ->Args({0lu, 16})
+    ->Args({1lu, 1})
+    ->Args({1lu, 16});
+
+static void BM_all_edge_lh(benchmark::State &state) {
+  std::vector<msa_t> msa;
+  size_t data_index = static_cast<size_t>(state.range(0));
+  msa.emplace_back(data_files_dna[data_keys[data_index]].first);
+  rooted_tree_t tree{data_files_dna[data_keys[data_index]].second};
+  uint32_t seed = (uint32_t)std::rand();
+  model_t model{tree, msa, {1}, true, seed, false};
+  model.initialize_partitions_uniform_freqs(msa);
+  model.compute_lh(tree.root_location(0));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(model.compute_all_edge_lh());
+  }
+}
+
+BENCHMARK(BM_all_edge_lh)->Arg(0lu)->Arg(1lu);
+
+/* Alternate between two roots, so that the partials get recomputed */
+static void BM_LH_computation_site_blocks(benchmark::State &state) {
+  std::vector<msa_t> msa;
+  size_t data_index = static_cast<size_t>(state.range(0));
+  msa.emplace_back(data_files_dna[data_keys[data_index]].first);
+  rooted_tree_t tree{data_files_dna[data_keys[data_index]].second};
+  uint32_t seed = (uint32_t)std::rand();
+  size_t blocks = static_cast<size_t>(state.range(1));
+  model_t model{tree, msa, {1}, true, seed, false, true, blocks};
+  model.initialize_partitions_uniform_freqs(msa);
+  auto rl_a = tree.root_location(0);
+  auto rl_b = tree.root_location(1);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(model.compute_lh(rl_a));
+    benchmark::DoNotOptimize(model.compute_lh(rl_b));
+  }
+}
+
+BENCHMARK(BM_LH_computation_site_blocks)
+    ->Args({1lu, 1})
+    ->Args({1lu, 2})
+    ->Args({1lu, 4})
+    ->Args({1lu, 8});
+
+static void BM_all_root_lh_sweep(benchmark::State &state) {
+  std::vector<msa_t> msa;
+  size_t data_index = static_cast<size_t>(state.range(0));
+  msa.emplace_back(data_files_dna[data_keys[data_index]].first);
+  rooted_tree_t tree{data_files_dna[data_keys[data_index]].second};
+  uint32_t seed = (uint32_t)std::rand();
+  model_t model{tree, msa, {1}, true, seed, false, false};
+  model.initialize_partitions_uniform_freqs(msa);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(model.compute_all_root_lh());
+  }
+}
+
+BENCHMARK(BM_all_root_lh_sweep)->Arg(0lu)->Arg(1lu);
+
 static void BM_LH_root_computation(benchmark::State &state) {
   std::vector<msa_t> msa;
   msa.emplace_back(data_files_dna["101.phy"].first);
@@ -76,3 +181,69 @@ static void BM_LH_root_computation(benchmark::State &state) {
 }
 
 BENCHMARK(BM_LH_root_computation)->Arg(0)->Arg(20)->Arg(120);
+
+/*
+ * Report the allocations made by one call of the root hot paths, once the
+ * first calls have sized the scratch buffers. The brlen ratio changes on every
+ * call, and there are more ratios than the lh cache holds, so every call is a
+ * miss in the cache.
+ */
+static void BM_hot_path_allocations(benchmark::State &state) {
+  std::vector<msa_t> msa;
+  msa.emplace_back(data_files_dna["101.phy"].first);
+  rooted_tree_t tree{data_files_dna["101.phy"].second};
+  uint32_t seed = (uint32_t)std::rand();
+  model_t model{tree, msa, {1}, true, seed, false};
+  model.initialize_partitions_uniform_freqs(msa);
+  auto rl = tree.root_location(static_cast<size_t>(state.range(0)));
+  model.compute_lh(rl);
+
+  std::vector<root_location_t> ratios;
+  for (size_t i = 0; i < 97; ++i) {
+    ratios.push_back(rl);
+    ratios.back().brlen_ratio = static_cast<double>(i) / 96.0;
+    model.compute_lh_root(ratios.back());
+    model.compute_d2lh(ratios.back());
+  }
+
+  uint64_t allocations = 0;
+  uint64_t calls       = 0;
+  size_t   next        = 0;
+  for (auto _ : state) {
+    auto &   cur   = ratios[next];
+    uint64_t start = allocation_count();
+    benchmark::DoNotOptimize(model.compute_lh_root(cur));
+    benchmark::DoNotOptimize(model.compute_d2lh(cur));
+    allocations += allocation_count() - start;
+    calls += 2;
+    next = (next + 1) % ratios.size();
+  }
+  state.counters["allocations_per_call"] =
+      static_cast<double>(allocations) / static_cast<double>(calls);
+}
+
+BENCHMARK(BM_hot_path_allocations)->Arg(0)->Arg(20)->Arg(120);
+
+/* Moving between roots goes through move_root for every root */
+static void BM_root_sweep_allocations(benchmark::State &state) {
+  std::vector<msa_t> msa;
+  msa.emplace_back(data_files_dna["101.phy"].first);
+  rooted_tree_t tree{data_files_dna["101.phy"].second};
+  uint32_t seed = (uint32_t)std::rand();
+  model_t model{tree, msa, {1}, true, seed, false, false};
+  model.initialize_partitions_uniform_freqs(msa);
+  model.compute_all_root_lh();
+
+  uint64_t allocations = 0;
+  uint64_t roots       = 0;
+  for (auto _ : state) {
+    uint64_t start = allocation_count();
+    benchmark::DoNotOptimize(model.compute_all_root_lh());
+    allocations += allocation_count() - start;
+    roots += tree.root_count();
+  }
+  state.counters["allocations_per_root"] =
+      static_cast<double>(allocations) / static_cast<double>(roots);
+}
+
+BENCHMARK(BM_root_sweep_allocations);
@@ -0,0 +1,373 @@
+#include "synthetic.hpp"
+#include <benchmark/benchmark.h>
+#include <checkpoint.hpp>
+#include <data.hpp>
+#include <model.hpp>
+#include <profile.hpp>
+#include <unistd.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/*
+ * Benchmarks for the optimization and search paths, which are the ones that
+ * dominate a real run. The optimizations are run from the same starting state
+ * every iteration, so the model is rebuilt outside of the timed region.
+ */
+
+static checkpoint_t make_bench_checkpoint() {
+  static size_t counter = 0;
+  checkpoint_t  ckp(std::string("/tmp/rd_bench_") + std::to_string(getpid())
+                   + "_" + std::to_string(counter++));
+  cli_options_t cli_options;
+  ckp.save_options(cli_options);
+  ckp.reload();
+  return ckp;
+}
+
+static std::vector<msa_t> make_msas(const std::vector<std::string> &filenames) {
+  std::vector<msa_t> msa;
+  for (auto &f : filenames) { msa.emplace_back(f); }
+  return msa;
+}
+
+static void BM_optimize_alpha(benchmark::State &state) {
+  size_t             data_index = static_cast<size_t>(state.range(0));
+  auto &             ds         = data_files_dna[data_keys[data_index]];
+  std::vector<msa_t> msa;
+  msa.emplace_back(ds.first);
+  rooted_tree_t tree{ds.second};
+  uint32_t      seed = (uint32_t)std::rand();
+  model_t       model{tree, msa, {1}, true, seed, false};
+  model.initialize_partitions_uniform_freqs(msa);
+  auto rl = tree.root_location(static_cast<size_t>(state.range(1)));
+  model.compute_lh(rl);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(model.optimize_alpha(rl, 1e-7));
+  }
+}
+
+BENCHMARK(BM_optimize_alpha)->Args({1lu, 0})->Args({1lu, 20})->Args({2lu, 2});
+
+static void BM_suggest_roots_lh(benchmark::State &state) {
+  size_t             data_index = static_cast<size_t>(state.range(0));
+  auto &             ds         = data_files_dna[data_keys[data_index]];
+  std::vector<msa_t> msa;
+  msa.emplace_back(ds.first);
+  rooted_tree_t tree{ds.second};
+  uint32_t      seed = (uint32_t)std::rand();
+  model_t       model{tree, msa, {1}, true, seed, false};
+  model.initialize_partitions_uniform_freqs(msa);
+  model.compute_lh(tree.root_location(0));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(model.suggest_roots_lh(1, 0.1));
+  }
+}
+
+BENCHMARK(BM_suggest_roots_lh)->Arg(1lu)->Arg(2lu);
+
+/*
+ * Ranking with four rate categories, with the second arg turning on the
+ * screening blocks. Without them, this is the move_root sweep.
+ */
+static void BM_suggest_roots_screening(benchmark::State &state) {
+  size_t             data_index = static_cast<size_t>(state.range(0));
+  auto &             ds         = data_files_dna[data_keys[data_index]];
+  std::vector<msa_t> msa;
+  msa.emplace_back(ds.first);
+  rooted_tree_t tree{ds.second};
+  uint32_t      seed = (uint32_t)std::rand();
+  model_t       model{
+      tree, msa, {4}, true, seed, false, false, 0, state.range(1) != 0};
+  model.initialize_partitions_uniform_freqs(msa);
+  model.compute_lh(tree.root_location(0));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(model.suggest_roots_lh(1, 0.1));
+  }
+}
+
+BENCHMARK(BM_suggest_roots_screening)
+    ->Args({1lu, 0})
+    ->Args({1lu, 1})
+    ->Args({2lu, 0})
+    ->Args({2lu, 1});
+
+/*
+ * optimize_root_location ranks the roots and optimizes alpha on the best of
+ * them, with the model parameters left as they are. BM_optimize_params covers
+ * the parameter optimization.
+ */
+static void BM_optimize_root_location(benchmark::State &state) {
+  size_t             data_index = static_cast<size_t>(state.range(0));
+  auto &             ds         = data_files_dna[data_keys[data_index]];
+  std::vector<msa_t> msa;
+  msa.emplace_back(ds.first);
+  rooted_tree_t tree{ds.second};
+  uint32_t      seed = (uint32_t)std::rand();
+  for (auto _ : state) {
+    state.PauseTiming();
+    model_t model{tree, msa, {4}, true, seed, false};
+    model.initialize_partitions_uniform_freqs(msa);
+    model.compute_lh(tree.root_location(0));
+    state.ResumeTiming();
+    benchmark::DoNotOptimize(model.optimize_root_location(1, 0.05));
+  }
+}
+
+BENCHMARK(BM_optimize_root_location)
+    ->Arg(1lu)
+    ->Arg(2lu)
+    ->Unit(benchmark::kMillisecond);
+
+/*
+ * An exhaustive search over a single root, which alternates optimize_params
+ * with the alpha optimization until the lh of the root converges.
+ */
+static void BM_optimize_params(benchmark::State &state) {
+  size_t             data_index = static_cast<size_t>(state.range(0));
+  auto &             ds         = data_files_dna[data_keys[data_index]];
+  std::vector<msa_t> msa;
+  msa.emplace_back(ds.first);
+  rooted_tree_t tree{ds.second};
+  uint32_t      seed = (uint32_t)std::rand();
+  for (auto _ : state) {
+    state.PauseTiming();
+    auto    checkpoint = make_bench_checkpoint();
+    model_t model{tree, msa, {4}, true, seed, false};
+    model.initialize_partitions_uniform_freqs(msa);
+    model.compute_lh(tree.root_location(0));
+    model.assign_indicies(std::vector<size_t>{0});
+    state.ResumeTiming();
+    benchmark::DoNotOptimize(
+        model.exhaustive_search(1e-7, 1e-7, 1e-12, 1e4, checkpoint));
+    state.PauseTiming();
+    checkpoint.clean();
+    state.ResumeTiming();
+  }
+}
+
+BENCHMARK(BM_optimize_params)
+    ->Arg(1lu)
+    ->Arg(2lu)
+    ->Unit(benchmark::kMillisecond);
+
+/*
+ * Compare the alternating parameter optimization with the joint one, over the
+ * same single root search as BM_optimize_params. The second arg turns on the
+ * joint optimization. The lh evaluations, and the number of joint
+ * optimizations, are reported as counters, so a run where the joint path
+ * wasn't taken shows up as zero.
+ */
+static void BM_optimize_params_evaluations(benchmark::State &state) {
+  size_t             data_index = static_cast<size_t>(state.range(0));
+  auto &             ds         = data_files_dna[data_keys[data_index]];
+  std::vector<msa_t> msa;
+  msa.emplace_back(ds.first);
+  rooted_tree_t tree{ds.second};
+  uint32_t      seed        = (uint32_t)std::rand();
+  uint64_t      evaluations = 0;
+  uint64_t      joint_runs  = 0;
+  uint64_t      runs        = 0;
+  for (auto _ : state) {
+    state.PauseTiming();
+    auto    checkpoint = make_bench_checkpoint();
+    model_t model{tree, msa, {4}, true, seed, false};
+    model.set_joint_params(state.range(1) != 0);
+    model.initialize_partitions_uniform_freqs(msa);
+    model.compute_lh(tree.root_location(0));
+    model.assign_indicies(std::vector<size_t>{0});
+    profile::enable();
+    state.ResumeTiming();
+    benchmark::DoNotOptimize(
+        model.exhaustive_search(1e-7, 1e-7, 1e-12, 1e4, checkpoint));
+    state.PauseTiming();
+    evaluations += profile::counter_value(profile::lh_evaluations);
+    joint_runs += profile::counter_value(profile::joint_optimizations);
+    profile::disable();
+    checkpoint.clean();
+    runs++;
+    state.ResumeTiming();
+  }
+  state.counters["lh_evaluations"] =
+      static_cast<double>(evaluations) / static_cast<double>(runs);
+  state.counters["joint_optimizations"] =
+      static_cast<double>(joint_runs) / static_cast<double>(runs);
+}
+
+BENCHMARK(BM_optimize_params_evaluations)
+    ->Args({1lu, 0})
+    ->Args({1lu, 1})
+    ->Args({2lu, 0})
+    ->Args({2lu, 1})
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_search(benchmark::State &state) {
+  size_t             data_index = static_cast<size_t>(state.range(0));
+  auto &             ds         = data_files_dna[data_keys[data_index]];
+  std::vector<msa_t> msa;
+  msa.emplace_back(ds.first);
+  rooted_tree_t tree{ds.second};
+  uint32_t      seed = (uint32_t)std::rand();
+  for (auto _ : state) {
+    state.PauseTiming();
+    auto    checkpoint = make_bench_checkpoint();
+    model_t model{tree, msa, {4}, true, seed, false};
+    model.initialize_partitions_uniform_freqs(msa);
+    model.initialize();
+    model.assign_indicies_by_rank_search(1, 0.05, 0, 1, checkpoint);
+    state.ResumeTiming();
+    benchmark::DoNotOptimize(
+        model.search(1, 0.05, 1e-7, 1e-7, 1e-12, 1e4, checkpoint));
+    state.PauseTiming();
+    checkpoint.clean();
+    state.ResumeTiming();
+  }
+}
+
+BENCHMARK(BM_search)->Arg(1lu)->Arg(2lu)->Unit(benchmark::kMillisecond);
+
+static void BM_exhaustive_search(benchmark::State &state) {
+  size_t             data_index = static_cast<size_t>(state.range(0));
+  auto &             ds         = data_files_dna[data_keys[data_index]];
+  std::vector<msa_t> msa;
+  msa.emplace_back(ds.first);
+  rooted_tree_t tree{ds.second};
+  uint32_t      seed = (uint32_t)std::rand();
+  for (auto _ : state) {
+    state.PauseTiming();
+    auto    checkpoint = make_bench_checkpoint();
+    model_t model{tree, msa, {1}, true, seed, false};
+    model.initialize_partitions_uniform_freqs(msa);
+    model.initialize();
+    model.assign_indicies_by_rank_exhaustive(0, 1, checkpoint);
+    state.ResumeTiming();
+    benchmark::DoNotOptimize(
+        model.exhaustive_search(1e-7, 1e-7, 1e-12, 1e4, checkpoint));
+    state.PauseTiming();
+    checkpoint.clean();
+    state.ResumeTiming();
+  }
+}
+
+BENCHMARK(BM_exhaustive_search)->Arg(2lu)->Unit(benchmark::kMillisecond);
+
+static std::vector<partition_parameters_t> make_bench_params() {
+  partition_parameters_t p;
+  p.subst_rates = model_params_t(12, 1.0);
+  p.freqs       = model_params_t(4, 0.25);
+  p.gamma_alpha = model_params_t(1, 1.0);
+  return {p};
+}
+
+static void BM_checkpoint_write(benchmark::State &state) {
+  auto   checkpoint = make_bench_checkpoint();
+  auto   params     = make_bench_params();
+  size_t root_id    = 0;
+  for (auto _ : state) {
+    checkpoint.write(rd_result_t{root_id++, -1000.0, 0.5}, params);
+  }
+  checkpoint.clean();
+}
+
+BENCHMARK(BM_checkpoint_write);
+
+static void BM_checkpoint_read_results(benchmark::State &state) {
+  auto checkpoint = make_bench_checkpoint();
+  auto params     = make_bench_params();
+  for (size_t i = 0; i < static_cast<size_t>(state.range(0)); ++i) {
+    checkpoint.write(rd_result_t{i, -1000.0, 0.5}, params);
+  }
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(checkpoint.read_results());
+  }
+  checkpoint.clean();
+}
+
+BENCHMARK(BM_checkpoint_read_results)->Arg(10)->Arg(100)->Arg(1000);
+
+/*
+ * Scaling sweeps over synthetic data. The args are taxa, sites per partition,
+ * partitions and threads, and are repeated as counters so that they show up
+ * as separate fields in the machine readable output.
+ */
+static void set_sweep_counters(benchmark::State &state) {
+  state.counters["taxa"]       = static_cast<double>(state.range(0));
+  state.counters["sites"]      = static_cast<double>(state.range(1));
+  state.counters["partitions"] = static_cast<double>(state.range(2));
+  state.counters["threads"]    = static_cast<double>(state.range(3));
+}
+
+static void sweep_args(benchmark::internal::Benchmark *b) {
+  for (int taxa : {16, 64, 256}) {
+    for (int sites : {1000, 10000}) {
+      for (int partitions : {1, 4}) {
+        for (int threads : {1, 2, 4, 8}) {
+          b->Args({taxa, sites, partitions, threads});
+        }
+      }
+    }
+  }
+}
+
+static void BM_synthetic_lh(benchmark::State &state) {
+  auto &data = make_synthetic_data(static_cast<size_t>(state.range(0)),
+                                   static_cast<size_t>(state.range(1)),
+                                   static_cast<size_t>(state.range(2)));
+#ifdef _OPENMP
+  int threads = omp_get_max_threads();
+  omp_set_num_threads(static_cast<int>(state.range(3)));
+#endif
+  {
+    auto          msa = make_msas(data.msa_filenames);
+    rooted_tree_t tree{data.tree_filename};
+    uint32_t      seed = (uint32_t)std::rand();
+    std::vector<ratehet_opts_t> rate_cats(msa.size(), ratehet_opts_t{4});
+    model_t model{tree, msa, rate_cats, true, seed, false};
+    model.initialize_partitions_uniform_freqs(msa);
+    auto rl_a = tree.root_location(0);
+    auto rl_b = tree.root_location(1);
+    for (auto _ : state) {
+      benchmark::DoNotOptimize(model.compute_lh(rl_a));
+      benchmark::DoNotOptimize(model.compute_lh(rl_b));
+    }
+  }
+#ifdef _OPENMP
+  omp_set_num_threads(threads);
+#endif
+  set_sweep_counters(state);
+}
+
+BENCHMARK(BM_synthetic_lh)->Apply(sweep_args)->UseRealTime();
+
+static void BM_synthetic_optimize_root_location(benchmark::State &state) {
+  auto &data = make_synthetic_data(static_cast<size_t>(state.range(0)),
+                                   static_cast<size_t>(state.range(1)),
+                                   static_cast<size_t>(state.range(2)));
+#ifdef _OPENMP
+  int threads = omp_get_max_threads();
+  omp_set_num_threads(static_cast<int>(state.range(3)));
+#endif
+  {
+    auto          msa = make_msas(data.msa_filenames);
+    rooted_tree_t tree{data.tree_filename};
+    uint32_t      seed = (uint32_t)std::rand();
+    std::vector<ratehet_opts_t> rate_cats(msa.size(), ratehet_opts_t{4});
+    for (auto _ : state) {
+      state.PauseTiming();
+      model_t model{tree, msa, rate_cats, true, seed, false};
+      model.initialize_partitions_uniform_freqs(msa);
+      model.compute_lh(tree.root_location(0));
+      state.ResumeTiming();
+      benchmark::DoNotOptimize(model.optimize_root_location(1, 0.05));
+    }
+  }
+#ifdef _OPENMP
+  omp_set_num_threads(threads);
+#endif
+  set_sweep_counters(state);
+}
+
+BENCHMARK(BM_synthetic_optimize_root_location)
+    ->Apply(sweep_args)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
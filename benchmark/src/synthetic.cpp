@@ -0,0 +1,134 @@
+#include "synthetic.hpp"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <tuple>
+
+static constexpr char nucleotides[] = "ACGT";
+
+class synthetic_generator_t {
+public:
+  synthetic_generator_t(size_t sites, uint64_t seed) :
+      _sites{sites}, _random_engine{seed} {}
+
+  /*
+   * Build the newick string for a subtree over the given taxa, evolving the
+   * sequences of the taxa from the parent sequence along the way.
+   */
+  std::string build_subtree(std::vector<size_t> taxa,
+                            const std::string & parent_seq) {
+    std::exponential_distribution<double> brlen_dist(10.0);
+    double                                brlen = brlen_dist(_random_engine);
+    std::string                           seq   = evolve(parent_seq, brlen);
+
+    if (taxa.size() == 1) {
+      _sequences[taxa.front()] = seq;
+      return "t" + std::to_string(taxa.front()) + ":" + std::to_string(brlen);
+    }
+
+    std::shuffle(taxa.begin(), taxa.end(), _random_engine);
+    std::uniform_int_distribution<size_t> split_dist(1, taxa.size() - 1);
+    size_t                                split = split_dist(_random_engine);
+    auto                offset = static_cast<offset_t>(split);
+    std::vector<size_t> left(taxa.begin(), taxa.begin() + offset);
+    std::vector<size_t> right(taxa.begin() + offset, taxa.end());
+
+    return "(" + build_subtree(left, seq) + "," + build_subtree(right, seq)
+           + "):" + std::to_string(brlen);
+  }
+
+  /* The unrooted tree has a trifurcation at the top */
+  std::string build_tree(size_t taxa) {
+    _sequences.assign(taxa, std::string());
+    std::vector<size_t> ids(taxa);
+    for (size_t i = 0; i < taxa; ++i) { ids[i] = i; }
+    std::shuffle(ids.begin(), ids.end(), _random_engine);
+
+    std::string root_seq = random_sequence();
+    auto        first    = static_cast<offset_t>(taxa / 3);
+    auto        second   = static_cast<offset_t>(2 * taxa / 3);
+    std::vector<size_t> a(ids.begin(), ids.begin() + first);
+    std::vector<size_t> b(ids.begin() + first, ids.begin() + second);
+    std::vector<size_t> c(ids.begin() + second, ids.end());
+
+    return "(" + build_subtree(a, root_seq) + "," + build_subtree(b, root_seq)
+           + "," + build_subtree(c, root_seq) + ");";
+  }
+
+  const std::vector<std::string> &sequences() const { return _sequences; }
+
+private:
+  typedef std::vector<size_t>::difference_type offset_t;
+
+  std::string random_sequence() {
+    std::uniform_int_distribution<size_t> base_dist(0, 3);
+    std::string                           seq(_sites, 'A');
+    for (auto &c : seq) { c = nucleotides[base_dist(_random_engine)]; }
+    return seq;
+  }
+
+  std::string evolve(const std::string &parent_seq, double brlen) {
+    double change_prob = 0.75 * (1.0 - std::exp(-4.0 / 3.0 * brlen));
+    std::uniform_real_distribution<double> change_dist(0.0, 1.0);
+    std::uniform_int_distribution<size_t>  base_dist(1, 3);
+    std::string                            seq{parent_seq};
+    for (auto &c : seq) {
+      if (change_dist(_random_engine) < change_prob) {
+        size_t cur = static_cast<size_t>(
+            std::find(nucleotides, nucleotides + 4, c) - nucleotides);
+        c = nucleotides[(cur + base_dist(_random_engine)) % 4];
+      }
+    }
+    return seq;
+  }
+
+  size_t                   _sites;
+  std::mt19937_64          _random_engine;
+  std::vector<std::string> _sequences;
+};
+
+const synthetic_data_t &make_synthetic_data(size_t   taxa,
+                                            size_t   sites,
+                                            size_t   partitions,
+                                            uint64_t seed) {
+  static std::map<std::tuple<size_t, size_t, size_t, uint64_t>,
+                  synthetic_data_t>
+      cache;
+
+  if (taxa < 3 || sites == 0 || partitions == 0) {
+    throw std::invalid_argument("Synthetic data needs at least 3 taxa, and "
+                                "at least one site and partition");
+  }
+
+  auto key = std::make_tuple(taxa, sites, partitions, seed);
+  auto it  = cache.find(key);
+  if (it != cache.end()) { return it->second; }
+
+  std::string prefix = "/tmp/rd_bench_" + std::to_string(taxa) + "_"
+                       + std::to_string(sites) + "_"
+                       + std::to_string(partitions) + "_"
+                       + std::to_string(seed);
+
+  synthetic_generator_t generator{sites * partitions, seed};
+  synthetic_data_t      data;
+
+  data.tree_filename = prefix + ".tree";
+  std::ofstream tree_file{data.tree_filename};
+  tree_file << generator.build_tree(taxa) << std::endl;
+
+  auto &sequences = generator.sequences();
+  for (size_t p = 0; p < partitions; ++p) {
+    data.msa_filenames.push_back(prefix + "_p" + std::to_string(p)
+                                 + ".fasta");
+    std::ofstream msa_file{data.msa_filenames.back()};
+    for (size_t t = 0; t < taxa; ++t) {
+      msa_file << ">t" << t << "\n"
+               << sequences[t].substr(p * sites, sites) << "\n";
+    }
+  }
+
+  return cache.emplace(key, std::move(data)).first->second;
+}
@@ -0,0 +1,27 @@
+#ifndef RD_BENCH_SYNTHETIC_HPP
+#define RD_BENCH_SYNTHETIC_HPP
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * Files for a synthetic dataset, used for the scaling sweeps. The tree is a
+ * random unrooted tree, and the sequences are evolved down the tree under JC,
+ * so the alignment has some signal instead of being pure noise. Each partition
+ * gets its own alignment file over the same taxa.
+ */
+struct synthetic_data_t {
+  std::string              tree_filename;
+  std::vector<std::string> msa_filenames;
+};
+
+/*
+ * Make, or reuse, a dataset of the given size. The files are written to /tmp,
+ * and are the same for the same arguments.
+ */
+const synthetic_data_t &make_synthetic_data(size_t   taxa,
+                                            size_t   sites,
+                                            size_t   partitions,
+                                            uint64_t seed = 0);
+
+#endif
@@ -1,3 +1,4 @@
+#include "synthetic.hpp"
 #include <benchmark/benchmark.h>
 #include <data.hpp>
 #include <tree.hpp>
@@ -59,3 +60,34 @@ BENCHMARK(BM_tree_generate_derivative_operations)
     ->Args({1, 0})
     ->Args({1, 20})
     ->Args({1, 120});
+
+/* The args are the number of taxa of a synthetic tree */
+static void BM_tree_rank_midpoints(benchmark::State &state) {
+  auto &data =
+      make_synthetic_data(static_cast<size_t>(state.range(0)), 1000, 1);
+  rooted_tree_t tree{data.tree_filename};
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(tree.rank_midpoints());
+  }
+}
+
+BENCHMARK(BM_tree_rank_midpoints)
+    ->Arg(64)
+    ->Arg(256)
+    ->Arg(1024)
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_tree_rank_modified_mad(benchmark::State &state) {
+  auto &data =
+      make_synthetic_data(static_cast<size_t>(state.range(0)), 1000, 1);
+  rooted_tree_t tree{data.tree_filename};
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(tree.rank_modified_mad());
+  }
+}
+
+BENCHMARK(BM_tree_rank_modified_mad)
+    ->Arg(64)
+    ->Arg(256)
+    ->Arg(1024)
+    ->Unit(benchmark::kMillisecond);
@@ -0,0 +1,82 @@
+#include "batch.hpp"
+#include <algorithm>
+#include <fstream>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unordered_set>
+
+bool parse_batch_job(const std::string &line, batch_job_t &job) {
+  std::istringstream       stream{line};
+  std::vector<std::string> fields;
+  for (std::string field; stream >> field;) {
+    if (fields.empty() && field[0] == '#') { return false; }
+    fields.push_back(field);
+  }
+  if (fields.empty()) { return false; }
+  if (fields.size() < 2 || fields.size() > 4) {
+    throw std::runtime_error{"A batch job needs an MSA and a tree, and at most "
+                             "a partition file and a prefix: "
+                             + line};
+  }
+
+  job.msa_filename  = fields[0];
+  job.tree_filename = fields[1];
+  job.partition_filename.clear();
+  if (fields.size() > 2 && fields[2] != "-") {
+    job.partition_filename = fields[2];
+  }
+  job.prefix = fields.size() > 3 ? fields[3] : job.tree_filename;
+  return true;
+}
+
+std::vector<batch_job_t> parse_batch_file(const std::string &filename) {
+  std::ifstream batch_file{filename};
+  if (!batch_file) {
+    throw std::runtime_error{"Failed to open the batch file"};
+  }
+
+  std::vector<batch_job_t>        jobs;
+  std::unordered_set<std::string> prefixes;
+  for (std::string line; std::getline(batch_file, line);) {
+    batch_job_t job;
+    if (!parse_batch_job(line, job)) { continue; }
+    if (!prefixes.insert(job.prefix).second) {
+      throw std::runtime_error{"Two batch jobs have the same prefix: "
+                               + job.prefix};
+    }
+    jobs.push_back(job);
+  }
+  return jobs;
+}
+
+double estimate_batch_cost(const batch_job_t &job) {
+  struct stat statbuf;
+  if (stat(job.msa_filename.c_str(), &statbuf) == -1) { return 0.0; }
+  return static_cast<double>(statbuf.st_size);
+}
+
+std::vector<size_t> assign_batch_jobs(const std::vector<double> &costs,
+                                      size_t                     rank,
+                                      size_t                     num_tasks) {
+  if (num_tasks == 0 || rank >= num_tasks) {
+    throw std::invalid_argument{"Rank is out of range for the batch"};
+  }
+  std::vector<size_t> order(costs.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return costs[a] > costs[b];
+  });
+
+  std::vector<double> loads(num_tasks, 0.0);
+  std::vector<size_t> assigned;
+  for (auto job : order) {
+    auto least = static_cast<size_t>(
+        std::min_element(loads.begin(), loads.end()) - loads.begin());
+    /* Every job costs something to set up, which also spreads out ties */
+    loads[least] += costs[job] + 1.0;
+    if (least == rank) { assigned.push_back(job); }
+  }
+  return assigned;
+}
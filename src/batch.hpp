@@ -0,0 +1,46 @@
+#ifndef RD_BATCH_HPP_
+#define RD_BATCH_HPP_
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/* One tree to root in batch mode, with its own outputs and checkpoint */
+struct batch_job_t {
+  std::string msa_filename;
+  std::string tree_filename;
+  std::string partition_filename;
+  std::string prefix;
+};
+
+/*
+ * Parse a batch manifest. Each line is a job, made of the MSA, the tree, the
+ * partition file and the prefix, separated by whitespace. A partition file of
+ * "-" means there is none, and both the partition file and the prefix can be
+ * left off, in which case the tree path is used for the prefix, like for a
+ * single run. Blank lines and lines starting with '#' are skipped. Throws if a
+ * line is malformed, or if two jobs have the same prefix.
+ */
+std::vector<batch_job_t> parse_batch_file(const std::string &filename);
+
+/* Returns false for a line without a job */
+bool parse_batch_job(const std::string &line, batch_job_t &job);
+
+/*
+ * Rough cost of a job, which is the size of its MSA file, so that the jobs can
+ * be scheduled without parsing all of the alignments first. Unreadable files
+ * cost nothing, and fail when the job is run.
+ */
+double estimate_batch_cost(const batch_job_t &job);
+
+/*
+ * Split the jobs between the ranks, biggest first, giving each job to the rank
+ * with the least work so far. Returns the indices of the jobs of the given
+ * rank, biggest first, so that the workers of a process start on the long jobs
+ * and fill in with the short ones.
+ */
+std::vector<size_t> assign_batch_jobs(const std::vector<double> &costs,
+                                      size_t                     rank,
+                                      size_t                     num_tasks);
+
+#endif
@@ -0,0 +1,161 @@
+#include "bootstrap.hpp"
+#include "checkpoint.hpp"
+#include "debug.h"
+#include "profile.hpp"
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+std::vector<unsigned int> bootstrap_weights(const unsigned int *weights,
+                                            size_t              patterns,
+                                            std::minstd_rand &  engine) {
+  std::vector<unsigned long> cumulative(patterns);
+  unsigned long              total = 0;
+  for (size_t i = 0; i < patterns; ++i) {
+    total += weights[i];
+    cumulative[i] = total;
+  }
+
+  std::vector<unsigned int> sampled(patterns, 0);
+  if (total == 0) { return sampled; }
+
+  std::uniform_int_distribution<unsigned long> dis(0, total - 1);
+  for (unsigned long site = 0; site < total; ++site) {
+    auto it =
+        std::upper_bound(cumulative.begin(), cumulative.end(), dis(engine));
+    sampled[static_cast<size_t>(it - cumulative.begin())]++;
+  }
+  return sampled;
+}
+
+std::vector<double> root_support(const std::vector<size_t> &best_roots,
+                                 size_t                     root_count) {
+  std::vector<double> support(root_count, 0.0);
+  if (best_roots.empty()) { return support; }
+  for (auto root_id : best_roots) {
+    if (root_id >= root_count) {
+      throw std::out_of_range("Root id is out of range for the root support");
+    }
+    support[root_id] += 1.0;
+  }
+  for (auto &s : support) { s /= static_cast<double>(best_roots.size()); }
+  return support;
+}
+
+/* Wait for the other ranks, unless the job is run by this process alone */
+static void replicate_barrier(bool local) {
+#ifdef MPI_VERSION
+  if (!local) { profile::mpi_barrier(); }
+#else
+  (void)local;
+#endif
+}
+
+/*
+ * True if the budget has run out on any rank, so that all of the ranks agree
+ * on whether to start the next search.
+ */
+static bool budget_exhausted_on_any_rank(const model_t &model, bool local) {
+  int exhausted = model.budget_exhausted();
+#ifdef MPI_VERSION
+  if (!local) {
+    MPI_Allreduce(
+        MPI_IN_PLACE, &exhausted, 1, MPI_INT, MPI_LOR, MPI_COMM_WORLD);
+  }
+#else
+  (void)local;
+#endif
+  return exhausted != 0;
+}
+
+std::vector<double> bootstrap_support(model_t &                 model,
+                                      const std::vector<msa_t> &msa,
+                                      const cli_options_t &     cli_options,
+                                      size_t                    root_count,
+                                      size_t                    rank,
+                                      size_t                    num_tasks,
+                                      bool                      local) {
+  bool                lead = local || __MPI_RANK__ == 0;
+  std::minstd_rand    engine{static_cast<std::minstd_rand::result_type>(
+      cli_options.seed)};
+  std::vector<size_t> best_roots;
+  best_roots.reserve(cli_options.bootstraps);
+
+  model.set_warm_start(true);
+  for (size_t r = 0; r < cli_options.bootstraps; ++r) {
+    if (budget_exhausted_on_any_rank(model, local)) {
+      debug_print(EMIT_LEVEL_WARNING,
+                  "The search budget ran out, skipping the last %lu "
+                  "bootstrap replicates",
+                  cli_options.bootstraps - r);
+      break;
+    }
+
+    std::vector<std::vector<unsigned int>> weights;
+    weights.reserve(msa.size());
+    for (auto &m : msa) {
+      weights.push_back(bootstrap_weights(m.weights(), m.length(), engine));
+    }
+    model.set_pattern_weights(weights);
+
+    checkpoint_t checkpoint(cli_options.prefix + ".bs" + std::to_string(r));
+    checkpoint.set_policy(checkpoint_policy(cli_options));
+    if (lead) {
+      /* The results are read after the options header, so it has to be
+       * written before anything is read from a new checkpoint */
+      checkpoint.save_options(cli_options);
+      if (checkpoint.needs_cleaning()) { checkpoint.merge(); }
+    }
+    replicate_barrier(local);
+    checkpoint.reload();
+
+    debug_print(EMIT_LEVEL_PROGRESS,
+                "Starting bootstrap replicate %lu / %lu",
+                r + 1,
+                cli_options.bootstraps);
+    model.initialize();
+
+    std::pair<root_location_t, double> tmp;
+    try {
+      if (!cli_options.exhaustive) {
+        model.assign_indicies_by_rank_search(cli_options.min_roots,
+                                             cli_options.root_ratio,
+                                             rank,
+                                             num_tasks,
+                                             cli_options.initial_root_strategy,
+                                             checkpoint);
+        replicate_barrier(local);
+        tmp = model.search(cli_options.min_roots,
+                           cli_options.root_ratio,
+                           cli_options.abs_tolerance,
+                           cli_options.bfgs_tol,
+                           cli_options.br_tolerance,
+                           cli_options.factor,
+                           checkpoint);
+      } else {
+        model.assign_indicies_by_rank_exhaustive(rank, num_tasks, checkpoint);
+        replicate_barrier(local);
+        tmp = model.exhaustive_search(cli_options.abs_tolerance,
+                                      cli_options.bfgs_tol,
+                                      cli_options.br_tolerance,
+                                      cli_options.factor,
+                                      checkpoint);
+      }
+    } catch (const invalid_empirical_frequencies_exception &) {
+      /* The weights are the same on every rank, so they all skip it */
+      debug_print(EMIT_LEVEL_WARNING,
+                  "Skipping bootstrap replicate %lu, as one of the states "
+                  "was left out of its sites",
+                  r + 1);
+      continue;
+    }
+
+    if (lead) { best_roots.push_back(tmp.first.id); }
+    model.seed_warm_start(checkpoint);
+  }
+
+  if (!lead) { return {}; }
+  return root_support(best_roots, root_count);
+}
+
@@ -0,0 +1,47 @@
+#ifndef RD_BOOTSTRAP_HPP_
+#define RD_BOOTSTRAP_HPP_
+
+#include "model.hpp"
+#include "msa.hpp"
+#include "util.hpp"
+#include <cstddef>
+#include <random>
+#include <vector>
+
+/*
+ * Draw the pattern weights of a bootstrap replicate. As many sites as the
+ * weights add up to are picked with replacement, so each pattern is picked
+ * with a probability proportional to its weight. Returns the number of times
+ * each pattern was picked.
+ */
+std::vector<unsigned int> bootstrap_weights(const unsigned int *weights,
+                                            size_t              patterns,
+                                            std::minstd_rand &  engine);
+
+/*
+ * Fraction of the replicates in which each root was the best, where
+ * best_roots holds the id of the best root of every replicate.
+ */
+std::vector<double> root_support(const std::vector<size_t> &best_roots,
+                                 size_t                     root_count);
+
+/*
+ * Search the bootstrap replicates of a job with the model of the main search.
+ * A replicate resamples the sites of each partition, which only changes the
+ * weights of the site patterns, so the partitions and tip states are kept, and
+ * each replicate is warm started from the parameters of the one before. The
+ * weights are drawn from the seed, so that every rank, and a resumed run, draw
+ * the same ones. Each replicate has its own checkpoint, so an interrupted run
+ * only has to redo the replicate it was in. Returns the fraction of the
+ * replicates in which each root was the best on the lead, and nothing on the
+ * other ranks.
+ */
+std::vector<double> bootstrap_support(model_t &                 model,
+                                      const std::vector<msa_t> &msa,
+                                      const cli_options_t &     cli_options,
+                                      size_t                    root_count,
+                                      size_t                    rank,
+                                      size_t                    num_tasks,
+                                      bool                      local);
+
+#endif
@@ -1,6 +1,10 @@
 #include "checkpoint.hpp"
 #include "debug.h"
+#include "profile.hpp"
 #include "util.hpp"
+#include <algorithm>
+#include <cctype>
+#include <dirent.h>
 #include <fcntl.h>
 #include <functional>
 #include <stdexcept>
@@ -114,6 +118,16 @@ template <> size_t write(int fd, const partition_parameters_t &pp) {
   return total_written;
 }
 
+template <>
+size_t write(checkpoint_buffer_t &buffer, const partition_parameters_t &pp) {
+  size_t total_written = 0;
+  total_written += write(buffer, pp.subst_rates);
+  total_written += write(buffer, pp.freqs);
+  total_written += write(buffer, pp.gamma_alpha);
+  total_written += write(buffer, pp.gamma_weights);
+  return total_written;
+}
+
 template <> size_t read(int fd, partition_parameters_t &pp) {
   size_t total_read = 0;
   total_read += read(fd, pp.subst_rates);
@@ -130,7 +144,77 @@ std::pair<uint32_t, uint32_t> compute_checksum_components(
       a, b, pp.subst_rates, pp.freqs, pp.gamma_alpha, pp.gamma_weights);
 }
 
-checkpoint_t::checkpoint_t(const std::string &prefix) {
+/*
+ * Read the results from a file descriptor, starting at the current position.
+ * Returns true if the file ended in a corrupted or partial record.
+ */
+static bool read_results_fd(int fd, checkpoint_results_t &results) {
+  auto current_position = lseek(fd, 0, SEEK_CUR);
+  auto end_position     = lseek(fd, 0, SEEK_END);
+  lseek(fd, current_position, SEEK_SET);
+
+  while (current_position < end_position) {
+    try {
+      rd_result_t rdr;
+      size_t      bytes_read = read_with_checksum(fd, rdr);
+      if (bytes_read == expected_read_size<rd_result_t>()) {
+      } else if (bytes_read == 0) {
+        break;
+      } else {
+        debug_string(EMIT_LEVEL_WARNING,
+                     "Found a partial result in the checkpoint, we will "
+                     "resume with what we can");
+        return true;
+      }
+      std::vector<partition_parameters_t> params;
+      read_with_checksum(fd, params);
+      results.push_back(std::make_pair(rdr, params));
+      current_position = lseek(fd, 0, SEEK_CUR);
+    } catch (checkpoint_read_success_failure &e) {
+      debug_string(
+          EMIT_LEVEL_WARNING,
+          "Checkpoint file is corrupted, we will resume with what we can");
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Read the results from the manifest, which are only present for checkpoints
+ * written by older versions, and from the shards.
+ */
+static bool read_all_results(int                             manifest_fd,
+                             const std::vector<std::string> &shards,
+                             checkpoint_results_t &          results) {
+  bool corrupted  = false;
+  auto current_fd = fcntl(manifest_fd, F_DUPFD, 0);
+  lseek(current_fd, 0, SEEK_SET);
+
+  // read and discard the options header to seek to the start of the results
+  {
+    cli_options_t tmp_opts;
+    read_with_success(current_fd, tmp_opts);
+  }
+  corrupted = read_results_fd(current_fd, results) || corrupted;
+  close(current_fd);
+
+  for (auto &shard : shards) {
+    int shard_fd = open(shard.c_str(), O_RDONLY);
+    if (shard_fd == -1) { continue; }
+    corrupted = read_results_fd(shard_fd, results) || corrupted;
+    close(shard_fd);
+  }
+  return corrupted;
+}
+
+checkpoint_t::checkpoint_t() :
+    _file_descriptor{-1},
+    _shard_descriptor{-1},
+    _existing_results{false},
+    _in_memory{true} {}
+
+checkpoint_t::checkpoint_t(const std::string &prefix) : _shard_descriptor{-1} {
   _checkpoint_filename = prefix + ".ckp";
   _existing_results    = (access(_checkpoint_filename.c_str(), F_OK) != -1);
   _file_descriptor =
@@ -140,52 +224,256 @@ checkpoint_t::checkpoint_t(const std::string &prefix) {
   }
 }
 
-void checkpoint_t::clean() {
-  if (!_existing_results) { return; }
-  std::string backup_filename = _checkpoint_filename + ".bak";
-  if (__MPI_RANK__ == 0) {
-    auto lock = write_lock<fcntl_lock_behavior::block>();
-    lseek(_file_descriptor, 0, SEEK_SET);
-    auto copy_fd = open(
-        backup_filename.c_str(), O_RDWR | O_CREAT | O_APPEND | O_EXCL, 0640);
-    if (copy_fd == -1) {
-      throw std::runtime_error(
-          "Failed to open the new checkpoint when cleaning the checkpoint");
+std::string checkpoint_t::get_shard_filename() const {
+  return _checkpoint_filename + "." + std::to_string(__MPI_RANK__);
+}
+
+/* Find the shards in the directory of the manifest, from any rank */
+std::vector<std::string> checkpoint_t::shard_filenames() const {
+  std::vector<std::string> shards;
+
+  auto        slash_pos = _checkpoint_filename.rfind('/');
+  std::string directory = slash_pos == std::string::npos
+                              ? std::string{"."}
+                              : _checkpoint_filename.substr(0, slash_pos);
+  std::string shard_prefix =
+      (slash_pos == std::string::npos
+           ? _checkpoint_filename
+           : _checkpoint_filename.substr(slash_pos + 1))
+      + ".";
+
+  DIR *dir = opendir(directory.c_str());
+  if (dir == nullptr) { return shards; }
+
+  for (auto entry = readdir(dir); entry != nullptr; entry = readdir(dir)) {
+    std::string name{entry->d_name};
+    if (name.size() <= shard_prefix.size()
+        || name.compare(0, shard_prefix.size(), shard_prefix) != 0) {
+      continue;
     }
-    cli_options_t options;
-    read_with_success(_file_descriptor, options);
-    write_with_success(copy_fd, options);
-    auto progress = read_results();
-    for (auto result : progress) {
-      write_with_checksum(copy_fd, result.first);
-      write_with_checksum(copy_fd, result.second);
+    if (!std::all_of(name.begin() + static_cast<std::ptrdiff_t>(
+                                        shard_prefix.size()),
+                     name.end(),
+                     [](char c) { return std::isdigit(c) != 0; })) {
+      continue;
     }
-    close(copy_fd);
-    rename(backup_filename.c_str(), _checkpoint_filename.c_str());
+    shards.push_back(directory + "/" + name);
   }
+  closedir(dir);
+
+  std::sort(shards.begin(), shards.end());
+  return shards;
 }
 
-void checkpoint_t::write(const rd_result_t &result) {
-  debug_print(
-      EMIT_LEVEL_MPI_DEBUG, "Writing result with root id: %lu", result.root_id);
-  write_with_checksum(_file_descriptor, result);
+void checkpoint_t::open_shard() {
+  if (_shard_descriptor != -1) { return; }
+  _shard_descriptor =
+      open(get_shard_filename().c_str(), O_WRONLY | O_APPEND | O_CREAT, 0640);
+  if (_shard_descriptor == -1) {
+    throw std::runtime_error("Failed to open the checkpoint shard");
+  }
 }
 
-void checkpoint_t::write(
-    const std::vector<partition_parameters_t> &parameters) {
-  write_with_checksum(_file_descriptor, parameters);
+/* Write all of the buffer, resuming after short writes */
+static void write_buffer(int fd, const checkpoint_buffer_t &buffer) {
+  size_t written = 0;
+  while (written < buffer.size()) {
+    auto result = ::write(fd, buffer.data() + written, buffer.size() - written);
+    if (result <= 0) {
+      throw checkpoint_write_failure{
+          "Failed to write the results to the checkpoint shard"};
+    }
+    written += static_cast<size_t>(result);
+  }
+}
+
+checkpoint_policy_t checkpoint_policy(const cli_options_t &options) {
+  checkpoint_policy_t policy;
+  policy.max_records = options.checkpoint_batch;
+  policy.max_delay   = options.checkpoint_delay;
+  return policy;
+}
+
+void checkpoint_t::set_policy(const checkpoint_policy_t &policy) {
+  std::lock_guard<std::mutex> lock(_shard_mutex);
+  _policy             = policy;
+  _policy.max_records = std::max<size_t>(_policy.max_records, 1);
+  _policy.max_queued  = std::max(_policy.max_queued, _policy.max_records);
+  _writer_cv.notify_all();
+}
+
+void checkpoint_t::start_writer() {
+  if (_writer.joinable()) { return; }
+  _stop_writer = false;
+  _writer      = std::thread(&checkpoint_t::writer_loop, this);
+}
+
+void checkpoint_t::stop_writer() {
+  {
+    std::lock_guard<std::mutex> lock(_shard_mutex);
+    _stop_writer = true;
+    _writer_cv.notify_all();
+  }
+  if (_writer.joinable()) { _writer.join(); }
+}
+
+bool checkpoint_t::batch_ready() const {
+  if (_pending_records == 0) { return false; }
+  if (_stop_writer || _flush_requests > 0
+      || _pending_records >= _policy.max_records) {
+    return true;
+  }
+  return _policy.max_delay > 0.0
+         && std::chrono::steady_clock::now() - _pending_since
+                >= std::chrono::duration<double>(_policy.max_delay);
 }
 
+/*
+ * Take everything that is queued, and write it outside of the lock, so that
+ * the search threads can keep queueing results in the meantime. Each batch is
+ * a run of whole records, so if we crash during a write, only the last record
+ * in the shard can be partial, which read_results skips.
+ */
+void checkpoint_t::writer_loop() {
+  std::unique_lock<std::mutex> lock(_shard_mutex);
+  while (true) {
+    while (!batch_ready() && !(_stop_writer && _pending_records == 0)) {
+      if (_pending_records > 0 && _policy.max_delay > 0.0) {
+        auto deadline = _pending_since
+                        + std::chrono::duration_cast<
+                            std::chrono::steady_clock::duration>(
+                            std::chrono::duration<double>(_policy.max_delay));
+        _writer_cv.wait_until(lock, deadline);
+      } else {
+        _writer_cv.wait(lock);
+      }
+    }
+    if (_pending_records == 0) { break; }
+
+    checkpoint_buffer_t batch;
+    batch.swap(_pending);
+    _pending_records = 0;
+    _writing         = true;
+    int fd           = _shard_descriptor;
+    _queue_cv.notify_all();
+
+    lock.unlock();
+    std::exception_ptr error;
+    try {
+      write_buffer(fd, batch);
+    } catch (...) { error = std::current_exception(); }
+    lock.lock();
+
+    if (error) { _writer_error = error; }
+    _writing = false;
+    _queue_cv.notify_all();
+  }
+}
+
+void checkpoint_t::rethrow_writer_error() {
+  if (!_writer_error) { return; }
+  auto error    = _writer_error;
+  _writer_error = nullptr;
+  std::rethrow_exception(error);
+}
+
+void checkpoint_t::flush(bool sync) {
+  std::unique_lock<std::mutex> lock(_shard_mutex);
+  _flush_requests++;
+  _writer_cv.notify_all();
+  _queue_cv.wait(lock, [this] { return _pending_records == 0 && !_writing; });
+  _flush_requests--;
+  if (sync && _shard_descriptor != -1) { fsync(_shard_descriptor); }
+  rethrow_writer_error();
+}
+
+void checkpoint_t::clean() {
+  if (!_existing_results) { return; }
+  if (__MPI_RANK__ == 0) { merge(); }
+}
+
+std::vector<std::pair<rd_result_t, std::vector<partition_parameters_t>>>
+checkpoint_t::merge() {
+  if (_in_memory) { return read_results(); }
+  flush();
+  profile::phase_timer_t timer{profile::checkpoint_io};
+  checkpoint_results_t   results;
+  std::string            backup_filename = _checkpoint_filename + ".bak";
+  auto                   lock   = write_lock<fcntl_lock_behavior::block>();
+  auto                   shards = shard_filenames();
+  if (!read_all_results(_file_descriptor, shards, results) && shards.empty()) {
+    /* Nothing to fold in, and nothing to repair */
+    return results;
+  }
+
+  lseek(_file_descriptor, 0, SEEK_SET);
+  auto copy_fd = open(
+      backup_filename.c_str(), O_RDWR | O_CREAT | O_APPEND | O_EXCL, 0640);
+  if (copy_fd == -1) {
+    throw std::runtime_error(
+        "Failed to open the new checkpoint when cleaning the checkpoint");
+  }
+  cli_options_t options;
+  read_with_success(_file_descriptor, options);
+  write_with_success(copy_fd, options);
+  for (auto &result : results) {
+    write_with_checksum(copy_fd, result.first);
+    write_with_checksum(copy_fd, result.second);
+  }
+  fsync(copy_fd);
+  close(copy_fd);
+  rename(backup_filename.c_str(), _checkpoint_filename.c_str());
+  reload();
+
+  {
+    std::lock_guard<std::mutex> shard_lock(_shard_mutex);
+    if (_shard_descriptor != -1) {
+      close(_shard_descriptor);
+      _shard_descriptor = -1;
+    }
+  }
+  for (auto &shard : shards) { unlink(shard.c_str()); }
+
+  return results;
+}
+
+/*
+ * Only this rank writes to the shard, so there is no need for a file lock. The
+ * file is opened with O_APPEND, so a crash can only leave a partial record at
+ * the end, which is caught by the checksums. The record is only encoded here,
+ * and queued for the writer thread.
+ */
 void checkpoint_t::write(
     const rd_result_t &                        result,
     const std::vector<partition_parameters_t> &parameters) {
-  auto lock = write_lock<fcntl_lock_behavior::block>();
-  write(result);
-  write(parameters);
+  profile::phase_timer_t timer{profile::checkpoint_io};
+  debug_print(EMIT_LEVEL_MPI_DEBUG,
+              "Queueing result with root id: %lu",
+              result.root_id);
+  if (_in_memory) {
+    std::lock_guard<std::mutex> lock(_shard_mutex);
+    _memory_results.emplace_back(result, parameters);
+    return;
+  }
+  checkpoint_buffer_t record;
+  write_with_checksum(record, result);
+  write_with_checksum(record, parameters);
+
+  std::unique_lock<std::mutex> lock(_shard_mutex);
+  rethrow_writer_error();
+  open_shard();
+  start_writer();
+  _queue_cv.wait(lock,
+                 [this] { return _pending_records < _policy.max_queued; });
+  if (_pending_records == 0) {
+    _pending_since = std::chrono::steady_clock::now();
+  }
+  _pending.insert(_pending.end(), record.begin(), record.end());
+  _pending_records++;
+  if (batch_ready()) { _writer_cv.notify_one(); }
 }
-
 void checkpoint_t::save_options(const cli_options_t &options) {
-  if (!_existing_results) {
+  if (!_existing_results && !_in_memory) {
     auto lock = write_lock<fcntl_lock_behavior::block>();
     write_with_success(_file_descriptor, options);
   }
@@ -231,18 +519,51 @@ int checkpoint_t::get_inode() {
   return statbuf.st_ino;
 }
 
-checkpoint_t::~checkpoint_t() { close(_file_descriptor); }
+checkpoint_t::~checkpoint_t() {
+  stop_writer();
+  if (_file_descriptor != -1) { close(_file_descriptor); }
+  if (_shard_descriptor != -1) {
+    fsync(_shard_descriptor);
+    close(_shard_descriptor);
+  }
+}
 
+/*
+ * The writer thread works on the checkpoint it was started for, so it is
+ * stopped before the checkpoint is moved. The next write starts a new one.
+ */
 checkpoint_t::checkpoint_t(checkpoint_t &&other) {
-  _file_descriptor = other._file_descriptor;
+  other.stop_writer();
+  _policy                 = other._policy;
+  _checkpoint_filename    = std::move(other._checkpoint_filename);
+  _file_descriptor        = other._file_descriptor;
+  _shard_descriptor       = other._shard_descriptor;
+  _existing_results       = other._existing_results;
+  _in_memory              = other._in_memory;
+  _memory_results         = std::move(other._memory_results);
+  other._file_descriptor  = -1;
+  other._shard_descriptor = -1;
 }
 
 checkpoint_t &checkpoint_t::operator=(checkpoint_t &&other) {
-  _file_descriptor = other._file_descriptor;
+  stop_writer();
+  other.stop_writer();
+  if (_shard_descriptor != -1) { close(_shard_descriptor); }
+  close(_file_descriptor);
+  _policy                 = other._policy;
+  _checkpoint_filename    = std::move(other._checkpoint_filename);
+  _file_descriptor        = other._file_descriptor;
+  _shard_descriptor       = other._shard_descriptor;
+  _existing_results       = other._existing_results;
+  _in_memory              = other._in_memory;
+  _memory_results         = std::move(other._memory_results);
+  other._file_descriptor  = -1;
+  other._shard_descriptor = -1;
   return *this;
 }
 
 void checkpoint_t::reload() {
+  if (_in_memory) { return; }
   close(_file_descriptor);
   _file_descriptor =
       open(_checkpoint_filename.c_str(), O_RDWR | O_APPEND | O_CREAT, 0640);
@@ -254,85 +575,21 @@ void checkpoint_t::reload() {
 
 std::vector<std::pair<rd_result_t, std::vector<partition_parameters_t>>>
 checkpoint_t::read_results() {
-  std::vector<std::pair<rd_result_t, std::vector<partition_parameters_t>>>
-       results;
-  auto lock       = write_lock<fcntl_lock_behavior::block>();
-  auto current_fd = fcntl(_file_descriptor, F_DUPFD, 0);
-
-  lseek(current_fd, 0, SEEK_SET);
-
-  // read and discard the options header to seek to the start of the results
-  {
-    cli_options_t tmp_opts;
-    read_with_success(current_fd, tmp_opts);
-  }
-
-  auto current_position = lseek(current_fd, 0, SEEK_CUR);
-  auto end_position     = lseek(current_fd, 0, SEEK_END);
-  lseek(current_fd, current_position, SEEK_SET);
-
-  while (current_position < end_position) {
-    try {
-      rd_result_t rdr;
-      size_t      bytes_read = read_with_checksum(current_fd, rdr);
-      if (bytes_read == expected_read_size<rd_result_t>()) {
-      } else if (bytes_read == 0) {
-        break;
-      } else {
-        throw std::runtime_error(
-            "Unexpected read size when loading results from the checkpoint");
-      }
-      std::vector<partition_parameters_t> params;
-      read_with_checksum(current_fd, params);
-      results.push_back(std::make_pair(rdr, params));
-      current_position = lseek(current_fd, 0, SEEK_CUR);
-    } catch (checkpoint_read_success_failure &e) {
-      debug_string(
-          EMIT_LEVEL_WARNING,
-          "Checkpoint file is corrupted, we will resume with what we can");
-      break;
-    }
+  if (_in_memory) {
+    std::lock_guard<std::mutex> lock(_shard_mutex);
+    return _memory_results;
   }
-  close(current_fd);
+  flush();
+  profile::phase_timer_t timer{profile::checkpoint_io};
+  checkpoint_results_t   results;
+  read_all_results(_file_descriptor, shard_filenames(), results);
   return results;
 }
 
 bool checkpoint_t::needs_cleaning() {
-  auto lock       = write_lock<fcntl_lock_behavior::block>();
-  auto current_fd = fcntl(_file_descriptor, F_DUPFD, 0);
-
-  lseek(current_fd, 0, SEEK_SET);
-
-  {
-    cli_options_t tmp_opts;
-    read_with_success(current_fd, tmp_opts);
-  }
-
-  auto current_position = lseek(current_fd, 0, SEEK_CUR);
-  auto end_position     = lseek(current_fd, 0, SEEK_END);
-  lseek(current_fd, current_position, SEEK_SET);
-  while (current_position < end_position) {
-    try {
-      rd_result_t rdr;
-      size_t      bytes_read = read_with_checksum(current_fd, rdr);
-      if (bytes_read == expected_read_size<rd_result_t>()) {
-      } else if (bytes_read == 0) {
-        break;
-      } else {
-        throw std::runtime_error(
-            "Unexpected read size when loading results from the checkpoint");
-      }
-      std::vector<partition_parameters_t> params;
-      read_with_checksum(current_fd, params);
-      current_position = lseek(current_fd, 0, SEEK_CUR);
-    } catch (checkpoint_read_success_failure &e) {
-      debug_string(
-          EMIT_LEVEL_WARNING,
-          "Checkpoint file is corrupted, we will resume with what we can");
-      close(current_fd);
-      return true;
-    }
-  }
-  close(current_fd);
-  return false;
+  if (_in_memory) { return false; }
+  flush();
+  profile::phase_timer_t timer{profile::checkpoint_io};
+  checkpoint_results_t   results;
+  return read_all_results(_file_descriptor, shard_filenames(), results);
 }
@@ -5,18 +5,25 @@
 #include "tree.hpp"
 #include "util.hpp"
 #include <cctype>
+#include <chrono>
+#include <condition_variable>
 #include <cstddef>
 #include <exception>
 #include <fcntl.h>
+#include <mutex>
 #include <stdexcept>
 #include <stdint.h>
 #include <string>
+#include <thread>
 #include <unistd.h>
 #include <utility>
 #include <vector>
 
 typedef uint32_t field_flags_t;
 
+typedef std::vector<std::pair<rd_result_t, std::vector<partition_parameters_t>>>
+    checkpoint_results_t;
+
 #define CHECKPOINT_WRITE_SUCCESS_FLAG 1 << 0
 
 class checkpoint_write_failure : std::runtime_error {
@@ -97,6 +104,18 @@ template <typename T> size_t write(int fd, const T &val) {
   return static_cast<size_t>(result);
 }
 
+/*
+ * The records which are not written as their bytes are defined in
+ * checkpoint.cpp. They are declared here, so that the templates below use them
+ * in every file, and not the byte copy.
+ */
+template <> size_t write(int fd, const std::string &str);
+template <> size_t write(int fd, const cli_options_t &options);
+template <> size_t write(int fd, const partition_parameters_t &pp);
+template <>
+std::pair<uint32_t, uint32_t> compute_checksum_components(
+    const partition_parameters_t &pp, uint32_t a, uint32_t b);
+
 template <typename T> size_t write(int fd, const std::vector<T> &vals) {
   size_t result = 0;
   result += write(fd, vals.size());
@@ -131,12 +150,56 @@ size_t write_with_checksum(int fd, const std::vector<T> &vals) {
   return total_written;
 }
 
+/*
+ * Records can also be encoded into a buffer, in the same format as they are
+ * written to a file, so that a batch of them can be written with a single call.
+ */
+typedef std::vector<uint8_t> checkpoint_buffer_t;
+
+template <typename T> size_t write(checkpoint_buffer_t &buffer, const T &val) {
+  const uint8_t *data = reinterpret_cast<const uint8_t *>(&val);
+  buffer.insert(buffer.end(), data, data + sizeof(T));
+  return sizeof(T);
+}
+
+template <>
+size_t write(checkpoint_buffer_t &buffer, const partition_parameters_t &pp);
+
+template <typename T>
+size_t write(checkpoint_buffer_t &buffer, const std::vector<T> &vals) {
+  size_t result = 0;
+  result += write(buffer, vals.size());
+  for (auto &v : vals) { result += write(buffer, v); }
+  return result;
+}
+
+template <typename T>
+size_t write_with_checksum(checkpoint_buffer_t &buffer, const T &val) {
+  auto bytes_written = write(buffer, val);
+  bytes_written += write(buffer, compute_checksum(val));
+  return bytes_written;
+}
+
+template <typename T>
+size_t write_with_checksum(checkpoint_buffer_t &  buffer,
+                           const std::vector<T> &vals) {
+  uint32_t checksum      = compute_checksum(vals);
+  size_t   total_written = 0;
+  total_written += write(buffer, vals);
+  total_written += write(buffer, checksum);
+  return total_written;
+}
+
 template <typename T> size_t read(int fd, T &val) {
   auto result = read(fd, &val, sizeof(val));
   if (result < 0) { throw checkpoint_read_failure{"Failed to read a value"}; }
   return static_cast<size_t>(result);
 }
 
+template <> size_t read(int fd, std::string &str);
+template <> size_t read(int fd, cli_options_t &options);
+template <> size_t read(int fd, partition_parameters_t &pp);
+
 template <typename T> size_t read(int fd, std::vector<T> &vals) {
   std::vector<T> tmp_vals;
 
@@ -257,8 +320,44 @@ private:
   flock _file_lock;
 };
 
+/*
+ * When the results buffered by the checkpoint writer are written to the shard.
+ * A batch is written once it has max_records results, or once its first result
+ * has waited for max_delay seconds, if max_delay is positive. Writers block
+ * when max_queued results are waiting. The shard is always synced when the
+ * checkpoint is closed.
+ */
+struct checkpoint_policy_t {
+  size_t max_records = 1;
+  double max_delay   = 0.0;
+  size_t max_queued  = 1024;
+};
+
+/* The policy set by --checkpoint-batch and --checkpoint-delay */
+checkpoint_policy_t checkpoint_policy(const cli_options_t &options);
+
+/*
+ * The checkpoint is made up of a manifest, which is the file `prefix.ckp`, and
+ * a set of shards, `prefix.ckp.<rank>`. The manifest holds the options header,
+ * and is only written under a lock, and only when the options are saved or the
+ * checkpoint is merged. Each rank appends its results to its own shard, so
+ * writing a result requires no file locking at all. Threads in the same rank
+ * share the shard.
+ *
+ * Results are encoded and handed to a background thread, which writes the
+ * queued results with one call, so the search doesn't wait on the file system.
+ * The results are read back, or merged, only after the queue has been flushed.
+ *
+ * Old checkpoints, which hold the results in the manifest after the options
+ * header, are still read, and get folded into the manifest on the next merge.
+ *
+ * A checkpoint made without a prefix keeps its results in memory instead, for
+ * searches run in process through the library, which want the results back
+ * and not a file. The results are lost with the checkpoint.
+ */
 class checkpoint_t {
 public:
+  checkpoint_t();
   checkpoint_t(const std::string &prefix);
   ~checkpoint_t();
 
@@ -275,6 +374,14 @@ public:
     write_with_success(_file_descriptor, val);
   }
   void write(const rd_result_t &, const std::vector<partition_parameters_t> &);
+
+  void set_policy(const checkpoint_policy_t &);
+
+  /*
+   * Wait until every result handed to write has been written to the shard, and
+   * synced if sync is set. Rethrows the error if the writer failed.
+   */
+  void flush(bool sync = false);
   void save_options(const cli_options_t &);
   void load_options(cli_options_t &);
   void reload();
@@ -287,7 +394,20 @@ public:
 
   std::vector<size_t> completed_indicies();
 
+  /*
+   * Fold the results from all the shards into the manifest, and remove the
+   * shards. Should only be called on rank 0 when no other rank is writing.
+   * Returns the results from the merged checkpoint.
+   */
+  std::vector<std::pair<rd_result_t, std::vector<partition_parameters_t>>>
+  merge();
+
+  bool in_memory() const { return _in_memory; }
+
   std::string get_filename() const { return _checkpoint_filename; }
+  std::string get_shard_filename() const;
+
+  std::vector<std::string> shard_filenames() const;
 
 private:
   template <fcntl_lock_behavior::fcntl_lock_block_t W>
@@ -295,12 +415,34 @@ private:
     return fcntl_lock_t<W>(_file_descriptor, F_WRLCK);
   }
 
-  void write(const rd_result_t &);
-  void write(const std::vector<partition_parameters_t> &);
+  void open_shard();
+
+  void start_writer();
+  void stop_writer();
+  void writer_loop();
+  bool batch_ready() const;
+  void rethrow_writer_error();
 
   std::string _checkpoint_filename;
   int         _file_descriptor;
+  int         _shard_descriptor;
   bool        _existing_results;
+  std::mutex  _shard_mutex;
+
+  checkpoint_policy_t                   _policy;
+  std::thread                           _writer;
+  std::condition_variable               _writer_cv;
+  std::condition_variable               _queue_cv;
+  checkpoint_buffer_t                   _pending;
+  size_t                                _pending_records = 0;
+  std::chrono::steady_clock::time_point _pending_since;
+  size_t                                _flush_requests = 0;
+  bool                                  _writing        = false;
+  bool                                  _stop_writer    = false;
+  std::exception_ptr                    _writer_error;
+
+  bool                 _in_memory = false;
+  checkpoint_results_t _memory_results;
 };
 
 #endif
@@ -0,0 +1,34 @@
+#include "lh_backend.hpp"
+
+/* The libpll kernels, on the host */
+class cpu_lh_backend_t : public lh_backend_t {
+public:
+  const char *name() const override { return "CPU"; }
+
+  int update_prob_matrices(pll_partition_t *   partition,
+                           const unsigned int *params_indices,
+                           const unsigned int *matrix_indices,
+                           const double *      branch_lengths,
+                           unsigned int        count) override {
+    return pll_update_prob_matrices(
+        partition, params_indices, matrix_indices, branch_lengths, count);
+  }
+
+  void update_partials(pll_partition_t *      partition,
+                       const pll_operation_t *operations,
+                       unsigned int           count) override {
+    pll_update_partials(partition, operations, count);
+  }
+
+  double root_loglikelihood(pll_partition_t *   partition,
+                            unsigned int        clv_index,
+                            int                 scaler_index,
+                            const unsigned int *freqs_indices) override {
+    return pll_compute_root_loglikelihood(
+        partition, clv_index, scaler_index, freqs_indices, nullptr);
+  }
+};
+
+std::unique_ptr<lh_backend_t> make_lh_backend() {
+  return std::unique_ptr<lh_backend_t>{new cpu_lh_backend_t};
+}
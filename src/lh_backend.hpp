@@ -0,0 +1,53 @@
+#ifndef RD_LH_BACKEND_HPP_
+#define RD_LH_BACKEND_HPP_
+
+extern "C" {
+#include <libpll/pll.h>
+}
+#include <memory>
+
+/*
+ * The kernels that the model computes its partitions with. Every probability
+ * matrix update, partial update and root lh of a partition goes through the
+ * backend, so that a device backend only has to replace this class. The only
+ * backend for now calls libpll on the CPU.
+ *
+ * The partitions are libpll partitions, and their memory on the host has to be
+ * up to date after a call returns, since the derivatives and the lh bounds read
+ * the CLVs directly. The backend is called for different partitions from
+ * different threads at the same time, but never for the same partition.
+ */
+class lh_backend_t {
+public:
+  virtual ~lh_backend_t() = default;
+
+  virtual const char *name() const = 0;
+
+  virtual int update_prob_matrices(pll_partition_t *   partition,
+                                   const unsigned int *params_indices,
+                                   const unsigned int *matrix_indices,
+                                   const double *      branch_lengths,
+                                   unsigned int        count) = 0;
+
+  virtual void update_partials(pll_partition_t *      partition,
+                               const pll_operation_t *operations,
+                               unsigned int           count) = 0;
+
+  virtual double root_loglikelihood(pll_partition_t *   partition,
+                                    unsigned int        clv_index,
+                                    int                 scaler_index,
+                                    const unsigned int *freqs_indices) = 0;
+
+  /*
+   * Drop whatever the backend keeps for the partition, because the CLVs were
+   * changed outside of the backend, or because it is about to be destroyed.
+   */
+  virtual void invalidate(const pll_partition_t *partition) {
+    (void)partition;
+  }
+};
+
+/* Make the backend that the model computes with */
+std::unique_ptr<lh_backend_t> make_lh_backend();
+
+#endif
@@ -0,0 +1,78 @@
+#include "lh_bound.hpp"
+#include "debug.h"
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+lh_bound_t::lh_bound_t(double threshold, bool local) :
+    _threshold{threshold},
+    _local{local},
+    _best_lh{-std::numeric_limits<double>::infinity()} {
+  if (!(threshold > 0.0)) {
+    throw std::invalid_argument("The prune threshold needs to be positive");
+  }
+#ifdef MPI_VERSION
+  if (_local) { return; }
+  MPI_Win_allocate(__MPI_RANK__ == 0 ? sizeof(double) : 0,
+                   sizeof(double),
+                   MPI_INFO_NULL,
+                   MPI_COMM_WORLD,
+                   &_window_lh,
+                   &_window);
+  if (__MPI_RANK__ == 0) {
+    MPI_Win_lock(MPI_LOCK_EXCLUSIVE, 0, 0, _window);
+    *_window_lh = _best_lh;
+    MPI_Win_unlock(0, _window);
+  }
+  MPI_Barrier(MPI_COMM_WORLD);
+#endif
+}
+
+lh_bound_t::~lh_bound_t() {
+#ifdef MPI_VERSION
+  if (!_local) { MPI_Win_free(&_window); }
+#endif
+}
+
+void lh_bound_t::update(double                                     lh,
+                        const std::vector<partition_parameters_t> &params) {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (!(lh > _best_lh)) { return; }
+    _best_lh     = lh;
+    _best_params = params;
+  }
+#ifdef MPI_VERSION
+  if (_local) { return; }
+  MPI_Win_lock(MPI_LOCK_SHARED, 0, 0, _window);
+  MPI_Accumulate(&lh, 1, MPI_DOUBLE, 0, 0, 1, MPI_DOUBLE, MPI_MAX, _window);
+  MPI_Win_unlock(0, _window);
+#endif
+}
+
+bool lh_bound_t::params(std::vector<partition_parameters_t> &params) const {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_best_params.empty()) { return false; }
+  params = _best_params;
+  return true;
+}
+
+double lh_bound_t::best() const {
+  double best_lh;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    best_lh = _best_lh;
+  }
+#ifdef MPI_VERSION
+  if (_local) { return best_lh; }
+  double global_lh;
+  MPI_Win_lock(MPI_LOCK_SHARED, 0, 0, _window);
+  MPI_Fetch_and_op(
+      nullptr, &global_lh, MPI_DOUBLE, 0, 0, MPI_NO_OP, _window);
+  MPI_Win_unlock(0, _window);
+  best_lh = std::max(best_lh, global_lh);
+#endif
+  return best_lh;
+}
+
+bool lh_bound_t::prune(double lh) const { return lh < best() - _threshold; }
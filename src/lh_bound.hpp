@@ -0,0 +1,62 @@
+#ifndef RD_LH_BOUND_HPP_
+#define RD_LH_BOUND_HPP_
+
+#include "util.hpp"
+#ifdef MPI_BUILD
+#include <mpi.h>
+#endif
+#include <mutex>
+#include <vector>
+
+/*
+ * The best optimized lh found so far in exhaustive mode, along with the
+ * parameters it was found with, for pruning the roots which can't contribute
+ * to the LWR. A root is screened by computing its lh with these parameters,
+ * optimizing only the brlen ratio. This is a lower bound on the optimized lh of
+ * the root, and if it falls more than the threshold below the best lh, the
+ * root is pruned.
+ *
+ * The bound is shared by the threads of a process, so all of the methods lock.
+ * For MPI runs, the best lh (but not the parameters) is also shared between
+ * the ranks, through a window on rank 0, so making and destroying a bound are
+ * collective. A local bound is only used by this process, and is never shared
+ * between ranks.
+ */
+class lh_bound_t {
+public:
+  explicit lh_bound_t(double threshold, bool local = false);
+  ~lh_bound_t();
+
+  lh_bound_t(const lh_bound_t &) = delete;
+  lh_bound_t &operator=(const lh_bound_t &) = delete;
+
+  /* Only an lh better than the best one so far replaces it */
+  void update(double lh, const std::vector<partition_parameters_t> &params);
+
+  /*
+   * Copy the parameters of the best lh of this process into params. Returns
+   * false, and leaves params alone, if there are none yet.
+   */
+  bool params(std::vector<partition_parameters_t> &params) const;
+
+  /* The best lh of any thread, and for MPI runs, of any rank */
+  double best() const;
+
+  /* True if a root with the given screening lh can be skipped */
+  bool prune(double lh) const;
+
+  double threshold() const { return _threshold; }
+
+private:
+  double                              _threshold;
+  bool                                _local;
+  double                              _best_lh;
+  std::vector<partition_parameters_t> _best_params;
+  mutable std::mutex                  _mutex;
+#ifdef MPI_VERSION
+  MPI_Win _window;
+  double *_window_lh;
+#endif
+};
+
+#endif
@@ -0,0 +1,154 @@
+#include "lh_cache.hpp"
+#include <cstring>
+#include <limits>
+
+lh_cache_t::lh_cache_t(size_t capacity) :
+    _mask{0},
+    _size{0},
+    _capacity{capacity},
+    _version{0},
+    _generation{1},
+    _clock{0} {
+  if (_capacity == 0) { return; }
+  size_t table_size = 1;
+  while (table_size < 2 * _capacity) { table_size *= 2; }
+  _slots.resize(table_size);
+  _mask = table_size - 1;
+}
+
+bool lh_cache_t::lookup(size_t            root_id,
+                        double            brlen_ratio,
+                        uint64_t          version,
+                        lh_cache_entry_t &entry) {
+  set_version(version);
+  if (_size == 0) { return false; }
+  size_t slot = find_slot(root_id, brlen_ratio);
+  if (!occupied(slot)) { return false; }
+  _slots[slot].last_used = ++_clock;
+  entry                  = _slots[slot].entry;
+  return true;
+}
+
+void lh_cache_t::insert_lh(size_t   root_id,
+                           double   brlen_ratio,
+                           uint64_t version,
+                           double   lh) {
+  set_version(version);
+  auto entry = emplace(root_id, brlen_ratio);
+  if (entry) { entry->lh = lh; }
+}
+
+void lh_cache_t::insert_dlh(size_t   root_id,
+                            double   brlen_ratio,
+                            uint64_t version,
+                            double   lh,
+                            double   dlh) {
+  set_version(version);
+  auto entry = emplace(root_id, brlen_ratio);
+  if (entry) {
+    entry->lh      = lh;
+    entry->dlh     = dlh;
+    entry->has_dlh = true;
+  }
+}
+
+void lh_cache_t::clear() {
+  _generation++;
+  _size = 0;
+}
+
+void lh_cache_t::set_version(uint64_t version) {
+  if (version == _version) { return; }
+  clear();
+  _version = version;
+}
+
+bool lh_cache_t::occupied(size_t slot) const {
+  return _slots[slot].generation == _generation;
+}
+
+size_t lh_cache_t::home_slot(size_t root_id, double brlen_ratio) const {
+  /* 0.0 and -0.0 compare equal, so they have to hash the same */
+  if (brlen_ratio == 0.0) { brlen_ratio = 0.0; }
+  uint64_t bits;
+  std::memcpy(&bits, &brlen_ratio, sizeof(bits));
+
+  uint64_t hash = static_cast<uint64_t>(root_id) * 0x9e3779b97f4a7c15ull;
+  hash ^= bits + 0x7f4a7c159e3779b9ull + (hash << 6) + (hash >> 2);
+  hash ^= hash >> 31;
+  hash *= 0xbf58476d1ce4e5b9ull;
+  hash ^= hash >> 29;
+  return static_cast<size_t>(hash) & _mask;
+}
+
+/*
+ * The slot which holds the key, or the empty slot that ends its probe
+ * sequence. There is always an empty slot, since the table is at most half
+ * full.
+ */
+size_t lh_cache_t::find_slot(size_t root_id, double brlen_ratio) const {
+  size_t slot = home_slot(root_id, brlen_ratio);
+  while (occupied(slot)) {
+    const auto &cur = _slots[slot];
+    if (cur.root_id == root_id && cur.brlen_ratio == brlen_ratio) {
+      return slot;
+    }
+    slot = (slot + 1) & _mask;
+  }
+  return slot;
+}
+
+/*
+ * Empty a slot, and shift the entries after it back, so that none of them is
+ * cut off from its home slot by the gap.
+ */
+void lh_cache_t::erase_slot(size_t slot) {
+  size_t next = slot;
+  while (true) {
+    next = (next + 1) & _mask;
+    if (!occupied(next)) { break; }
+    size_t home = home_slot(_slots[next].root_id, _slots[next].brlen_ratio);
+    bool   reachable = slot <= next ? (slot < home && home <= next)
+                                    : (slot < home || home <= next);
+    if (reachable) { continue; }
+    _slots[slot] = _slots[next];
+    slot         = next;
+  }
+  _slots[slot].generation = 0;
+  _size--;
+}
+
+void lh_cache_t::evict_least_recently_used() {
+  size_t   oldest    = 0;
+  uint64_t oldest_at = std::numeric_limits<uint64_t>::max();
+  for (size_t slot = 0; slot < _slots.size(); ++slot) {
+    if (occupied(slot) && _slots[slot].last_used < oldest_at) {
+      oldest    = slot;
+      oldest_at = _slots[slot].last_used;
+    }
+  }
+  erase_slot(oldest);
+}
+
+/*
+ * Find or make the entry for a key, and make it the most recently used. The
+ * least recently used entry is dropped to make room.
+ */
+lh_cache_entry_t *lh_cache_t::emplace(size_t root_id, double brlen_ratio) {
+  if (_capacity == 0) { return nullptr; }
+  size_t slot = find_slot(root_id, brlen_ratio);
+  if (!occupied(slot)) {
+    if (_size >= _capacity) {
+      evict_least_recently_used();
+      slot = find_slot(root_id, brlen_ratio);
+    }
+    auto &cur       = _slots[slot];
+    cur.root_id     = root_id;
+    cur.brlen_ratio = brlen_ratio;
+    cur.entry       = lh_cache_entry_t{};
+    cur.generation  = _generation;
+    _size++;
+  }
+  _slots[slot].last_used = ++_clock;
+  return &_slots[slot].entry;
+}
@@ -0,0 +1,85 @@
+#ifndef RD_LH_CACHE_HPP_
+#define RD_LH_CACHE_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct lh_cache_entry_t {
+  double lh      = 0.0;
+  double dlh     = 0.0;
+  bool   has_dlh = false;
+};
+
+/*
+ * A small least recently used cache of the lh at a root location, and the
+ * derivative when it has been computed. Entries are keyed by the root id and
+ * the brlen ratio, and are only valid for the version of the model parameters
+ * they were computed with. Looking up or inserting a different version drops
+ * all of the entries, since none of them can be used again. A cache with a
+ * capacity of zero never holds anything.
+ *
+ * The entries live in an open addressing table with linear probing, which is
+ * allocated once by the constructor, so that a miss in the root hot paths
+ * doesn't allocate. The table is at most half full, and the least recently
+ * used entry is found by a scan over it, which is cheap next to computing an
+ * lh for the capacities that the model uses.
+ */
+class lh_cache_t {
+public:
+  explicit lh_cache_t(size_t capacity = 64);
+
+  /* Copy the entry into entry and return true on a hit */
+  bool lookup(size_t            root_id,
+              double            brlen_ratio,
+              uint64_t          version,
+              lh_cache_entry_t &entry);
+
+  /* An existing derivative for the same key is kept */
+  void insert_lh(size_t   root_id,
+                 double   brlen_ratio,
+                 uint64_t version,
+                 double   lh);
+  void insert_dlh(size_t   root_id,
+                  double   brlen_ratio,
+                  uint64_t version,
+                  double   lh,
+                  double   dlh);
+
+  void clear();
+
+  size_t size() const { return _size; }
+  size_t capacity() const { return _capacity; }
+
+private:
+  /*
+   * A slot holds an entry when its generation is the current one, so that
+   * clearing the table is just a matter of starting a new generation.
+   */
+  struct slot_t {
+    size_t           root_id     = 0;
+    double           brlen_ratio = 0.0;
+    lh_cache_entry_t entry;
+    uint64_t         generation = 0;
+    uint64_t         last_used  = 0;
+  };
+
+  void              set_version(uint64_t version);
+  lh_cache_entry_t *emplace(size_t root_id, double brlen_ratio);
+
+  bool   occupied(size_t slot) const;
+  size_t home_slot(size_t root_id, double brlen_ratio) const;
+  size_t find_slot(size_t root_id, double brlen_ratio) const;
+  void   erase_slot(size_t slot);
+  void   evict_least_recently_used();
+
+  std::vector<slot_t> _slots;
+  size_t              _mask;
+  size_t              _size;
+  size_t              _capacity;
+  uint64_t            _version;
+  uint64_t            _generation;
+  uint64_t            _clock;
+};
+
+#endif
@@ -3,6 +3,7 @@
 extern "C" {
 #include <libpll/pll.h>
 }
+#include <atomic>
 #include <cctype>
 #include <chrono>
 #include <cmath>
@@ -11,6 +12,7 @@ extern "C" {
 #include <getopt.h>
 #include <iomanip>
 #include <iostream>
+#include <memory>
 #include <omp.h>
 #include <sstream>
 #ifdef MPI_BUILD
@@ -20,15 +22,22 @@ extern "C" {
 #include <random>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "debug.h"
 int __VERBOSE__       = EMIT_LEVEL_PROGRESS;
 int __MPI_RANK__      = 0;
 int __MPI_NUM_TASKS__ = 1;
+#include "batch.hpp"
+#include "bootstrap.hpp"
 #include "checkpoint.hpp"
 #include "model.hpp"
 #include "msa.hpp"
+#include "profile.hpp"
+#include "root_digger.hpp"
+#include "search_budget.hpp"
+#include "tip_kernel.hpp"
 #include "tree.hpp"
 #include "util.hpp"
 
@@ -58,6 +67,7 @@ static void print_run_header(
   debug_print(EMIT_LEVEL_IMPORTANT, "Started: %s", time_string);
   debug_print(EMIT_LEVEL_IMPORTANT, "Seed: %lu", seed);
   debug_print(EMIT_LEVEL_IMPORTANT, "Number of threads per proc: %lu", threads);
+  debug_print(EMIT_LEVEL_IMPORTANT, "SIMD: %s", model_t::simd_name().c_str());
 #ifdef MPI_VERSION
   debug_print(EMIT_LEVEL_IMPORTANT, "Number of procs %d", __MPI_NUM_TASKS__);
 #endif
@@ -77,6 +87,15 @@ static void print_usage() {
       << "Application Options:\n"
       << "  --msa [FILE]\n"
       << "         File containing the alignment.\n"
+      << "  --msa-cache [FILE]\n"
+      << "         Binary cache of the alignment, written with\n"
+      << "         --write-msa-cache, to use instead of --msa. The cache\n"
+      << "         is mapped into memory, so it is not parsed or compressed\n"
+      << "         again. If --partition is given, it has to be the\n"
+      << "         partition file the cache was written with.\n"
+      << "  --write-msa-cache [FILE]\n"
+      << "         Parse, partition and compress the alignment, write it\n"
+      << "         to a binary cache for --msa-cache, and exit.\n"
       << "  --tree [FILE]\n"
       << "         File containing the tree, with branch lengths.\n"
       << "  --partition [FILE]\n"
@@ -84,9 +103,22 @@ static void print_usage() {
       << "         Format is the same as RAxML-NG partition file.\n"
       << "  --prefix [STRING]\n"
       << "         Prefix for the output files.\n"
+      << "  --batch [FILE]\n"
+      << "         Root every job listed in FILE in one run. Each line has\n"
+      << "         the columns MSA TREE [PARTITION] [PREFIX], separated by\n"
+      << "         whitespace. Use - for no partition file. The prefix\n"
+      << "         defaults to the tree file. Lines starting with # are\n"
+      << "         ignored. The other options apply to every job.\n"
       << "  --exhaustive\n"
       << "         Enable exhaustive mode. This will attempt to root a tree\n"
       << "         at every branch, and then report the results using LWR.\n"
+      << "  --prune-threshold [NUMBER]\n"
+      << "         In exhaustive mode, first compute the LH of each root with\n"
+      << "         the best parameters found so far, and skip the full\n"
+      << "         optimization of the root if that LH is more than this\n"
+      << "         many log units below the best LH. Pruned roots are marked\n"
+      << "         with pruned=true in the LWR tree, and their LWR is a lower\n"
+      << "         bound. Default is off.\n"
       << "  --early-stop\n"
       << "         Enable early stopping. This will cause cause the search\n"
       << "         to terminate when the root placement is sufficently\n"
@@ -95,6 +127,22 @@ static void print_usage() {
       << "         search mode and disabled by default for exhaustive mode.\n"
       << "  --no-early-stop\n"
       << "         Force disable early stop.\n"
+      << "  --newton-alpha\n"
+      << "         Optimize the root position on a branch with Newton's\n"
+      << "         method, using analytic derivatives of the likelihood.\n"
+      << "         Usually requires fewer likelihood evaluations. Default\n"
+      << "         is off.\n"
+      << "  --joint-params\n"
+      << "         Optimize the substitution rates, frequencies and rate\n"
+      << "         categories of a partition together in one BFGS run,\n"
+      << "         instead of one after the other. Usually requires fewer\n"
+      << "         likelihood evaluations. Default is off.\n"
+      << "  --warm-start\n"
+      << "         Start the parameter optimization for each root from the\n"
+      << "         best parameters found on a neighboring root, and process\n"
+      << "         neighboring roots one after the other. Usually reduces\n"
+      << "         the number of BFGS iterations, especially in exhaustive\n"
+      << "         mode. Default is off.\n"
       << "  --seed [NUMBER]\n"
       << "         Random seed to use. Optional\n"
       << "  --rate-cats [NUMBER]\n"
@@ -126,8 +174,93 @@ static void print_usage() {
       << "         pick the starting branches. This can actually drive the\n"
       << "         so care should be taken when selecting this option.\n"
       << "         Default is random\n"
+      << "  --bootstrap [NUMBER]\n"
+      << "         After the search, resample the sites this many times,\n"
+      << "         and search each replicate again, starting from the\n"
+      << "         parameters of the replicate before. The fraction of the\n"
+      << "         replicates in which each branch held the best root is\n"
+      << "         written to <prefix>.support.tree. Default is 0.\n"
       << "  --threads [NUMBER]\n"
-      << "         Number of threads to use\n"
+      << "         Number of threads to use per process. By default, the\n"
+      << "         physical cores of a host are split evenly between the\n"
+      << "         processes running on it.\n"
+      << "  --pin-threads\n"
+      << "         Pin each thread to a core. Processes on the same host are\n"
+      << "         spread evenly over the NUMA nodes, and the threads of a\n"
+      << "         process are kept on the cores of its node, so that its\n"
+      << "         memory is allocated on that node. Only supported on\n"
+      << "         Linux. Default is off.\n"
+      << "  --static-schedule\n"
+      << "         Split the roots into fixed chunks per process, instead of\n"
+      << "         handing them out to processes as they finish. Only has an\n"
+      << "         effect for MPI runs.\n"
+      << "  --memory-estimate\n"
+      << "         Print an estimate of the memory needed by each process\n"
+      << "         for the likelihood computations, and exit without\n"
+      << "         searching. The estimate depends on the threads, and on\n"
+      << "         --replicas, --site-blocks and --no-extra-clvs. With fewer\n"
+      << "         site blocks than threads, it includes a copy of every\n"
+      << "         block per thread, up to the number of free model\n"
+      << "         parameters, for the parallel gradients.\n"
+      << "  --profile\n"
+      << "         Count the likelihood evaluations, lh cache hits, matrix\n"
+      << "         and partial updates and optimizer steps, and time the\n"
+      << "         parameter optimization, root ranking, alpha\n"
+      << "         optimization, checkpoint and MPI phases. Each process\n"
+      << "         writes its report to <prefix>.rank<N>.profile.tsv.\n"
+      << "         Default is off.\n"
+      << "  --no-extra-clvs\n"
+      << "         Don't allocate the directional CLVs used to rank all the\n"
+      << "         roots in a single pass, or the per-thread copies of small\n"
+      << "         partitions used to compute the gradients in parallel. The\n"
+      << "         CLVs of the tree itself are always kept. This roughly\n"
+      << "         halves the memory used, at the cost of ranking the roots\n"
+      << "         one at a time.\n"
+      << "  --replicas [NUMBER]\n"
+      << "         Number of copies of the model to search with in each\n"
+      << "         process. Each copy works on its own root in its own\n"
+      << "         thread, and the threads are split evenly between the\n"
+      << "         copies. Uses proportionally more memory, since each copy\n"
+      << "         has its own partitions. The copies share the tree. Not\n"
+      << "         supported for MPI runs. Default is 1.\n"
+      << "  --site-blocks [NUMBER]\n"
+      << "         Number of blocks to split the sites of each partition\n"
+      << "         into, so that a single partition can be computed with\n"
+      << "         several threads. By default, a partition is split when it\n"
+      << "         is more than a thread's share of the work, which is\n"
+      << "         estimated from its sites, states and rate categories.\n"
+      << "  --screen-roots\n"
+      << "         Rank the roots before optimizing them with a copy of the\n"
+      << "         model with a single rate category, which is cheaper than\n"
+      << "         the full model. Only the best roots of the ranking are\n"
+      << "         optimized with the full model. Uses more memory. Default\n"
+      << "         is off.\n"
+      << "  --tip-kernel [auto|site-repeats|tip-pattern]\n"
+      << "         Kernel to use for the tips of each partition. Site\n"
+      << "         repeats skip the patterns which are the same below a\n"
+      << "         node, and tip patterns use lookup tables for the tips\n"
+      << "         instead. The default, auto, picks tip patterns when\n"
+      << "         site repeats would still compute more than half of the\n"
+      << "         sites at the inner nodes. The choice is reported for\n"
+      << "         each partition.\n"
+      << "  --checkpoint-batch [NUMBER]\n"
+      << "         Number of results to collect before they are written to\n"
+      << "         the checkpoint together. The results are written by a\n"
+      << "         background thread, so the search does not wait for the\n"
+      << "         file system. Default is 1.\n"
+      << "  --checkpoint-interval [SECONDS]\n"
+      << "         Write the collected results to the checkpoint once the\n"
+      << "         first of them has waited this long, even if there are\n"
+      << "         fewer than --checkpoint-batch. Default is off.\n"
+      << "  --time-limit [SECONDS]\n"
+      << "         Stop the search once it has run this long, and write the\n"
+      << "         best tree, and for exhaustive mode the LWRs, of the\n"
+      << "         roots finished so far. The roots are done in the order\n"
+      << "         of their expected payoff. Running again with the same\n"
+      << "         prefix continues from the checkpoint. Default is off.\n"
+      << "  --max-evals [NUMBER]\n"
+      << "         Like --time-limit, but stop after this many likelihood\n"
+      << "         evaluations in each process. Default is off.\n"
       << "  --silent\n"
       << "         Suppress output except for the final tree\n"
       << "  --verbose\n"
@@ -173,6 +306,27 @@ cli_options_t parse_options(int argv, char **argc) {
       {"clean", no_argument, 0, 0},                       /* 25 */
       {"echo", no_argument, 0, 0},                        /* 26 */
       {"help", no_argument, 0, 0},                        /* 27 */
+      {"newton-alpha", no_argument, 0, 0},                /* 28 */
+      {"static-schedule", no_argument, 0, 0},             /* 29 */
+      {"no-extra-clvs", no_argument, 0, 0},               /* 30 */
+      {"replicas", required_argument, 0, 0},              /* 31 */
+      {"site-blocks", required_argument, 0, 0},           /* 32 */
+      {"warm-start", no_argument, 0, 0},                  /* 33 */
+      {"pin-threads", no_argument, 0, 0},                 /* 34 */
+      {"memory-estimate", no_argument, 0, 0},             /* 35 */
+      {"profile", no_argument, 0, 0},                     /* 36 */
+      {"msa-cache", required_argument, 0, 0},             /* 37 */
+      {"write-msa-cache", required_argument, 0, 0},       /* 38 */
+      {"prune-threshold", required_argument, 0, 0},       /* 39 */
+      {"batch", required_argument, 0, 0},                 /* 40 */
+      {"joint-params", no_argument, 0, 0},                /* 41 */
+      {"screen-roots", no_argument, 0, 0},                /* 42 */
+      {"tip-kernel", required_argument, 0, 0},            /* 43 */
+      {"checkpoint-batch", required_argument, 0, 0},      /* 44 */
+      {"checkpoint-interval", required_argument, 0, 0},   /* 45 */
+      {"bootstrap", required_argument, 0, 0},             /* 46 */
+      {"time-limit", required_argument, 0, 0},            /* 47 */
+      {"max-evals", required_argument, 0, 0},             /* 48 */
       {0, 0, 0, 0},
   };
 
@@ -286,6 +440,104 @@ cli_options_t parse_options(int argv, char **argc) {
       print_usage();
       std::exit(0);
       break;
+    case 28: // newton-alpha
+      cli_options.newton_alpha = true;
+      break;
+    case 29: // static-schedule
+      cli_options.dynamic_schedule = false;
+      break;
+    case 30: // no-extra-clvs
+      cli_options.no_extra_clvs = true;
+      break;
+    case 31: // replicas
+      cli_options.replicas = static_cast<size_t>(atol(optarg));
+      if (cli_options.replicas == 0) {
+        throw std::invalid_argument("Replicas needs to be at least 1");
+      }
+      break;
+    case 32: // site-blocks
+      cli_options.site_blocks = static_cast<size_t>(atol(optarg));
+      break;
+    case 33: // warm-start
+      cli_options.warm_start = true;
+      break;
+    case 34: // pin-threads
+      cli_options.pin_threads = true;
+      break;
+    case 35: // memory-estimate
+      cli_options.memory_estimate = true;
+      break;
+    case 36: // profile
+      cli_options.profile = true;
+      break;
+    case 37: // msa-cache
+      cli_options.msa_cache_filename = optarg;
+      break;
+    case 38: // write-msa-cache
+      cli_options.write_msa_cache_filename = optarg;
+      break;
+    case 39: // prune-threshold
+      cli_options.prune_threshold = atof(optarg);
+      if (!(cli_options.prune_threshold > 0.0)) {
+        throw std::invalid_argument("The prune threshold needs to be positive");
+      }
+      break;
+    case 40: // batch
+      cli_options.batch_filename = optarg;
+      break;
+    case 41: // joint-params
+      cli_options.joint_params = true;
+      break;
+    case 42: // screen-roots
+      cli_options.screen_roots = true;
+      break;
+    case 43: // tip-kernel
+      if (strcmp(optarg, "auto") == 0) {
+        cli_options.tip_kernel_mode = tip_kernel::automatic;
+      } else if (strcmp(optarg, "site-repeats") == 0) {
+        cli_options.tip_kernel_mode = tip_kernel::site_repeats;
+      } else if (strcmp(optarg, "tip-pattern") == 0) {
+        cli_options.tip_kernel_mode = tip_kernel::pattern_tip;
+      } else {
+        throw std::invalid_argument{
+            "The tip kernel needs to be one of auto, site-repeats or "
+            "tip-pattern"};
+      }
+      break;
+    case 44: // checkpoint-batch
+      if (atol(optarg) < 1) {
+        throw std::invalid_argument(
+            "The checkpoint batch needs to be at least one result");
+      }
+      cli_options.checkpoint_batch = static_cast<size_t>(atol(optarg));
+      break;
+    case 45: // checkpoint-interval
+      cli_options.checkpoint_delay = atof(optarg);
+      if (!(cli_options.checkpoint_delay > 0.0)) {
+        throw std::invalid_argument(
+            "The checkpoint interval needs to be positive");
+      }
+      break;
+    case 46: // bootstrap
+      if (atol(optarg) < 0) {
+        throw std::invalid_argument(
+            "The number of bootstrap replicates cannot be negative");
+      }
+      cli_options.bootstraps = static_cast<size_t>(atol(optarg));
+      break;
+    case 47: // time-limit
+      cli_options.time_limit = atof(optarg);
+      if (!(cli_options.time_limit > 0.0)) {
+        throw std::invalid_argument("The time limit needs to be positive");
+      }
+      break;
+    case 48: // max-evals
+      if (atol(optarg) < 1) {
+        throw std::invalid_argument(
+            "The number of evaluations needs to be at least one");
+      }
+      cli_options.max_evals = static_cast<size_t>(atol(optarg));
+      break;
     case '?':
     case ':':
       print_usage();
@@ -326,9 +578,461 @@ void merge_options_checkpoint(cli_options_t &cli_options,
   checkpoint_options.silent  = cli_options.silent;
   checkpoint_options.clean   = cli_options.clean;
 
+  checkpoint_options.newton_alpha     = cli_options.newton_alpha;
+  checkpoint_options.joint_params     = cli_options.joint_params;
+  checkpoint_options.dynamic_schedule = cli_options.dynamic_schedule;
+  checkpoint_options.no_extra_clvs    = cli_options.no_extra_clvs;
+  checkpoint_options.replicas         = cli_options.replicas;
+  checkpoint_options.site_blocks      = cli_options.site_blocks;
+  checkpoint_options.screen_roots     = cli_options.screen_roots;
+  checkpoint_options.tip_kernel_mode  = cli_options.tip_kernel_mode;
+  checkpoint_options.checkpoint_batch = cli_options.checkpoint_batch;
+  checkpoint_options.checkpoint_delay = cli_options.checkpoint_delay;
+  checkpoint_options.bootstraps       = cli_options.bootstraps;
+  checkpoint_options.time_limit       = cli_options.time_limit;
+  checkpoint_options.max_evals        = cli_options.max_evals;
+  checkpoint_options.warm_start       = cli_options.warm_start;
+  checkpoint_options.pin_threads      = cli_options.pin_threads;
+  checkpoint_options.memory_estimate  = cli_options.memory_estimate;
+  checkpoint_options.profile          = cli_options.profile;
+  checkpoint_options.prune_threshold  = cli_options.prune_threshold;
+
+  checkpoint_options.msa_cache_filename = cli_options.msa_cache_filename;
+
   std::swap(cli_options, checkpoint_options);
 }
 
+/*
+ * Find the rank of this process among the processes on the same host, and the
+ * number of processes on the host.
+ */
+static std::pair<size_t, size_t> local_rank() {
+#ifdef MPI_VERSION
+  MPI_Comm local_comm;
+  MPI_Comm_split_type(MPI_COMM_WORLD,
+                      MPI_COMM_TYPE_SHARED,
+                      __MPI_RANK__,
+                      MPI_INFO_NULL,
+                      &local_comm);
+  int rank = 0;
+  int size = 1;
+  MPI_Comm_rank(local_comm, &rank);
+  MPI_Comm_size(local_comm, &size);
+  MPI_Comm_free(&local_comm);
+  return {static_cast<size_t>(rank), static_cast<size_t>(size)};
+#else
+  return {0, 1};
+#endif
+}
+
+/*
+ * Pin the threads of this process, and report where they went. Failing to pin
+ * is not fatal, we just run unpinned.
+ */
+static void pin_threads(const std::pair<size_t, size_t> &local,
+                        size_t                           threads) {
+  try {
+    auto cpus = sysutil_get_thread_cpus(local.first, local.second, threads);
+    if (!sysutil_pin_threads(cpus)) {
+      debug_string(EMIT_LEVEL_WARNING, "Failed to pin the threads");
+      return;
+    }
+    std::string cpu_list;
+    for (size_t i = 0; i < cpus.size(); ++i) {
+      cpu_list += std::to_string(cpus[i]);
+      if (i != cpus.size() - 1) { cpu_list += ","; }
+    }
+    debug_print(EMIT_LEVEL_MPI_DEBUG,
+                "Pinned threads to cpus %s",
+                cpu_list.c_str());
+  } catch (const std::runtime_error &e) {
+    debug_print(
+        EMIT_LEVEL_WARNING, "Failed to pin the threads: %s", e.what());
+  }
+}
+
+/*
+ * Parse the MSA, and split it into the partitions. When a cache is given, the
+ * partitions are mapped from it instead, and the partition file is only read
+ * for the models.
+ */
+static std::vector<msa_t> load_msa(const cli_options_t &cli_options,
+                                   const pll_state_t *  map,
+                                   msa_partitions_t &   part_infos) {
+  if (!cli_options.partition_filename.empty()) {
+    part_infos = parse_partition_file(cli_options.partition_filename);
+  }
+
+  if (!cli_options.msa_cache_filename.empty()) {
+    auto   msa      = msa_t::read_cache(cli_options.msa_cache_filename, map);
+    size_t expected = cli_options.partition_filename.empty()
+                          ? 1
+                          : part_infos.size();
+    if (msa.size() != expected) {
+      throw std::runtime_error("The MSA cache has "
+                               + std::to_string(msa.size())
+                               + " partitions, but " + std::to_string(expected)
+                               + " were expected");
+    }
+    for (auto &m : msa) {
+      if (m.states() != cli_options.states) {
+        throw std::runtime_error(
+            "The MSA cache was written for a different number of states");
+      }
+    }
+    return msa;
+  }
+
+  std::vector<msa_t> msa;
+  if (cli_options.partition_filename.empty()) {
+    msa.emplace_back(cli_options.msa_filename, map, cli_options.states);
+  } else {
+    msa_t unparted_msa{
+        cli_options.msa_filename, map, cli_options.states, false};
+    msa = unparted_msa.partition(part_infos);
+  }
+  return msa;
+}
+
+/* Each process writes its report to <prefix>.rank<N>.profile.tsv */
+static void write_profile_report(const std::string &prefix) {
+  std::string profile_filename =
+      prefix + ".rank" + std::to_string(__MPI_RANK__) + ".profile.tsv";
+  profile::write_report(profile_filename, __MPI_RANK__);
+  debug_print(EMIT_LEVEL_INFO,
+              "Wrote the profile report to %s",
+              profile_filename.c_str());
+}
+
+/* Wait for the other ranks, unless the job is run by this process alone */
+static void job_barrier(bool local) {
+#ifdef MPI_VERSION
+  if (!local) { profile::mpi_barrier(); }
+#else
+  (void)local;
+#endif
+}
+
+struct job_result_t {
+  std::string tree;
+  double      lh = -std::numeric_limits<double>::infinity();
+};
+
+/*
+ * Search a tree with the given options and checkpoint, and write the trees to
+ * the prefix. Unless the job is local, all ranks search together, and only
+ * rank 0 writes the trees and fills in the result. Returns false if only the
+ * memory estimate was asked for.
+ */
+static bool run_job(cli_options_t &    cli_options,
+                    checkpoint_t &     checkpoint,
+                    const pll_state_t *map,
+                    bool               local,
+                    job_result_t &     result) {
+  size_t rank      = local ? 0 : static_cast<size_t>(__MPI_RANK__);
+  size_t num_tasks = local ? 1 : static_cast<size_t>(__MPI_NUM_TASKS__);
+  bool   lead      = local || __MPI_RANK__ == 0;
+
+  /* Parse the model */
+  if (!cli_options.model_string.empty()) {
+    auto mi = parse_model_info(cli_options.model_string);
+    cli_options.rate_cats.clear();
+
+    cli_options.rate_cats.push_back(mi.ratehet_opts);
+
+    if (mi.ratehet_opts.alpha_init) {
+      debug_string(EMIT_LEVEL_WARNING,
+                   "Ignoring alpha in model string as it currently "
+                   "is not suported");
+    }
+    auto subst_str{mi.subst_str};
+
+    for (auto &ch : subst_str) { ch = std::tolower(ch); }
+    if (subst_str != "unrest") {
+      debug_print(EMIT_LEVEL_WARNING,
+                  "Ignoring subst matrix %s for model from command line"
+                  ". Currently only UNREST is supported",
+                  mi.subst_str.c_str());
+    }
+  }
+
+  /* Parse the MSA */
+  msa_partitions_t part_infos;
+  auto             msa = load_msa(cli_options, map, part_infos);
+
+  /* Parse the partitions */
+  if (part_infos.size() > 0) {
+    if (cli_options.rate_cats.size() > 0) {
+      debug_string(EMIT_LEVEL_WARNING,
+                   "Using rate categories from the partition file "
+                   "over the option passed on the command line");
+    }
+    cli_options.rate_cats.clear();
+    for (auto &p : part_infos) {
+      auto rate_cats = p.model.ratehet_opts;
+      if (rate_cats.rate_cats == 0) { rate_cats.rate_cats = 1; }
+      cli_options.rate_cats.push_back(rate_cats);
+      if (p.model.ratehet_opts.alpha_init) {
+        debug_print(EMIT_LEVEL_WARNING,
+                    "Ignoring alpha in partition %s as it currently "
+                    "is not suported",
+                    p.partition_name.c_str());
+      }
+      auto subst_str{p.model.subst_str};
+
+      for (auto &ch : subst_str) { ch = std::tolower(ch); }
+
+      if (subst_str != "unrest") {
+        debug_print(EMIT_LEVEL_WARNING,
+                    "Ignoring subst matrix %s for partition "
+                    "%s. Currently only UNREST is supported",
+                    p.model.subst_str.c_str(),
+                    p.partition_name.c_str());
+      }
+    }
+  }
+
+  if (cli_options.rate_cats.size() == 1
+      && cli_options.rate_cats[0].rate_cats == 0) {
+    throw std::runtime_error("Rate categories cannot be zero");
+  }
+
+  /* Check the msa for validity */
+  for (auto &m : msa) { m.valid_data(); }
+
+  /* Make the tree */
+  rooted_tree_t tree{cli_options.tree_filename};
+
+  if (cli_options.min_roots > tree.root_count()) {
+    throw std::runtime_error(
+        "Min roots is larger than the number of roots on the tree");
+  }
+
+  size_t memory_estimate =
+      cli_options.replicas
+      * model_t::estimate_memory(tree,
+                                 msa,
+                                 cli_options.rate_cats,
+                                 !cli_options.no_extra_clvs,
+                                 cli_options.site_blocks,
+                                 cli_options.screen_roots,
+                                 cli_options.tip_kernel_mode);
+  debug_print(cli_options.memory_estimate ? EMIT_LEVEL_IMPORTANT
+                                          : EMIT_LEVEL_INFO,
+              "Estimated memory per process: %.1f MiB",
+              static_cast<double>(memory_estimate) / (1024.0 * 1024.0));
+  if (cli_options.memory_estimate) {
+    job_barrier(local);
+    return false;
+  }
+
+  auto  model_ptr = make_model(tree, msa, cli_options, cli_options.seed);
+  auto &model     = *model_ptr;
+
+  if (!cli_options.silent) {
+    auto &kernels = model.tip_kernels();
+    for (size_t i = 0; i < kernels.size(); ++i) {
+      debug_print(EMIT_LEVEL_IMPORTANT,
+                  "Kernel for partition %lu: %s",
+                  i,
+                  tip_kernel_name(kernels[i]));
+    }
+  }
+
+  if (cli_options.echo) { std::cout << tree.newick() << std::endl; }
+
+  model.set_warm_start(cli_options.warm_start);
+  model.set_prune_threshold(cli_options.prune_threshold);
+  model.set_local(local);
+  if (cli_options.time_limit > 0.0 || cli_options.max_evals > 0) {
+    model.set_budget(std::make_shared<search_budget_t>(cli_options.time_limit,
+                                                       cli_options.max_evals));
+  }
+
+  if (cli_options.replicas > 1) {
+    std::vector<std::unique_ptr<model_t>> replicas;
+    replicas.reserve(cli_options.replicas - 1);
+    for (size_t i = 1; i < cli_options.replicas; ++i) {
+      replicas.push_back(
+          make_model(tree, msa, cli_options, cli_options.seed + i));
+    }
+    model.set_replicas(std::move(replicas));
+  }
+  root_location_t final_rl;
+  if (!cli_options.exhaustive) {
+    model.assign_indicies_by_rank_search(
+        cli_options.min_roots,
+        cli_options.root_ratio,
+        rank,
+        num_tasks,
+        cli_options.initial_root_strategy,
+        checkpoint);
+    job_barrier(local);
+    auto tmp = model.search(cli_options.min_roots,
+                            cli_options.root_ratio,
+                            cli_options.abs_tolerance,
+                            cli_options.bfgs_tol,
+                            cli_options.br_tolerance,
+                            cli_options.factor,
+                            checkpoint);
+    if (lead) {
+      model.finalize();
+      final_rl  = tmp.first;
+      result.lh = tmp.second;
+      std::ofstream outfile{cli_options.prefix + ".rooted.tree"};
+      result.tree = model.rooted_newick(final_rl, false);
+      outfile << result.tree;
+    }
+  } else {
+
+    model.assign_indicies_by_rank_exhaustive(
+        rank,
+        num_tasks,
+        checkpoint);
+
+    job_barrier(local);
+
+    auto tmp = model.exhaustive_search(cli_options.abs_tolerance,
+                                       cli_options.bfgs_tol,
+                                       cli_options.br_tolerance,
+                                       cli_options.factor,
+                                       checkpoint);
+    if (lead) {
+      model.finalize();
+      final_rl    = tmp.first;
+      result.lh   = tmp.second;
+      result.tree = model.virtual_rooted_newick(final_rl);
+      {
+        std::ofstream outfile{cli_options.prefix + ".lwr.tree"};
+        outfile << result.tree;
+      }
+      {
+        std::ofstream outfile{cli_options.prefix + ".rooted.tree"};
+        outfile << model.rooted_newick(final_rl, false);
+      }
+    }
+  }
+
+  if (cli_options.bootstraps > 0) {
+    auto support = bootstrap_support(
+        model, msa, cli_options, tree.root_count(), rank, num_tasks, local);
+    if (lead) {
+      model.annotate_support(support);
+      model.finalize();
+      std::ofstream outfile{cli_options.prefix + ".support.tree"};
+      outfile << model.virtual_rooted_newick(final_rl);
+    }
+  }
+  return true;
+}
+
+/*
+ * Set up the options and the checkpoint of a batch job from the options of the
+ * batch, and search it in this process alone.
+ */
+static job_result_t run_batch_job(const cli_options_t &batch_options,
+                                  const batch_job_t &  job,
+                                  const pll_state_t *  map) {
+  cli_options_t cli_options      = batch_options;
+  cli_options.msa_filename       = job.msa_filename;
+  cli_options.tree_filename      = job.tree_filename;
+  cli_options.partition_filename = job.partition_filename;
+  cli_options.prefix             = job.prefix;
+  cli_options.replicas           = 1;
+  cli_options.batch_filename.clear();
+  cli_options.msa_cache_filename.clear();
+
+  checkpoint_t checkpoint(cli_options.prefix);
+  merge_options_checkpoint(cli_options, checkpoint);
+  checkpoint.set_policy(checkpoint_policy(cli_options));
+  checkpoint.save_options(cli_options);
+  if (checkpoint.needs_cleaning()) { checkpoint.merge(); }
+  checkpoint.reload();
+
+  job_result_t result;
+  run_job(cli_options, checkpoint, map, true, result);
+  return result;
+}
+
+/*
+ * Root all of the trees in the batch file. The jobs are split between the
+ * ranks by size, and each rank runs its jobs on a set of workers, each with an
+ * even share of the threads, which take the next job as they finish. A failed
+ * job is reported, and doesn't stop the others. Returns the exit code.
+ */
+static int run_batch(cli_options_t &cli_options, const pll_state_t *map) {
+  auto                jobs = parse_batch_file(cli_options.batch_filename);
+  std::vector<double> costs;
+  costs.reserve(jobs.size());
+  for (auto &job : jobs) { costs.push_back(estimate_batch_cost(job)); }
+  auto assigned = assign_batch_jobs(costs,
+                                    static_cast<size_t>(__MPI_RANK__),
+                                    static_cast<size_t>(__MPI_NUM_TASKS__));
+
+  if (cli_options.threads == 0) {
+    cli_options.threads =
+        std::max<size_t>(1, sysutil_get_cpu_cores() / local_rank().second);
+  }
+  if (cli_options.pin_threads) {
+    debug_string(EMIT_LEVEL_WARNING,
+                 "Pinning threads is not supported in batch mode");
+  }
+  size_t workers =
+      std::max<size_t>(1, std::min(cli_options.threads, assigned.size()));
+  int omp_threads =
+      static_cast<int>(std::max<size_t>(1, cli_options.threads / workers));
+  debug_print(EMIT_LEVEL_PROGRESS,
+              "Running %lu of %lu batch jobs with %lu workers",
+              assigned.size(),
+              jobs.size(),
+              workers);
+
+  std::atomic<size_t> next_job{0};
+  std::atomic<size_t> failed_jobs{0};
+  auto                worker = [&]() {
+#ifdef _OPENMP
+    omp_set_num_threads(omp_threads);
+#else
+    (void)omp_threads;
+#endif
+    for (size_t i = next_job++; i < assigned.size(); i = next_job++) {
+      const auto &job = jobs[assigned[i]];
+      try {
+        auto result = run_batch_job(cli_options, job, map);
+        debug_print(EMIT_LEVEL_PROGRESS,
+                    "Finished batch job %s, LogLH: %.5f",
+                    job.prefix.c_str(),
+                    result.lh);
+      } catch (const std::exception &e) {
+        failed_jobs++;
+        debug_print(EMIT_LEVEL_ERROR,
+                    "Batch job %s failed: %s",
+                    job.prefix.c_str(),
+                    e.what());
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  threads.reserve(workers - 1);
+  for (size_t i = 1; i < workers; ++i) { threads.emplace_back(worker); }
+  worker();
+  for (auto &t : threads) { t.join(); }
+  job_barrier(false);
+
+  if (cli_options.profile) {
+    write_profile_report(cli_options.prefix.empty() ? cli_options.batch_filename
+                                                    : cli_options.prefix);
+  }
+  if (failed_jobs > 0) {
+    debug_print(EMIT_LEVEL_ERROR,
+                "%lu batch jobs failed",
+                static_cast<size_t>(failed_jobs));
+    return 1;
+  }
+  return 0;
+}
+
 void verify_options(const cli_options_t &cli_options) {
   if (cli_options.msa_filename.empty()) {
     std::cout << "No MSA was given, please supply an MSA" << std::endl;
@@ -351,7 +1055,8 @@ int wrapped_main(int argv, char **argc) {
 #ifdef MPI_VERSION
   if (__MPI_NUM_TASKS__ == 1) {
     debug_string(EMIT_LEVEL_WARNING,
-                 "Running MPI version with only 1 process, "
+                 "Running MPI version with only 1 process, consider "
+                 "using the non-MPI version");
   }
 #endif
 
@@ -369,8 +1074,32 @@ int wrapped_main(int argv, char **argc) {
 
     auto cli_options = parse_options(argv, argc);
 #ifdef MPI_VERSION
-    MPI_Barrier(MPI_COMM_WORLD);
+    profile::mpi_barrier();
+#endif
+
+    constexpr const pll_state_t *map = pll_map_nt;
+
+    if (!cli_options.write_msa_cache_filename.empty()) {
+      if (__MPI_RANK__ == 0) {
+        msa_partitions_t part_infos;
+        auto             msa = load_msa(cli_options, map, part_infos);
+        for (auto &m : msa) { m.valid_data(); }
+        msa_t::write_cache(cli_options.write_msa_cache_filename, msa);
+        debug_print(EMIT_LEVEL_IMPORTANT,
+                    "Wrote %lu partitions to the MSA cache %s",
+                    msa.size(),
+                    cli_options.write_msa_cache_filename.c_str());
+      }
+#ifdef MPI_VERSION
+      profile::mpi_barrier();
 #endif
+      return 0;
+    }
+
+    if (!cli_options.batch_filename.empty()) {
+      if (cli_options.profile) { profile::enable(); }
+      return run_batch(cli_options, map);
+    }
 
     /* Use the tree path for the prefix */
     if (cli_options.prefix.empty()) {
@@ -379,6 +1108,8 @@ int wrapped_main(int argv, char **argc) {
 
     checkpoint_t checkpoint(cli_options.prefix);
     merge_options_checkpoint(cli_options, checkpoint);
+    checkpoint.set_policy(checkpoint_policy(cli_options));
+    if (cli_options.profile) { profile::enable(); }
     if (__MPI_RANK__ == 0) {
       if (cli_options.clean) {
         debug_print(EMIT_LEVEL_IMPORTANT,
@@ -386,7 +1117,7 @@ int wrapped_main(int argv, char **argc) {
                     checkpoint.get_filename().c_str());
         checkpoint.clean();
 #ifdef MPI_VERSION
-        MPI_Barrier(MPI_COMM_WORLD);
+        profile::mpi_barrier();
 #endif
         return 0;
       }
@@ -394,30 +1125,47 @@ int wrapped_main(int argv, char **argc) {
       if (checkpoint.needs_cleaning()) { checkpoint.clean(); }
     } else if (cli_options.clean) {
 #ifdef MPI_VERSION
-      MPI_Barrier(MPI_COMM_WORLD);
+      profile::mpi_barrier();
 #endif
       return 0;
     }
 #ifdef MPI_VERSION
-    MPI_Barrier(MPI_COMM_WORLD);
+    profile::mpi_barrier();
 #endif
 
     checkpoint.reload();
     debug_print(
         EMIT_LEVEL_MPI_DEBUG, "Checkpoint inode %d", checkpoint.get_inode());
 
+    /*
+     * For hybrid runs, the cores of a host are split between the processes
+     * on it, so that a run with one process per socket uses all of the cores.
+     */
+    auto local = local_rank();
     if (cli_options.threads == 0) {
-#ifdef MPI_VERSION
-      cli_options.threads = 1;
-#else
-      cli_options.threads = sysutil_get_cpu_cores();
-#endif
+      cli_options.threads =
+          std::max<size_t>(1, sysutil_get_cpu_cores() / local.second);
     }
 
 #ifdef _OPENMP
     omp_set_num_threads(cli_options.threads);
 #endif
 
+    /*
+     * This has to happen before the model is built, so that the CLVs are
+     * first touched from the NUMA node the threads are pinned to.
+     */
+    if (cli_options.pin_threads) { pin_threads(local, cli_options.threads); }
+
+#ifdef MPI_VERSION
+    if (cli_options.replicas > 1) {
+      debug_string(EMIT_LEVEL_WARNING,
+                   "Replicas are not supported for MPI runs, use more "
+                   "processes instead");
+      cli_options.replicas = 1;
+    }
+#endif
+
     if (!cli_options.silent)
       print_run_header(
           start_time, cli_options.seed, cli_options.threads, argv, argc);
@@ -428,174 +1176,16 @@ int wrapped_main(int argv, char **argc) {
         && cli_options.early_stop.convert_with_default(
             !cli_options.exhaustive)) {}
 
-    constexpr const pll_state_t *map = pll_map_nt;
-
-    /* Parse the model */
-    if (!cli_options.model_string.empty()) {
-      auto mi = parse_model_info(cli_options.model_string);
-      cli_options.rate_cats.clear();
-
-      cli_options.rate_cats.push_back(mi.ratehet_opts);
-
-      if (mi.ratehet_opts.alpha_init) {
-        debug_string(EMIT_LEVEL_WARNING,
-                     "Ignoring alpha in model string as it currently "
-                     "is not suported");
-      }
-      auto subst_str{mi.subst_str};
-
-      for (auto &ch : subst_str) { ch = std::tolower(ch); }
-      if (subst_str != "unrest") {
-        debug_print(EMIT_LEVEL_WARNING,
-                    "Ignoring subst matrix %s for model from command line"
-                    ". Currently only UNREST is supported",
-                    mi.subst_str.c_str());
-      }
-    }
-
-    /* Parse the MSA */
-    std::vector<msa_t> msa;
-    msa_partitions_t   part_infos;
-    if (cli_options.partition_filename.empty()) {
-      msa.emplace_back(cli_options.msa_filename, map, cli_options.states);
-    } else {
-      msa_t unparted_msa{
-          cli_options.msa_filename, map, cli_options.states, false};
-      part_infos = parse_partition_file(cli_options.partition_filename);
-      msa        = unparted_msa.partition(part_infos);
-    }
-
-    /* Parse the partitions */
-    if (part_infos.size() > 0) {
-      if (cli_options.rate_cats.size() > 0) {
-        debug_string(EMIT_LEVEL_WARNING,
-                     "Using rate categories from the partition file "
-                     "over the option passed on the command line");
-      }
-      cli_options.rate_cats.clear();
-      for (auto &p : part_infos) {
-        auto rate_cats = p.model.ratehet_opts;
-        if (rate_cats.rate_cats == 0) { rate_cats.rate_cats = 1; }
-        cli_options.rate_cats.push_back(rate_cats);
-        if (p.model.ratehet_opts.alpha_init) {
-          debug_print(EMIT_LEVEL_WARNING,
-                      "Ignoring alpha in partition %s as it currently "
-                      "is not suported",
-                      p.partition_name.c_str());
-        }
-        auto subst_str{p.model.subst_str};
-
-        for (auto &ch : subst_str) { ch = std::tolower(ch); }
-
-        if (subst_str != "unrest") {
-          debug_print(EMIT_LEVEL_WARNING,
-                      "Ignoring subst matrix %s for partition "
-                      "%s. Currently only UNREST is supported",
-                      p.model.subst_str.c_str(),
-                      p.partition_name.c_str());
-        }
-      }
-    }
-
-    if (cli_options.rate_cats.size() == 1
-        && cli_options.rate_cats[0].rate_cats == 0) {
-      throw std::runtime_error("Rate categories cannot be zero");
-    }
-
-    /* Check the msa for validity */
-    for (auto &m : msa) { m.valid_data(); }
-
-    /* Make the tree */
-    rooted_tree_t tree{cli_options.tree_filename};
-
-    if (cli_options.min_roots > tree.root_count()) {
-      throw std::runtime_error(
-          "Min roots is larger than the number of roots on the tree");
-    }
-
-    model_t model{
-        tree,
-        msa,
-        cli_options.rate_cats,
-        cli_options.invariant_sites,
-        cli_options.seed,
-        cli_options.early_stop.convert_with_default(!cli_options.exhaustive)};
-    try {
-      model.initialize_partitions(msa);
-    } catch (const invalid_empirical_frequencies_exception &) {
-      model.initialize_partitions_uniform_freqs(msa);
-    }
-
-    if (cli_options.echo) { std::cout << tree.newick() << std::endl; }
-
-    model.initialize();
-    root_location_t final_rl;
-    double          final_lh = -std::numeric_limits<double>::infinity();
-    std::string     final_tree_string;
-    if (!cli_options.exhaustive) {
-      model.assign_indicies_by_rank_search(
-          cli_options.min_roots,
-          cli_options.root_ratio,
-          static_cast<size_t>(__MPI_RANK__),
-          static_cast<size_t>(__MPI_NUM_TASKS__),
-          cli_options.initial_root_strategy,
-          checkpoint);
-#ifdef MPI_VERSION
-      MPI_Barrier(MPI_COMM_WORLD);
-#endif
-      auto tmp = model.search(cli_options.min_roots,
-                              cli_options.root_ratio,
-                              cli_options.abs_tolerance,
-                              cli_options.bfgs_tol,
-                              cli_options.br_tolerance,
-                              cli_options.factor,
-                              checkpoint);
-      if (__MPI_RANK__ == 0) {
-        model.finalize();
-        final_rl = tmp.first;
-        final_lh = tmp.second;
-        std::ofstream outfile{cli_options.prefix + ".rooted.tree"};
-        final_tree_string = model.rooted_tree(final_rl).newick(false);
-        outfile << final_tree_string;
-      }
-    } else {
-
-      model.assign_indicies_by_rank_exhaustive(
-          static_cast<size_t>(__MPI_RANK__),
-          static_cast<size_t>(__MPI_NUM_TASKS__),
-          checkpoint);
-
-#ifdef MPI_VERSION
-      MPI_Barrier(MPI_COMM_WORLD);
-#endif
-
-      auto tmp = model.exhaustive_search(cli_options.abs_tolerance,
-                                         cli_options.bfgs_tol,
-                                         cli_options.br_tolerance,
-                                         cli_options.factor,
-                                         checkpoint);
-      if (__MPI_RANK__ == 0) {
-        model.finalize();
-        final_rl          = tmp.first;
-        final_lh          = tmp.second;
-        final_tree_string = model.virtual_rooted_tree(final_rl).newick();
-        {
-          std::ofstream outfile{cli_options.prefix + ".lwr.tree"};
-          outfile << final_tree_string;
-        }
-        {
-          std::ofstream outfile{cli_options.prefix + ".rooted.tree"};
-          auto          tmp_tree = model.rooted_tree(final_rl);
-          outfile << tmp_tree.newick(false);
-        }
-      }
-    }
+    job_result_t result;
+    if (!run_job(cli_options, checkpoint, map, false, result)) { return 0; }
 
     if (!cli_options.silent) {
-      debug_print(EMIT_LEVEL_IMPORTANT, "Final LogLH: %.5f", final_lh);
+      debug_print(EMIT_LEVEL_IMPORTANT, "Final LogLH: %.5f", result.lh);
     }
 
-    if (__MPI_RANK__ == 0) { std::cout << final_tree_string << std::endl; }
+    if (__MPI_RANK__ == 0) { std::cout << result.tree << std::endl; }
+
+    if (cli_options.profile) { write_profile_report(cli_options.prefix); }
 
     auto end_time = std::chrono::system_clock::now();
 
@@ -618,7 +1208,20 @@ int wrapped_main(int argv, char **argc) {
 
 int main(int argv, char **argc) {
 #ifdef MPI_VERSION
-  MPI_Init(&argv, &argc);
+  /*
+   * The OpenMP threads and the checkpoint writer are running while the main
+   * thread makes the MPI calls, so we need at least funneled support.
+   */
+  int provided = MPI_THREAD_SINGLE;
+  MPI_Init_thread(&argv, &argc, MPI_THREAD_FUNNELED, &provided);
+  if (provided < MPI_THREAD_FUNNELED) {
+    MPI_Comm_rank(MPI_COMM_WORLD, &__MPI_RANK__);
+    debug_string(EMIT_LEVEL_ERROR,
+                 "The MPI library does not support threads, which RootDigger "
+                 "needs. Please use an MPI library with funneled thread "
+                 "support");
+    MPI_Abort(MPI_COMM_WORLD, 1);
+  }
 #endif
   wrapped_main(argv, argc);
 #ifdef MPI_VERSION
@@ -8,14 +8,21 @@
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <unordered_map>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "checkpoint.hpp"
 #include "debug.h"
 #include "libpll/pll.h"
 #include "model.hpp"
 #include "msa.hpp"
+#include "partition_schedule.hpp"
 #include "pll.h"
+#include "profile.hpp"
+#include "tip_kernel.hpp"
 #include "tree.hpp"
 #include "util.hpp"
 extern "C" {
@@ -98,25 +105,328 @@ inline size_t compute_final_size(size_t vector_size, double ratio, size_t min) {
   return std::max(static_cast<size_t>(vector_size * ratio), min);
 }
 
+static std::vector<double>
+compute_partition_costs(const std::vector<msa_t> &         msas,
+                        const std::vector<ratehet_opts_t> &rate_cats) {
+  std::vector<double> costs;
+  for (size_t i = 0; i < msas.size(); ++i) {
+    costs.push_back(partition_cost(
+        msas[i].length(), msas[i].states(), rate_cats[i].rate_cats));
+  }
+  return costs;
+}
+
+/*
+ * Pick the number of site blocks for each partition, by its share of the cost,
+ * so that the threads get about the same amount of work.
+ */
+static std::vector<size_t>
+compute_site_blocks(size_t                     site_blocks,
+                    const std::vector<msa_t> & msas,
+                    const std::vector<double> &costs,
+                    size_t                     min_block_sites) {
+  size_t threads = 1;
+#ifdef _OPENMP
+  threads = static_cast<size_t>(omp_get_max_threads());
+#endif
+  std::vector<size_t> sites;
+  for (auto &msa : msas) { sites.push_back(msa.length()); }
+  return partition_site_blocks(
+      costs, sites, site_blocks, threads, min_block_sites);
+}
+
+/*
+ * The most parameters that one optimization of a partition can have, which is
+ * the joint optimization of the rates, the freqs, and the free rate categories
+ * with their weights. A gradient never scores more points than this at once.
+ */
+static size_t
+max_free_parameters(const std::vector<msa_t> &         msas,
+                    const std::vector<ratehet_opts_t> &rate_cats) {
+  size_t max_params = 0;
+  for (size_t i = 0; i < msas.size(); ++i) {
+    size_t states = msas[i].states();
+    max_params =
+        std::max(max_params, states * states + 2 * rate_cats[i].rate_cats);
+  }
+  return max_params;
+}
+
+/*
+ * Pick the number of gradient lanes. The lanes are only worth their memory when
+ * there are threads left over after the blocks have been spread out, which is
+ * when the partitions are too small to split. Each lane is a copy of every
+ * block, so there are never more lanes than points in a gradient.
+ */
+static size_t
+compute_gradient_lanes(size_t blocks, size_t max_params, bool enabled) {
+  if (!enabled) { return 0; }
+  size_t threads = 1;
+#ifdef _OPENMP
+  threads = static_cast<size_t>(omp_get_max_threads());
+#endif
+  if (blocks >= threads) { return 0; }
+  return std::min(threads, max_params);
+}
+
+/*
+ * Screening only saves work when there is more than one rate category to
+ * collapse.
+ */
+static bool use_screening(bool                               screening,
+                          const std::vector<ratehet_opts_t> &rate_cats) {
+  if (!screening) { return false; }
+  for (auto &rc : rate_cats) {
+    if (rc.rate_cats > 1) { return true; }
+  }
+  return false;
+}
+
+/*
+ * The widest vector instructions that both the CPU and libpll support. Older
+ * versions of libpll don't have the AVX-512 kernels.
+ */
+static unsigned int pll_arch_attributes() {
+#ifdef PLL_ATTRIB_ARCH_AVX512
+  if (PLL_STAT(avx512f_present)) { return PLL_ATTRIB_ARCH_AVX512; }
+#endif
+  if (PLL_STAT(avx2_present)) { return PLL_ATTRIB_ARCH_AVX2; }
+  if (PLL_STAT(avx_present)) { return PLL_ATTRIB_ARCH_AVX; }
+  if (PLL_STAT(sse42_present)) { return PLL_ATTRIB_ARCH_SSE; }
+  return PLL_ATTRIB_ARCH_CPU;
+}
+
+static unsigned int pll_attributes(tip_kernel::tip_kernel_e kernel) {
+  unsigned int attributes = pll_arch_attributes();
+
+  attributes |= PLL_ATTRIB_NONREV;
+  attributes |= kernel == tip_kernel::pattern_tip ? PLL_ATTRIB_PATTERN_TIP
+                                                  : PLL_ATTRIB_SITE_REPEATS;
+  return attributes;
+}
+
+std::string model_t::simd_name() {
+  unsigned int attributes = pll_arch_attributes();
+#ifdef PLL_ATTRIB_ARCH_AVX512
+  if (attributes & PLL_ATTRIB_ARCH_AVX512) { return "AVX-512"; }
+#endif
+  if (attributes & PLL_ATTRIB_ARCH_AVX2) { return "AVX2"; }
+  if (attributes & PLL_ATTRIB_ARCH_AVX) { return "AVX"; }
+  if (attributes & PLL_ATTRIB_ARCH_SSE) { return "SSE"; }
+  return "none";
+}
+
+/*
+ * Pick the kernel for each partition from the site repeats that libpll would
+ * find at the inner CLVs of the tree. This is counted before the partitions
+ * exist, since the kernel is fixed when they are made. The tree is the same
+ * for every partition, but the patterns are not.
+ */
+static std::vector<tip_kernel::tip_kernel_e>
+compute_tip_kernels(const rooted_tree_t &      tree,
+                    const std::vector<msa_t> & msas,
+                    tip_kernel::tip_kernel_e   requested,
+                    std::vector<double> *      ratios = nullptr) {
+  std::vector<std::pair<size_t, size_t>> children;
+  std::unordered_map<std::string, unsigned int> label_map;
+  if (requested == tip_kernel::automatic) {
+    children  = tree.inner_children();
+    label_map = tree.label_map();
+  }
+
+  std::vector<tip_kernel::tip_kernel_e> kernels;
+  for (auto &msa : msas) {
+    double ratio = 1.0;
+    if (requested == tip_kernel::automatic) {
+      std::vector<const char *> tips(tree.tip_count(), nullptr);
+      for (int i = 0; i < msa.count(); ++i) {
+        auto it = label_map.find(msa.label(i));
+        if (it != label_map.end() && it->second < tips.size()) {
+          tips[it->second] = msa.sequence(i);
+        }
+      }
+      if (std::find(tips.begin(), tips.end(), nullptr) == tips.end()) {
+        ratio = site_repeats_ratio(tips, children, msa.length());
+      }
+    }
+    if (ratios) { ratios->push_back(ratio); }
+    kernels.push_back(select_tip_kernel(requested, ratio));
+  }
+  return kernels;
+}
+
+/*
+ * The number of doubles that libpll pads the states of a CLV to.
+ */
+static unsigned int simd_padding(unsigned int attributes) {
+#ifdef PLL_ATTRIB_ARCH_AVX512
+  if (attributes & PLL_ATTRIB_ARCH_AVX512) { return 8; }
+#endif
+  if (attributes & (PLL_ATTRIB_ARCH_AVX | PLL_ATTRIB_ARCH_AVX2)) { return 4; }
+  if (attributes & PLL_ATTRIB_ARCH_SSE) { return 2; }
+  return 1;
+}
+
+/*
+ * Estimate the size of a libpll partition from the buffers that
+ * pll_partition_create allocates. Without the tip pattern attribute, the tips
+ * get full CLVs. With it, they only get their characters, and the lookup
+ * tables for pairs of tips, which are small next to a CLV, are left out. With
+ * site repeats, the CLVs can end up smaller, so this is an upper bound.
+ */
+static size_t estimate_partition_memory(unsigned int tips,
+                                        unsigned int clv_buffers,
+                                        unsigned int states,
+                                        unsigned int sites,
+                                        unsigned int prob_matrices,
+                                        unsigned int rate_cats,
+                                        unsigned int scale_buffers,
+                                        unsigned int attributes) {
+  size_t padding       = simd_padding(attributes);
+  size_t states_padded = (states + padding - 1) / padding * padding;
+
+  size_t clv_size     = sites * states_padded * rate_cats * sizeof(double);
+  size_t pmatrix_size = states * states_padded * rate_cats * sizeof(double);
+  size_t scaler_size  = sites * sizeof(unsigned int);
+  /* The site repeats keep an id and a class per site for every CLV */
+  size_t repeats_size = attributes & PLL_ATTRIB_SITE_REPEATS
+                            ? 2 * sites * sizeof(unsigned int)
+                            : 0;
+
+  size_t clvs      = clv_buffers;
+  size_t tips_size = 0;
+  if (attributes & PLL_ATTRIB_PATTERN_TIP) {
+    tips_size = static_cast<size_t>(tips) * sites * sizeof(unsigned char);
+  } else {
+    clvs += tips;
+  }
+  return clvs * (clv_size + repeats_size) + tips_size
+         + prob_matrices * pmatrix_size + scale_buffers * scaler_size;
+}
+
+/*
+ * The directional CLVs go after the ones used for the current root.
+ */
+unsigned int model_t::clv_buffer_count(const rooted_tree_t &tree,
+                                       bool                 all_edge_clvs) {
+  unsigned int clv_buffers = tree.inner_clv_count();
+  if (all_edge_clvs) { clv_buffers += tree.directional_clv_count(); }
+  return clv_buffers;
+}
+
+/*
+ * The pmatrices for the whole edges and the root splits of every edge go after
+ * the ones used by the tree, the derivatives and the batched ratios.
+ */
+unsigned int model_t::pmatrix_count(const rooted_tree_t &tree,
+                                    bool                 all_edge_clvs) {
+  unsigned int pmatrices =
+      tree.branch_count() + _derivative_pmatrices + _batch_pmatrices;
+  if (all_edge_clvs) {
+    pmatrices += 3 * static_cast<unsigned int>(tree.root_count());
+  }
+  return pmatrices;
+}
+
+size_t
+model_t::estimate_memory(const rooted_tree_t &              tree,
+                         const std::vector<msa_t> &         msas,
+                         const std::vector<ratehet_opts_t> &rate_cats,
+                         bool                               all_edge_clvs,
+                         size_t                             site_blocks,
+                         bool                               screening,
+                         tip_kernel::tip_kernel_e           tip_kernel_mode) {
+  unsigned int clv_buffers       = clv_buffer_count(tree, all_edge_clvs);
+  unsigned int pmatrices         = pmatrix_count(tree, all_edge_clvs);
+  unsigned int screening_clvs    = clv_buffer_count(tree, false);
+  unsigned int screening_pmatrix = pmatrix_count(tree, false);
+  bool         screening_blocks  = use_screening(screening, rate_cats);
+
+  size_t total        = 0;
+  size_t lane_size    = 0;
+  size_t total_blocks = 0;
+  auto   costs        = compute_partition_costs(msas, rate_cats);
+  auto   block_counts =
+      compute_site_blocks(site_blocks, msas, costs, _min_block_sites);
+  auto kernels = compute_tip_kernels(tree, msas, tip_kernel_mode);
+  for (size_t partition_index = 0; partition_index < msas.size();
+       ++partition_index) {
+    auto &       msa = msas[partition_index];
+    unsigned int rate_cat_count =
+        static_cast<unsigned int>(rate_cats[partition_index].rate_cats);
+    unsigned int attributes = pll_attributes(kernels[partition_index]);
+    size_t blocks = block_counts[partition_index];
+    for (size_t block = 0; block < blocks; ++block) {
+      unsigned int block_sites =
+          static_cast<unsigned int>(msa.length() * (block + 1) / blocks)
+          - static_cast<unsigned int>(msa.length() * block / blocks);
+      total += estimate_partition_memory(tree.tip_count(),
+                                         clv_buffers,
+                                         msa.states(),
+                                         block_sites,
+                                         pmatrices,
+                                         rate_cat_count,
+                                         clv_buffers,
+                                         attributes);
+      lane_size += estimate_partition_memory(tree.tip_count(),
+                                             tree.inner_clv_count(),
+                                             msa.states(),
+                                             block_sites,
+                                             tree.branch_count(),
+                                             rate_cat_count,
+                                             tree.inner_clv_count(),
+                                             attributes);
+      if (screening_blocks) {
+        total += estimate_partition_memory(tree.tip_count(),
+                                           screening_clvs,
+                                           msa.states(),
+                                           block_sites,
+                                           screening_pmatrix,
+                                           1,
+                                           screening_clvs,
+                                           attributes);
+      }
+    }
+    total_blocks += blocks;
+  }
+
+  total += compute_gradient_lanes(total_blocks,
+                                  max_free_parameters(msas, rate_cats),
+                                  all_edge_clvs)
+           * lane_size;
+  return total;
+}
+
 model_t::model_t(rooted_tree_t                      tree,
                  const std::vector<msa_t> &         msas,
                  const std::vector<ratehet_opts_t> &rate_cats,
                  bool                               invariant_sites,
                  uint64_t                           seed,
-                 bool                               early_stop) :
-    _invariant_sites{invariant_sites}, _seed{seed}, _early_stop{early_stop} {
+                 bool                               early_stop,
+                 bool                               all_edge_clvs,
+                 size_t                             site_blocks,
+                 bool                               screening,
+                 tip_kernel::tip_kernel_e           tip_kernel_mode) :
+    _invariant_sites{invariant_sites},
+    _seed{seed},
+    _early_stop{early_stop},
+    _all_edge_clvs{all_edge_clvs} {
   if (_early_stop) {
     debug_string(EMIT_LEVEL_IMPORTANT, "INFO: Early stop is enabled");
   }
 
   _random_engine = std::minstd_rand(_seed);
   _tree          = std::move(tree);
+  _backend       = make_lh_backend();
+  debug_print(EMIT_LEVEL_INFO,
+              "Computing the likelihoods with the %s backend",
+              _backend->name());
   for (auto rc : rate_cats) {
     _rate_rates.emplace_back(rc.rate_cats, rc.alpha);
     _rate_weights.emplace_back(rc.rate_cats, 1.0 / rc.rate_cats);
     _rate_category_types.emplace_back(rc.rate_category_type);
     _rate_user_init.emplace_back(rc.alpha_init);
-    _param_indicies.emplace_back(rc.rate_cats, 0);
+    _rate_param_indicies.emplace_back(rc.rate_cats, 0);
   }
 
   for (auto &msa : msas) {
@@ -126,22 +436,35 @@ model_t::model_t(rooted_tree_t                      tree,
     }
   }
 
-  unsigned int attributes = 0;
-  if (PLL_STAT(avx2_present)) {
-    attributes |= PLL_ATTRIB_ARCH_AVX2;
-  } else if (PLL_STAT(avx_present)) {
-    attributes |= PLL_ATTRIB_ARCH_AVX;
-  } else if (PLL_STAT(sse42_present)) {
-    attributes |= PLL_ATTRIB_ARCH_SSE;
-  }
+  unsigned int clv_buffers = clv_buffer_count(_tree, _all_edge_clvs);
+  unsigned int pmatrices   = pmatrix_count(_tree, _all_edge_clvs);
 
-  attributes |= PLL_ATTRIB_NONREV;
-  attributes |= PLL_ATTRIB_SITE_REPEATS;
+  auto partition_costs = compute_partition_costs(msas, rate_cats);
+  auto block_counts =
+      compute_site_blocks(site_blocks, msas, partition_costs, _min_block_sites);
+  std::vector<double> block_costs;
+
+  std::vector<double> repeats_ratios;
+  _tip_kernels =
+      compute_tip_kernels(_tree, msas, tip_kernel_mode, &repeats_ratios);
 
   size_t total_weight = 0;
   for (size_t partition_index = 0; partition_index < msas.size();
        ++partition_index) {
-    auto &msa = msas[partition_index];
+    auto &       msa        = msas[partition_index];
+    unsigned int attributes = pll_attributes(_tip_kernels[partition_index]);
+    if (tip_kernel_mode == tip_kernel::automatic) {
+      debug_print(EMIT_LEVEL_INFO,
+                  "Partition %lu: using %s, site repeats ratio %.3f",
+                  partition_index,
+                  tip_kernel_name(_tip_kernels[partition_index]),
+                  repeats_ratios[partition_index]);
+    } else {
+      debug_print(EMIT_LEVEL_INFO,
+                  "Partition %lu: using %s",
+                  partition_index,
+                  tip_kernel_name(_tip_kernels[partition_index]));
+    }
 
     if (_rate_rates[partition_index].size()
         > static_cast<size_t>(std::numeric_limits<int>::max())) {
@@ -154,22 +477,107 @@ model_t::model_t(rooted_tree_t                      tree,
           "The length of the MSA is too large to safely cast");
     }
 
-    _partitions.push_back(pll_partition_create(
-        _tree.tip_count(),
-        _tree.branch_count(),
-        msa.states(),
-        msa.length(),
-        _submodels,
-        _tree.branch_count(),
-        static_cast<unsigned int>(_rate_rates[partition_index].size()),
-        _tree.branch_count(),
-        attributes));
+    size_t blocks = block_counts[partition_index];
+    if (blocks > 1) {
+      debug_print(EMIT_LEVEL_INFO,
+                  "Splitting partition %lu into %lu site blocks",
+                  partition_index,
+                  blocks);
+    }
+
+    /*
+     * Each block is a separate partition in libpll, over a contiguous range of
+     * the site patterns. The parameters are still set per partition, and are
+     * copied to all the blocks.
+     */
+    _partition_blocks.emplace_back();
+    for (size_t block = 0; block < blocks; ++block) {
+      unsigned int block_begin =
+          static_cast<unsigned int>(msa.length() * block / blocks);
+      unsigned int block_end =
+          static_cast<unsigned int>(msa.length() * (block + 1) / blocks);
+
+      _partition_blocks.back().push_back(_partitions.size());
+      _block_offsets.push_back(block_begin);
+      block_costs.push_back(
+          partition_cost(block_end - block_begin,
+                         msa.states(),
+                         _rate_rates[partition_index].size()));
+      _param_indicies.push_back(_rate_param_indicies[partition_index]);
+      _partitions.push_back(pll_partition_create(
+          _tree.tip_count(),
+          clv_buffers,
+          msa.states(),
+          block_end - block_begin,
+          _submodels,
+          pmatrices,
+          static_cast<unsigned int>(_rate_rates[partition_index].size()),
+          clv_buffers,
+          attributes));
+      _pmatrix_caches.emplace_back();
+      _pmatrix_caches.back().branch_lengths.resize(pmatrices);
+      _pmatrix_caches.back().versions.resize(pmatrices, 0);
+    }
     _partition_weights.push_back(msa.total_weight());
 
     set_gamma_rates(partition_index);
     total_weight += msa.total_weight();
   }
 
+  _partition_order = longest_first(partition_costs);
+  _block_order     = longest_first(block_costs);
+  for (auto partition_index : _partition_order) {
+    debug_print(EMIT_LEVEL_INFO,
+                "Scheduling partition %lu: %u sites, cost %.3g, %lu blocks",
+                partition_index,
+                msas[partition_index].length(),
+                partition_costs[partition_index],
+                _partition_blocks[partition_index].size());
+  }
+
+  /*
+   * The lanes only need enough CLVs and pmatrices for the current root, since
+   * they are only used to compute the lh at the root for the gradients.
+   */
+  size_t lanes = compute_gradient_lanes(_partitions.size(),
+                                        max_free_parameters(msas, rate_cats),
+                                        _all_edge_clvs);
+  if (lanes > 0) {
+    debug_print(EMIT_LEVEL_INFO, "Using %lu gradient lanes", lanes);
+  }
+  _gradient_lanes.resize(lanes);
+  for (auto &lane : _gradient_lanes) {
+    for (auto block : _partitions) {
+      lane.push_back(pll_partition_create(_tree.tip_count(),
+                                          _tree.inner_clv_count(),
+                                          block->states,
+                                          block->sites,
+                                          _submodels,
+                                          _tree.branch_count(),
+                                          block->rate_cats,
+                                          _tree.inner_clv_count(),
+                                          block->attributes));
+    }
+  }
+
+  if (use_screening(screening, rate_cats)) {
+    debug_string(EMIT_LEVEL_INFO,
+                 "Ranking roots with a single rate category");
+    unsigned int screening_clvs = clv_buffer_count(_tree, false);
+    for (auto block : _partitions) {
+      _screening_blocks.push_back(
+          pll_partition_create(_tree.tip_count(),
+                               screening_clvs,
+                               block->states,
+                               block->sites,
+                               _submodels,
+                               pmatrix_count(_tree, false),
+                               1,
+                               screening_clvs,
+                               block->attributes));
+    }
+  }
+
   assign_indicies();
 }
 
@@ -177,10 +585,21 @@ model_t::~model_t() {
   for (auto p : _partitions) {
     if (p) pll_partition_destroy(p);
   }
+  for (auto &lane : _gradient_lanes) {
+    for (auto p : lane) {
+      if (p) pll_partition_destroy(p);
+    }
+  }
+  for (auto p : _screening_blocks) {
+    if (p) pll_partition_destroy(p);
+  }
 }
 
 void model_t::set_subst_rates(size_t p_index, const model_params_t &mp) {
-  pll_set_subst_params(_partitions[p_index], 0, mp.data());
+  for (auto block : _partition_blocks[p_index]) {
+    pll_set_subst_params(_partitions[block], 0, mp.data());
+  }
+  invalidate_pmatrices(p_index);
 }
 
 void model_t::set_subst_rates_random(size_t p_index, const msa_t &msa) {
@@ -200,11 +619,16 @@ void model_t::set_gamma_weights(size_t p_index, model_params_t w) {
   for (auto &f : w) { sum += f; }
   for (auto &f : w) { f /= sum; }
   debug_print(EMIT_LEVEL_DEBUG, "setting weights to %s", to_string(w).c_str());
-  pll_set_category_weights(_partitions[p_index], w.data());
+  for (auto block : _partition_blocks[p_index]) {
+    pll_set_category_weights(_partitions[block], w.data());
+  }
+  invalidate_lh();
 }
 
 void model_t::set_gamma_rates(size_t p_index) {
-  pll_set_category_weights(_partitions[p_index], _rate_weights[p_index].data());
+  for (auto block : _partition_blocks[p_index]) {
+    pll_set_category_weights(_partitions[block], _rate_weights[p_index].data());
+  }
   switch (_rate_category_types[p_index]) {
   case rate_category::MEAN:
     set_gamma_rates_mean(p_index);
@@ -237,7 +661,7 @@ void model_t::set_gamma_rates_mean(size_t p_index) {
                          static_cast<unsigned int>(_rate_rates[p_index].size()),
                          _rate_rates[p_index].data(),
                          PLL_GAMMA_RATES_MEAN);
-  pll_set_category_rates(_partitions[p_index], _rate_rates[p_index].data());
+  set_category_rates(p_index);
 }
 
 void model_t::set_gamma_rates_mean(size_t p_index, double alpha) {
@@ -245,7 +669,7 @@ void model_t::set_gamma_rates_mean(size_t p_index, double alpha) {
                          static_cast<unsigned int>(_rate_rates[p_index].size()),
                          _rate_rates[p_index].data(),
                          PLL_GAMMA_RATES_MEDIAN);
-  pll_set_category_rates(_partitions[p_index], _rate_rates[p_index].data());
+  set_category_rates(p_index);
 }
 
 void model_t::set_gamma_rates_median(size_t p_index) {
@@ -253,7 +677,7 @@ void model_t::set_gamma_rates_median(size_t p_index) {
                          static_cast<unsigned int>(_rate_rates[p_index].size()),
                          _rate_rates[p_index].data(),
                          PLL_GAMMA_RATES_MEAN);
-  pll_set_category_rates(_partitions[p_index], _rate_rates[p_index].data());
+  set_category_rates(p_index);
 }
 
 void model_t::set_gamma_rates_median(size_t p_index, double alpha) {
@@ -261,12 +685,12 @@ void model_t::set_gamma_rates_median(size_t p_index, double alpha) {
                          static_cast<unsigned int>(_rate_rates[p_index].size()),
                          _rate_rates[p_index].data(),
                          PLL_GAMMA_RATES_MEDIAN);
-  pll_set_category_rates(_partitions[p_index], _rate_rates[p_index].data());
+  set_category_rates(p_index);
 }
 
 void model_t::set_gamma_rates_free(size_t p_index) {
   for (auto &r : _rate_rates[p_index]) { r = 1.0; }
-  pll_set_category_rates(_partitions[p_index], _rate_rates[p_index].data());
+  set_category_rates(p_index);
 }
 
 void model_t::set_gamma_rates_free(size_t p_index, model_params_t free_rates) {
@@ -279,17 +703,38 @@ void model_t::set_gamma_rates_free(size_t p_index, model_params_t free_rates) {
   for (auto &f : free_rates) { f /= sum; }
   debug_print(
       EMIT_LEVEL_DEBUG, "setting rates to %s", to_string(free_rates).c_str());
-  pll_set_category_rates(_partitions[p_index], _rate_rates[p_index].data());
+  set_category_rates(p_index);
+}
+
+void model_t::set_category_rates(size_t p_index) {
+  for (auto block : _partition_blocks[p_index]) {
+    pll_set_category_rates(_partitions[block], _rate_rates[p_index].data());
+  }
+  invalidate_pmatrices(p_index);
+}
+
+std::vector<pll_partition_t *> model_t::block_and_lanes(size_t block) const {
+  std::vector<pll_partition_t *> partitions{_partitions[block]};
+  for (auto &lane : _gradient_lanes) { partitions.push_back(lane[block]); }
+  if (!_screening_blocks.empty()) {
+    partitions.push_back(_screening_blocks[block]);
+  }
+  return partitions;
 }
 
 void model_t::update_invariant_sites(size_t p_index) {
-  if (_invariant_sites) {
-    pll_update_invariant_sites(_partitions[p_index]);
-  } else {
-    for (unsigned int i = 0; i < _submodels; ++i) {
-      pll_update_invariant_sites_proportion(_partitions[p_index], i, 0.0);
+  for (auto block : _partition_blocks[p_index]) {
+    for (auto partition : block_and_lanes(block)) {
+      if (_invariant_sites) {
+        pll_update_invariant_sites(partition);
+      } else {
+        for (unsigned int i = 0; i < _submodels; ++i) {
+          pll_update_invariant_sites_proportion(partition, i, 0.0);
+        }
+      }
     }
   }
+  invalidate_pmatrices(p_index);
 }
 
 void model_t::set_tip_states(size_t p_index, const msa_t &msa) {
@@ -298,37 +743,90 @@ void model_t::set_tip_states(size_t p_index, const msa_t &msa) {
 
   /* use the label map to assign tip states in the partition */
 
-  for (int i = 0; i < msa.count(); ++i) {
-    try {
-      auto result = pll_set_tip_states(_partitions[p_index],
-                                       label_map.at(msa.label(i)),
-                                       msa.map(),
-                                       msa.sequence(i));
-      if (result == PLL_FAILURE) {
-        throw std::runtime_error("failed to set tip " + std::to_string(i));
+  for (auto block : _partition_blocks[p_index]) {
+    auto offset = _block_offsets[block];
+    for (auto partition : block_and_lanes(block)) {
+      for (int i = 0; i < msa.count(); ++i) {
+        try {
+          auto result = pll_set_tip_states(partition,
+                                           label_map.at(msa.label(i)),
+                                           msa.map(),
+                                           msa.sequence(i) + offset);
+          _backend->invalidate(partition);
+          if (result == PLL_FAILURE) {
+            throw std::runtime_error("failed to set tip "
+                                     + std::to_string(i));
+          }
+        } catch (const std::exception &e) {
+          throw std::runtime_error(std::string("Could not find taxa ")
+                                   + msa.label(i) + " in tree");
+        }
       }
-    } catch (const std::exception &e) {
-      throw std::runtime_error(std::string("Could not find taxa ")
-                               + msa.label(i) + " in tree");
+
+      /* set pattern weights */
+      pll_set_pattern_weights(partition, msa.weights() + offset);
     }
   }
+  invalidate_lh();
+}
 
-  /* set pattern weights */
-  pll_set_pattern_weights(_partitions[p_index], msa.weights());
+void model_t::set_pattern_weights(
+    const std::vector<std::vector<unsigned int>> &weights) {
+  if (weights.size() != partition_count()) {
+    throw std::runtime_error("Need pattern weights for every partition");
+  }
+  for (size_t p_index = 0; p_index < partition_count(); ++p_index) {
+    double total_weight = 0.0;
+    for (auto block : _partition_blocks[p_index]) {
+      auto offset = _block_offsets[block];
+      if (offset + _partitions[block]->sites > weights[p_index].size()) {
+        throw std::runtime_error("The pattern weights for partition "
+                                 + std::to_string(p_index)
+                                 + " are too short");
+      }
+      for (auto partition : block_and_lanes(block)) {
+        pll_set_pattern_weights(partition, weights[p_index].data() + offset);
+      }
+    }
+    for (auto w : weights[p_index]) { total_weight += w; }
+    _partition_weights[p_index] = total_weight;
+  }
+  invalidate_lh();
+  for (auto &replica : _replicas) { replica->set_pattern_weights(weights); }
 }
 
+/*
+ * The empirical frequencies are computed per block, so we combine them by the
+ * total pattern weight of each block to get the frequencies of the partition.
+ */
 void model_t::set_empirical_freqs(size_t p_index) {
-  pll_partition_t *partition = _partitions[p_index];
-  double *         emp_freqs = pllmod_msa_empirical_frequencies(partition);
-  for (size_t i = 0; i < partition->states; ++i) {
-    if (emp_freqs[i] <= 0) {
+  model_params_t emp_freqs(first_block(p_index)->states, 0.0);
+  double         total_weight = 0.0;
+  for (auto block : _partition_blocks[p_index]) {
+    pll_partition_t *partition    = _partitions[block];
+    double *         block_freqs  = pllmod_msa_empirical_frequencies(partition);
+    double           block_weight = 0.0;
+    for (unsigned int i = 0; i < partition->sites; ++i) {
+      block_weight += partition->pattern_weights[i];
+    }
+    for (size_t i = 0; i < emp_freqs.size(); ++i) {
+      emp_freqs[i] += block_freqs[i] * block_weight;
+    }
+    total_weight += block_weight;
+    free(block_freqs);
+  }
+  for (auto &f : emp_freqs) {
+    f /= total_weight;
+    if (f <= 0) {
       throw invalid_empirical_frequencies_exception(
           "One of the state frequenices is zero while using emperical "
           "frequencies");
     }
   }
-  pll_set_frequencies(partition, 0, emp_freqs);
-  free(emp_freqs);
+  for (auto block : _partition_blocks[p_index]) {
+    pll_set_frequencies(_partitions[block], 0, emp_freqs.data());
+  }
+  invalidate_pmatrices(p_index);
 }
 
 void model_t::set_freqs(size_t p_index, const model_params_t &freqs) {
@@ -337,7 +835,10 @@ void model_t::set_freqs(size_t p_index, const model_params_t &freqs) {
       throw std::runtime_error("Frequencies with 0 entries are not allowed");
     }
   }
-  pll_set_frequencies(_partitions[p_index], 0, freqs.data());
+  for (auto block : _partition_blocks[p_index]) {
+    pll_set_frequencies(_partitions[block], 0, freqs.data());
+  }
+  invalidate_pmatrices(p_index);
 }
 
 void model_t::set_freqs_all_free(size_t p_index, model_params_t freqs) {
@@ -354,6 +855,7 @@ bool model_t::update_eigen_partition(size_t partition_index) {
     if (!part->eigen_decomp_valid[i]) {
       int result = pll_update_eigen(part, _param_indicies[partition_index][i]);
       updated    = true;
+      profile::count(profile::eigen_updates);
       if (result == PLL_FAILURE) {
         throw std::runtime_error{"Failed to update the eigen decomposition"};
       }
@@ -362,18 +864,108 @@ bool model_t::update_eigen_partition(size_t partition_index) {
   return updated;
 }
 
+/*
+ * Any change to the parameters which the probability matrices depend on has to
+ * go through here, so that the cached matrices of the partition are recomputed.
+ */
+void model_t::invalidate_pmatrices(size_t p_index) {
+  for (auto block : _partition_blocks[p_index]) {
+    _pmatrix_caches[block].version++;
+  }
+  invalidate_lh();
+}
+
+/*
+ * Drop the cached lhs. The parameters of different partitions are set from the
+ * threads of optimize_params, so the version is bumped atomically.
+ */
+void model_t::invalidate_lh() {
+#pragma omp atomic
+  _lh_version++;
+}
+
+/* Count for the profile, and against the budget */
+void model_t::count_lh_evaluations(uint64_t n) {
+  profile::count(profile::lh_evaluations, n);
+  if (_budget) { _budget->count(n); }
+}
+
+bool model_t::lookup_lh(const root_location_t &root,
+                        bool                   need_dlh,
+                        lh_cache_entry_t &     entry) {
+  bool hit = _lh_cache.lookup(root.id, root.brlen_ratio, _lh_version, entry)
+             && (entry.has_dlh || !need_dlh);
+  profile::count(hit ? profile::lh_cache_hits : profile::lh_cache_misses);
+  return hit;
+}
+
+/*
+ * After a cached lh is used for a root, the tree is on that root but the root
+ * CLVs are not, so the next lh which reads them has to recompute them.
+ */
+void model_t::mark_root_clvs_stale() {
+  for (auto &cache : _pmatrix_caches) { cache.root_clv_stale = true; }
+}
+
+/*
+ * Update the probability matrices of a block, skipping the ones which already
+ * hold the requested branch length. The rest are computed in batches, one per
+ * thread, unless this is already called from a parallel region.
+ */
 void model_t::update_pmatrix_partition(
     size_t                           partition_index,
     const std::vector<unsigned int> &pmatrix_indices,
     const std::vector<double> &      branch_lengths) {
-  auto part = _partitions[partition_index];
-#pragma omp parallel for collapse(1) schedule(static)
-  for (size_t branch = 0; branch < branch_lengths.size(); ++branch) {
-    auto param_index   = _param_indicies[partition_index];
-    auto matrix_index  = pmatrix_indices[branch];
-    auto branch_length = branch_lengths[branch];
-    pll_update_prob_matrices(
-        part, param_index.data(), &matrix_index, &branch_length, 1);
+  auto &cache         = _pmatrix_caches[partition_index];
+  auto &stale_indices = cache.stale_indices;
+  auto &stale_lengths = cache.stale_lengths;
+  stale_indices.clear();
+  stale_lengths.clear();
+  for (size_t i = 0; i < pmatrix_indices.size(); ++i) {
+    auto matrix_index = pmatrix_indices[i];
+    if (cache.versions[matrix_index] == cache.version
+        && cache.branch_lengths[matrix_index] == branch_lengths[i]) {
+      continue;
+    }
+    cache.versions[matrix_index]       = cache.version;
+    cache.branch_lengths[matrix_index] = branch_lengths[i];
+    stale_indices.push_back(matrix_index);
+    stale_lengths.push_back(branch_lengths[i]);
+  }
+  profile::count(profile::pmatrix_cache_hits,
+                 pmatrix_indices.size() - stale_indices.size());
+  profile::count(profile::pmatrix_updates, stale_indices.size());
+  if (stale_indices.empty()) { return; }
+
+  size_t batches = 1;
+#ifdef _OPENMP
+  if (!omp_in_parallel()) {
+    batches = std::min(static_cast<size_t>(omp_get_max_threads()),
+                       stale_indices.size());
+  }
+#endif
+
+  auto part   = _partitions[partition_index];
+  bool failed = false;
+#pragma omp parallel for schedule(static) if (batches > 1)
+  for (size_t batch = 0; batch < batches; ++batch) {
+    size_t begin  = stale_indices.size() * batch / batches;
+    size_t end    = stale_indices.size() * (batch + 1) / batches;
+    int    result = _backend->update_prob_matrices(
+        part,
+        _param_indicies[partition_index].data(),
+        stale_indices.data() + begin,
+        stale_lengths.data() + begin,
+        static_cast<unsigned int>(end - begin));
+    if (result == PLL_FAILURE) {
+#pragma omp atomic write
+      failed = true;
+    }
+  }
+
+  if (failed) {
+    cache.version++;
+    throw std::runtime_error(pll_errmsg);
   }
 }
 
@@ -398,137 +990,949 @@ double model_t::compute_lh(const root_location_t &root_location) {
   std::vector<double>          branch_lengths;
   bool new_root = root_location != _tree.root_location();
 
+  /*
+   * Only the same root can come from the cache, since moving the root has to
+   * update the CLVs along the way.
+   */
+  lh_cache_entry_t cached;
+  if (!new_root && lookup_lh(root_location, false, cached)) {
+    return cached.lh;
+  }
+
   GENERATE_AND_UNPACK_OPS(
       _tree, root_location, ops, pmatrix_indices, branch_lengths);
 
   auto updated_partitions = update_pmatrices(pmatrix_indices, branch_lengths);
+  count_lh_evaluations();
 
   double lh = 0.0;
 
-#pragma omp parallel for reduction(+ : lh)
-  for (size_t i = 0; i < _partitions.size(); ++i) {
-    auto &partition = _partitions[i];
+#pragma omp parallel for schedule(dynamic) reduction(+ : lh)
+  for (size_t k = 0; k < _block_order.size(); ++k) {
+    size_t i         = _block_order[k];
+    auto & partition = _partitions[i];
 
-    if (new_root || updated_partitions[i]) {
-      pll_update_partials(
+    if (new_root || updated_partitions[i]
+        || _pmatrix_caches[i].root_clv_stale) {
+      _backend->update_partials(
           partition, ops.data(), static_cast<unsigned int>(ops.size()));
+      profile::count(profile::partial_updates, ops.size());
+      _pmatrix_caches[i].root_clv_stale = false;
     }
 
-    lh += pll_compute_root_loglikelihood(partition,
-                                         _tree.root_clv_index(),
-                                         _tree.root_scaler_index(),
-                                         _param_indicies[i].data(),
-                                         nullptr);
+    lh += _backend->root_loglikelihood(partition,
+                                       _tree.root_clv_index(),
+                                       _tree.root_scaler_index(),
+                                       _param_indicies[i].data());
   }
+  _lh_cache.insert_lh(
+      root_location.id, root_location.brlen_ratio, _lh_version, lh);
   return lh;
 }
 
 double model_t::compute_lh_root(const root_location_t &root) {
-  pll_operation_t           op;
-  std::vector<unsigned int> matrix_indices;
-  std::vector<double>       branch_lengths;
+  _tree.fill_derivative_operations(root, _root_plan);
 
-  {
-    auto result    = _tree.generate_derivative_operations(root);
-    op             = std::move(std::get<0>(result));
-    matrix_indices = std::move(std::get<1>(result));
-    branch_lengths = std::move(std::get<2>(result));
+  lh_cache_entry_t cached;
+  if (lookup_lh(root, false, cached)) {
+    mark_root_clvs_stale();
+    return cached.lh;
   }
 
+  const auto &op             = _root_plan.ops[0];
+  const auto &matrix_indices = _root_plan.pmatrix_indices;
+  const auto &branch_lengths = _root_plan.branch_lengths;
+  count_lh_evaluations();
+
   double lh = 0.0;
 
-#pragma omp parallel for reduction(+ : lh)
-  for (size_t i = 0; i < _partitions.size(); ++i) {
-    auto &partition = _partitions[i];
-    int   result    = pll_update_prob_matrices(
-        partition,
-        _param_indicies[i].data(),
-        matrix_indices.data(),
-        branch_lengths.data(),
-        static_cast<unsigned int>(matrix_indices.size()));
-
-    if (result == PLL_FAILURE) { throw std::runtime_error(pll_errmsg); }
-    pll_update_partials(partition, &op, 1);
-    lh += pll_compute_root_loglikelihood(partition,
-                                         _tree.root_clv_index(),
-                                         _tree.root_scaler_index(),
-                                         _param_indicies[i].data(),
-                                         nullptr);
+#pragma omp parallel for schedule(dynamic) reduction(+ : lh)
+  for (size_t k = 0; k < _block_order.size(); ++k) {
+    size_t i         = _block_order[k];
+    auto & partition = _partitions[i];
+    update_pmatrix_partition(i, matrix_indices, branch_lengths);
+    _backend->update_partials(partition, &op, 1);
+    profile::count(profile::partial_updates);
+    _pmatrix_caches[i].root_clv_stale = false;
+    lh += _backend->root_loglikelihood(partition,
+                                       _tree.root_clv_index(),
+                                       _tree.root_scaler_index(),
+                                       _param_indicies[i].data());
     //* _partition_weights[i];
   }
   if (std::isnan(lh)) {
     throw std::runtime_error("lh at root is not a number: "
                              + std::to_string(lh));
   }
+  _lh_cache.insert_lh(root.id, root.brlen_ratio, _lh_version, lh);
   return lh;
 }
 
+/*
+ * Compute the lh of a single partition, summed over its site blocks. The blocks
+ * are independent, so they are computed in parallel.
+ */
 double
 model_t::compute_lh_partition(size_t partition_index,
                               const std::vector<pll_operation_t> &ops,
                               const std::vector<unsigned int> &pmatrix_indices,
                               const std::vector<double> &      branch_lengths) {
-  bool update_partials = update_eigen_partition(partition_index);
-  if (update_partials) {
-    update_pmatrix_partition(partition_index, pmatrix_indices, branch_lengths);
-    pll_update_partials(_partitions[partition_index],
-                        ops.data(),
-                        static_cast<unsigned int>(ops.size()));
-  }
-
-  double lh =
-      pll_compute_root_loglikelihood(_partitions[partition_index],
-                                     _tree.root_clv_index(),
-                                     _tree.root_scaler_index(),
-                                     _param_indicies[partition_index].data(),
-                                     nullptr);
+  const auto &blocks = _partition_blocks[partition_index];
+  double      lh     = 0.0;
+  count_lh_evaluations();
+
+#pragma omp parallel for reduction(+ : lh) if (blocks.size() > 1)
+  for (size_t b = 0; b < blocks.size(); ++b) {
+    size_t block           = blocks[b];
+    bool   update_partials = update_eigen_partition(block)
+                           || _pmatrix_caches[block].root_clv_stale;
+    if (update_partials) {
+      update_pmatrix_partition(block, pmatrix_indices, branch_lengths);
+      _backend->update_partials(_partitions[block],
+                                ops.data(),
+                                static_cast<unsigned int>(ops.size()));
+      profile::count(profile::partial_updates, ops.size());
+      _pmatrix_caches[block].root_clv_stale = false;
+    }
+
+    lh += _backend->root_loglikelihood(_partitions[block],
+                                       _tree.root_clv_index(),
+                                       _tree.root_scaler_index(),
+                                       _param_indicies[block].data());
+  }
   if (std::isnan(lh)) {
     throw std::runtime_error("lh at root is not a number: "
                              + std::to_string(lh));
   }
-  return lh;
+  return lh;
+}
+
+/*
+ * Copy the model parameters of a partition, as they are currently set on its
+ * blocks, to the blocks of a gradient lane.
+ */
+void model_t::copy_params_to_lane(size_t partition_index, size_t lane) {
+  for (auto block : _partition_blocks[partition_index]) {
+    const pll_partition_t *src = _partitions[block];
+    pll_partition_t *      dst = _gradient_lanes[lane][block];
+    for (unsigned int i = 0; i < _submodels; ++i) {
+      pll_set_subst_params(dst, i, src->subst_params[i]);
+      pll_set_frequencies(dst, i, src->frequencies[i]);
+      pll_update_invariant_sites_proportion(dst, i, src->prop_invar[i]);
+    }
+    pll_set_category_rates(dst, src->rates);
+    pll_set_category_weights(dst, src->rate_weights);
+  }
+}
+
+/*
+ * Compute the lh of a partition on a gradient lane. This does the same work as
+ * compute_lh_partition, but always from scratch, and without any threading of
+ * its own, so that many lanes can be computed at once.
+ */
+double
+model_t::compute_lh_lane(size_t                              partition_index,
+                         size_t                              lane,
+                         const std::vector<pll_operation_t> &ops,
+                         const std::vector<unsigned int> &   pmatrix_indices,
+                         const std::vector<double> &         branch_lengths) {
+  double lh = 0.0;
+  count_lh_evaluations();
+  for (auto block : _partition_blocks[partition_index]) {
+    auto partition = _gradient_lanes[lane][block];
+    for (size_t i = 0; i < partition->rate_cats; ++i) {
+      if (!partition->eigen_decomp_valid[i]) {
+        int result = pll_update_eigen(partition, _param_indicies[block][i]);
+        profile::count(profile::eigen_updates);
+        if (result == PLL_FAILURE) {
+          throw std::runtime_error{"Failed to update the eigen decomposition"};
+        }
+      }
+    }
+    for (size_t branch = 0; branch < branch_lengths.size(); ++branch) {
+      auto matrix_index  = pmatrix_indices[branch];
+      auto branch_length = branch_lengths[branch];
+      _backend->update_prob_matrices(partition,
+                                     _param_indicies[block].data(),
+                                     &matrix_index,
+                                     &branch_length,
+                                     1);
+    }
+    _backend->update_partials(
+        partition, ops.data(), static_cast<unsigned int>(ops.size()));
+    profile::count(profile::pmatrix_updates, branch_lengths.size());
+    profile::count(profile::partial_updates, ops.size());
+    lh += _backend->root_loglikelihood(partition,
+                                       _tree.root_clv_index(),
+                                       _tree.root_scaler_index(),
+                                       _param_indicies[block].data());
+  }
+  return lh;
+}
+
+/*
+ * Copy the parameters of the blocks to the screening blocks, with the rate
+ * categories collapsed into one category of rate 1.
+ */
+void model_t::copy_params_to_screening() {
+  const double rate   = 1.0;
+  const double weight = 1.0;
+  for (size_t block = 0; block < _partitions.size(); ++block) {
+    const pll_partition_t *src = _partitions[block];
+    pll_partition_t *      dst = _screening_blocks[block];
+    for (unsigned int i = 0; i < _submodels; ++i) {
+      pll_set_subst_params(dst, i, src->subst_params[i]);
+      pll_set_frequencies(dst, i, src->frequencies[i]);
+      pll_update_invariant_sites_proportion(dst, i, src->prop_invar[i]);
+      if (pll_update_eigen(dst, i) == PLL_FAILURE) {
+        throw std::runtime_error{"Failed to update the eigen decomposition"};
+      }
+      profile::count(profile::eigen_updates);
+    }
+    pll_set_category_rates(dst, &rate);
+    pll_set_category_weights(dst, &weight);
+  }
+}
+
+static void apply_plan(lh_backend_t &          backend,
+                       pll_partition_t *       partition,
+                       const unsigned int *    param_indices,
+                       const operation_plan_t &plan) {
+  if (!plan.pmatrix_indices.empty()) {
+    backend.update_prob_matrices(
+        partition,
+        param_indices,
+        plan.pmatrix_indices.data(),
+        plan.branch_lengths.data(),
+        static_cast<unsigned int>(plan.pmatrix_indices.size()));
+  }
+  if (!plan.ops.empty()) {
+    backend.update_partials(
+        partition, plan.ops.data(), static_cast<unsigned int>(plan.ops.size()));
+  }
+  profile::count(profile::pmatrix_updates, plan.pmatrix_indices.size());
+  profile::count(profile::partial_updates, plan.ops.size());
+}
+
+/*
+ * Compute the lh of every root in roots() with the screening blocks. The plans
+ * for the whole sweep are made first, since making them moves the root of the
+ * tree, and then every block runs through them on its own. The tree is put
+ * back on its root at the end, so the CLVs of the real blocks stay valid.
+ */
+std::vector<double> model_t::compute_screening_lh() {
+  copy_params_to_screening();
+
+  const auto &                  roots = _tree.roots();
+  auto                          start = _tree.root_location();
+  std::vector<operation_plan_t> update_plans(roots.size() + 1);
+  std::vector<operation_plan_t> root_plans(roots.size());
+  _tree.fill_operations(start, update_plans[0]);
+  for (size_t r = 0; r < roots.size(); ++r) {
+    _tree.fill_root_update_operations(roots[r], update_plans[r + 1]);
+    _tree.fill_derivative_operations(roots[r], root_plans[r]);
+  }
+  _tree.fill_root_update_operations(start, _root_plan);
+  _tree.fill_derivative_operations(start, _root_plan);
+  count_lh_evaluations(roots.size());
+
+  std::vector<std::vector<double>> block_lh(
+      _screening_blocks.size(), std::vector<double>(roots.size(), 0.0));
+#pragma omp parallel for schedule(dynamic)
+  for (size_t k = 0; k < _block_order.size(); ++k) {
+    size_t              i             = _block_order[k];
+    auto                partition     = _screening_blocks[i];
+    const unsigned int *param_indices = _param_indicies[i].data();
+    apply_plan(*_backend, partition, param_indices, update_plans[0]);
+    for (size_t r = 0; r < roots.size(); ++r) {
+      apply_plan(*_backend, partition, param_indices, update_plans[r + 1]);
+      apply_plan(*_backend, partition, param_indices, root_plans[r]);
+      block_lh[i][r] = _backend->root_loglikelihood(partition,
+                                                    _tree.root_clv_index(),
+                                                    _tree.root_scaler_index(),
+                                                    param_indices);
+    }
+  }
+
+  std::vector<double> lh(roots.size(), 0.0);
+  for (auto &block : block_lh) {
+    for (size_t r = 0; r < roots.size(); ++r) { lh[r] += block[r]; }
+  }
+  return lh;
+}
+
+/*
+ * Compute the lh of a partition for each of a batch of parameter vectors. The
+ * parameters are set on the partition one vector at a time, and copied to a
+ * gradient lane, and then the lanes are computed in parallel. Each lh is
+ * computed on its own lane, so the results don't depend on the number of
+ * threads. Without lanes, the vectors are computed one after the other. Either
+ * way, the partition is left with the last vector set.
+ */
+void model_t::compute_lh_partition_batch(
+    size_t                                                     partition_index,
+    const std::vector<model_params_t> &                        points,
+    const std::function<void(size_t, const model_params_t &)> &set_func,
+    const std::vector<pll_operation_t> &                       ops,
+    const std::vector<unsigned int> &                          pmatrix_indices,
+    const std::vector<double> &                                branch_lengths,
+    std::vector<double> &                                      lh) {
+  lh.resize(points.size());
+  size_t lanes = _gradient_lanes.size();
+  if (lanes == 0) {
+    for (size_t i = 0; i < points.size(); ++i) {
+      set_func(partition_index, points[i]);
+      lh[i] = compute_lh_partition(
+          partition_index, ops, pmatrix_indices, branch_lengths);
+    }
+    return;
+  }
+
+  for (size_t begin = 0; begin < points.size(); begin += lanes) {
+    size_t count = std::min(lanes, points.size() - begin);
+    for (size_t lane = 0; lane < count; ++lane) {
+      set_func(partition_index, points[begin + lane]);
+      copy_params_to_lane(partition_index, lane);
+    }
+#pragma omp parallel for schedule(static)
+    for (size_t lane = 0; lane < count; ++lane) {
+      lh[begin + lane] = compute_lh_lane(
+          partition_index, lane, ops, pmatrix_indices, branch_lengths);
+    }
+  }
+}
+
+/*
+ * Step in the brlen ratio for the secant used by compute_dlh and
+ * compute_dlh_batch.
+ */
+static constexpr double DLH_SECANT_STEP = 1e-8;
+
+/*
+ * Shift a root for the secant. We step backwards near the end of the edge, and
+ * return the sign that the difference needs to be multiplied by.
+ */
+static double secant_root(const root_location_t &root,
+                          root_location_t &      root_prime) {
+  root_prime = root;
+  root_prime.brlen_ratio += DLH_SECANT_STEP;
+  if (root_prime.brlen_ratio >= 1.0) {
+    root_prime.brlen_ratio = root.brlen_ratio - DLH_SECANT_STEP;
+    return -1.0;
+  }
+  return 1.0;
+}
+
+/*
+ * Use a secant method to compute the derivative. The search methods come back
+ * to the same ratios, so the derivative is cached along with the lh.
+ */
+dlh_t model_t::compute_dlh(const root_location_t &root) {
+  lh_cache_entry_t cached;
+  if (lookup_lh(root, true, cached)) {
+    _tree.fill_derivative_operations(root, _root_plan);
+    mark_root_clvs_stale();
+    return {cached.lh, cached.dlh};
+  }
+
+  dlh_t           ret;
+  root_location_t root_prime{root};
+  double          sign = secant_root(root, root_prime);
+
+  profile::count(profile::derivative_evaluations);
+  double fx = compute_lh_root(root);
+  ret.lh    = fx;
+
+  if (std::isnan(fx)) {
+    throw std::runtime_error("fx is not finite when computing derivative: "
+                             + std::to_string(root.edge->length));
+  }
+  double fxh = compute_lh_root(root_prime);
+  if (std::isnan(fxh)) {
+    throw std::runtime_error("fxh is not finite when computing derivative: "
+                             + std::to_string(root_prime.edge->length));
+  }
+
+  if (std::isnan(fxh)) {
+    throw std::runtime_error("fxh is not finite when computing derivative: "
+                             + std::to_string(root_prime.edge->length));
+  }
+  if (std::isinf(fxh) && std::isinf(fx)) {
+    debug_string(EMIT_LEVEL_DEBUG,
+                 "Both evals are -inf, returning a 0 derivative");
+    _lh_cache.insert_dlh(root.id, root.brlen_ratio, _lh_version, fx, 0);
+    return {fx, 0};
+  }
+  double dlh = (fxh - fx) / DLH_SECANT_STEP;
+  debug_print(
+      EMIT_LEVEL_DEBUG, "dlh: %f, fx: %f, fxh: %f", dlh * sign, fx, fxh);
+  ret.dlh = dlh * sign;
+  _lh_cache.insert_dlh(root.id, root.brlen_ratio, _lh_version, ret.lh, ret.dlh);
+  return ret;
+}
+
+/*
+ * Largest row sum of |P - I| over the rate categories of a pmatrix, which
+ * bounds how fast the series for log(P) converges.
+ */
+static double pmatrix_distance_from_identity(const double *pm,
+                                             unsigned int  rate_cats,
+                                             unsigned int  states,
+                                             unsigned int  states_padded) {
+  double norm = 0.0;
+  for (unsigned int c = 0; c < rate_cats; ++c) {
+    for (unsigned int i = 0; i < states; ++i) {
+      const double *row = pm + (c * states + i) * states_padded;
+      double        sum = 0.0;
+      for (unsigned int j = 0; j < states; ++j) {
+        sum += fabs(row[j] - (i == j ? 1.0 : 0.0));
+      }
+      norm = std::max(norm, sum);
+    }
+  }
+  return norm;
+}
+
+/*
+ * Recover the rate matrix of each category from its pmatrix at the branch
+ * length t, as Q = log(P(t)) / t. The branch has to be short enough that
+ * |P - I| is well below 1, so that the series log(I + A) = A - A^2/2 + ...
+ * converges in a few terms.
+ */
+static void log_pmatrix(const double *pm,
+                        unsigned int  rate_cats,
+                        unsigned int  states,
+                        unsigned int  states_padded,
+                        double        t,
+                        double *      q) {
+  std::vector<double> a(states * states);
+  std::vector<double> power(states * states);
+  std::vector<double> next(states * states);
+  for (unsigned int c = 0; c < rate_cats; ++c) {
+    const double *pm_c = pm + c * states * states_padded;
+    double *      q_c  = q + c * states * states_padded;
+    for (unsigned int i = 0; i < states; ++i) {
+      for (unsigned int j = 0; j < states; ++j) {
+        a[i * states + j] = pm_c[i * states_padded + j] - (i == j ? 1.0 : 0.0);
+        q_c[i * states_padded + j] = 0.0;
+      }
+    }
+    power = a;
+    for (unsigned int k = 1; k <= 64; ++k) {
+      double sign    = k % 2 == 1 ? 1.0 : -1.0;
+      double largest = 0.0;
+      for (unsigned int i = 0; i < states; ++i) {
+        for (unsigned int j = 0; j < states; ++j) {
+          double term = sign * power[i * states + j] / k;
+          q_c[i * states_padded + j] += term / t;
+          largest = std::max(largest, fabs(term));
+        }
+      }
+      if (largest < std::numeric_limits<double>::epsilon() * 1e-3) { break; }
+      for (unsigned int i = 0; i < states; ++i) {
+        for (unsigned int j = 0; j < states; ++j) {
+          double sum = 0.0;
+          for (unsigned int l = 0; l < states; ++l) {
+            sum += power[i * states + l] * a[l * states + j];
+          }
+          next[i * states + j] = sum;
+        }
+      }
+      power.swap(next);
+    }
+  }
+}
+
+/*
+ * Compute Q P for each rate category, with both matrices in the layout of a
+ * pmatrix. Since P(t) = exp(Q t), this is dP/dt, and applying it to dP/dt again
+ * gives the second derivative.
+ */
+static void multiply_rate_matrices(const double *q,
+                                   const double *pm,
+                                   unsigned int  rate_cats,
+                                   unsigned int  states,
+                                   unsigned int  states_padded,
+                                   double *      result) {
+  for (unsigned int c = 0; c < rate_cats; ++c) {
+    size_t offset = c * states * states_padded;
+    for (unsigned int i = 0; i < states; ++i) {
+      for (unsigned int j = 0; j < states; ++j) {
+        double sum = 0.0;
+        for (unsigned int l = 0; l < states; ++l) {
+          sum += q[offset + i * states_padded + l]
+                 * pm[offset + l * states_padded + j];
+        }
+        result[offset + i * states_padded + j] = sum;
+      }
+    }
+  }
+}
+
+/*
+ * Recover the scaled rate matrices of a block, once per parameter version. The
+ * pmatrices are computed by libpll, and the eigen decompositions of the
+ * nonreversible models can be complex, so instead of reading them, we take
+ * log(P) of a matrix at a short branch length, which is the same rate matrix up
+ * to rounding. This also picks up the scaling of the branch by the category
+ * rate and the invariant sites, in the same way as the pmatrices themselves.
+ */
+void model_t::update_rate_matrices(size_t block, unsigned int scratch_matrix) {
+  auto &cache = _pmatrix_caches[block];
+  if (cache.rate_matrices_version == cache.version) { return; }
+
+  auto               partition     = _partitions[block];
+  const unsigned int rate_cats     = partition->rate_cats;
+  const unsigned int states        = partition->states;
+  const unsigned int states_padded = partition->states_padded;
+
+  /* The rates are normalized, so this is close already, but is checked below */
+  double max_rate = 1.0;
+  for (unsigned int c = 0; c < rate_cats; ++c) {
+    double pinv = partition->prop_invar[_param_indicies[block][c]];
+    max_rate    = std::max(max_rate, partition->rates[c] / (1.0 - pinv));
+  }
+
+  std::vector<unsigned int> matrix_indices{scratch_matrix};
+  std::vector<double>       branch_lengths{1e-3 / max_rate};
+  for (size_t attempt = 0;; ++attempt) {
+    update_pmatrix_partition(block, matrix_indices, branch_lengths);
+    double distance =
+        pmatrix_distance_from_identity(partition->pmatrix[scratch_matrix],
+                                       rate_cats,
+                                       states,
+                                       states_padded);
+    if (distance < 1e-2 || attempt == 8) { break; }
+    branch_lengths[0] *= 1e-3 / distance;
+  }
+
+  cache.rate_matrices.resize(rate_cats * states * states_padded);
+  log_pmatrix(partition->pmatrix[scratch_matrix],
+              rate_cats,
+              states,
+              states_padded,
+              branch_lengths[0],
+              cache.rate_matrices.data());
+  cache.rate_matrices_version = cache.version;
+}
+
+/*
+ * A child CLV of the root, one site at a time. With the tip pattern attribute,
+ * the tips don't have CLVs, only their characters, so the CLV of a tip is
+ * filled in from the character at each site.
+ */
+class root_child_clv_t {
+public:
+  root_child_clv_t(const pll_partition_t *partition, unsigned int clv_index) :
+      _clv{partition->clv[clv_index]},
+      _span{partition->states_padded * partition->rate_cats} {
+    if (!(partition->attributes & PLL_ATTRIB_PATTERN_TIP)
+        || clv_index >= partition->tips) {
+      return;
+    }
+    _chars         = partition->tipchars[clv_index];
+    _tipmap        = partition->tipmap;
+    _states        = partition->states;
+    _states_padded = partition->states_padded;
+    _tip_clv.resize(_span, 0.0);
+  }
+
+  /* The CLV for all of the rate categories at index, which is the site id */
+  const double *operator()(unsigned int index) {
+    if (_chars == nullptr) { return _clv + index * _span; }
+    if (_chars[index] != _last_char) {
+      _last_char        = _chars[index];
+      pll_state_t state = _tipmap[_last_char];
+      for (size_t c = 0; c < _span; c += _states_padded) {
+        for (unsigned int i = 0; i < _states; ++i) {
+          _tip_clv[c + i] = (state >> i) & 1 ? 1.0 : 0.0;
+        }
+      }
+    }
+    return _tip_clv.data();
+  }
+
+private:
+  const double *       _clv;
+  size_t               _span;
+  const unsigned char *_chars         = nullptr;
+  const pll_state_t *  _tipmap        = nullptr;
+  unsigned int         _states        = 0;
+  size_t               _states_padded = 1;
+  int                  _last_char     = -1;
+  std::vector<double>  _tip_clv;
+};
+
+/*
+ * Compute the first and second derivatives of the log likelihood of a single
+ * partition at the virtual root with respect to the brlen ratio. The root CLV
+ * is (P_1 x_1) * (P_2 x_2), with t_1 = alpha * L and t_2 = (1 - alpha) * L, so
+ * the derivatives can be computed directly from the child CLVs once we have
+ * the derivative matrices for the two root branches. Scalers cancel out of the
+ * ratios, except for the invariant sites term, which we scale to match.
+ */
+static std::pair<double, double>
+compute_root_derivatives_partition(const pll_partition_t *partition,
+                                   const pll_operation_t &op,
+                                   const double *         pm1,
+                                   const double *         d_pm1,
+                                   const double *         dd_pm1,
+                                   const double *         pm2,
+                                   const double *         d_pm2,
+                                   const double *         dd_pm2,
+                                   const unsigned int *   param_indices,
+                                   double                 brlen) {
+  const unsigned int states        = partition->states;
+  const unsigned int states_padded = partition->states_padded;
+  const unsigned int rate_cats     = partition->rate_cats;
+  const size_t       pm_span       = states * states_padded;
+
+  root_child_clv_t clv1{partition, op.child1_clv_index};
+  root_child_clv_t clv2{partition, op.child2_clv_index};
+
+  const unsigned int *site_id1 =
+      pll_get_site_id(partition, op.child1_clv_index);
+  const unsigned int *site_id2 =
+      pll_get_site_id(partition, op.child2_clv_index);
+
+  const unsigned int *scaler1 =
+      op.child1_scaler_index == PLL_SCALE_BUFFER_NONE
+          ? nullptr
+          : partition->scale_buffer[op.child1_scaler_index];
+  const unsigned int *scaler2 =
+      op.child2_scaler_index == PLL_SCALE_BUFFER_NONE
+          ? nullptr
+          : partition->scale_buffer[op.child2_scaler_index];
+
+  const double  prop_invar = partition->prop_invar[param_indices[0]];
+  const double *inv_freqs  = partition->frequencies[param_indices[0]];
+
+  double dlh  = 0.0;
+  double d2lh = 0.0;
+
+  for (unsigned int site = 0; site < partition->sites; ++site) {
+    unsigned int  id1   = site_id1 ? site_id1[site] : site;
+    unsigned int  id2   = site_id2 ? site_id2[site] : site;
+    const double *site1 = clv1(id1);
+    const double *site2 = clv2(id2);
+
+    double s0 = 0.0;
+    double s1 = 0.0;
+    double s2 = 0.0;
+
+    for (unsigned int c = 0; c < rate_cats; ++c) {
+      const double *x1    = site1 + c * states_padded;
+      const double *x2    = site2 + c * states_padded;
+      const double *freqs = partition->frequencies[param_indices[c]];
+      double        cat_0 = 0.0;
+      double        cat_1 = 0.0;
+      double        cat_2 = 0.0;
+
+      for (unsigned int i = 0; i < states; ++i) {
+        size_t row = c * pm_span + i * states_padded;
+        double u = 0.0, du = 0.0, ddu = 0.0;
+        double v = 0.0, dv = 0.0, ddv = 0.0;
+        for (unsigned int j = 0; j < states; ++j) {
+          u += pm1[row + j] * x1[j];
+          du += d_pm1[row + j] * x1[j];
+          ddu += dd_pm1[row + j] * x1[j];
+          v += pm2[row + j] * x2[j];
+          dv += d_pm2[row + j] * x2[j];
+          ddv += dd_pm2[row + j] * x2[j];
+        }
+        cat_0 += freqs[i] * u * v;
+        cat_1 += freqs[i] * (du * v - u * dv);
+        cat_2 += freqs[i] * (ddu * v - 2.0 * du * dv + u * ddv);
+      }
+      s0 += partition->rate_weights[c] * cat_0;
+      s1 += partition->rate_weights[c] * cat_1;
+      s2 += partition->rate_weights[c] * cat_2;
+    }
+
+    /* d t_1 / d alpha = L, d t_2 / d alpha = -L */
+    s1 *= brlen;
+    s2 *= brlen * brlen;
+
+    if (prop_invar > 0.0) {
+      int    inv_state = partition->invariant ? partition->invariant[site] : -1;
+      double inv_lh    = inv_state == -1 ? 0.0 : inv_freqs[inv_state];
+      unsigned int scale_count =
+          (scaler1 ? scaler1[id1] : 0) + (scaler2 ? scaler2[id2] : 0);
+      if (scale_count > 0) {
+        inv_lh /= std::pow(PLL_SCALE_THRESHOLD, scale_count);
+      }
+      s0 = s0 * (1.0 - prop_invar) + inv_lh * prop_invar;
+      s1 *= (1.0 - prop_invar);
+      s2 *= (1.0 - prop_invar);
+    }
+
+    double weight = partition->pattern_weights[site];
+    double site_d = s1 / s0;
+    dlh += weight * site_d;
+    d2lh += weight * (s2 / s0 - site_d * site_d);
+  }
+  return {dlh, d2lh};
+}
+
+/*
+ * Compute the lh of a single partition at the virtual root for a batch of root
+ * splits. Split k uses the matrices at matrix_base + 2k for the first child and
+ * matrix_base + 2k + 1 for the second. The child CLVs are read once per site
+ * for all of the splits, which is where the savings over separate calls to
+ * compute_lh_root come from. The lhs are added to the lh array.
+ */
+static void compute_root_lh_batch_partition(const pll_partition_t *partition,
+                                            const pll_operation_t &op,
+                                            unsigned int        matrix_base,
+                                            size_t              splits,
+                                            const unsigned int *param_indices,
+                                            double *            lh) {
+  const unsigned int states        = partition->states;
+  const unsigned int states_padded = partition->states_padded;
+  const unsigned int rate_cats     = partition->rate_cats;
+  const size_t       pm_span       = states * states_padded;
+  const double       log_threshold = std::log(PLL_SCALE_THRESHOLD);
+
+  root_child_clv_t clv1{partition, op.child1_clv_index};
+  root_child_clv_t clv2{partition, op.child2_clv_index};
+
+  const unsigned int *site_id1 =
+      pll_get_site_id(partition, op.child1_clv_index);
+  const unsigned int *site_id2 =
+      pll_get_site_id(partition, op.child2_clv_index);
+
+  const unsigned int *scaler1 =
+      op.child1_scaler_index == PLL_SCALE_BUFFER_NONE
+          ? nullptr
+          : partition->scale_buffer[op.child1_scaler_index];
+  const unsigned int *scaler2 =
+      op.child2_scaler_index == PLL_SCALE_BUFFER_NONE
+          ? nullptr
+          : partition->scale_buffer[op.child2_scaler_index];
+
+  const double  prop_invar = partition->prop_invar[param_indices[0]];
+  const double *inv_freqs  = partition->frequencies[param_indices[0]];
+
+  for (unsigned int site = 0; site < partition->sites; ++site) {
+    unsigned int  id1   = site_id1 ? site_id1[site] : site;
+    unsigned int  id2   = site_id2 ? site_id2[site] : site;
+    const double *site1 = clv1(id1);
+    const double *site2 = clv2(id2);
+    unsigned int  scale_count =
+        (scaler1 ? scaler1[id1] : 0) + (scaler2 ? scaler2[id2] : 0);
+
+    double inv_lh = 0.0;
+    if (prop_invar > 0.0) {
+      int inv_state = partition->invariant ? partition->invariant[site] : -1;
+      inv_lh        = inv_state == -1 ? 0.0 : inv_freqs[inv_state];
+      if (scale_count > 0) {
+        inv_lh /= std::pow(PLL_SCALE_THRESHOLD, scale_count);
+      }
+    }
+    double weight = partition->pattern_weights[site];
+
+    for (size_t split = 0; split < splits; ++split) {
+      const double *pm1 = partition->pmatrix[matrix_base + 2 * split];
+      const double *pm2 = partition->pmatrix[matrix_base + 2 * split + 1];
+
+      double s0 = 0.0;
+      for (unsigned int c = 0; c < rate_cats; ++c) {
+        const double *x1    = site1 + c * states_padded;
+        const double *x2    = site2 + c * states_padded;
+        const double *freqs = partition->frequencies[param_indices[c]];
+        double        cat_0 = 0.0;
+
+        for (unsigned int i = 0; i < states; ++i) {
+          size_t row = c * pm_span + i * states_padded;
+          double u = 0.0, v = 0.0;
+          for (unsigned int j = 0; j < states; ++j) {
+            u += pm1[row + j] * x1[j];
+            v += pm2[row + j] * x2[j];
+          }
+          cat_0 += freqs[i] * u * v;
+        }
+        s0 += partition->rate_weights[c] * cat_0;
+      }
+
+      if (prop_invar > 0.0) {
+        s0 = s0 * (1.0 - prop_invar) + inv_lh * prop_invar;
+      }
+      lh[split] += weight * (std::log(s0) + scale_count * log_threshold);
+    }
+  }
+}
+
+/*
+ * Compute the lh, and the first and second derivative of the lh w.r.t. alpha
+ * at the given root. This requires that the CLVs of the children of the root
+ * are valid, so move_root needs to be called beforehand, just like for
+ * compute_lh_root. The derivative probability matrices are dP/dt = Q P and
+ * d^2P/dt^2 = Q^2 P, with the rate matrices from update_rate_matrices.
+ */
+d2lh_t model_t::compute_d2lh(const root_location_t &root) {
+  profile::count(profile::derivative_evaluations);
+
+  _tree.fill_derivative_operations(root, _root_plan);
+  const auto &op             = _root_plan.ops[0];
+  const auto &matrix_indices = _root_plan.pmatrix_indices;
+  const auto &branch_lengths = _root_plan.branch_lengths;
+  unsigned int scratch_matrix = _tree.branch_count();
+
+  double lh   = 0.0;
+  double dlh  = 0.0;
+  double d2lh = 0.0;
+
+#pragma omp parallel for schedule(dynamic) reduction(+ : lh, dlh, d2lh)
+  for (size_t k = 0; k < _block_order.size(); ++k) {
+    size_t i         = _block_order[k];
+    auto & partition = _partitions[i];
+    update_rate_matrices(i, scratch_matrix);
+    update_pmatrix_partition(i, matrix_indices, branch_lengths);
+    _backend->update_partials(partition, &op, 1);
+    profile::count(profile::partial_updates);
+    _pmatrix_caches[i].root_clv_stale = false;
+    lh += _backend->root_loglikelihood(partition,
+                                       _tree.root_clv_index(),
+                                       _tree.root_scaler_index(),
+                                       _param_indicies[i].data());
+
+    const unsigned int rate_cats     = partition->rate_cats;
+    const unsigned int states        = partition->states;
+    const unsigned int states_padded = partition->states_padded;
+    size_t             pm_size       = rate_cats * states * states_padded;
+    auto &             scratch       = _pmatrix_caches[i].derivatives;
+    scratch.resize(4 * pm_size);
+    double *      d_pm1  = scratch.data();
+    double *      dd_pm1 = d_pm1 + pm_size;
+    double *      d_pm2  = dd_pm1 + pm_size;
+    double *      dd_pm2 = d_pm2 + pm_size;
+    const double *q      = _pmatrix_caches[i].rate_matrices.data();
+
+    multiply_rate_matrices(q,
+                           partition->pmatrix[op.child1_matrix_index],
+                           rate_cats,
+                           states,
+                           states_padded,
+                           d_pm1);
+    multiply_rate_matrices(
+        q, d_pm1, rate_cats, states, states_padded, dd_pm1);
+    multiply_rate_matrices(q,
+                           partition->pmatrix[op.child2_matrix_index],
+                           rate_cats,
+                           states,
+                           states_padded,
+                           d_pm2);
+    multiply_rate_matrices(
+        q, d_pm2, rate_cats, states, states_padded, dd_pm2);
+
+    auto derivatives = compute_root_derivatives_partition(
+        partition,
+        op,
+        partition->pmatrix[op.child1_matrix_index],
+        d_pm1,
+        dd_pm1,
+        partition->pmatrix[op.child2_matrix_index],
+        d_pm2,
+        dd_pm2,
+        _param_indicies[i].data(),
+        root.saved_brlen);
+    dlh += derivatives.first;
+    d2lh += derivatives.second;
+  }
+
+  if (std::isnan(lh) || std::isnan(dlh) || std::isnan(d2lh)) {
+    throw std::runtime_error("lh derivatives at root are not a number: "
+                             + std::to_string(dlh) + ", "
+                             + std::to_string(d2lh));
+  }
+  debug_print(
+      EMIT_LEVEL_DEBUG, "lh: %f, dlh: %f, d2lh: %f", lh, dlh, d2lh);
+  return {lh, dlh, d2lh};
 }
 
 /*
- * Use a secant method to compute the derivative
+ * Compute the lh and the derivative of the lh w.r.t. alpha, the same way as
+ * compute_dlh, for each of the brlen ratios on the edge of the given root. The
+ * matrices for a chunk of ratios are computed together, and the root lhs are
+ * computed from the child CLVs directly, so that a chunk costs about as much
+ * as a single call to compute_dlh. Just like compute_lh_root, this requires
+ * that move_root was called for the edge.
  */
-dlh_t model_t::compute_dlh(const root_location_t &root) {
-  dlh_t            ret;
-  constexpr double EPSILON = 1e-8;
-  root_location_t  root_prime{root};
-  root_prime.brlen_ratio += EPSILON;
-  double sign = 1.0;
-  if (root_prime.brlen_ratio >= 1.0) {
-    root_prime.brlen_ratio = root.brlen_ratio - EPSILON;
-    sign                   = -1.0;
-  }
+std::vector<dlh_t>
+model_t::compute_dlh_batch(const root_location_t &    root,
+                           const std::vector<double> &ratios) {
+  profile::count(profile::derivative_evaluations, ratios.size());
 
-  double fx = compute_lh_root(root);
-  ret.lh    = fx;
+  _tree.fill_derivative_operations(root, _root_plan);
+  const pll_operation_t op          = _root_plan.ops[0];
+  const unsigned int    matrix_base = batch_pmatrix_base();
 
-  if (std::isnan(fx)) {
-    throw std::runtime_error("fx is not finite when computing derivative: "
-                             + std::to_string(root.edge->length));
-  }
-  double fxh = compute_lh_root(root_prime);
-  if (std::isnan(fxh)) {
-    throw std::runtime_error("fxh is not finite when computing derivative: "
-                             + std::to_string(root_prime.edge->length));
-  }
+  std::vector<dlh_t>        ret(ratios.size());
+  std::vector<unsigned int> matrix_indices;
+  std::vector<double>       branch_lengths;
+  std::vector<double>       signs;
+  std::vector<double>       lh(_partitions.size() * 2 * _batch_ratios);
+  matrix_indices.reserve(_batch_pmatrices);
+  branch_lengths.reserve(_batch_pmatrices);
+  signs.reserve(_batch_ratios);
+
+  for (size_t begin = 0; begin < ratios.size(); begin += _batch_ratios) {
+    size_t count = std::min<size_t>(_batch_ratios, ratios.size() - begin);
+    matrix_indices.clear();
+    branch_lengths.clear();
+    signs.clear();
+
+    /* Split 2k is the ratio itself, and split 2k + 1 the shifted ratio */
+    for (size_t k = 0; k < count; ++k) {
+      root_location_t rl{root};
+      rl.brlen_ratio = ratios[begin + k];
+      root_location_t rl_prime{rl};
+      signs.push_back(secant_root(rl, rl_prime));
+      for (const auto &split : {rl, rl_prime}) {
+        matrix_indices.push_back(
+            matrix_base + static_cast<unsigned int>(branch_lengths.size()));
+        branch_lengths.push_back(split.brlen());
+        matrix_indices.push_back(
+            matrix_base + static_cast<unsigned int>(branch_lengths.size()));
+        branch_lengths.push_back(split.brlen_compliment());
+      }
+    }
+    std::fill(lh.begin(), lh.end(), 0.0);
+    count_lh_evaluations(2 * count);
 
-  if (std::isnan(fxh)) {
-    throw std::runtime_error("fxh is not finite when computing derivative: "
-                             + std::to_string(root_prime.edge->length));
-  }
-  if (std::isinf(fxh) && std::isinf(fx)) {
-    debug_string(EMIT_LEVEL_DEBUG,
-                 "Both evals are -inf, returning a 0 derivative");
-    return {fx, 0};
+#pragma omp parallel for schedule(dynamic)
+    for (size_t k = 0; k < _block_order.size(); ++k) {
+      size_t i = _block_order[k];
+      update_pmatrix_partition(i, matrix_indices, branch_lengths);
+      compute_root_lh_batch_partition(_partitions[i],
+                                      op,
+                                      matrix_base,
+                                      2 * count,
+                                      _param_indicies[i].data(),
+                                      lh.data() + i * 2 * _batch_ratios);
+    }
+
+    for (size_t k = 0; k < count; ++k) {
+      double fx  = 0.0;
+      double fxh = 0.0;
+      for (size_t i = 0; i < _partitions.size(); ++i) {
+        fx += lh[i * 2 * _batch_ratios + 2 * k];
+        fxh += lh[i * 2 * _batch_ratios + 2 * k + 1];
+      }
+      if (std::isnan(fx) || std::isnan(fxh)) {
+        throw std::runtime_error(
+            "lh is not finite when computing batched derivatives: "
+            + std::to_string(root.edge->length));
+      }
+      auto &d = ret[begin + k];
+      d.lh    = fx;
+      d.dlh   = std::isinf(fx) && std::isinf(fxh)
+                  ? 0.0
+                  : (fxh - fx) / DLH_SECANT_STEP * signs[k];
+    }
   }
-  double dlh = (fxh - fx) / EPSILON;
-  debug_print(
-      EMIT_LEVEL_DEBUG, "dlh: %f, fx: %f, fxh: %f", dlh * sign, fx, fxh);
-  ret.dlh = dlh * sign;
+  /* The root CLVs were not updated, so they are still on some earlier root */
+  mark_root_clvs_stale();
   return ret;
 }
 
@@ -551,6 +1955,7 @@ std::pair<root_location_t, double> model_t::bisect(const root_location_t &beg,
                                                    size_t depth = 0) {
   assert_string(d_beg.dlh * d_end.dlh > 0,
                 "Bisect called with endpoints which don't bracket");
+  profile::count(profile::bisect_steps);
   root_location_t midpoint{beg};
   midpoint.brlen_ratio = (beg.brlen_ratio + end.brlen_ratio) / 2;
 
@@ -632,6 +2037,7 @@ std::pair<root_location_t, double> model_t::brents(root_location_t beg,
   d = e = end.brlen_ratio - beg.brlen_ratio;
 
   for (size_t i = 0; i < 64; ++i) {
+    profile::count(profile::brents_steps);
     if (d_end.dlh * d_midpoint.dlh > 0.0) {
       midpoint   = beg;
       d_midpoint = d_beg;
@@ -694,6 +2100,8 @@ std::pair<root_location_t, double> model_t::brents(root_location_t beg,
 /* Find the optimum for the ratio via brents method */
 root_location_t model_t::optimize_alpha(const root_location_t &root,
                                         double                 atol) {
+  profile::phase_timer_t timer{profile::alpha_optimization};
+
   double lh = compute_lh_root(root);
   if (std::isnan(lh)) {
     throw std::runtime_error("initial likelihood calculation is not finite");
@@ -751,15 +2159,25 @@ root_location_t model_t::optimize_alpha(const root_location_t &root,
   root_location_t best_midpoint;
   bool            found_midpoint = false;
 
+  /*
+   * Each level of the grid only has the midpoints that are new to it, and is
+   * evaluated in one batch. The midpoints are then checked in order, so the
+   * result is the same as evaluating them one at a time.
+   */
+  std::vector<double> alphas;
   for (size_t midpoints = 2; midpoints <= 32; midpoints *= 2) {
-    for (size_t midpoint = 1; midpoint <= midpoints; ++midpoint) {
-      if (midpoint % 2 == 0) continue;
+    alphas.clear();
+    for (size_t midpoint = 1; midpoint <= midpoints; midpoint += 2) {
+      alphas.push_back(1.0 / (double)midpoints * midpoint);
+    }
+    auto d_midpoints = compute_dlh_batch(beg, alphas);
 
-      double alpha = 1.0 / (double)midpoints * midpoint;
+    for (size_t m = 0; m < alphas.size(); ++m) {
+      double alpha = alphas[m];
       debug_print(EMIT_LEVEL_DEBUG, "alpha: %f", alpha);
       root_location_t midpoint_root{beg};
       midpoint_root.brlen_ratio = alpha;
-      auto d_midpoint           = compute_dlh(midpoint_root);
+      auto d_midpoint           = d_midpoints[m];
       debug_print(EMIT_LEVEL_DEBUG, "d_midpoint.dlh: %f", d_midpoint.dlh);
       if (fabs(d_midpoint.dlh) < atol) {
         if (best_midpoint_lh.lh < d_midpoint.lh) {
@@ -809,6 +2227,96 @@ root_location_t model_t::optimize_alpha(const root_location_t &root,
       "Initial derivatives failed when optimizing alpha, ran out of cases");
 }
 
+/*
+ * Find the optimum for the ratio via a safeguarded Newton-Raphson method, using
+ * the analytic derivatives from compute_d2lh. We keep a bracket around the
+ * maximum, and fall back to bisecting it when the Newton step leaves the
+ * bracket, or the function is not concave at the current point. If the
+ * endpoints don't bracket a maximum, we defer to optimize_alpha, which handles
+ * the "even" cases with a grid search.
+ */
+root_location_t model_t::optimize_alpha_newton(const root_location_t &root,
+                                               double                 atol) {
+  profile::phase_timer_t timer{profile::alpha_optimization};
+
+  root_location_t beg{root};
+  beg.brlen_ratio = 0.0;
+
+  root_location_t end{root};
+  end.brlen_ratio = 1.0;
+
+  auto d_beg = compute_d2lh(beg);
+  auto d_end = compute_d2lh(end);
+
+  root_location_t best_endpoint    = d_beg.lh >= d_end.lh ? beg : end;
+  double          lh_best_endpoint = std::max(d_beg.lh, d_end.lh);
+
+  if (fabs(d_beg.dlh) < atol || fabs(d_end.dlh) < atol) {
+    debug_string(EMIT_LEVEL_DEBUG, "one of the endpoints is sufficient");
+    return best_endpoint;
+  }
+
+  if (d_beg.dlh < 0.0 && d_end.dlh > 0.0) {
+    debug_string(EMIT_LEVEL_DEBUG,
+                 "endpoints bracket a minimum, returning the best endpoint");
+    return best_endpoint;
+  }
+
+  if (!(d_beg.dlh > 0.0 && d_end.dlh < 0.0)) {
+    debug_string(EMIT_LEVEL_DEBUG,
+                 "endpoints don't bracket, falling back to optimize_alpha");
+    return optimize_alpha(root, atol);
+  }
+
+  double lo = beg.brlen_ratio;
+  double hi = end.brlen_ratio;
+
+  root_location_t cur{root};
+  if (!(cur.brlen_ratio > lo && cur.brlen_ratio < hi)) {
+    cur.brlen_ratio = (lo + hi) / 2.0;
+  }
+
+  d2lh_t d_cur{};
+  bool   evaluated = false;
+  for (size_t i = 0; i < 64; ++i) {
+    profile::count(profile::newton_steps);
+    d_cur     = compute_d2lh(cur);
+    evaluated = true;
+    debug_print(EMIT_LEVEL_DEBUG,
+                "newton iter: %lu, alpha: %f, dlh: %f, d2lh: %f",
+                i,
+                cur.brlen_ratio,
+                d_cur.dlh,
+                d_cur.d2lh);
+
+    if (fabs(d_cur.dlh) < atol) { break; }
+
+    if (d_cur.dlh > 0.0) {
+      lo = cur.brlen_ratio;
+    } else {
+      hi = cur.brlen_ratio;
+    }
+
+    double next = (lo + hi) / 2.0;
+    if (d_cur.d2lh < 0.0) {
+      double newton_step = cur.brlen_ratio - d_cur.dlh / d_cur.d2lh;
+      if (newton_step > lo && newton_step < hi) { next = newton_step; }
+    }
+
+    double tol = 2.0 * fabs(cur.brlen_ratio)
+                     * std::numeric_limits<double>::epsilon()
+                 + 0.5 * atol;
+    bool done = fabs(next - cur.brlen_ratio) <= tol || (hi - lo) <= tol;
+    cur.brlen_ratio = next;
+    evaluated       = false;
+    if (done) { break; }
+  }
+
+  /* The last step moved cur, so the lh to compare with is not known yet */
+  if (!evaluated) { d_cur = compute_d2lh(cur); }
+  return lh_best_endpoint > d_cur.lh ? best_endpoint : cur;
+}
+
 std::pair<root_location_t, double>
 model_t::optimize_root_location(size_t min_roots, double root_ratio) {
   std::pair<root_location_t, double> best;
@@ -821,7 +2329,8 @@ model_t::optimize_root_location(size_t min_roots, double root_ratio) {
     debug_print(EMIT_LEVEL_DEBUG, "working rl: %s", rl.label().c_str());
 
     move_root(rl);
-    rl = optimize_alpha(rl, 1e-14);
+    rl = _newton_alpha ? optimize_alpha_newton(rl, _newton_alpha_atol)
+                       : optimize_alpha(rl, 1e-14);
     debug_print(EMIT_LEVEL_DEBUG, "alpha: %f", rl.brlen_ratio);
 
     double rl_lh = compute_lh_root(rl);
@@ -837,35 +2346,25 @@ model_t::optimize_root_location(size_t min_roots, double root_ratio) {
 }
 
 void model_t::move_root(const root_location_t &new_root) {
-  std::vector<pll_operation_t> ops;
-  std::vector<unsigned int>    pmatrix_indices;
-  std::vector<double>          branch_lengths;
-
-  {
-    auto results    = _tree.generate_root_update_operations(new_root);
-    ops             = std::move(std::get<0>(results));
-    pmatrix_indices = std::move(std::get<1>(results));
-    branch_lengths  = std::move(std::get<2>(results));
-  }
+  _tree.fill_root_update_operations(new_root, _root_plan);
+  const auto &ops             = _root_plan.ops;
+  const auto &pmatrix_indices = _root_plan.pmatrix_indices;
+  const auto &branch_lengths  = _root_plan.branch_lengths;
   debug_print(EMIT_LEVEL_DEBUG,
               "ops.size: %lu, pmats.size: %lu, brlens.size: %lu",
               ops.size(),
               pmatrix_indices.size(),
               branch_lengths.size());
 
-  for (size_t i = 0; i < _partitions.size(); ++i) {
-    auto &partition = _partitions[i];
-    int   result    = pll_update_prob_matrices(
-        partition,
-        _param_indicies[i].data(),
-        pmatrix_indices.data(),
-        branch_lengths.data(),
-        static_cast<unsigned int>(pmatrix_indices.size()));
-
-    if (result == PLL_FAILURE) { throw std::runtime_error(pll_errmsg); }
+#pragma omp parallel for schedule(dynamic)
+  for (size_t k = 0; k < _block_order.size(); ++k) {
+    size_t i         = _block_order[k];
+    auto & partition = _partitions[i];
+    update_pmatrix_partition(i, pmatrix_indices, branch_lengths);
 
-    pll_update_partials(
+    _backend->update_partials(
         partition, ops.data(), static_cast<unsigned int>(ops.size()));
+    profile::count(profile::partial_updates, ops.size());
   }
 }
 
@@ -880,13 +2379,27 @@ std::vector<root_location_t> model_t::suggest_roots_random(size_t min,
 
 std::vector<root_location_t> model_t::suggest_roots_lh(size_t min,
                                                        double ratio) {
+  profile::phase_timer_t timer{profile::root_ranking};
+
   std::vector<std::pair<root_location_t, double>> rl_lhs;
   using fucking_difference_type =
       std::vector<std::pair<root_location_t, double>>::difference_type;
   rl_lhs.reserve(_tree.root_count());
-  for (auto rl : _tree.roots()) {
-    move_root(rl);
-    rl_lhs.push_back(std::make_pair(rl, compute_lh_root(rl)));
+  if (!_screening_blocks.empty()) {
+    auto root_lh = compute_screening_lh();
+    for (size_t i = 0; i < root_lh.size(); ++i) {
+      rl_lhs.push_back(std::make_pair(_tree.roots()[i], root_lh[i]));
+    }
+  } else if (_all_edge_clvs) {
+    auto root_lh = compute_all_edge_lh();
+    for (size_t i = 0; i < root_lh.size(); ++i) {
+      rl_lhs.push_back(std::make_pair(_tree.roots()[i], root_lh[i]));
+    }
+  } else {
+    for (auto rl : _tree.roots()) {
+      move_root(rl);
+      rl_lhs.push_back(std::make_pair(rl, compute_lh_root(rl)));
+    }
   }
   auto final_size = compute_final_size(rl_lhs.size(), ratio, min);
   std::partial_sort(
@@ -977,47 +2490,447 @@ std::vector<size_t> model_t::suggest_root_indicies_modified_mad() {
   return ret;
 }
 
-std::vector<size_t> model_t::suggest_root_indicies_length() {
-  auto                internal_rls = suggest_roots_internal_branches(1, 1.0);
-  auto                external_rls = suggest_roots_external_branches(1, 1.0);
-  std::vector<size_t> ret;
-  ret.resize(internal_rls.size() + external_rls.size());
-  for (size_t i = 0; i < ret.size(); i++) {
-    if (i % 2 == 0) {
-      ret[i] = internal_rls[i / 2].id;
-    } else {
-      ret[i] = external_rls[i / 2].id;
-    }
+std::vector<size_t> model_t::suggest_root_indicies_lh() {
+  std::vector<uint64_t> order;
+  if (_local || __MPI_RANK__ == 0) {
+    for (auto &rl : suggest_roots_lh(1, 1.0)) { order.push_back(rl.id); }
+  }
+#ifdef MPI_VERSION
+  if (!_local) {
+    uint64_t count = order.size();
+    MPI_Bcast(&count, 1, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+    order.resize(count);
+    MPI_Bcast(order.data(),
+              static_cast<int>(count),
+              MPI_UINT64_T,
+              0,
+              MPI_COMM_WORLD);
+  }
+#endif
+  return std::vector<size_t>(order.begin(), order.end());
+}
+
+std::vector<size_t> model_t::suggest_root_indicies_length() {
+  auto                internal_rls = suggest_roots_internal_branches(1, 1.0);
+  auto                external_rls = suggest_roots_external_branches(1, 1.0);
+  std::vector<size_t> ret;
+  ret.resize(internal_rls.size() + external_rls.size());
+  for (size_t i = 0; i < ret.size(); i++) {
+    if (i % 2 == 0) {
+      ret[i] = internal_rls[i / 2].id;
+    } else {
+      ret[i] = external_rls[i / 2].id;
+    }
+  }
+  return ret;
+}
+
+partition_parameters_t model_t::make_partition_parameters(
+    size_t states, rate_category::rate_category_e rc, size_t rate_cat_count) {
+  partition_parameters_t pp;
+  size_t                 subst_size = states * states - states;
+
+  pp.subst_rates.resize(subst_size);
+  for (auto &v : pp.subst_rates) { v = 1.0 / subst_size; }
+
+  pp.freqs.resize(states);
+  std::fill(pp.freqs.begin(), pp.freqs.end(), 1.0 / states);
+  for (auto &v : pp.freqs) { v = 1.0 / states; }
+
+  switch (rc) {
+  case rate_category::MEAN:
+  case rate_category::MEDIAN:
+    pp.gamma_alpha.resize(1);
+    pp.gamma_alpha[0] = 1.0;
+    break;
+  case rate_category::FREE:
+    pp.gamma_alpha.resize(rate_cat_count);
+    for (auto &v : pp.gamma_alpha) { v = 1.0; }
+    pp.gamma_weights.resize(rate_cat_count);
+    std::uniform_real_distribution<> dis(0.0, 1.0);
+    for (auto &v : pp.gamma_weights) { v = dis(_random_engine); }
+  }
+  return pp;
+}
+
+/*
+ * Run the search for a single starting root, and write the result to the
+ * checkpoint.
+ */
+void model_t::search_root(size_t        rl_index,
+                          size_t        min_roots,
+                          double        root_ratio,
+                          double        atol,
+                          double        pgtol,
+                          double        brtol,
+                          double        factor,
+                          checkpoint_t &checkpoint) {
+  auto rl = _tree.root_location(rl_index);
+  set_subst_rates_uniform();
+  set_empirical_freqs();
+
+  std::vector<partition_parameters_t> params;
+  params.reserve(partition_count());
+
+  std::vector<partition_parameters_t> saved_params;
+  saved_params.reserve(partition_count());
+
+  for (size_t p = 0; p < partition_count(); ++p) {
+    params.push_back(make_partition_parameters(first_block(p)->states,
+                                               _rate_category_types[p],
+                                               first_block(p)->rate_cats));
+  }
+  warm_start_params(rl.id, params);
+
+  auto   cur_best_rl = rl;
+  double cur_best_lh = -std::numeric_limits<double>::infinity();
+
+  for (size_t iter = 0; iter < 1e3; ++iter) {
+    if (budget_exhausted()) {
+      debug_print(
+          EMIT_LEVEL_DEBUG, "Out of budget, dropping root %lu", rl_index);
+      return;
+    }
+    saved_params = params;
+
+    optimize_params(params, rl, pgtol, factor, true);
+
+    debug_string(EMIT_LEVEL_INFO, "Optimizing Root Location");
+    auto cur = optimize_root_location(min_roots, root_ratio);
+
+    debug_print(EMIT_LEVEL_INFO, "Iteration %lu LH: %.9f", iter, cur.second);
+
+    if (cur.second < cur_best_lh) {
+      /* We failed to make any progress, so just give up */
+      debug_string(EMIT_LEVEL_DEBUG,
+                   "breaking due to failure to make progress");
+      for (size_t i = 0; i < partition_count(); ++i) {
+        set_subst_rates(i, saved_params[i].subst_rates);
+        set_freqs(i, saved_params[i].freqs);
+        set_gamma_rates(i, saved_params[i].gamma_alpha);
+        if (_rate_category_types[i] == rate_category::FREE) {
+          set_gamma_weights(i, saved_params[i].gamma_weights);
+        }
+      }
+      params = saved_params;
+      break;
+    }
+
+    if (_early_stop) {
+      if (rl.edge == cur.first.edge
+          && fabs(rl.brlen_ratio - cur.first.brlen_ratio) < brtol) {
+        debug_string(EMIT_LEVEL_DEBUG, "breaking due to early stop");
+        cur_best_rl = cur.first;
+        cur_best_lh = cur.second;
+        break;
+      }
+    }
+
+    if (fabs(cur.second - cur_best_lh) < atol) {
+      debug_string(EMIT_LEVEL_DEBUG, "breaking due to atol");
+      cur_best_rl = cur.first;
+      cur_best_lh = cur.second;
+      break;
+    }
+
+    cur_best_rl = cur.first;
+    cur_best_lh = cur.second;
+
+    rl = cur_best_rl;
+  }
+
+  checkpoint.write({cur_best_rl.id, cur_best_lh, cur_best_rl.brlen_ratio},
+                   params);
+  record_warm_start(cur_best_rl.id, cur_best_lh, params);
+
+  debug_print(EMIT_LEVEL_DEBUG,
+              "finished optimize_all root, cur_best_lh: %f",
+              cur_best_lh);
+}
+
+/*
+ * Optimize the parameters and the brlen ratio for a single root, and write
+ * the result to the checkpoint.
+ */
+void model_t::exhaustive_root(size_t        rl_index,
+                              double        atol,
+                              double        pgtol,
+                              double        brtol,
+                              double        factor,
+                              checkpoint_t &checkpoint) {
+  if (_lh_bound && screen_root(rl_index, brtol, checkpoint)) { return; }
+
+  auto rl = _tree.root_location(rl_index);
+  set_subst_rates_uniform();
+  set_empirical_freqs();
+
+  _tree.root_by(rl);
+  compute_lh(rl);
+  std::vector<partition_parameters_t> params;
+
+  for (size_t p = 0; p < partition_count(); ++p) {
+    params.push_back(make_partition_parameters(first_block(p)->states,
+                                               _rate_category_types[p],
+                                               first_block(p)->rate_cats));
+  }
+  warm_start_params(rl.id, params);
+
+  root_location_t cur_best_rl = rl;
+  double          cur_best_lh = -std::numeric_limits<double>::infinity();
+
+  for (size_t iter = 0; iter < 1e3; ++iter) {
+    if (budget_exhausted()) {
+      debug_print(
+          EMIT_LEVEL_DEBUG, "Out of budget, dropping root %lu", rl_index);
+      return;
+    }
+    debug_string(EMIT_LEVEL_MPROGRESS, "Optimizing parameters");
+    optimize_params(params, rl, pgtol, factor, (iter % 10 == 0));
+
+    if (fabs(compute_lh(rl) - cur_best_lh) < atol) { break; }
+
+    debug_string(EMIT_LEVEL_MPROGRESS, "Optimizing Root Location");
+    auto   cur_rl = _newton_alpha ? optimize_alpha_newton(rl, brtol)
+                                  : optimize_alpha(rl, brtol);
+    double cur_lh = compute_lh_root(cur_rl);
+
+    debug_print(EMIT_LEVEL_MPROGRESS, "Iteration %lu LH: %.5f", iter, cur_lh);
+    debug_print(
+        EMIT_LEVEL_INFO, "difference in lh: %.5f", (cur_lh - cur_best_lh));
+
+    if (_early_stop) {
+      if (fabs(rl.brlen_ratio - cur_rl.brlen_ratio) < brtol) {
+        debug_print(EMIT_LEVEL_DEBUG,
+                    "Current BRlen ratio tolerances: %.7f, brtol: %.7f",
+                    fabs(rl.brlen_ratio - cur_rl.brlen_ratio),
+                    brtol);
+        cur_best_rl = cur_rl;
+        cur_best_lh = cur_lh;
+        break;
+      }
+    }
+
+    if ((cur_lh - cur_best_lh) < atol) {
+      if (cur_lh > cur_best_lh) {
+        cur_best_rl = cur_rl;
+        cur_best_lh = cur_lh;
+      }
+      break;
+    }
+
+    if (cur_lh > cur_best_lh) {
+      cur_best_rl = cur_rl;
+      cur_best_lh = cur_lh;
+    }
+
+    rl = cur_rl;
+  }
+
+  checkpoint.write({cur_best_rl.id, cur_best_lh, cur_best_rl.brlen_ratio},
+                   params);
+  record_warm_start(cur_best_rl.id, cur_best_lh, params);
+  if (_lh_bound) { _lh_bound->update(cur_best_lh, params); }
+}
+
+/*
+ * Compute the lh of a root with the best parameters found so far, optimizing
+ * only the brlen ratio. If the lh is too far below the best lh, the root is
+ * written to the checkpoint with the screening lh and no parameters, which
+ * marks it as pruned, and true is returned. Nothing is pruned until there is a
+ * best lh to compare with.
+ */
+bool model_t::screen_root(size_t        rl_index,
+                          double        brtol,
+                          checkpoint_t &checkpoint) {
+  std::vector<partition_parameters_t> params;
+  if (!_lh_bound->params(params)) { return false; }
+
+  auto rl = _tree.root_location(rl_index);
+  set_model_params(params);
+  _tree.root_by(rl);
+  compute_lh(rl);
+
+  rl = _newton_alpha ? optimize_alpha_newton(rl, brtol)
+                     : optimize_alpha(rl, brtol);
+  double lh = compute_lh_root(rl);
+  if (!_lh_bound->prune(lh)) { return false; }
+
+  debug_print(EMIT_LEVEL_DEBUG,
+              "Pruning root %lu, screening lh: %f, best lh: %f",
+              rl.id,
+              lh,
+              _lh_bound->best());
+  profile::count(profile::pruned_roots);
+  checkpoint.write({rl.id, lh, rl.brlen_ratio}, {});
+  return true;
+}
+
+/*
+ * Hand out the work in the queue to this model and its replicas, one thread
+ * per model. The OpenMP threads are split between the models, so that the
+ * total number of threads stays the same. If the threads were pinned, each
+ * worker is pinned to its share of the cpus. Once the budget runs out, the
+ * queue is stopped, and the workers stop after the root they are on, which is
+ * dropped by search_root or exhaustive_root.
+ */
+void model_t::run_workers(work_queue_t &                                queue,
+                          const std::function<void(model_t &, size_t)> &func) {
+  size_t worker_count = _replicas.size() + 1;
+
+  auto worker = [&](size_t worker_index, int omp_threads) {
+#ifdef _OPENMP
+    omp_set_num_threads(omp_threads);
+#else
+    (void)omp_threads;
+#endif
+    if (worker_count > 1) { sysutil_pin_worker(worker_index, worker_count); }
+    model_t &model = worker_index == 0 ? *this : *_replicas[worker_index - 1];
+    size_t rl_index = 0;
+    while (queue.next(rl_index, worker_index)) {
+      func(model, rl_index);
+      debug_print(EMIT_LEVEL_PROGRESS,
+                  "Step %lu / %lu, ETC: %0.2fh",
+                  queue.position(),
+                  queue.size(),
+                  progress_macro(queue.position(), queue.size()));
+      if (budget_exhausted()) { queue.stop(); }
+    }
+  };
+
+  int omp_threads = 1;
+#ifdef _OPENMP
+  omp_threads =
+      std::max(1, omp_get_max_threads() / static_cast<int>(worker_count));
+#endif
+
+  if (worker_count == 1) {
+    worker(0, omp_threads);
+    return;
+  }
+
+  std::vector<std::thread>        threads;
+  std::vector<std::exception_ptr> errors(worker_count);
+  threads.reserve(worker_count);
+  for (size_t i = 0; i < worker_count; ++i) {
+    threads.emplace_back([&, i]() {
+      try {
+        worker(i, omp_threads);
+      } catch (...) { errors[i] = std::current_exception(); }
+    });
+  }
+  for (auto &t : threads) { t.join(); }
+  for (auto &e : errors) {
+    if (e) { std::rethrow_exception(e); }
+  }
+}
+
+/*
+ * Wait for the results of this process to be written to its shard, before rank
+ * 0 merges the shards. If the budget ran out, the shard is synced as well,
+ * since the job is likely to be killed soon.
+ */
+void model_t::flush_results(checkpoint_t &checkpoint) {
+  bool stopped = budget_exhausted();
+  checkpoint.flush(stopped);
+  if (stopped) {
+    debug_print(EMIT_LEVEL_WARNING,
+                "The search budget ran out after %.1fs and %lu lh "
+                "evaluations, run again with the same prefix to continue",
+                _budget->elapsed(),
+                _budget->evaluations());
+  }
+}
+
+void model_t::set_replicas(std::vector<std::unique_ptr<model_t>> replicas) {
+  _replicas = std::move(replicas);
+  for (auto &replica : _replicas) {
+    replica->set_newton_alpha(_newton_alpha);
+    replica->set_joint_params(_joint_params);
+    replica->set_warm_start(_warm_start);
+    replica->set_budget(_budget);
+  }
+}
+
+void model_t::set_budget(std::shared_ptr<search_budget_t> budget) {
+  _budget = budget;
+  for (auto &replica : _replicas) { replica->set_budget(budget); }
+}
+
+/*
+ * Make the cache of optimized parameters, seed it with the results which are
+ * already in the checkpoint, and share it with the replicas.
+ */
+void model_t::start_warm_start(checkpoint_t &checkpoint) {
+  if (!_warm_start) { return; }
+  _warm_start_cache =
+      _warm_start_seed
+          ? std::move(_warm_start_seed)
+          : std::make_shared<warm_start_cache_t>(_tree.root_neighbors());
+  _warm_start_seed.reset();
+  for (auto &result : checkpoint.read_results()) {
+    if (result.second.empty()) { continue; }
+    _warm_start_cache->insert(
+        result.first.root_id, result.first.lh, result.second);
+  }
+  for (auto &replica : _replicas) {
+    replica->_warm_start_cache = _warm_start_cache;
+  }
+  debug_print(EMIT_LEVEL_DEBUG,
+              "Warm start cache seeded with %lu results",
+              _warm_start_cache->size());
+}
+
+void model_t::seed_warm_start(checkpoint_t &checkpoint) {
+  _warm_start_seed =
+      std::make_shared<warm_start_cache_t>(_tree.root_neighbors());
+  for (auto &result : checkpoint.read_results()) {
+    if (result.second.empty()) { continue; }
+    _warm_start_seed->insert(result.first.root_id,
+                             -std::numeric_limits<double>::infinity(),
+                             result.second);
   }
-  return ret;
 }
 
-partition_parameters_t model_t::make_partition_parameters(
-    size_t states, rate_category::rate_category_e rc, size_t rate_cat_count) {
-  partition_parameters_t pp;
-  size_t                 subst_size = states * states - states;
+void model_t::finish_warm_start() {
+  _warm_start_cache.reset();
+  for (auto &replica : _replicas) { replica->_warm_start_cache.reset(); }
+}
 
-  pp.subst_rates.resize(subst_size);
-  for (auto &v : pp.subst_rates) { v = 1.0 / subst_size; }
+/*
+ * Make the bound used to prune roots in exhaustive mode, seed it with the
+ * optimized results which are already in the checkpoint, and share it with
+ * the replicas. This is collective for MPI runs, unless the model is local.
+ */
+void model_t::start_lh_bound(checkpoint_t &checkpoint) {
+  if (!(_prune_threshold > 0.0)) { return; }
+  _lh_bound = std::make_shared<lh_bound_t>(_prune_threshold, _local);
+  for (auto &result : checkpoint.read_results()) {
+    if (result.second.empty()) { continue; }
+    _lh_bound->update(result.first.lh, result.second);
+  }
+  for (auto &replica : _replicas) { replica->_lh_bound = _lh_bound; }
+}
 
-  pp.freqs.resize(states);
-  std::fill(pp.freqs.begin(), pp.freqs.end(), 1.0 / states);
-  for (auto &v : pp.freqs) { v = 1.0 / states; }
+/* Collective for MPI runs, like start_lh_bound */
+void model_t::finish_lh_bound() {
+  for (auto &replica : _replicas) { replica->_lh_bound.reset(); }
+  _lh_bound.reset();
+}
 
-  switch (rc) {
-  case rate_category::MEAN:
-  case rate_category::MEDIAN:
-    pp.gamma_alpha.resize(1);
-    pp.gamma_alpha[0] = 1.0;
-    break;
-  case rate_category::FREE:
-    pp.gamma_alpha.resize(rate_cat_count);
-    for (auto &v : pp.gamma_alpha) { v = 1.0; }
-    pp.gamma_weights.resize(rate_cat_count);
-    std::uniform_real_distribution<> dis(0.0, 1.0);
-    for (auto &v : pp.gamma_weights) { v = dis(_random_engine); }
+void model_t::warm_start_params(
+    size_t root_id, std::vector<partition_parameters_t> &params) const {
+  if (!_warm_start_cache) { return; }
+  if (_warm_start_cache->lookup(root_id, params)) {
+    debug_print(EMIT_LEVEL_DEBUG, "Warm starting root %lu", root_id);
   }
-  return pp;
+}
+
+void model_t::record_warm_start(
+    size_t                                     root_id,
+    double                                     lh,
+    const std::vector<partition_parameters_t> &params) {
+  if (!_warm_start_cache) { return; }
+  _warm_start_cache->insert(root_id, lh, params);
 }
 
 /* Optimize the substitution parameters and root location.*/
@@ -1036,104 +2949,40 @@ std::pair<root_location_t, double> model_t::search(size_t        min_roots,
 
   set_subst_rates_uniform();
   set_empirical_freqs();
-  size_t root_count = _assigned_idx.size();
-  size_t root_index = 0;
+  work_queue_t queue{
+      _assigned_idx, _dynamic_schedule, _replicas.size() + 1, _local};
 
   std::vector<partition_parameters_t> best_params;
-  best_params.reserve(_partitions.size());
+  best_params.reserve(partition_count());
 
   debug_string(EMIT_LEVEL_PROGRESS, "Starting root search");
 
-  for (auto rl_index : _assigned_idx) {
-    auto rl = _tree.root_location(rl_index);
-    set_subst_rates_uniform();
-    set_empirical_freqs();
-
-    std::vector<partition_parameters_t> params;
-    params.reserve(_partitions.size());
-
-    std::vector<partition_parameters_t> saved_params;
-    saved_params.reserve(_partitions.size());
-
-    for (size_t p = 0; p < _partitions.size(); ++p) {
-      params.push_back(make_partition_parameters(_partitions[p]->states,
-                                                 _rate_category_types[p],
-                                                 _partitions[p]->rate_cats));
-    }
-
-    auto   cur_best_rl = rl;
-    double cur_best_lh = -std::numeric_limits<double>::infinity();
-
-    for (size_t iter = 0; iter < 1e3; ++iter) {
-      saved_params = params;
-
-      optimize_params(params, rl, pgtol, factor, true);
-
-      debug_string(EMIT_LEVEL_INFO, "Optimizing Root Location");
-      auto cur = optimize_root_location(min_roots, root_ratio);
-
-      debug_print(EMIT_LEVEL_INFO, "Iteration %lu LH: %.9f", iter, cur.second);
-
-      if (cur.second < cur_best_lh) {
-        /* We failed to make any progress, so just give up */
-        debug_string(EMIT_LEVEL_DEBUG,
-                     "breaking due to failure to make progress");
-        for (size_t i = 0; i < _partitions.size(); ++i) {
-          set_subst_rates(i, saved_params[i].subst_rates);
-          set_freqs(i, saved_params[i].freqs);
-          set_gamma_rates(i, saved_params[i].gamma_alpha);
-          if (_rate_category_types[i] == rate_category::FREE) {
-            set_gamma_weights(i, saved_params[i].gamma_weights);
-          }
-        }
-        params = saved_params;
-        break;
-      }
-
-      if (_early_stop) {
-        if (rl.edge == cur.first.edge
-            && fabs(rl.brlen_ratio - cur.first.brlen_ratio) < brtol) {
-          debug_string(EMIT_LEVEL_DEBUG, "breaking due to early stop");
-          cur_best_rl = cur.first;
-          cur_best_lh = cur.second;
-          break;
-        }
-      }
-
-      if (fabs(cur.second - cur_best_lh) < atol) {
-        debug_string(EMIT_LEVEL_DEBUG, "breaking due to atol");
-        cur_best_rl = cur.first;
-        cur_best_lh = cur.second;
-        break;
-      }
-
-      cur_best_rl = cur.first;
-      cur_best_lh = cur.second;
-
-      rl = cur_best_rl;
-    }
-
-    ++root_index;
-    debug_print(EMIT_LEVEL_PROGRESS,
-                "Stage %lu/%lu, ETC: %fh",
-                root_index,
-                root_count,
-                progress_macro(root_index, root_count));
-
-    checkpoint.write({cur_best_rl.id, cur_best_lh, cur_best_rl.brlen_ratio},
-                     params);
-
-    debug_print(EMIT_LEVEL_DEBUG,
-                "finished optimize_all root, cur_best_lh: %f",
-                cur_best_lh);
-  }
+  start_warm_start(checkpoint);
+  run_workers(queue, [&](model_t &model, size_t rl_index) {
+    model.search_root(rl_index,
+                      min_roots,
+                      root_ratio,
+                      atol,
+                      pgtol,
+                      brtol,
+                      factor,
+                      checkpoint);
+  });
+  finish_warm_start();
+  /* Rank 0 merges the shards after the barrier, so they have to be complete */
+  flush_results(checkpoint);
 
 #ifdef MPI_VERSION
-  MPI_Barrier(MPI_COMM_WORLD);
+  if (!_local) { profile::mpi_barrier(); }
 #endif
+  queue.report_utilization();
 
-  if (__MPI_RANK__ == 0) {
-    auto total_progress    = checkpoint.read_results();
+  if (_local || __MPI_RANK__ == 0) {
+    auto total_progress = checkpoint.merge();
+    if (total_progress.empty()) {
+      throw std::runtime_error{"No root was finished before the search "
+                               "budget ran out"};
+    }
     auto total_best_result = *std::max_element(
         total_progress.begin(),
         total_progress.end(),
@@ -1161,97 +3010,44 @@ model_t::exhaustive_search(double        atol,
   if (_assigned_idx.size() == 0) {
     debug_string(EMIT_LEVEL_WARNING, "There is no work to be done");
   }
-  size_t          root_index = 0;
+  work_queue_t    queue{
+      _assigned_idx, _dynamic_schedule, _replicas.size() + 1, _local};
   root_location_t best_rl;
-  double          best_lh    = -std::numeric_limits<double>::infinity();
-  size_t          root_count = _assigned_idx.size();
+  double          best_lh = -std::numeric_limits<double>::infinity();
   debug_string(EMIT_LEVEL_PROGRESS, "Starting exhaustive search");
 
-  for (auto rl_index : _assigned_idx) {
-    auto rl = _tree.root_location(rl_index);
-    set_subst_rates_uniform();
-    set_empirical_freqs();
-
-    _tree.root_by(rl);
-    compute_lh(rl);
-    std::vector<partition_parameters_t> params;
-
-    for (size_t p = 0; p < _partitions.size(); ++p) {
-      params.push_back(make_partition_parameters(_partitions[p]->states,
-                                                 _rate_category_types[p],
-                                                 _partitions[p]->rate_cats));
-    }
-
-    root_location_t cur_best_rl = rl;
-    double          cur_best_lh = -std::numeric_limits<double>::infinity();
-
-    for (size_t iter = 0; iter < 1e3; ++iter) {
-      debug_string(EMIT_LEVEL_MPROGRESS, "Optimizing parameters");
-      optimize_params(params, rl, pgtol, factor, (iter % 10 == 0));
-
-      if (fabs(compute_lh(rl) - cur_best_lh) < atol) { break; }
-
-      debug_string(EMIT_LEVEL_MPROGRESS, "Optimizing Root Location");
-      auto   cur_rl = optimize_alpha(rl, brtol);
-      double cur_lh = compute_lh_root(cur_rl);
-
-      debug_print(EMIT_LEVEL_MPROGRESS, "Iteration %lu LH: %.5f", iter, cur_lh);
-      debug_print(
-          EMIT_LEVEL_INFO, "difference in lh: %.5f", (cur_lh - cur_best_lh));
-
-      if (_early_stop) {
-        if (fabs(rl.brlen_ratio - cur_rl.brlen_ratio) < brtol) {
-          debug_print(EMIT_LEVEL_DEBUG,
-                      "Current BRlen ratio tolerances: %.7f, brtol: %.7f",
-                      fabs(rl.brlen_ratio - cur_rl.brlen_ratio),
-                      brtol);
-          cur_best_rl = cur_rl;
-          cur_best_lh = cur_lh;
-          break;
-        }
-      }
-
-      if ((cur_lh - cur_best_lh) < atol) {
-        if (cur_lh > cur_best_lh) {
-          cur_best_rl = cur_rl;
-          cur_best_lh = cur_lh;
-        }
-        break;
-      }
-
-      if (cur_lh > cur_best_lh) {
-        cur_best_rl = cur_rl;
-        cur_best_lh = cur_lh;
-      }
-
-      rl = cur_rl;
-    }
-
-    checkpoint.write({cur_best_rl.id, cur_best_lh, cur_best_rl.brlen_ratio},
-                     params);
-    root_index++;
-
-    debug_print(EMIT_LEVEL_PROGRESS,
-                "Step %lu / %lu, ETC: %0.2fh",
-                root_index,
-                root_count,
-                progress_macro(root_index, root_count));
-
-    if (cur_best_lh > best_lh) {
-      best_rl = cur_best_rl;
-      best_lh = cur_best_lh;
-    }
-  }
+  start_warm_start(checkpoint);
+  start_lh_bound(checkpoint);
+  run_workers(queue, [&](model_t &model, size_t rl_index) {
+    model.exhaustive_root(rl_index, atol, pgtol, brtol, factor, checkpoint);
+  });
+  finish_warm_start();
+  flush_results(checkpoint);
 
 #ifdef MPI_VERSION
-  debug_string(EMIT_LEVEL_IMPORTANT, "Waiting for the rest to finish");
-  MPI_Barrier(MPI_COMM_WORLD);
-  debug_string(EMIT_LEVEL_IMPORTANT, "Done waiting");
+  if (!_local) {
+    debug_string(EMIT_LEVEL_IMPORTANT, "Waiting for the rest to finish");
+    profile::mpi_barrier();
+    debug_string(EMIT_LEVEL_IMPORTANT, "Done waiting");
+  }
 #endif
+  finish_lh_bound();
+  queue.report_utilization();
 
-  if (__MPI_RANK__ == 0) {
-    auto   total_progress = checkpoint.read_results();
+  if (_local || __MPI_RANK__ == 0) {
+    auto   total_progress = checkpoint.merge();
     double max_lh         = -std::numeric_limits<double>::infinity();
+    if (total_progress.empty()) {
+      throw std::runtime_error{"No root was finished before the search "
+                               "budget ran out"};
+    }
+    if (total_progress.size() < _tree.root_count()) {
+      debug_print(EMIT_LEVEL_WARNING,
+                  "Only %lu of %lu roots are finished, so the LWRs are over "
+                  "the finished roots",
+                  total_progress.size(),
+                  _tree.root_count());
+    }
 
     for (auto result : total_progress) {
       max_lh = std::max(result.first.lh, max_lh);
@@ -1263,6 +3059,10 @@ model_t::exhaustive_search(double        atol,
     }
     debug_print(EMIT_LEVEL_DEBUG, "LWR denom: %f, %e", total_lh, total_lh - 1);
 
+    /*
+     * Pruned roots only have their screening lh, which is a lower bound, so
+     * their LWR is a lower bound as well.
+     */
     for (auto result : total_progress) {
       double lwr     = exp((result.first.lh - max_lh)) / total_lh;
       auto   rl      = _tree.root_location(result.first.root_id);
@@ -1270,6 +3070,9 @@ model_t::exhaustive_search(double        atol,
       _tree.annotate_branch(rl, "LWR", std::to_string(lwr));
       _tree.annotate_lh(rl, result.first.lh);
       _tree.annotate_ratio(rl, result.first.alpha);
+      if (result.second.empty()) {
+        _tree.annotate_branch(rl, "pruned", "true");
+      }
     }
     auto total_best_result = *std::max_element(
         total_progress.begin(),
@@ -1286,6 +3089,16 @@ model_t::exhaustive_search(double        atol,
   return {best_rl, best_lh};
 }
 
+void model_t::annotate_support(const std::vector<double> &support) {
+  if (support.size() != _tree.root_count()) {
+    throw std::runtime_error("Need the support of every root");
+  }
+  _tree.clear_newick_annotations();
+  for (size_t i = 0; i < support.size(); ++i) {
+    _tree.annotate_branch(i, "support", std::to_string(support[i]));
+  }
+}
+
 void model_t::initialize() { compute_lh(_tree.root_location(0)); }
 
 void model_t::finalize() { _tree.unroot(); }
@@ -1309,8 +3122,19 @@ rooted_tree_t model_t::unrooted_tree() const {
   return new_tree;
 }
 
+std::string model_t::rooted_newick(const root_location_t &root,
+                                   bool                   annotations) const {
+  return _tree.rooted_newick(_tree.root_location(root.id), annotations);
+}
+
+std::string model_t::virtual_rooted_newick(const root_location_t &root,
+                                           bool annotations) const {
+  return _tree.virtual_rooted_newick(_tree.root_location(root.id),
+                                     annotations);
+}
+
 void model_t::initialize_partitions(const std::vector<msa_t> &msa) {
-  for (size_t partition_index = 0; partition_index < _partitions.size();
+  for (size_t partition_index = 0; partition_index < partition_count();
        ++partition_index) {
     set_tip_states(partition_index, msa[partition_index]);
     update_invariant_sites(partition_index);
@@ -1322,13 +3146,13 @@ void model_t::initialize_partitions(const std::vector<msa_t> &msa) {
 
 void model_t::initialize_partitions_uniform_freqs(
     const std::vector<msa_t> &msa) {
-  for (size_t partition_index = 0; partition_index < _partitions.size();
+  for (size_t partition_index = 0; partition_index < partition_count();
        ++partition_index) {
     set_tip_states(partition_index, msa[partition_index]);
     update_invariant_sites(partition_index);
     std::vector<double> uni_freqs(
-        _partitions[partition_index]->states,
-        1.0 / (double)_partitions[partition_index]->states);
+        first_block(partition_index)->states,
+        1.0 / (double)first_block(partition_index)->states);
     set_freqs(partition_index, uni_freqs);
     set_subst_rates_random(partition_index, msa[partition_index]);
     set_gamma_rates(partition_index);
@@ -1338,8 +3162,8 @@ void model_t::initialize_partitions_uniform_freqs(
 std::string model_t::subst_string() const {
   std::ostringstream oss;
   oss << "{";
-  for (size_t p_index = 0; p_index < _partitions.size(); ++p_index) {
-    auto p = _partitions[p_index];
+  for (size_t p_index = 0; p_index < partition_count(); ++p_index) {
+    auto p = first_block(p_index);
     oss << "{";
     size_t              params_size = p->states * p->states - p->states;
     std::vector<double> params{p->subst_params[0],
@@ -1349,12 +3173,61 @@ std::string model_t::subst_string() const {
       if (i != params.size() - 1) oss << ",";
     }
     oss << "}";
-    if (p_index != _partitions.size() - 1) oss << ",";
+    if (p_index != partition_count() - 1) oss << ",";
   }
   oss << "}";
   return oss.str();
 }
 
+/*
+ * Computes the score for each of a batch of parameter vectors. The vectors are
+ * independent of each other, so they can be computed in parallel.
+ */
+typedef std::function<void(const std::vector<model_params_t> &,
+                           std::vector<double> &)>
+    batch_score_func_t;
+
+/*
+ * Forward difference gradient of the score. All of the perturbed parameter
+ * vectors are made up front, and scored as one batch. If there is no batch
+ * function, they are scored one at a time with set_func and compute_lh.
+ */
+static void finite_difference_gradient(
+    const model_params_t &                              parameters,
+    double                                              score,
+    size_t                                              partition_index,
+    double                                              epsilon,
+    const std::function<double()> &                     compute_lh,
+    std::function<void(size_t, const model_params_t &)> set_func,
+    const batch_score_func_t &                          compute_lh_batch,
+    std::vector<double> &                               gradient) {
+  size_t                      n_params = parameters.size();
+  std::vector<model_params_t> points(n_params, parameters);
+  std::vector<double>         steps(n_params);
+  std::vector<double>         scores(n_params);
+  for (size_t i = 0; i < n_params; ++i) {
+    double h = epsilon * fabs(parameters[i]);
+    if (h < epsilon) { h = epsilon; }
+    points[i][i] += h;
+    steps[i] = h;
+  }
+
+  if (compute_lh_batch) {
+    compute_lh_batch(points, scores);
+  } else {
+    for (size_t i = 0; i < n_params; ++i) {
+      set_func(partition_index, points[i]);
+      scores[i] = compute_lh();
+    }
+  }
+
+  for (size_t i = 0; i < n_params; ++i) {
+    assert_string(std::isfinite(scores[i]), "dlh is not finite");
+    gradient[i] = (scores[i] - score) / steps[i];
+    assert_string(std::isfinite(gradient[i]), "gradient is not finite");
+  }
+}
+
 static double
 gd_params(model_params_t &                                    initial_params,
           size_t                                              partition_index,
@@ -1362,7 +3235,8 @@ gd_params(model_params_t &                                    initial_params,
           double                                              p_max,
           double                                              epsilon,
           std::function<double()>                             compute_lh,
-          std::function<void(size_t, const model_params_t &)> set_func) {
+          std::function<void(size_t, const model_params_t &)> set_func,
+          const batch_score_func_t &compute_lh_batch = nullptr) {
   size_t              iters    = 0;
   double              atol     = 1e-4;
   size_t              n_params = initial_params.size();
@@ -1375,19 +3249,16 @@ gd_params(model_params_t &                                    initial_params,
     set_func(partition_index, parameters);
     double score = compute_lh();
     debug_print(EMIT_LEVEL_INFO, "GD Iter: %lu Score: %.5f", iters, -score);
+    profile::count(profile::gd_iterations);
     if (fabs(last_score - score) < atol) { break; }
-    for (size_t i = 0; i < n_params; ++i) {
-      double h = epsilon * fabs(parameters[i]);
-      if (h < epsilon) { h = epsilon; }
-      double temp = parameters[i];
-      parameters[i] += h;
-      set_func(partition_index, parameters);
-      double dlh = compute_lh();
-      assert_string(std::isfinite(dlh), "dlh is not finite");
-      gradient[i] = (dlh - score) / h;
-      assert_string(std::isfinite(gradient[i]), "gradient is not finite");
-      parameters[i] = temp;
-    }
+    finite_difference_gradient(parameters,
+                               score,
+                               partition_index,
+                               epsilon,
+                               compute_lh,
+                               set_func,
+                               compute_lh_batch,
+                               gradient);
     /* backtracking line search */
     double gnorm = 0.0;
     /* compute the norm of the gradient */
@@ -1442,16 +3313,21 @@ gd_params(model_params_t &                                    initial_params,
   return -final_score;
 }
 
+/*
+ * Bounded BFGS over a parameter vector, with separate bounds for every
+ * parameter, so that different kinds of parameters can be optimized together.
+ */
 static double
 bfgs_params(model_params_t &                                    initial_params,
             size_t                                              partition_index,
-            double                                              p_min,
-            double                                              p_max,
+            std::vector<double>                                 param_min,
+            std::vector<double>                                 param_max,
             double                                              epsilon,
             double                                              pgtol,
             double                                              factor,
             std::function<double()>                             compute_lh,
-            std::function<void(size_t, const model_params_t &)> set_func) {
+            std::function<void(size_t, const model_params_t &)> set_func,
+            const batch_score_func_t &compute_lh_batch = nullptr) {
   int task     = START;
   int n_params = static_cast<int>(initial_params.size());
   set_func(partition_index, initial_params);
@@ -1467,8 +3343,6 @@ bfgs_params(model_params_t &                                    initial_params,
   std::vector<int>    iwa(3 * static_cast<size_t>(n_params), 0);
 
   std::vector<double> parameters(initial_params);
-  std::vector<double> param_min(static_cast<size_t>(n_params), p_min);
-  std::vector<double> param_max(static_cast<size_t>(n_params), p_max);
   logical             lsave[4];
   int                 isave[44];
   double              dsave[29];
@@ -1499,22 +3373,19 @@ bfgs_params(model_params_t &                                    initial_params,
            dsave);
 
     debug_print(EMIT_LEVEL_INFO, "BFGS Iter: %lu Score: %.5f", iters, -score);
+    profile::count(profile::bfgs_iterations);
 
     set_func(partition_index, parameters);
     score = compute_lh();
     if (IS_FG(task)) {
-      for (size_t i = 0; i < static_cast<size_t>(n_params); ++i) {
-        double h = epsilon * fabs(parameters[i]);
-        if (h < epsilon) { h = epsilon; }
-        double temp = parameters[i];
-        parameters[i] += h;
-        set_func(partition_index, parameters);
-        double dlh = compute_lh();
-        assert_string(std::isfinite(dlh), "dlh is not finite");
-        gradient[i] = (dlh - score) / h;
-        assert_string(std::isfinite(gradient[i]), "gradient is not finite");
-        parameters[i] = temp;
-      }
+      finite_difference_gradient(parameters,
+                                 score,
+                                 partition_index,
+                                 epsilon,
+                                 compute_lh,
+                                 set_func,
+                                 compute_lh_batch,
+                                 gradient);
     } else if (task != NEW_X) {
       break;
     }
@@ -1536,6 +3407,29 @@ bfgs_params(model_params_t &                                    initial_params,
   return score;
 }
 
+static double
+bfgs_params(model_params_t &                                    initial_params,
+            size_t                                              partition_index,
+            double                                              p_min,
+            double                                              p_max,
+            double                                              epsilon,
+            double                                              pgtol,
+            double                                              factor,
+            std::function<double()>                             compute_lh,
+            std::function<void(size_t, const model_params_t &)> set_func,
+            const batch_score_func_t &compute_lh_batch = nullptr) {
+  return bfgs_params(initial_params,
+                     partition_index,
+                     std::vector<double>(initial_params.size(), p_min),
+                     std::vector<double>(initial_params.size(), p_max),
+                     epsilon,
+                     pgtol,
+                     factor,
+                     std::move(compute_lh),
+                     std::move(set_func),
+                     compute_lh_batch);
+}
+
 double model_t::bfgs_rates(model_params_t &                    initial_rates,
                            const std::vector<pll_operation_t> &ops,
                            const std::vector<unsigned int>     pmatrix_indices,
@@ -1547,6 +3441,11 @@ double model_t::bfgs_rates(model_params_t &                    initial_rates,
   constexpr double p_max   = 1e4;
   constexpr double epsilon = 1e-4;
 
+  std::function<void(size_t, const model_params_t &)> set_func =
+      [this](size_t pi, const model_params_t &mp) -> void {
+        this->set_subst_rates(pi, mp);
+      };
+
   debug_string(EMIT_LEVEL_DEBUG, "doing bfgs params");
   return bfgs_params(
       initial_rates,
@@ -1560,8 +3459,17 @@ double model_t::bfgs_rates(model_params_t &                    initial_rates,
         return -this->compute_lh_partition(
             partition_index, ops, pmatrix_indices, branch_lengths);
       },
-      [&, this](size_t pi, const model_params_t &mp) -> void {
-        this->set_subst_rates(pi, mp);
+      set_func,
+      [&, this](const std::vector<model_params_t> &points,
+                std::vector<double> &              scores) -> void {
+        this->compute_lh_partition_batch(partition_index,
+                                         points,
+                                         set_func,
+                                         ops,
+                                         pmatrix_indices,
+                                         branch_lengths,
+                                         scores);
+        for (auto &score : scores) { score = -score; }
       });
 }
 
@@ -1597,6 +3505,11 @@ double model_t::bfgs_freqs(model_params_t &                    initial_freqs,
   model_params_t   constrained_freqs(initial_freqs.begin(),
                                    initial_freqs.end() - 1);
 
+  std::function<void(size_t, const model_params_t &)> set_func =
+      [this](size_t pi, const model_params_t &mp) -> void {
+        this->set_freqs_all_free(pi, mp);
+      };
+
   debug_string(EMIT_LEVEL_DEBUG, "doing bfgs freqs");
   double lh = bfgs_params(
       initial_freqs,
@@ -1610,8 +3523,17 @@ double model_t::bfgs_freqs(model_params_t &                    initial_freqs,
         return -this->compute_lh_partition(
             partition_index, ops, pmatrix_indices, branch_lengths);
       },
-      [&, this](size_t pi, const model_params_t &mp) -> void {
-        this->set_freqs_all_free(pi, mp);
+      set_func,
+      [&, this](const std::vector<model_params_t> &points,
+                std::vector<double> &              scores) -> void {
+        this->compute_lh_partition_batch(partition_index,
+                                         points,
+                                         set_func,
+                                         ops,
+                                         pmatrix_indices,
+                                         branch_lengths,
+                                         scores);
+        for (auto &score : scores) { score = -score; }
       });
 
   return lh;
@@ -1653,6 +3575,11 @@ model_t::bfgs_gamma_rates(model_params_t &                    alpha,
   constexpr double p_max   = 10000.0;
   constexpr double epsilon = 1e-4;
 
+  std::function<void(size_t, const model_params_t &)> set_func =
+      [this](size_t pi, const model_params_t &mp) -> void {
+        this->set_gamma_rates(pi, mp);
+      };
+
   debug_string(EMIT_LEVEL_DEBUG, "doing bfgs gamma");
   double lh = bfgs_params(
       alpha,
@@ -1666,8 +3593,17 @@ model_t::bfgs_gamma_rates(model_params_t &                    alpha,
         return -this->compute_lh_partition(
             partition_index, ops, pmatrix_indices, branch_lengths);
       },
-      [&, this](size_t pi, const model_params_t &mp) -> void {
-        this->set_gamma_rates(pi, mp);
+      set_func,
+      [&, this](const std::vector<model_params_t> &points,
+                std::vector<double> &              scores) -> void {
+        this->compute_lh_partition_batch(partition_index,
+                                         points,
+                                         set_func,
+                                         ops,
+                                         pmatrix_indices,
+                                         branch_lengths,
+                                         scores);
+        for (auto &score : scores) { score = -score; }
       });
 
   return lh;
@@ -1707,6 +3643,11 @@ model_t::bfgs_gamma_weights(model_params_t &                    alpha,
   constexpr double p_max   = 1.0;
   constexpr double epsilon = 1e-4;
 
+  std::function<void(size_t, const model_params_t &)> set_func =
+      [this](size_t pi, const model_params_t &mp) -> void {
+        this->set_gamma_weights(pi, mp);
+      };
+
   debug_string(EMIT_LEVEL_DEBUG, "doing bfgs gamma");
   double lh = bfgs_params(
       alpha,
@@ -1720,8 +3661,17 @@ model_t::bfgs_gamma_weights(model_params_t &                    alpha,
         return -this->compute_lh_partition(
             partition_index, ops, pmatrix_indices, branch_lengths);
       },
-      [&, this](size_t pi, const model_params_t &mp) -> void {
-        this->set_gamma_weights(pi, mp);
+      set_func,
+      [&, this](const std::vector<model_params_t> &points,
+                std::vector<double> &              scores) -> void {
+        this->compute_lh_partition_batch(partition_index,
+                                         points,
+                                         set_func,
+                                         ops,
+                                         pmatrix_indices,
+                                         branch_lengths,
+                                         scores);
+        for (auto &score : scores) { score = -score; }
       });
 
   return lh;
@@ -1749,8 +3699,258 @@ double model_t::gd_gamma_weights(model_params_t &       alpha,
   return lh;
 }
 
+/*
+ * Optimize the rates, freqs and, if asked, the gamma rates and weights of a
+ * partition together, as one parameter vector. The bounds are the same as for
+ * the separate optimizations, so the results are comparable.
+ */
+double model_t::bfgs_joint(partition_parameters_t &            params,
+                           const std::vector<pll_operation_t> &ops,
+                           const std::vector<unsigned int>     pmatrix_indices,
+                           const std::vector<double>           branch_lengths,
+                           size_t                              partition_index,
+                           bool                                optimize_gamma,
+                           double                              pgtol,
+                           double                              factor) {
+  constexpr double epsilon = 1e-4;
+
+  bool   free_rates = _rate_category_types[partition_index]
+                    == rate_category::FREE;
+  size_t rates_size = params.subst_rates.size();
+  size_t freqs_size = params.freqs.size();
+  size_t alpha_size = optimize_gamma ? params.gamma_alpha.size() : 0;
+  size_t weights_size =
+      optimize_gamma && free_rates ? params.gamma_weights.size() : 0;
+
+  model_params_t      joint;
+  std::vector<double> param_min;
+  std::vector<double> param_max;
+  auto append = [&](const model_params_t &mp,
+                    size_t                size,
+                    double                p_min,
+                    double                p_max) {
+    joint.insert(joint.end(),
+                 mp.begin(),
+                 mp.begin() + static_cast<std::ptrdiff_t>(size));
+    param_min.insert(param_min.end(), size, p_min);
+    param_max.insert(param_max.end(), size, p_max);
+  };
+  append(params.subst_rates, rates_size, 1e-4, 1e4);
+  append(params.freqs, freqs_size, 1e-4, 1.0 - 1e-4 * 3);
+  append(params.gamma_alpha, alpha_size, 0.2, 10000.0);
+  append(params.gamma_weights, weights_size, 1e-4, 1.0);
+
+  auto unpack = [=](const model_params_t &mp, partition_parameters_t &pp) {
+    auto it   = mp.begin();
+    auto take = [&it](model_params_t &dst, size_t size) {
+      auto end = it + static_cast<std::ptrdiff_t>(size);
+      if (size) { dst.assign(it, end); }
+      it = end;
+    };
+    take(pp.subst_rates, rates_size);
+    take(pp.freqs, freqs_size);
+    take(pp.gamma_alpha, alpha_size);
+    take(pp.gamma_weights, weights_size);
+  };
+
+  std::function<void(size_t, const model_params_t &)> set_func =
+      [this, unpack](size_t pi, const model_params_t &mp) -> void {
+        partition_parameters_t pp;
+        unpack(mp, pp);
+        this->set_subst_rates(pi, pp.subst_rates);
+        this->set_freqs_all_free(pi, pp.freqs);
+        if (!pp.gamma_alpha.empty()) {
+          this->set_gamma_rates(pi, pp.gamma_alpha);
+        }
+        if (!pp.gamma_weights.empty()) {
+          this->set_gamma_weights(pi, pp.gamma_weights);
+        }
+      };
+
+  debug_string(EMIT_LEVEL_DEBUG, "doing bfgs joint");
+  profile::count(profile::joint_optimizations);
+  double lh = bfgs_params(
+      joint,
+      partition_index,
+      param_min,
+      param_max,
+      epsilon,
+      pgtol,
+      factor,
+      [&, this]() -> double {
+        return -this->compute_lh_partition(
+            partition_index, ops, pmatrix_indices, branch_lengths);
+      },
+      set_func,
+      [&, this](const std::vector<model_params_t> &points,
+                std::vector<double> &              scores) -> void {
+        this->compute_lh_partition_batch(partition_index,
+                                         points,
+                                         set_func,
+                                         ops,
+                                         pmatrix_indices,
+                                         branch_lengths,
+                                         scores);
+        for (auto &score : scores) { score = -score; }
+      });
+
+  unpack(joint, params);
+  return lh;
+}
+
+/*
+ * Compute the lh of a root placed on an edge, directly from the directional
+ * CLVs on either side of the edge, and the pmatrices for the two halves of the
+ * edge. Nothing is written to the partition, so this can be called for many
+ * edges in parallel.
+ */
+static double
+compute_edge_root_lh_partition(const pll_partition_t *   partition,
+                               const edge_clv_indices_t &edge,
+                               const double *            pm1,
+                               const double *            pm2,
+                               const unsigned int *      param_indices) {
+  const unsigned int states        = partition->states;
+  const unsigned int states_padded = partition->states_padded;
+  const unsigned int rate_cats     = partition->rate_cats;
+  const size_t       pm_span       = states * states_padded;
+
+  root_child_clv_t clv1{partition, edge.clv1};
+  root_child_clv_t clv2{partition, edge.clv2};
+
+  const unsigned int *site_id1 = pll_get_site_id(partition, edge.clv1);
+  const unsigned int *site_id2 = pll_get_site_id(partition, edge.clv2);
+
+  const unsigned int *scaler1 =
+      edge.scaler1 == PLL_SCALE_BUFFER_NONE
+          ? nullptr
+          : partition->scale_buffer[edge.scaler1];
+  const unsigned int *scaler2 =
+      edge.scaler2 == PLL_SCALE_BUFFER_NONE
+          ? nullptr
+          : partition->scale_buffer[edge.scaler2];
+
+  const double  prop_invar = partition->prop_invar[param_indices[0]];
+  const double *inv_freqs  = partition->frequencies[param_indices[0]];
+  const double  log_scale  = std::log(PLL_SCALE_THRESHOLD);
+
+  double lh = 0.0;
+  for (unsigned int site = 0; site < partition->sites; ++site) {
+    unsigned int  id1   = site_id1 ? site_id1[site] : site;
+    unsigned int  id2   = site_id2 ? site_id2[site] : site;
+    const double *site1 = clv1(id1);
+    const double *site2 = clv2(id2);
+
+    double site_lh = 0.0;
+    for (unsigned int c = 0; c < rate_cats; ++c) {
+      const double *x1     = site1 + c * states_padded;
+      const double *x2     = site2 + c * states_padded;
+      const double *freqs  = partition->frequencies[param_indices[c]];
+      double        cat_lh = 0.0;
+      for (unsigned int i = 0; i < states; ++i) {
+        size_t row = c * pm_span + i * states_padded;
+        double u   = 0.0;
+        double v   = 0.0;
+        for (unsigned int j = 0; j < states; ++j) {
+          u += pm1[row + j] * x1[j];
+          v += pm2[row + j] * x2[j];
+        }
+        cat_lh += freqs[i] * u * v;
+      }
+      site_lh += partition->rate_weights[c] * cat_lh;
+    }
+
+    unsigned int scale_count =
+        (scaler1 ? scaler1[id1] : 0) + (scaler2 ? scaler2[id2] : 0);
+    double log_site_lh = std::log(site_lh) + scale_count * log_scale;
+
+    if (prop_invar > 0.0) {
+      int    inv_state = partition->invariant ? partition->invariant[site] : -1;
+      double inv_lh    = inv_state == -1 ? 0.0 : inv_freqs[inv_state];
+      double log_var   = log_site_lh + std::log(1.0 - prop_invar);
+      if (inv_lh > 0.0) {
+        double log_inv = std::log(inv_lh * prop_invar);
+        double log_max = std::max(log_var, log_inv);
+        log_site_lh    = log_max
+                      + std::log(std::exp(log_var - log_max)
+                                 + std::exp(log_inv - log_max));
+      } else {
+        log_site_lh = log_var;
+      }
+    }
+
+    lh += partition->pattern_weights[site] * log_site_lh;
+  }
+  return lh;
+}
+
+std::vector<double> model_t::compute_all_edge_lh() {
+  if (!_all_edge_clvs) {
+    throw std::runtime_error(
+        "The model was constructed without the directional CLVs");
+  }
+
+  /*
+   * The root CLVs need to be recomputed if the model has changed, so we do that
+   * with the regular method, so that the current root stays valid.
+   */
+  bool eigen_valid = true;
+  for (size_t i = 0; i < _partitions.size(); ++i) {
+    for (auto param_index : _param_indicies[i]) {
+      eigen_valid =
+          eigen_valid && _partitions[i]->eigen_decomp_valid[param_index];
+    }
+  }
+  if (!eigen_valid) {
+    compute_lh(_tree.rooted() ? _tree.root_location() : _tree.roots()[0]);
+  }
+
+  auto ops = _tree.generate_all_edge_operations(
+      all_edge_clv_base(), all_edge_scaler_base(), all_edge_pmatrix_base());
+
+  const auto &roots = _tree.roots();
+
+  std::vector<unsigned int> split_indices;
+  std::vector<double>       split_lengths;
+  split_indices.reserve(roots.size() * 2);
+  split_lengths.reserve(roots.size() * 2);
+  for (size_t i = 0; i < roots.size(); ++i) {
+    auto base =
+        all_edge_split_pmatrix_base() + 2 * static_cast<unsigned int>(i);
+    split_indices.push_back(base);
+    split_lengths.push_back(roots[i].brlen());
+    split_indices.push_back(base + 1);
+    split_lengths.push_back(roots[i].brlen_compliment());
+  }
+
+  std::vector<double> root_lh(roots.size(), 0.0);
+  count_lh_evaluations(roots.size());
+  for (size_t i = 0; i < _partitions.size(); ++i) {
+    auto &partition = _partitions[i];
+    update_pmatrix_partition(i, ops.pmatrix_indices, ops.branch_lengths);
+    update_pmatrix_partition(i, split_indices, split_lengths);
+    _backend->update_partials(
+        partition, ops.ops.data(), static_cast<unsigned int>(ops.ops.size()));
+    profile::count(profile::partial_updates, ops.ops.size());
+
+#pragma omp parallel for schedule(static)
+    for (size_t e = 0; e < roots.size(); ++e) {
+      root_lh[e] += compute_edge_root_lh_partition(
+          partition,
+          ops.edges[e],
+          partition->pmatrix[split_indices[2 * e]],
+          partition->pmatrix[split_indices[2 * e + 1]],
+          _param_indicies[i].data());
+    }
+  }
+  return root_lh;
+}
+
 std::vector<double> model_t::compute_all_root_lh() {
+  profile::phase_timer_t timer{profile::root_ranking};
+
   compute_lh(_tree.roots()[0]);
+  if (_all_edge_clvs) { return compute_all_edge_lh(); }
   std::vector<double> root_lh;
   root_lh.reserve(_tree.roots().size());
   for (auto rl : _tree.roots()) {
@@ -1761,8 +3961,8 @@ std::vector<double> model_t::compute_all_root_lh() {
 }
 
 void model_t::set_subst_rates_uniform() {
-  for (size_t i = 0; i < _partitions.size(); ++i) {
-    unsigned int   states = _partitions[i]->states;
+  for (size_t i = 0; i < partition_count(); ++i) {
+    unsigned int   states = first_block(i)->states;
     unsigned int   params = states * states - states;
     model_params_t mp(params, 1.0 / params);
     set_subst_rates(i, mp);
@@ -1770,7 +3970,7 @@ void model_t::set_subst_rates_uniform() {
 }
 
 void model_t::set_empirical_freqs() {
-  for (size_t i = 0; i < _partitions.size(); ++i) { set_empirical_freqs(i); }
+  for (size_t i = 0; i < partition_count(); ++i) { set_empirical_freqs(i); }
 }
 
 void model_t::assign_indicies(const std::vector<size_t> &idx) {
@@ -1862,11 +4062,28 @@ void model_t::assign_indicies_by_rank_search(size_t                  min_roots,
   trimmed_idx.reserve(work_left);
 
   for (auto i : shuffled_idx) {
+    if (trimmed_idx.size() == work_left) { break; }
     if (!std::binary_search(completed_work.begin(), completed_work.end(), i)) {
       trimmed_idx.push_back(i);
     }
   }
 
+  /*
+   * With a budget, the roots most likely to be the best go first, in the same
+   * order as the exhaustive search. Otherwise, the warm start order keeps the
+   * roots of each rank close together on the tree.
+   */
+  if (_budget) {
+    std::vector<bool> picked(_tree.root_count(), false);
+    for (auto i : trimmed_idx) { picked[i] = true; }
+    trimmed_idx.clear();
+    for (auto i : suggest_root_indicies_lh()) {
+      if (picked[i]) { trimmed_idx.push_back(i); }
+    }
+  } else if (_warm_start) {
+    trimmed_idx = _tree.adjacency_order(trimmed_idx);
+  }
+
   size_t chunk_size, mod;
   {
     auto res   = compute_chunk_size_mod(work_left, num_tasks);
@@ -1874,6 +4091,11 @@ void model_t::assign_indicies_by_rank_search(size_t                  min_roots,
     mod        = res.second;
   }
 
+  if (_dynamic_schedule) {
+    assign_indicies(trimmed_idx);
+    return;
+  }
+
   size_t beg = chunk_size * rank + std::min(mod, rank);
   size_t end = chunk_size * (rank + 1) + std::min(mod, (rank + 1));
   assign_indicies(beg, end, trimmed_idx);
@@ -1911,17 +4133,37 @@ void model_t::assign_indicies_by_rank_exhaustive(size_t        rank,
     }
   }
 
+  /*
+   * With a budget, the roots with the highest lh go first, since they carry
+   * most of the LWR. Otherwise, with static scheduling, the warm start order
+   * also keeps the roots of each rank close together on the tree.
+   */
+  if (_budget) {
+    std::vector<bool> left(_tree.root_count(), false);
+    for (auto i : tmp_idx) { left[i] = true; }
+    tmp_idx.clear();
+    for (auto i : suggest_root_indicies_lh()) {
+      if (left[i]) { tmp_idx.push_back(i); }
+    }
+  } else if (_warm_start) {
+    tmp_idx = _tree.adjacency_order(tmp_idx);
+  }
+
   size_t chunk_size, mod;
   {
     auto res   = compute_chunk_size_mod(work_left, num_tasks);
     chunk_size = res.first;
     mod        = res.second;
   }
-  size_t beg = chunk_size * rank + std::min(mod, rank);
-  size_t end = chunk_size * (rank + 1) + std::min(mod, (rank + 1));
-  assign_indicies(beg, end, tmp_idx);
+  if (_dynamic_schedule) {
+    assign_indicies(tmp_idx);
+  } else {
+    size_t beg = chunk_size * rank + std::min(mod, rank);
+    size_t end = chunk_size * (rank + 1) + std::min(mod, (rank + 1));
+    assign_indicies(beg, end, tmp_idx);
+  }
 #ifdef MPI_VERSION
-  MPI_Barrier(MPI_COMM_WORLD);
+  if (!_local) { profile::mpi_barrier(); }
 #endif
 }
 
@@ -1942,13 +4184,30 @@ void model_t::optimize_params(std::vector<partition_parameters_t> &params,
                               double                               pgtol,
                               double                               factor,
                               bool optimize_gamma) {
+  profile::phase_timer_t       timer{profile::param_optimization};
   std::vector<pll_operation_t> ops;
   std::vector<unsigned int>    pmatrix_indices;
   std::vector<double>          branch_lengths;
 
   GENERATE_AND_UNPACK_OPS(_tree, rl, ops, pmatrix_indices, branch_lengths);
-#pragma omp parallel for schedule(dynamic)
-  for (size_t i = 0; i < _partitions.size(); ++i) {
+  /*
+   * When there are fewer partitions than threads, they are split into site
+   * blocks, and the threads are used on the blocks instead, which happens in
+   * compute_lh_partition. Otherwise, the partitions are handed out longest
+   * first, and the blocks of a big partition are computed by its thread.
+   * Likewise, when there are gradient lanes, the threads are used on the lanes,
+   * which are shared between the partitions.
+   */
+  size_t threads = 1;
+#ifdef _OPENMP
+  threads = static_cast<size_t>(omp_get_max_threads());
+#endif
+  bool split_partitions    = _partitions.size() != partition_count();
+  bool parallel_partitions = (!split_partitions || partition_count() >= threads)
+                             && _gradient_lanes.empty();
+#pragma omp parallel for schedule(dynamic) if (parallel_partitions)
+  for (size_t k = 0; k < partition_count(); ++k) {
+    size_t i = _partition_order[k];
     set_subst_rates(i, params[i].subst_rates);
     set_freqs_all_free(i, params[i].freqs);
     set_gamma_rates(i, params[i].gamma_alpha);
@@ -1957,6 +4216,19 @@ void model_t::optimize_params(std::vector<partition_parameters_t> &params,
       set_gamma_weights(i, params[i].gamma_weights);
     }
 
+    if (_joint_params) {
+      debug_string(EMIT_LEVEL_INFO, "Optimizing all params jointly");
+      bfgs_joint(params[i],
+                 ops,
+                 pmatrix_indices,
+                 branch_lengths,
+                 i,
+                 optimize_gamma && !_rate_user_init[i],
+                 pgtol,
+                 factor);
+      continue;
+    }
+
     bfgs_rates(params[i].subst_rates,
                ops,
                pmatrix_indices,
@@ -6,10 +6,17 @@ extern "C" {
 }
 #include "checkpoint.hpp"
 #include "debug.h"
+#include "lh_bound.hpp"
+#include "lh_backend.hpp"
+#include "lh_cache.hpp"
 #include "msa.hpp"
+#include "search_budget.hpp"
 #include "tree.hpp"
 #include "util.hpp"
+#include "warm_start.hpp"
+#include "work_queue.hpp"
 #include <functional>
+#include <memory>
 #ifdef MPI_BUILD
 #include <mpi.h>
 #endif
@@ -23,6 +30,43 @@ struct dlh_t {
   double dlh;
 };
 
+struct d2lh_t {
+  double lh;
+  double dlh;
+  double d2lh;
+};
+
+/*
+ * The branch length and parameter version that each probability matrix of a
+ * block was last computed with. A matrix asked for again with the same length,
+ * before the parameters change, is not computed again.
+ *
+ * The rest is scratch space for the matrix updates and root derivatives of the
+ * block, kept here so that the hot paths don't allocate.
+ */
+struct pmatrix_cache_t {
+  uint64_t              version = 1;
+  std::vector<double>   branch_lengths;
+  std::vector<uint64_t> versions;
+
+  std::vector<unsigned int> stale_indices;
+  std::vector<double>       stale_lengths;
+  std::vector<double>       derivatives;
+
+  /*
+   * The rate matrix of each rate category, scaled by the category rate, in the
+   * layout of a pmatrix, and the parameter version it was computed for.
+   */
+  std::vector<double> rate_matrices;
+  uint64_t            rate_matrices_version = 0;
+
+  /*
+   * Set when the root CLV is older than the root of the tree, because a cached
+   * lh was returned instead of computing it.
+   */
+  bool root_clv_stale = false;
+};
+
 struct invalid_empirical_frequencies_exception : public std::runtime_error {
   invalid_empirical_frequencies_exception(const char *m) :
       std::runtime_error(m){};
@@ -51,14 +95,24 @@ public:
       const std::vector<ratehet_opts_t> &                rate_cats,
       bool                                               invariant_sites,
       uint64_t                                           seed,
-      bool                                               early_stop);
+      bool                                               early_stop,
+      bool                                               all_edge_clvs = true,
+      size_t                                             site_blocks   = 0,
+      bool                                               screening     = false,
+      tip_kernel::tip_kernel_e                           tip_kernel_mode =
+          tip_kernel::site_repeats);
 
   model_t(rooted_tree_t             t,
           const std::vector<msa_t> &msa,
           size_t                    rate_cats,
           bool                      invariant_sites,
           uint64_t                  seed,
-          bool                      early_stop) :
+          bool                      early_stop,
+          bool                      all_edge_clvs = true,
+          size_t                    site_blocks   = 0,
+          bool                      screening     = false,
+          tip_kernel::tip_kernel_e  tip_kernel_mode =
+              tip_kernel::site_repeats) :
 
       model_t(
           t,
@@ -66,15 +120,24 @@ public:
           std::vector<ratehet_opts_t>{rate_cats, ratehet_opts_t{}},
           invariant_sites,
           seed,
-          early_stop){};
+          early_stop,
+          all_edge_clvs,
+          site_blocks,
+          screening,
+          tip_kernel_mode){};
 
   ~model_t();
 
   double compute_lh(const root_location_t &root_location);
   double compute_lh_root(const root_location_t &root);
   dlh_t  compute_dlh(const root_location_t &root_location);
+  d2lh_t compute_d2lh(const root_location_t &root_location);
+  std::vector<dlh_t> compute_dlh_batch(const root_location_t &    root,
+                                       const std::vector<double> &ratios);
 
   root_location_t optimize_alpha(const root_location_t &root, double atol);
+  root_location_t optimize_alpha_newton(const root_location_t &root,
+                                        double                 atol);
   std::pair<root_location_t, double> optimize_root_location(size_t min_roots,
                                                             double root_ratio);
 
@@ -92,10 +155,23 @@ public:
   void initialize();
   void finalize();
 
+  /*
+   * Copies of the model tree, rooted at root, rooted there and then unrooted,
+   * or unrooted. The copies share the topology with the model tree.
+   */
   rooted_tree_t rooted_tree(const root_location_t &root) const;
   rooted_tree_t virtual_rooted_tree(const root_location_t &root) const;
   rooted_tree_t unrooted_tree() const;
 
+  /*
+   * Newick strings for the tree rooted at root, written straight from the
+   * model tree, so that we don't need to copy it first.
+   */
+  std::string rooted_newick(const root_location_t &root,
+                            bool                   annotations = true) const;
+  std::string virtual_rooted_newick(const root_location_t &root,
+                                    bool annotations = true) const;
+
   void initialize_partitions(const std::vector<msa_t> &);
   void initialize_partitions_uniform_freqs(const std::vector<msa_t> &);
 
@@ -118,11 +194,55 @@ public:
   std::vector<size_t> suggest_root_indicies_length();
   std::vector<size_t> suggest_root_indicies_modified_mad();
 
+  /*
+   * All of the roots, from the highest to the lowest lh with the current
+   * parameters. Unless the model is local, this is collective, and the lhs
+   * are only computed on rank 0, so that every rank gets the same order.
+   */
+  std::vector<size_t> suggest_root_indicies_lh();
+
   std::vector<double> compute_all_root_lh();
 
+  /*
+   * Compute the lh of every root in roots(), at the stored brlen ratio, using
+   * the directional CLVs. Requires the model to be constructed with
+   * all_edge_clvs.
+   */
+  std::vector<double> compute_all_edge_lh();
+
   void set_subst_rates(size_t, const model_params_t &);
   void set_freqs(size_t, const model_params_t &);
 
+  /* Number of partitions, as given by the MSAs, not counting the site blocks */
+  size_t partition_count() const { return _partition_blocks.size(); }
+
+  /* Number of site blocks over all partitions */
+  size_t block_count() const { return _partitions.size(); }
+
+  /* Number of copies of the blocks used to compute gradients in parallel */
+  size_t gradient_lane_count() const { return _gradient_lanes.size(); }
+
+  /* The kernel used for the tips of each partition */
+  const std::vector<tip_kernel::tip_kernel_e> &tip_kernels() const {
+    return _tip_kernels;
+  }
+
+  /* Name of the vector instructions used by the libpll kernels */
+  static std::string simd_name();
+
+  /*
+   * Estimate the memory in bytes used by the partitions of a model built with
+   * the same arguments, including the site blocks and the gradient lanes.
+   */
+  static size_t estimate_memory(const rooted_tree_t &              tree,
+                                const std::vector<msa_t> &         msas,
+                                const std::vector<ratehet_opts_t> &rate_cats,
+                                bool   all_edge_clvs,
+                                size_t site_blocks = 0,
+                                bool   screening   = false,
+                                tip_kernel::tip_kernel_e tip_kernel_mode =
+                                    tip_kernel::site_repeats);
+
   void assign_indicies(const std::vector<size_t> &);
   void assign_indicies(size_t, size_t);
   void assign_indicies(size_t beg, size_t end, std::vector<size_t> idx);
@@ -145,7 +265,116 @@ public:
 
   std::vector<size_t> assigned_indicies() const { return _assigned_idx; }
 
+  void set_newton_alpha(bool newton_alpha) { _newton_alpha = newton_alpha; }
+  void set_joint_params(bool joint_params) { _joint_params = joint_params; }
+
+  /*
+   * When set, every rank is assigned all of the remaining roots, and the roots
+   * are handed out on demand by a work_queue_t during the search instead.
+   */
+  void set_dynamic_schedule(bool dynamic_schedule) {
+    _dynamic_schedule = dynamic_schedule;
+  }
+
+  /*
+   * Give this model replicas to search with. Each replica is a fully separate
+   * model, with its own partitions and tree, and will process roots in its own
+   * thread during search and exhaustive_search. The replicas share the
+   * topology of the tree, and only keep their own root. They need to be
+   * initialized the same way as this model.
+   */
+  void set_replicas(std::vector<std::unique_ptr<model_t>> replicas);
+
+  /*
+   * When set, the parameter optimization for each root starts from the best
+   * parameters found so far on an adjacent root, instead of from uniform
+   * parameters. The roots are also ordered so that neighbors are done one
+   * after the other.
+   */
+  void set_warm_start(bool warm_start) { _warm_start = warm_start; }
+
+  /*
+   * Seed the warm start cache of the next search with the parameters of the
+   * results in checkpoint, as well as with the ones in its own checkpoint. The
+   * lh of the seeded results is dropped, so that any root which is finished in
+   * the next search is preferred over them. Bootstrap replicates use this to
+   * start from the parameters of the replicate before.
+   */
+  void seed_warm_start(checkpoint_t &checkpoint);
+
+  /*
+   * Replace the pattern weights of every partition, in this model and the
+   * replicas, keeping the tip states. weights holds a weight for every site
+   * pattern of each partition, in the order of msa_t::weights().
+   */
+  void set_pattern_weights(
+      const std::vector<std::vector<unsigned int>> &weights);
+
+  /*
+   * Replace the annotations of the tree with the fraction of the bootstrap
+   * replicates each root was the best in, indexed by root id.
+   */
+  void annotate_support(const std::vector<double> &support);
+
+  /*
+   * When positive, exhaustive_search screens each root with the best
+   * parameters found so far, and skips the full optimization of roots whose
+   * screening lh is more than the threshold below the best lh.
+   */
+  void set_prune_threshold(double threshold) { _prune_threshold = threshold; }
+
+  /*
+   * A local model is searched by this process alone, even in an MPI run, as
+   * for the jobs of batch mode. Nothing it does is collective, and this
+   * process merges and reports the results, like rank 0 does otherwise.
+   */
+  void set_local(bool local) { _local = local; }
+  size_t replica_count() const { return _replicas.size(); }
+
+  /*
+   * Stop search and exhaustive_search when the budget runs out, which is
+   * shared with the replicas. Roots which are not finished by then are not
+   * written to the checkpoint, so a resumed search starts them over. The roots
+   * are ordered by their expected payoff instead of for the warm start: by the
+   * initial root strategy for search, and by the lh with the starting
+   * parameters for exhaustive_search.
+   */
+  void set_budget(std::shared_ptr<search_budget_t> budget);
+  bool budget_exhausted() const { return _budget && _budget->exhausted(); }
+
 private:
+  void search_root(size_t        rl_index,
+                   size_t        min_roots,
+                   double        root_ratio,
+                   double        atol,
+                   double        pgtol,
+                   double        brtol,
+                   double        factor,
+                   checkpoint_t &checkpoint);
+
+  void exhaustive_root(size_t        rl_index,
+                       double        atol,
+                       double        pgtol,
+                       double        brtol,
+                       double        factor,
+                       checkpoint_t &checkpoint);
+
+  bool screen_root(size_t rl_index, double brtol, checkpoint_t &checkpoint);
+
+  void run_workers(work_queue_t &                                queue,
+                   const std::function<void(model_t &, size_t)> &func);
+
+  void start_lh_bound(checkpoint_t &checkpoint);
+  void finish_lh_bound();
+
+  void start_warm_start(checkpoint_t &checkpoint);
+  void finish_warm_start();
+  void warm_start_params(size_t                               root_id,
+                         std::vector<partition_parameters_t> &params) const;
+  void record_warm_start(size_t                                     root_id,
+                         double                                     lh,
+                         const std::vector<partition_parameters_t> &params);
+
   std::pair<root_location_t, double> bisect(const root_location_t &beg,
                                             dlh_t                  d_beg,
                                             const root_location_t &end,
@@ -171,6 +400,7 @@ private:
   void set_gamma_rates_median(size_t, double);
   void set_gamma_rates_free(size_t);
   void set_gamma_rates_free(size_t, model_params_t);
+  void set_category_rates(size_t);
   void update_invariant_sites(size_t);
   void set_tip_states(size_t, const msa_t &);
   void set_empirical_freqs(size_t);
@@ -180,6 +410,17 @@ private:
   void move_root(const root_location_t &new_root);
 
   bool update_eigen_partition(size_t partition_index);
+  void update_rate_matrices(size_t block, unsigned int scratch_matrix);
+
+  void invalidate_pmatrices(size_t p_index);
+  void invalidate_lh();
+  void count_lh_evaluations(uint64_t n = 1);
+  void flush_results(checkpoint_t &checkpoint);
+
+  bool lookup_lh(const root_location_t &root,
+                 bool                   need_dlh,
+                 lh_cache_entry_t &     entry);
+  void mark_root_clvs_stale();
 
   void
   update_pmatrix_partition(size_t                           partition_index,
@@ -195,6 +436,26 @@ private:
                               const std::vector<unsigned int> &pmatrix_indices,
                               const std::vector<double> &      branch_lengths);
 
+  void copy_params_to_lane(size_t partition_index, size_t lane);
+
+  void                copy_params_to_screening();
+  std::vector<double> compute_screening_lh();
+
+  double compute_lh_lane(size_t                              partition_index,
+                         size_t                              lane,
+                         const std::vector<pll_operation_t> &ops,
+                         const std::vector<unsigned int> &   pmatrix_indices,
+                         const std::vector<double> &         branch_lengths);
+
+  void compute_lh_partition_batch(
+      size_t                                                     partition_index,
+      const std::vector<model_params_t> &                        points,
+      const std::function<void(size_t, const model_params_t &)> &set_func,
+      const std::vector<pll_operation_t> &                       ops,
+      const std::vector<unsigned int> &pmatrix_indices,
+      const std::vector<double> &      branch_lengths,
+      std::vector<double> &            lh);
+
   double bfgs_rates(model_params_t &                    initial_rates,
                     const std::vector<pll_operation_t> &ops,
                     const std::vector<unsigned int>     pmatrix_indices,
@@ -243,6 +504,15 @@ private:
                           const root_location_t &rl,
                           size_t                 partition_index);
 
+  double bfgs_joint(partition_parameters_t &            params,
+                    const std::vector<pll_operation_t> &ops,
+                    const std::vector<unsigned int>     pmatrix_indices,
+                    const std::vector<double>           branch_lengths,
+                    size_t                              partition_index,
+                    bool                                optimize_gamma,
+                    double                              pgtol,
+                    double                              factor);
+
   void optimize_params(std::vector<partition_parameters_t> &params,
                        const root_location_t &              rl,
                        double                               pgtol,
@@ -254,27 +524,138 @@ private:
 
   std::pair<size_t, size_t> compute_chunk_size_mod(size_t num_tasks) const;
 
+  unsigned int all_edge_clv_base() const {
+    return _tree.tip_count() + _tree.inner_clv_count();
+  }
+  int all_edge_scaler_base() const {
+    return static_cast<int>(_tree.inner_clv_count());
+  }
+  unsigned int batch_pmatrix_base() const {
+    return _tree.branch_count() + _derivative_pmatrices;
+  }
+  unsigned int all_edge_pmatrix_base() const {
+    return batch_pmatrix_base() + _batch_pmatrices;
+  }
+  unsigned int all_edge_split_pmatrix_base() const {
+    return all_edge_pmatrix_base()
+           + static_cast<unsigned int>(_tree.root_count());
+  }
+
+  static unsigned int clv_buffer_count(const rooted_tree_t &tree,
+                                       bool                 all_edge_clvs);
+  static unsigned int pmatrix_count(const rooted_tree_t &tree,
+                                    bool                 all_edge_clvs);
+
+  const pll_partition_t *first_block(size_t partition_index) const {
+    return _partitions[_partition_blocks[partition_index].front()];
+  }
+
+  std::vector<pll_partition_t *> block_and_lanes(size_t block) const;
+
   partition_parameters_t make_partition_parameters(
       size_t states, rate_category::rate_category_e rc, size_t rate_cat_count);
 
-  rooted_tree_t                               _tree;
+  rooted_tree_t _tree;
+
+  /*
+   * Each partition is split into one or more blocks of sites, which are
+   * separate libpll partitions. _partitions holds all of the blocks, and
+   * _partition_blocks lists the blocks of each partition. The parameters below
+   * are stored per partition, except for _param_indicies, _block_offsets and
+   * _pmatrix_caches, which are per block.
+   */
+  /* Computes the partitions, the blocks, the lanes and the screening blocks */
+  std::unique_ptr<lh_backend_t>               _backend;
   std::vector<pll_partition_t *>              _partitions;
+  std::vector<std::vector<size_t>>            _partition_blocks;
+  std::vector<unsigned int>                   _block_offsets;
+  /* Partitions and blocks from the most to the least expensive */
+  std::vector<size_t>                         _partition_order;
+  std::vector<size_t>                         _block_order;
   std::vector<rate_category::rate_category_e> _rate_category_types;
   std::vector<double>                         _partition_weights;
   std::vector<model_params_t>                 _rate_rates;
   std::vector<model_params_t>                 _rate_weights;
   std::vector<bool>                           _rate_user_init;
+  std::vector<std::vector<unsigned int>>      _rate_param_indicies;
   std::vector<std::vector<unsigned int>>      _param_indicies;
+  std::vector<pmatrix_cache_t>                _pmatrix_caches;
+
+  /* Reused by compute_lh_root, compute_d2lh and move_root */
+  operation_plan_t _root_plan;
+
+  /*
+   * The lh, and the derivative, of the root locations computed with the
+   * current parameters. Anything which changes the lh of a root has to bump
+   * _lh_version through invalidate_lh.
+   */
+  lh_cache_t _lh_cache;
+  uint64_t   _lh_version = 1;
+
+  /*
+   * Copies of the blocks, used to compute the perturbed lh values for a
+   * finite difference gradient in parallel. The tips are set on every lane
+   * along with the blocks, through block_and_lanes, and the rest of the
+   * parameters are copied before each use. Indexed by lane, then by block.
+   */
+  std::vector<std::vector<pll_partition_t *>> _gradient_lanes;
+  /*
+   * Copies of the blocks with a single rate category, used to rank the roots
+   * in suggest_roots_lh for a fraction of the cost. Indexed by block, and only
+   * made when the model is constructed with screening.
+   */
+  std::vector<pll_partition_t *>              _screening_blocks;
+  std::vector<tip_kernel::tip_kernel_e>       _tip_kernels;
   std::vector<size_t>                         _assigned_idx;
+  std::vector<std::unique_ptr<model_t>>       _replicas;
+  std::shared_ptr<warm_start_cache_t>         _warm_start_cache;
+  std::shared_ptr<warm_start_cache_t>         _warm_start_seed;
+  std::shared_ptr<lh_bound_t>                 _lh_bound;
+  std::shared_ptr<search_budget_t>            _budget;
   std::minstd_rand                            _random_engine;
   bool                                        _invariant_sites;
   uint64_t                                    _seed;
   bool                                        _early_stop;
+  bool                                        _all_edge_clvs;
+  bool                                        _newton_alpha     = false;
+  bool                                        _joint_params     = false;
+  bool                                        _dynamic_schedule = false;
+  bool                                        _warm_start       = false;
+  double                                      _prune_threshold  = 0.0;
+  bool                                        _local            = false;
   /*
    * Only one submodel will be used for the time being. If there is desire for
    * more, we can add support for more models..
    */
   static constexpr unsigned int _submodels = 1;
+
+  /*
+   * Extra probability matrix, past the ones used by the tree, which holds the
+   * short branch that the rate matrices are recovered from.
+   */
+  static constexpr unsigned int _derivative_pmatrices = 1;
+
+  /*
+   * Stopping tolerance on the derivative of the lh for the Newton steps in
+   * optimize_root_location. The derivatives are only exact up to the rounding
+   * of the sum over the sites, so it can't be much tighter than this.
+   */
+  static constexpr double _newton_alpha_atol = 1e-7;
+
+  /*
+   * Number of brlen ratios that compute_dlh_batch evaluates in one pass, and
+   * the pmatrices that go with them. Each ratio needs the two root branches at
+   * the ratio itself, and at the ratio shifted for the secant.
+   */
+  static constexpr unsigned int _batch_ratios    = 16;
+  static constexpr unsigned int _batch_pmatrices = 4 * _batch_ratios;
+
+  /*
+   * Smallest number of site patterns in a block when the number of blocks is
+   * picked automatically. Below this, the overhead of the extra partitions is
+   * larger than the gain from the extra threads.
+   */
+  static constexpr size_t _min_block_sites = 1000;
 };
 
 #endif
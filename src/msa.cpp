@@ -2,12 +2,20 @@
 #include "msa.hpp"
 #include "pll.h"
 #include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <fcntl.h>
 #include <fstream>
 #include <functional>
 #include <limits>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <vector>
 
 extern "C" {
@@ -87,6 +95,43 @@ pll_msa_t *parse_msa_file(const std::string &msa_filename) {
   throw std::invalid_argument("Could not parse msa file");
 }
 
+pll_msa_t *make_msa(const std::vector<std::string> &labels,
+                    const std::vector<std::string> &sequences) {
+  if (labels.size() != sequences.size()) {
+    throw std::invalid_argument("Need a label for every sequence");
+  }
+  if (sequences.empty()) {
+    throw std::invalid_argument("Can't make an MSA without sequences");
+  }
+  if (sequences.size() > static_cast<size_t>(std::numeric_limits<int>::max())
+      || sequences[0].size()
+             > static_cast<size_t>(std::numeric_limits<int>::max())) {
+    throw std::runtime_error("The MSA is too large to cast safely");
+  }
+  for (auto &sequence : sequences) {
+    if (sequence.size() != sequences[0].size()) {
+      throw std::invalid_argument("Sequences don't match in size");
+    }
+  }
+
+  auto copy_string = [](const std::string &str) {
+    char *copy = (char *)malloc(str.size() + 1);
+    memcpy(copy, str.c_str(), str.size() + 1);
+    return copy;
+  };
+
+  pll_msa_t *pll_msa = (pll_msa_t *)malloc(sizeof(pll_msa_t));
+  pll_msa->count     = static_cast<int>(sequences.size());
+  pll_msa->length    = static_cast<int>(sequences[0].size());
+  pll_msa->sequence  = (char **)malloc(sizeof(char *) * sequences.size());
+  pll_msa->label     = (char **)malloc(sizeof(char *) * sequences.size());
+  for (size_t i = 0; i < sequences.size(); ++i) {
+    pll_msa->sequence[i] = copy_string(sequences[i]);
+    pll_msa->label[i]    = copy_string(labels[i]);
+  }
+  return pll_msa;
+}
+
 /* Given a character, looks for the next instance of that character. If the
  * another character is encountered that isn't the specified one, the function
  * throws an exception. Ignores spaces The the returned iterator is one past the
@@ -514,70 +559,8 @@ msa_partitions_t parse_partition_file(const std::string &filename) {
   return parts;
 }
 
-msa_t::msa_t(const msa_t &other, const partition_info_t &partition) {
-  _msa         = (pll_msa_t *)malloc(sizeof(pll_msa_t));
-  _msa->count  = other.count();
-  _msa->length = 0;
-  for (auto range : partition.parts) {
-    /*
-     * Since the range specification is [first, second], we have to add one to
-     * include the endpoint
-     */
-    size_t cur_partition_length = (range.second - range.first) + 1;
-    if (cur_partition_length
-        > static_cast<size_t>(std::numeric_limits<int>::max())) {
-      throw std::runtime_error("Partition range is too large to cast safely");
-    }
-    _msa->length += static_cast<int>(cur_partition_length);
-    debug_print(EMIT_LEVEL_DEBUG, "%d", _msa->length);
-  }
-
-  if (other.count() < 0) {
-    throw std::runtime_error("MSA from which we are copy constructing has a "
-                             "negative count (overflow?)");
-  }
-
-  _msa->sequence = (char **)malloc(static_cast<size_t>(sizeof(char *))
-                                   * static_cast<size_t>(other.count()));
-
-  for (int i = 0; i < other.count(); ++i) {
-    if (_msa->length <= 0) {
-      throw std::runtime_error(
-          "The size of the MSA is less than 0 (overflow?)");
-    }
-
-    // We need to make space for the terminating zero
-    _msa->sequence[i]     = (char *)malloc(static_cast<size_t>(sizeof(char))
-                                       * static_cast<size_t>(_msa->length + 1));
-    size_t cur_idx        = 0;
-    char * other_sequence = other.sequence(i);
-    for (auto range : partition.parts) {
-      if (range.first == 0) {
-        throw std::runtime_error(
-            "Partition ranges start at 1, but we encountered a 0");
-      }
-      for (size_t j = range.first - 1; j < range.second; ++j) {
-        _msa->sequence[i][cur_idx++] = other_sequence[j];
-      }
-    }
-  }
-
-  if (_msa->count < 0) {
-    throw std::runtime_error(
-        "The current MSA count is less than 0 (overflow?)");
-  }
-  _msa->label =
-      (char **)calloc(sizeof(char *), static_cast<size_t>(_msa->count));
-  for (int i = 0; i < _msa->count; ++i) {
-    size_t label_size = strlen(other.label(i)) + 1;
-    _msa->label[i]    = (char *)malloc(sizeof(char) * label_size);
-    strncpy(_msa->label[i], other.label(i), label_size);
-  }
-  _map     = other.map();
-  _states  = other.states();
-  _weights = nullptr;
-  compress();
-}
+msa_t::msa_t(const msa_t &other, const partition_info_t &partition) :
+    msa_t(std::move(other.partition(msa_partitions_t{partition})[0])) {}
 
 char *msa_t::sequence(int index) const {
   if (index < _msa->count && !(index < 0)) return _msa->sequence[index];
@@ -612,6 +595,13 @@ unsigned int msa_t::length() const {
 }
 
 void msa_t::compress() {
+  if (_storage) {
+    throw std::logic_error("A partitioned or cached MSA is already compressed");
+  }
+  compress_patterns();
+}
+
+void msa_t::compress_patterns() {
   if (_weights != nullptr) { free(_weights); }
   int new_length = _msa->length;
   _weights       = pll_compress_site_patterns(
@@ -624,9 +614,103 @@ void msa_t::compress() {
 }
 
 std::vector<msa_t> msa_t::partition(const msa_partitions_t &ps) const {
+  if (_msa->count <= 0) {
+    throw std::runtime_error("Can't partition an MSA without sequences");
+  }
+  size_t count = static_cast<size_t>(_msa->count);
+
+  /*
+   * The buffer holds a block of count rows for each partition, with a zero
+   * after each row, followed by one copy of the labels.
+   */
+  std::vector<size_t> offsets(ps.size() + 1, 0);
+  for (size_t p = 0; p < ps.size(); ++p) {
+    size_t length = 0;
+    for (auto range : ps[p].parts) {
+      if (range.first == 0) {
+        throw std::runtime_error(
+            "Partition ranges start at 1, but we encountered a 0");
+      }
+      if (range.second < range.first
+          || range.second > static_cast<size_t>(_msa->length)) {
+        throw std::runtime_error("Partition " + ps[p].partition_name
+                                 + " has a range outside of the MSA");
+      }
+      /*
+       * Since the range specification is [first, second], we have to add one
+       * to include the endpoint
+       */
+      length += (range.second - range.first) + 1;
+    }
+    if (length > static_cast<size_t>(std::numeric_limits<int>::max())) {
+      throw std::runtime_error("Partition range is too large to cast safely");
+    }
+    offsets[p + 1] = offsets[p] + count * (length + 1);
+  }
+
+  size_t labels_size = 0;
+  for (size_t i = 0; i < count; ++i) {
+    labels_size += strlen(_msa->label[i]) + 1;
+  }
+
+  std::shared_ptr<char> buffer{
+      static_cast<char *>(malloc(offsets.back() + labels_size)), free};
+  if (!buffer) { throw std::bad_alloc(); }
+
+  std::vector<char *> labels(count);
+  char *              label_ptr = buffer.get() + offsets.back();
+  for (size_t i = 0; i < count; ++i) {
+    size_t label_size = strlen(_msa->label[i]) + 1;
+    memcpy(label_ptr, _msa->label[i], label_size);
+    labels[i] = label_ptr;
+    label_ptr += label_size;
+  }
+
   std::vector<msa_t> parted_msa;
   parted_msa.reserve(ps.size());
-  for (auto p : ps) { parted_msa.emplace_back(*this, p); }
+  for (size_t p = 0; p < ps.size(); ++p) {
+    size_t     length = (offsets[p + 1] - offsets[p]) / count - 1;
+    pll_msa_t *msa    = (pll_msa_t *)malloc(sizeof(pll_msa_t));
+    msa->count        = _msa->count;
+    msa->length       = static_cast<int>(length);
+    msa->sequence     = (char **)malloc(sizeof(char *) * count);
+    msa->label        = (char **)malloc(sizeof(char *) * count);
+    for (size_t i = 0; i < count; ++i) {
+      msa->sequence[i] = buffer.get() + offsets[p] + i * (length + 1);
+      msa->label[i]    = labels[i];
+    }
+    parted_msa.push_back(msa_t{msa, _map, nullptr, _states, buffer});
+  }
+
+  /*
+   * The partitions only write to their own block, so they can be filled in
+   * and compressed independently. Exceptions can't leave the parallel region,
+   * so the first one is kept and thrown afterwards.
+   */
+  std::exception_ptr error;
+#pragma omp parallel for schedule(dynamic)
+  for (size_t p = 0; p < ps.size(); ++p) {
+    try {
+      for (size_t i = 0; i < count; ++i) {
+        char *row = parted_msa[p].sequence(static_cast<int>(i));
+        for (auto range : ps[p].parts) {
+          size_t range_length = range.second - range.first + 1;
+          memcpy(row, _msa->sequence[i] + range.first - 1, range_length);
+          row += range_length;
+        }
+        *row = '\0';
+      }
+      parted_msa[p].compress_patterns();
+    } catch (...) {
+#pragma omp critical
+      if (!error) { error = std::current_exception(); }
+    }
+  }
+  if (error) { std::rethrow_exception(error); }
+
+  debug_print(EMIT_LEVEL_DEBUG,
+              "Partitioned the MSA into %lu partitions",
+              parted_msa.size());
   return parted_msa;
 }
 
@@ -678,6 +762,223 @@ void msa_t::valid_data() const {
 }
 
 msa_t::~msa_t() {
+  if (_storage) {
+    /* The sequences and labels belong to the shared storage */
+    if (_msa) {
+      free(_msa->sequence);
+      free(_msa->label);
+      free(_msa);
+    }
+    if (_weights) free(_weights);
+    return;
+  }
   if (_msa) pll_msa_destroy(_msa);
   if (_weights) free(_weights);
 }
+
+/*
+ * Layout of the cache file. Every section starts on an 8 byte boundary.
+ *
+ *   msa_cache_header_t
+ *   for each partition:
+ *     msa_cache_partition_t
+ *     weights, length unsigned ints
+ *     labels, count zero terminated strings, labels_size bytes in total
+ *     sequences, count zero terminated strings of length characters
+ */
+constexpr char     MSA_CACHE_MAGIC[8] = {'R', 'D', 'M', 'S', 'A', 'C', 0, 0};
+constexpr uint64_t MSA_CACHE_VERSION  = 1;
+
+struct msa_cache_header_t {
+  char     magic[8];
+  uint64_t version;
+  uint64_t partitions;
+};
+
+struct msa_cache_partition_t {
+  uint64_t count;
+  uint64_t length;
+  uint64_t states;
+  uint64_t labels_size;
+};
+
+static inline size_t msa_cache_pad(size_t size) { return (size + 7) & ~7ul; }
+
+struct mapped_file_t {
+  void * data = nullptr;
+  size_t size = 0;
+
+  ~mapped_file_t() {
+    if (data) { munmap(data, size); }
+  }
+};
+
+msa_t::msa_t(pll_msa_t *                  msa,
+             const pll_state_t *          map,
+             unsigned int *               weights,
+             unsigned int                 states,
+             const std::shared_ptr<void> &storage) :
+    _msa{msa},
+    _map{map},
+    _weights{weights},
+    _states{states},
+    _storage{storage} {}
+
+static void
+write_padded(std::ofstream &outfile, const char *data, size_t size) {
+  static const char zeros[8] = {0};
+  outfile.write(data, static_cast<std::streamsize>(size));
+  outfile.write(zeros,
+                static_cast<std::streamsize>(msa_cache_pad(size) - size));
+}
+
+void msa_t::write_cache(const std::string &       filename,
+                        const std::vector<msa_t> &msas) {
+  /* Write to a temporary file, so that a reader never sees a partial cache */
+  std::string   tmp_filename = filename + ".tmp";
+  std::ofstream outfile{tmp_filename, std::ios::binary | std::ios::trunc};
+  if (!outfile) {
+    throw std::runtime_error("Failed to open the MSA cache " + tmp_filename);
+  }
+
+  msa_cache_header_t header;
+  memcpy(header.magic, MSA_CACHE_MAGIC, sizeof(header.magic));
+  header.version    = MSA_CACHE_VERSION;
+  header.partitions = msas.size();
+  write_padded(
+      outfile, reinterpret_cast<const char *>(&header), sizeof(header));
+
+  for (auto &msa : msas) {
+    if (!msa._weights) {
+      throw std::runtime_error("Only compressed MSAs can be cached");
+    }
+    std::string labels;
+    for (int i = 0; i < msa.count(); ++i) {
+      labels += msa.label(i);
+      labels.push_back('\0');
+    }
+
+    msa_cache_partition_t part;
+    part.count       = static_cast<uint64_t>(msa.count());
+    part.length      = msa.length();
+    part.states      = msa.states();
+    part.labels_size = labels.size();
+    write_padded(outfile, reinterpret_cast<const char *>(&part), sizeof(part));
+    write_padded(outfile,
+                 reinterpret_cast<const char *>(msa._weights),
+                 sizeof(unsigned int) * msa.length());
+    write_padded(outfile, labels.data(), labels.size());
+
+    std::string sequences;
+    sequences.reserve(part.count * (part.length + 1));
+    for (int i = 0; i < msa.count(); ++i) {
+      sequences.append(msa.sequence(i), msa.length());
+      sequences.push_back('\0');
+    }
+    write_padded(outfile, sequences.data(), sequences.size());
+  }
+
+  outfile.close();
+  if (!outfile) {
+    throw std::runtime_error("Failed to write the MSA cache " + tmp_filename);
+  }
+  if (std::rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+    throw std::runtime_error("Failed to move the MSA cache to " + filename);
+  }
+}
+
+std::vector<msa_t> msa_t::read_cache(const std::string &filename,
+                                     const pll_state_t *map) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd == -1) {
+    throw std::runtime_error("Failed to open the MSA cache " + filename);
+  }
+  struct stat statbuf;
+  if (fstat(fd, &statbuf) == -1) {
+    close(fd);
+    throw std::runtime_error("Failed to stat the MSA cache " + filename);
+  }
+
+  auto mapping  = std::make_shared<mapped_file_t>();
+  mapping->size = static_cast<size_t>(statbuf.st_size);
+  void *data    = mmap(nullptr,
+                    mapping->size,
+                    PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE,
+                    fd,
+                    0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    throw std::runtime_error("Failed to map the MSA cache " + filename);
+  }
+  mapping->data = data;
+
+  char * base   = static_cast<char *>(data);
+  size_t offset = 0;
+  auto   take   = [&](size_t size) -> char * {
+    if (size > mapping->size || offset > mapping->size - size) {
+      throw std::runtime_error("The MSA cache " + filename + " is truncated");
+    }
+    char *ptr = base + offset;
+    offset += msa_cache_pad(size);
+    return ptr;
+  };
+
+  auto header =
+      reinterpret_cast<msa_cache_header_t *>(take(sizeof(msa_cache_header_t)));
+  if (memcmp(header->magic, MSA_CACHE_MAGIC, sizeof(header->magic)) != 0
+      || header->version != MSA_CACHE_VERSION) {
+    throw std::runtime_error(filename + " is not an MSA cache, or was written "
+                                        "by a different version");
+  }
+
+  std::vector<msa_t> msas;
+  msas.reserve(header->partitions);
+  for (uint64_t p = 0; p < header->partitions; ++p) {
+    auto part = reinterpret_cast<msa_cache_partition_t *>(
+        take(sizeof(msa_cache_partition_t)));
+    if (part->count == 0 || part->length == 0
+        || part->count > static_cast<uint64_t>(std::numeric_limits<int>::max())
+        || part->length
+               > static_cast<uint64_t>(std::numeric_limits<int>::max())) {
+      throw std::runtime_error("The MSA cache " + filename + " is corrupt");
+    }
+    size_t weights_size   = sizeof(unsigned int) * part->length;
+    char * mapped_weights = take(weights_size);
+    char * labels         = take(part->labels_size);
+    char * sequences      = take(part->count * (part->length + 1));
+
+    /* The weights are small, and are freed with the MSA like any other */
+    auto weights = (unsigned int *)malloc(weights_size);
+    memcpy(weights, mapped_weights, weights_size);
+
+    pll_msa_t *msa = (pll_msa_t *)malloc(sizeof(pll_msa_t));
+    msa->count     = static_cast<int>(part->count);
+    msa->length    = static_cast<int>(part->length);
+    msa->sequence  = (char **)malloc(sizeof(char *) * part->count);
+    msa->label     = (char **)malloc(sizeof(char *) * part->count);
+    msas.push_back(msa_t{msa,
+                         map,
+                         weights,
+                         static_cast<unsigned int>(part->states),
+                         mapping});
+
+    char *label_end = labels + part->labels_size;
+    for (uint64_t i = 0; i < part->count; ++i) {
+      if (labels >= label_end
+          || memchr(labels, '\0', static_cast<size_t>(label_end - labels))
+                 == nullptr) {
+        throw std::runtime_error("The MSA cache " + filename
+                                 + " has a corrupt label");
+      }
+      msa->label[i] = labels;
+      labels += strlen(labels) + 1;
+      msa->sequence[i] = sequences + i * (part->length + 1);
+    }
+  }
+  debug_print(EMIT_LEVEL_DEBUG,
+              "Mapped %lu partitions from the MSA cache %s",
+              msas.size(),
+              filename.c_str());
+  return msas;
+}
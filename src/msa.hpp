@@ -7,6 +7,8 @@ extern "C" {
 
 #include "debug.h"
 #include "util.hpp"
+#include <memory>
+#include <stdexcept>
 #include <string>
 #include <unordered_set>
 #include <vector>
@@ -14,6 +16,14 @@ extern "C" {
 typedef std::vector<partition_info_t> msa_partitions_t;
 
 pll_msa_t *      parse_msa_file(const std::string &msa_filename);
+
+/*
+ * Build an MSA from sequences which are already in memory, without going
+ * through a file. The sequences all need to be the same length, and are
+ * copied into the MSA, which is owned by the caller.
+ */
+pll_msa_t *make_msa(const std::vector<std::string> &labels,
+                    const std::vector<std::string> &sequences);
 msa_partitions_t parse_partition_file(const std::string &filename);
 partition_info_t parse_partition_info(const std::string &line);
 model_info_t     parse_model_info(const std::string &line);
@@ -24,8 +34,25 @@ public:
         const pll_state_t *map      = pll_map_nt,
         unsigned int       states   = 4,
         bool               compress = true) :
-      _msa{nullptr}, _map(map), _weights{nullptr}, _states(states) {
-    _msa = parse_msa_file(msa_filename);
+      msa_t(parse_msa_file(msa_filename), map, states, compress){};
+
+  msa_t(const std::vector<std::string> &labels,
+        const std::vector<std::string> &sequences,
+        const pll_state_t *             map      = pll_map_nt,
+        unsigned int                    states   = 4,
+        bool                            compress = true) :
+      msa_t(make_msa(labels, sequences), map, states, compress){};
+
+  /*
+   * Take ownership of an MSA which is already in memory, without copying the
+   * sequences. When compress is set, the sequences are compressed in place.
+   */
+  msa_t(pll_msa_t *        msa,
+        const pll_state_t *map      = pll_map_nt,
+        unsigned int       states   = 4,
+        bool               compress = true) :
+      _msa{msa}, _map(map), _weights{nullptr}, _states(states) {
+    if (_msa == nullptr) { throw std::invalid_argument("The MSA is empty"); }
     if (compress) {
       _weights = pll_compress_site_patterns(
           _msa->sequence, map, _msa->count, &(_msa->length));
@@ -41,7 +68,11 @@ public:
       _msa(other._msa),
       _map(other._map),
       _weights(other._weights),
-      _states(other._states) {}
+      _states(other._states),
+      _storage(std::move(other._storage)) {
+    other._msa     = nullptr;
+    other._weights = nullptr;
+  }
 
   char *             sequence(int) const;
   char *             label(int) const;
@@ -51,20 +82,56 @@ public:
   unsigned int       states() const;
   int                count() const;
   unsigned int       length() const;
+  /*
+   * Split the MSA into partitions, and compress them concurrently. The
+   * partitions are views into a single buffer, with one block of rows per
+   * partition, instead of each holding its own copy of the sequences.
+   */
   std::vector<msa_t> partition(const msa_partitions_t &) const;
 
   void compress();
 
+  /*
+   * Write the MSAs, which should already be compressed and partitioned, to a
+   * binary cache file. The cache holds the patterns, weights and labels of
+   * each partition, in the byte order of the machine that wrote it.
+   */
+  static void write_cache(const std::string &       filename,
+                          const std::vector<msa_t> &msas);
+
+  /*
+   * Map a cache written by write_cache, without parsing or compressing the
+   * MSA again. The mapping is private and shared by all the returned MSAs, so
+   * processes on the same host share the pages of the file until they are
+   * written to.
+   */
+  static std::vector<msa_t> read_cache(const std::string &filename,
+                                       const pll_state_t *map = pll_map_nt);
+
   bool constiency_check(std::unordered_set<std::string>) const;
   void valid_data() const;
 
   ~msa_t();
 
 private:
+  msa_t(pll_msa_t *                   msa,
+        const pll_state_t *           map,
+        unsigned int *                weights,
+        unsigned int                  states,
+        const std::shared_ptr<void> &storage);
+
+  void compress_patterns();
+
   pll_msa_t *        _msa;
   const pll_state_t *_map;
   unsigned int *     _weights;
   unsigned int       _states;
+
+  /*
+   * Set when the sequences and labels point into storage shared with other
+   * MSAs, either a partition buffer or a cache file
+   */
+  std::shared_ptr<void> _storage;
 };
 
 #endif
@@ -0,0 +1,48 @@
+#include "partition_schedule.hpp"
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <stdexcept>
+
+double partition_cost(size_t sites, size_t states, size_t rate_cats) {
+  return static_cast<double>(sites) * static_cast<double>(states * states)
+         * static_cast<double>(rate_cats);
+}
+
+std::vector<size_t> partition_site_blocks(const std::vector<double> &costs,
+                                          const std::vector<size_t> &sites,
+                                          size_t site_blocks,
+                                          size_t threads,
+                                          size_t min_block_sites) {
+  if (costs.size() != sites.size()) {
+    throw std::invalid_argument{"Need a cost for every partition"};
+  }
+
+  double total_cost = std::accumulate(costs.begin(), costs.end(), 0.0);
+  threads           = std::max<size_t>(threads, 1);
+
+  std::vector<size_t> blocks(costs.size());
+  for (size_t i = 0; i < costs.size(); ++i) {
+    size_t count = site_blocks;
+    if (count == 0) {
+      /*
+       * The slack keeps partitions which are exactly a thread's share from
+       * being split in two by rounding.
+       */
+      double share = total_cost > 0.0 ? costs[i] * threads / total_cost : 1.0;
+      count        = static_cast<size_t>(std::ceil(share - 1e-6));
+      count        = std::min(count, sites[i] / min_block_sites);
+    }
+    blocks[i] = std::max<size_t>(1, std::min(count, sites[i]));
+  }
+  return blocks;
+}
+
+std::vector<size_t> longest_first(const std::vector<double> &costs) {
+  std::vector<size_t> order(costs.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return costs[a] > costs[b];
+  });
+  return order;
+}
@@ -0,0 +1,35 @@
+#ifndef RD_PARTITION_SCHEDULE_HPP_
+#define RD_PARTITION_SCHEDULE_HPP_
+
+#include <cstddef>
+#include <vector>
+
+/*
+ * Relative cost of computing the partials of a partition, which is the number
+ * of site patterns, the number of rate categories, and the square of the
+ * number of states, from the matrix vector products.
+ */
+double partition_cost(size_t sites, size_t states, size_t rate_cats);
+
+/*
+ * Pick the number of site blocks for each partition. If site_blocks is given,
+ * every partition is split into that many blocks. Otherwise, each partition is
+ * split so that no block is much more than a thread's share of the total cost,
+ * which spreads out a few small partitions over the threads, and keeps one big
+ * partition from holding up all of the others. Blocks are never made smaller
+ * than min_block_sites by the automatic splitting.
+ */
+std::vector<size_t> partition_site_blocks(const std::vector<double> &costs,
+                                          const std::vector<size_t> &sites,
+                                          size_t site_blocks,
+                                          size_t threads,
+                                          size_t min_block_sites);
+
+/*
+ * Indices of the costs from the most to the least expensive, with ties kept in
+ * index order. Handing out work in this order with a dynamic schedule keeps a
+ * long job from being started last.
+ */
+std::vector<size_t> longest_first(const std::vector<double> &costs);
+
+#endif
@@ -0,0 +1,136 @@
+#include "profile.hpp"
+#include <fstream>
+#include <stdexcept>
+
+namespace profile {
+bool                  _enabled = false;
+std::atomic<uint64_t> _counters[counter_count];
+
+static std::atomic<uint64_t> _phase_nanoseconds[phase_count];
+static std::atomic<uint64_t> _phase_calls[phase_count];
+static thread_local size_t   _phase_depth[phase_count];
+
+void enable() {
+  reset();
+  _enabled = true;
+}
+
+void disable() { _enabled = false; }
+
+void reset() {
+  for (auto &c : _counters) { c = 0; }
+  for (auto &t : _phase_nanoseconds) { t = 0; }
+  for (auto &c : _phase_calls) { c = 0; }
+}
+
+bool enabled() { return _enabled; }
+
+uint64_t counter_value(counter_e counter) { return _counters[counter]; }
+
+double phase_seconds(phase_e phase) {
+  return static_cast<double>(_phase_nanoseconds[phase]) * 1e-9;
+}
+
+uint64_t phase_calls(phase_e phase) { return _phase_calls[phase]; }
+
+double hit_rate(counter_e hits, counter_e misses) {
+  uint64_t lookups = counter_value(hits) + counter_value(misses);
+  if (lookups == 0) { return 0.0; }
+  return static_cast<double>(counter_value(hits))
+         / static_cast<double>(lookups);
+}
+
+std::string counter_name(counter_e counter) {
+  switch (counter) {
+  case lh_evaluations:
+    return "lh_evaluations";
+  case derivative_evaluations:
+    return "derivative_evaluations";
+  case pmatrix_updates:
+    return "pmatrix_updates";
+  case pmatrix_cache_hits:
+    return "pmatrix_cache_hits";
+  case partial_updates:
+    return "partial_updates";
+  case eigen_updates:
+    return "eigen_updates";
+  case bfgs_iterations:
+    return "bfgs_iterations";
+  case joint_optimizations:
+    return "joint_optimizations";
+  case gd_iterations:
+    return "gd_iterations";
+  case brents_steps:
+    return "brents_steps";
+  case bisect_steps:
+    return "bisect_steps";
+  case newton_steps:
+    return "newton_steps";
+  case pruned_roots:
+    return "pruned_roots";
+  case lh_cache_hits:
+    return "lh_cache_hits";
+  case lh_cache_misses:
+    return "lh_cache_misses";
+  default:
+    throw std::invalid_argument("Unknown profile counter");
+  }
+}
+
+std::string phase_name(phase_e phase) {
+  switch (phase) {
+  case param_optimization:
+    return "param_optimization";
+  case root_ranking:
+    return "root_ranking";
+  case alpha_optimization:
+    return "alpha_optimization";
+  case checkpoint_io:
+    return "checkpoint_io";
+  case mpi_wait:
+    return "mpi_wait";
+  default:
+    throw std::invalid_argument("Unknown profile phase");
+  }
+}
+
+void write_report(const std::string &filename, int rank) {
+  std::ofstream outfile{filename};
+  if (!outfile) {
+    throw std::runtime_error("Failed to open the profile report " + filename);
+  }
+  outfile << "rank\tkind\tname\tvalue\n";
+  for (size_t i = 0; i < counter_count; ++i) {
+    auto counter = static_cast<counter_e>(i);
+    outfile << rank << "\tcounter\t" << counter_name(counter) << "\t"
+            << counter_value(counter) << "\n";
+  }
+  outfile << rank << "\trate\tlh_cache_hits\t"
+          << hit_rate(lh_cache_hits, lh_cache_misses) << "\n";
+  for (size_t i = 0; i < phase_count; ++i) {
+    auto phase = static_cast<phase_e>(i);
+    outfile << rank << "\tseconds\t" << phase_name(phase) << "\t"
+            << phase_seconds(phase) << "\n";
+    outfile << rank << "\tcalls\t" << phase_name(phase) << "\t"
+            << phase_calls(phase) << "\n";
+  }
+}
+
+phase_timer_t::phase_timer_t(phase_e phase) :
+    _phase{phase}, _entered{_enabled}, _running{false} {
+  if (!_entered) { return; }
+  _running = _phase_depth[_phase]++ == 0;
+  if (_running) { _start = clock_t::now(); }
+}
+
+phase_timer_t::~phase_timer_t() {
+  if (!_entered) { return; }
+  _phase_depth[_phase]--;
+  if (_running) {
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        clock_t::now() - _start);
+    _phase_nanoseconds[_phase] += static_cast<uint64_t>(elapsed.count());
+    _phase_calls[_phase] += 1;
+  }
+}
+} // namespace profile
@@ -0,0 +1,105 @@
+#ifndef RD_PROFILE_HPP
+#define RD_PROFILE_HPP
+#ifdef MPI_BUILD
+#include <mpi.h>
+#endif
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+/*
+ * Counters and timers for the hot paths, which are turned on with --profile.
+ * When profiling is off, a counter costs a load and a branch, and a timer does
+ * not read the clock.
+ *
+ * The counters are shared by all the threads of a process. The timers add up
+ * the wall time spent in a phase by every thread, so a threaded phase can add
+ * up to more than the run time. A phase entered again by the same thread, for
+ * example optimize_alpha_newton falling back to optimize_alpha, is only timed
+ * once.
+ */
+namespace profile {
+enum counter_e {
+  lh_evaluations,
+  derivative_evaluations,
+  pmatrix_updates,
+  pmatrix_cache_hits,
+  partial_updates,
+  eigen_updates,
+  bfgs_iterations,
+  joint_optimizations,
+  gd_iterations,
+  brents_steps,
+  bisect_steps,
+  newton_steps,
+  pruned_roots,
+  lh_cache_hits,
+  lh_cache_misses,
+  counter_count,
+};
+
+enum phase_e {
+  param_optimization,
+  root_ranking,
+  alpha_optimization,
+  checkpoint_io,
+  mpi_wait,
+  phase_count,
+};
+
+extern bool                  _enabled;
+extern std::atomic<uint64_t> _counters[counter_count];
+
+void enable();
+void disable();
+void reset();
+bool enabled();
+
+inline void count(counter_e counter, uint64_t n = 1) {
+  if (_enabled) { _counters[counter].fetch_add(n, std::memory_order_relaxed); }
+}
+
+uint64_t    counter_value(counter_e counter);
+double      phase_seconds(phase_e phase);
+uint64_t    phase_calls(phase_e phase);
+std::string counter_name(counter_e counter);
+std::string phase_name(phase_e phase);
+
+/* The fraction of the lookups which were hits, or zero without any lookups */
+double hit_rate(counter_e hits, counter_e misses);
+
+/*
+ * Write the counters, the hit rate of the lh cache and the timers as tab
+ * separated values, one per line, with the rank of the process. Throws if the
+ * file can't be written.
+ */
+void write_report(const std::string &filename, int rank);
+
+class phase_timer_t {
+public:
+  explicit phase_timer_t(phase_e phase);
+  ~phase_timer_t();
+
+  phase_timer_t(const phase_timer_t &) = delete;
+  phase_timer_t &operator=(const phase_timer_t &) = delete;
+
+private:
+  typedef std::chrono::steady_clock clock_t;
+
+  phase_e             _phase;
+  bool                _entered;
+  bool                _running;
+  clock_t::time_point _start;
+};
+
+#ifdef MPI_VERSION
+/* MPI_Barrier on MPI_COMM_WORLD, timed as mpi_wait */
+inline void mpi_barrier() {
+  phase_timer_t timer{mpi_wait};
+  MPI_Barrier(MPI_COMM_WORLD);
+}
+#endif
+} // namespace profile
+
+#endif
@@ -0,0 +1,109 @@
+#include "root_digger.hpp"
+#include "checkpoint.hpp"
+#include "search_budget.hpp"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
+
+std::unique_ptr<model_t> make_model(const rooted_tree_t &     tree,
+                                    const std::vector<msa_t> &msa,
+                                    const cli_options_t &     options,
+                                    uint64_t                  seed) {
+  std::unique_ptr<model_t> model{new model_t{
+      tree,
+      msa,
+      options.rate_cats,
+      options.invariant_sites,
+      seed,
+      options.early_stop.convert_with_default(!options.exhaustive),
+      !options.no_extra_clvs,
+      options.site_blocks,
+      options.screen_roots,
+      options.tip_kernel_mode}};
+  try {
+    model->initialize_partitions(msa);
+  } catch (const invalid_empirical_frequencies_exception &) {
+    model->initialize_partitions_uniform_freqs(msa);
+  }
+  model->set_newton_alpha(options.newton_alpha);
+  model->set_joint_params(options.joint_params);
+  model->set_dynamic_schedule(options.dynamic_schedule);
+  model->initialize();
+  return model;
+}
+
+root_search_result_t root_search(const rooted_tree_t &     tree,
+                                 const std::vector<msa_t> &msa,
+                                 const cli_options_t &     options) {
+  if (options.min_roots > tree.root_count()) {
+    throw std::runtime_error(
+        "Min roots is larger than the number of roots on the tree");
+  }
+
+  checkpoint_t checkpoint;
+  auto         model = make_model(tree, msa, options, options.seed);
+  model->set_warm_start(options.warm_start);
+  model->set_prune_threshold(options.prune_threshold);
+  model->set_local(true);
+  if (options.time_limit > 0.0 || options.max_evals > 0) {
+    model->set_budget(std::make_shared<search_budget_t>(options.time_limit,
+                                                        options.max_evals));
+  }
+
+  if (options.replicas > 1) {
+    std::vector<std::unique_ptr<model_t>> replicas;
+    replicas.reserve(options.replicas - 1);
+    for (size_t i = 1; i < options.replicas; ++i) {
+      replicas.push_back(make_model(tree, msa, options, options.seed + i));
+    }
+    model->set_replicas(std::move(replicas));
+  }
+
+  std::pair<root_location_t, double> best;
+  if (!options.exhaustive) {
+    model->assign_indicies_by_rank_search(options.min_roots,
+                                          options.root_ratio,
+                                          0,
+                                          1,
+                                          options.initial_root_strategy,
+                                          checkpoint);
+    best = model->search(options.min_roots,
+                         options.root_ratio,
+                         options.abs_tolerance,
+                         options.bfgs_tol,
+                         options.br_tolerance,
+                         options.factor,
+                         checkpoint);
+  } else {
+    model->assign_indicies_by_rank_exhaustive(0, 1, checkpoint);
+    best = model->exhaustive_search(options.abs_tolerance,
+                                    options.bfgs_tol,
+                                    options.br_tolerance,
+                                    options.factor,
+                                    checkpoint);
+  }
+  model->finalize();
+
+  root_search_result_t result;
+  result.best = {best.first.id, best.second, best.first.brlen_ratio};
+  for (auto &r : checkpoint.read_results()) { result.roots.push_back(r.first); }
+  std::sort(result.roots.begin(),
+            result.roots.end(),
+            [](const rd_result_t &a, const rd_result_t &b) {
+              return a.root_id < b.root_id;
+            });
+
+  result.rooted_newick = model->rooted_newick(best.first, false);
+  if (options.exhaustive) {
+    double max_lh = -std::numeric_limits<double>::infinity();
+    for (auto &r : result.roots) { max_lh = std::max(max_lh, r.lh); }
+    double total_lh = 0.0;
+    for (auto &r : result.roots) { total_lh += exp(r.lh - max_lh); }
+    for (auto &r : result.roots) {
+      result.lwr.push_back(exp(r.lh - max_lh) / total_lh);
+    }
+    result.lwr_newick = model->virtual_rooted_newick(best.first);
+  }
+  return result;
+}
@@ -0,0 +1,65 @@
+#ifndef RD_ROOT_DIGGER_HPP_
+#define RD_ROOT_DIGGER_HPP_
+
+#include "model.hpp"
+#include "msa.hpp"
+#include "tree.hpp"
+#include "util.hpp"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/*
+ * The interface for running RootDigger in process, as a library, which is
+ * built as the root_digger target. The MSAs and the tree can be made from
+ * memory, with the msa_t and rooted_tree_t constructors, and the results come
+ * back as data instead of files.
+ *
+ * Only the model and search options of cli_options_t are used, and none of
+ * the file names. A search uses the OpenMP threads of the caller, and is never
+ * collective, even in an MPI build.
+ */
+
+struct root_search_result_t {
+  /* The best root, and the position of the root on its branch */
+  rd_result_t best;
+
+  /*
+   * The result of every root optimization, ordered by root id. For searches,
+   * this is the root that each of the starting roots ended up at, so a root
+   * can be in here more than once.
+   */
+  std::vector<rd_result_t> roots;
+
+  /*
+   * The LWR of each of the roots, only for exhaustive searches. Roots pruned
+   * by the prune threshold only have a lower bound.
+   */
+  std::vector<double> lwr;
+
+  /* The tree rooted at the best root */
+  std::string rooted_newick;
+
+  /* The tree annotated with the LWR of every root, for exhaustive searches */
+  std::string lwr_newick;
+};
+
+/*
+ * Build and initialize a model for the tree and MSAs, with the model options
+ * and the given seed.
+ */
+std::unique_ptr<model_t> make_model(const rooted_tree_t &     tree,
+                                    const std::vector<msa_t> &msa,
+                                    const cli_options_t &     options,
+                                    uint64_t                  seed);
+
+/*
+ * Search for the root of the tree, or evaluate every root if
+ * options.exhaustive is set, and keep the results in memory.
+ */
+root_search_result_t root_search(const rooted_tree_t &     tree,
+                                 const std::vector<msa_t> &msa,
+                                 const cli_options_t &     options);
+
+#endif
@@ -0,0 +1,21 @@
+#include "search_budget.hpp"
+#include <stdexcept>
+
+search_budget_t::search_budget_t(double time_limit, uint64_t max_evals) :
+    _time_limit{time_limit},
+    _max_evals{max_evals},
+    _start{clock_t::now()},
+    _evaluations{0} {
+  if (!(time_limit >= 0.0)) {
+    throw std::invalid_argument("The time limit can't be negative");
+  }
+}
+
+bool search_budget_t::exhausted() const {
+  if (_max_evals > 0 && evaluations() >= _max_evals) { return true; }
+  return _time_limit > 0.0 && elapsed() >= _time_limit;
+}
+
+double search_budget_t::elapsed() const {
+  return std::chrono::duration<double>(clock_t::now() - _start).count();
+}
@@ -0,0 +1,41 @@
+#ifndef RD_SEARCH_BUDGET_HPP_
+#define RD_SEARCH_BUDGET_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+/*
+ * A limit on the wall time and on the number of lh evaluations of a search, for
+ * runs which have to finish inside the wall time of a cluster job. A limit of
+ * zero is no limit. The time is counted from when the budget is made, and the
+ * evaluations are the ones counted as lh_evaluations by the profile.
+ *
+ * The budget is shared by a model, its replicas and their threads, so the
+ * evaluations are counted atomically. Each process has its own budget.
+ */
+class search_budget_t {
+public:
+  search_budget_t(double time_limit, uint64_t max_evals);
+
+  void count(uint64_t n = 1) {
+    _evaluations.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  bool exhausted() const;
+
+  double   elapsed() const;
+  uint64_t evaluations() const { return _evaluations; }
+  double   time_limit() const { return _time_limit; }
+  uint64_t max_evals() const { return _max_evals; }
+
+private:
+  typedef std::chrono::steady_clock clock_t;
+
+  double                _time_limit;
+  uint64_t              _max_evals;
+  clock_t::time_point   _start;
+  std::atomic<uint64_t> _evaluations;
+};
+
+#endif
@@ -0,0 +1,82 @@
+#include "tip_kernel.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <unordered_map>
+
+double
+site_repeats_ratio(const std::vector<const char *> &              tips,
+                   const std::vector<std::pair<size_t, size_t>> &children,
+                   unsigned int                                  sites) {
+  if (children.empty() || sites == 0) { return 1.0; }
+
+  constexpr size_t char_count = std::numeric_limits<unsigned char>::max() + 1;
+  size_t max_table = std::max(char_count * char_count, 4 * size_t{sites});
+
+  /* The repeat class of every site of a node. Each node is the child of only
+   * one other, so the classes are dropped once its parent has them. */
+  std::vector<std::vector<unsigned int>> classes(tips.size()
+                                                 + children.size());
+  std::vector<size_t> class_counts(classes.size(), char_count);
+  auto class_of = [&](size_t node, unsigned int site) -> size_t {
+    if (node < tips.size()) {
+      return static_cast<unsigned char>(tips[node][site]);
+    }
+    return classes[node][site];
+  };
+
+  std::vector<unsigned int>                  table;
+  std::unordered_map<uint64_t, unsigned int> map;
+
+  double total = 0.0;
+  for (size_t i = 0; i < children.size(); ++i) {
+    size_t left        = children[i].first;
+    size_t right       = children[i].second;
+    size_t right_count = class_counts[right];
+    size_t table_size  = class_counts[left] * right_count;
+    bool   dense       = table_size <= max_table;
+    if (dense) {
+      table.assign(table_size, 0);
+    } else {
+      map.clear();
+    }
+
+    auto &node_classes = classes[tips.size() + i];
+    node_classes.resize(sites);
+    unsigned int distinct = 0;
+    for (unsigned int site = 0; site < sites; ++site) {
+      size_t key = class_of(left, site) * right_count + class_of(right, site);
+      unsigned int &id = dense ? table[key] : map[key];
+      if (id == 0) { id = ++distinct; }
+      node_classes[site] = id - 1;
+    }
+    class_counts[tips.size() + i] = distinct;
+    total += static_cast<double>(distinct) / sites;
+
+    for (size_t child : {left, right}) {
+      if (child >= tips.size()) {
+        std::vector<unsigned int>().swap(classes[child]);
+      }
+    }
+  }
+  return total / static_cast<double>(children.size());
+}
+
+tip_kernel::tip_kernel_e select_tip_kernel(tip_kernel::tip_kernel_e requested,
+                                           double repeats_ratio,
+                                           double max_repeats_ratio) {
+  if (requested != tip_kernel::automatic) { return requested; }
+  return repeats_ratio > max_repeats_ratio ? tip_kernel::pattern_tip
+                                           : tip_kernel::site_repeats;
+}
+
+const char *tip_kernel_name(tip_kernel::tip_kernel_e kernel) {
+  switch (kernel) {
+  case tip_kernel::site_repeats:
+    return "site repeats";
+  case tip_kernel::pattern_tip:
+    return "tip patterns";
+  default:
+    return "automatic";
+  }
+}
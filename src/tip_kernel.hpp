@@ -0,0 +1,34 @@
+#ifndef RD_TIP_KERNEL_HPP_
+#define RD_TIP_KERNEL_HPP_
+
+#include "util.hpp"
+#include <utility>
+#include <vector>
+
+/*
+ * The share of the sites that site repeats still computes at the inner CLVs,
+ * averaged over the CLVs. The sites are counted the way libpll counts them for
+ * each CLV: two sites are repeats at a node when they are repeats at both of
+ * its children, and a tip repeats the sites with the same character. tips are
+ * the sequences by node index, and children are the children of the inner
+ * nodes, as given by rooted_tree_t::inner_children(). Returns 1.0 when there
+ * are no inner nodes or sites.
+ */
+double
+site_repeats_ratio(const std::vector<const char *> &              tips,
+                   const std::vector<std::pair<size_t, size_t>> &children,
+                   unsigned int                                  sites);
+
+/*
+ * Pick the kernel for a partition. When the kernel is chosen automatically,
+ * site repeats are used unless they still compute most of the sites at the
+ * inner CLVs, in which case the repeats are mostly bookkeeping, and the tip
+ * pattern kernels are cheaper.
+ */
+tip_kernel::tip_kernel_e select_tip_kernel(tip_kernel::tip_kernel_e requested,
+                                           double repeats_ratio,
+                                           double max_repeats_ratio = 0.5);
+
+const char *tip_kernel_name(tip_kernel::tip_kernel_e kernel);
+
+#endif
@@ -2,6 +2,7 @@
 #include "tree.hpp"
 #include <algorithm>
 #include <bits/c++config.h>
+#include <cmath>
 #include <functional>
 #include <limits>
 #include <numeric>
@@ -13,65 +14,28 @@ pll_utree_t *parse_tree_file(const std::string &tree_filename) {
   return pll_utree_parse_newick_unroot(tree_filename.c_str());
 }
 
-static void clean_root_unode(pll_unode_t *node) {
-  assert(!node->data);
-
-  node->length = -1;
-  // We _want_ this to fail if we ever use it after without setting it. So we
-  // set it to a ridiculous value
-  node->node_index = std::numeric_limits<unsigned int>::max();
-
-  node->back = nullptr;
-}
-
-rooted_tree_t::rooted_tree_t(const rooted_tree_t &other) {
-  if (other.rooted()) {
-    throw std::runtime_error{"Attempted to copy a tree that is rooted"};
+rooted_tree_t rooted_tree_t::from_newick(const std::string &newick) {
+  pll_utree_t *tree = pll_utree_parse_newick_string_unroot(newick.c_str());
+  if (tree == nullptr) {
+    throw std::invalid_argument("Newick string could not be parsed");
   }
-  _tree   = pll_utree_clone(other._tree);
-  _rooted = other._rooted;
-
-  copy_root_locations(other);
-  copy_annotations(other);
-
-  if (!_rooted) { add_root_space(); }
+  return rooted_tree_t{tree};
 }
 
-rooted_tree_t::~rooted_tree_t() {
-  auto deallocate_data = [](void *n) {
-    assert(n != (void *)0xdeadbeef);
-    if (n != nullptr) free(n);
-  };
-  if (_tree != nullptr) {
-    // pll_utree_destroy works by traversing the tree. We just need to make sure
-    // that the extra roots are actually part of the tree in order to not leak
-    // memory.
-    root_by(_roots[0]);
-    pll_utree_destroy(_tree, deallocate_data);
-  }
-}
-
-rooted_tree_t &rooted_tree_t::operator=(rooted_tree_t &&other) {
-  _tree             = std::move(other._tree);
-  _roots            = std::move(other._roots);
-  _root_annotations = std::move(other._root_annotations);
-  _rooted           = other._rooted;
-  other._tree       = nullptr;
-  return *this;
+static void destroy_tree(const pll_utree_t *tree) {
+  if (tree == nullptr) { return; }
+  pll_utree_destroy(const_cast<pll_utree_t *>(tree), free);
 }
 
-rooted_tree_t &rooted_tree_t::operator=(const rooted_tree_t &other) {
-  if (other.rooted()) {
-    throw std::runtime_error{"Attempted to copy a tree that is rooted"};
-  }
-  _tree   = pll_utree_clone(other._tree);
-  _rooted = other._rooted;
-
-  copy_root_locations(other);
-  copy_annotations(other);
-
-  if (!_rooted) { add_root_space(); }
-  return *this;
+rooted_tree_t::rooted_tree_t(pll_utree_t *tree, const char *error) :
+    _tree{tree, destroy_tree},
+    _vroot{tree != nullptr ? tree->vroot : nullptr},
+    _current_rl{},
+    _roots{},
+    _rooted{false} {
+  if (_tree == nullptr) { throw std::invalid_argument(error); }
+  generate_root_locations();
+  sort_root_locations();
 }
 
 root_location_t rooted_tree_t::root_location(size_t index) const {
@@ -102,12 +66,15 @@ unsigned int rooted_tree_t::inner_count() const {
 unsigned int rooted_tree_t::branch_count() const {
   return _tree->tip_count * 2 - 2;
 }
+unsigned int rooted_tree_t::inner_clv_count() const {
+  return _tree->tip_count - 1;
+}
 
 unsigned int rooted_tree_t::root_clv_index() const {
-  return _tree->vroot->clv_index;
+  return _tree->tip_count + _tree->inner_count;
 }
 int rooted_tree_t::root_scaler_index() const {
-  return _tree->vroot->scaler_index;
+  return static_cast<int>(_tree->inner_count);
 }
 
 std::unordered_map<std::string, unsigned int> rooted_tree_t::label_map() const {
@@ -129,39 +96,23 @@ std::unordered_set<std::string> rooted_tree_t::label_set() const {
   return label_set;
 }
 
-void rooted_tree_t::copy_root_locations(const rooted_tree_t &other) {
-  _roots.clear();
-  std::unordered_map<pll_unode_t *, size_t> id_map;
-  id_map.reserve(other.root_count() * 2);
-  for (const auto &r : other.roots()) {
-    debug_print(EMIT_LEVEL_DEBUG, "mapping %p to %lu", (void *)r.edge, r.id);
-    id_map[r.edge]       = r.id;
-    id_map[r.edge->back] = r.id;
-  }
-
-  auto other_trav = other.full_traverse();
-  auto our_trav   = full_traverse();
-
-  if (other_trav.size() != our_trav.size()) {
-    throw std::runtime_error("Traversal sizes didn't match during copy "
-                             "constructor, something is seriously wrong");
-  }
-
-  std::unordered_set<size_t> consumed_ids;
-  for (size_t i = 0; i < other_trav.size(); ++i) {
-    auto id_map_res = id_map.find(other_trav[i]);
-    if (id_map_res != id_map.end()
-        && consumed_ids.find(id_map_res->second) == consumed_ids.end()) {
-      auto edge = our_trav[i];
-      _roots.push_back({edge, id_map_res->second, edge->length, 0.5});
-      consumed_ids.insert(id_map_res->second);
-    }
-  }
+size_t rooted_tree_t::inner_children_recurse(
+    pll_unode_t *node, std::vector<std::pair<size_t, size_t>> &children) const {
+  if (node->next == nullptr) { return node->node_index; }
+  size_t left  = inner_children_recurse(node->next->back, children);
+  size_t right = inner_children_recurse(node->next->next->back, children);
+  children.emplace_back(left, right);
+  return tip_count() + children.size() - 1;
+}
 
-  if (_roots.size() != other._roots.size()) {
-    throw std::runtime_error{"We got the wrong number of roots after copy"};
-  }
-  sort_root_locations();
+std::vector<std::pair<size_t, size_t>> rooted_tree_t::inner_children() const {
+  std::vector<std::pair<size_t, size_t>> children;
+  if (_tree == nullptr) { return children; }
+  children.reserve(tip_count());
+  pll_unode_t *start = _tree->nodes[0]->back;
+  if (start->next == nullptr) { return children; }
+  inner_children_recurse(start, children);
+  return children;
 }
 
 void rooted_tree_t::sort_root_locations() {
@@ -211,29 +162,6 @@ std::vector<root_location_t> rooted_tree_t::external_root_locations() const {
   return ret;
 }
 
-void rooted_tree_t::add_root_space() {
-  unsigned int new_size     = _tree->inner_count + _tree->tip_count + 1;
-  unsigned int total_unodes = _tree->inner_count * 3 + _tree->tip_count;
-  _tree->nodes =
-      (pll_unode_t **)realloc(_tree->nodes, sizeof(pll_unode_t *) * new_size);
-  assert(new_size > 0);
-  pll_unode_t *new_root_left  = (pll_unode_t *)calloc(1, sizeof(pll_unode_t));
-  pll_unode_t *new_root_right = (pll_unode_t *)calloc(1, sizeof(pll_unode_t));
-  new_root_left->next         = new_root_right;
-  new_root_right->next        = new_root_left;
-
-  new_root_left->clv_index = new_root_right->clv_index = new_size;
-  new_root_left->scaler_index = new_root_right->scaler_index =
-      static_cast<int>(_tree->inner_count - 1);
-
-  new_root_left->node_index = total_unodes + 1;
-
-  new_root_right->node_index    = total_unodes + 2;
-  new_root_right->pmatrix_index = _tree->edge_count - 1;
-
-  _tree->nodes[new_size - 1] = new_root_left;
-}
-
 std::vector<pll_unode_t *> rooted_tree_t::edge_traverse() const {
   std::vector<pll_unode_t *> trav_buf(inner_count());
   unsigned int               trav_size = 0;
@@ -273,221 +201,242 @@ void rooted_tree_t::root_by(const root_location_t &root_location) {
   debug_print(EMIT_LEVEL_DEBUG,
               "rooting by node labeled: %s",
               root_location.label().c_str());
-  if (root_location.edge == _tree->vroot) {
-    update_root(root_location);
-    return;
-  }
-  if (rooted()) { unroot(); }
-  unsigned int tree_size      = _tree->inner_count + _tree->tip_count + 1;
-  pll_unode_t *new_root_left  = _tree->nodes[tree_size - 1];
-  pll_unode_t *new_root_right = new_root_left->next;
-
-  new_root_left->next  = new_root_right;
-  new_root_right->next = new_root_left;
-
-  pll_unode_t *left_child  = root_location.edge;
-  pll_unode_t *right_child = left_child->back;
-
-  left_child->back    = new_root_left;
-  new_root_left->back = left_child;
-  left_child->length = new_root_left->length = root_location.brlen();
-
-  right_child->back    = new_root_right;
-  new_root_right->back = right_child;
-  right_child->length  = new_root_right->length =
-      root_location.brlen_compliment();
-
-  unsigned int total_unodes = _tree->inner_count * 3 + _tree->tip_count;
-
-  _tree->inner_count += 1;
-  _tree->edge_count += 1;
-  _tree->vroot = new_root_left;
-
-  new_root_left->clv_index = new_root_right->clv_index = tree_size - 1;
-  new_root_left->scaler_index = new_root_right->scaler_index =
-      static_cast<int>(_tree->inner_count - 1);
-
-  new_root_left->pmatrix_index = left_child->pmatrix_index;
-
-  new_root_right->node_index = total_unodes + 2;
-  right_child->pmatrix_index = new_root_right->pmatrix_index =
-      _tree->edge_count - 1;
-  new_root_right->pmatrix_index = _tree->edge_count - 1;
-
   _current_rl = root_location;
   _rooted     = true;
 }
 
 void rooted_tree_t::update_root(root_location_t root) {
-  if (root.edge != _tree->vroot) {
+  if (!_rooted || root.edge != _current_rl.edge) {
     throw std::runtime_error("Provided root doesn't match the current tree");
   }
-
-  pll_unode_t *right_root = root.edge;
-  pll_unode_t *left_root  = root.edge->next;
-
-  right_root->length = right_root->back->length = root.brlen();
-  left_root->length = left_root->back->length = root.brlen_compliment();
+  _current_rl = root;
 }
 
 void rooted_tree_t::unroot() {
-  pll_unode_t *left_child  = _tree->vroot->back;
-  pll_unode_t *right_child = _tree->vroot->next->back;
-  pll_unode_t *root_left   = _tree->vroot;
-  pll_unode_t *root_right  = _tree->vroot->next;
+  if (!_rooted) { return; }
+  pll_unode_t *left_child  = _current_rl.edge;
+  pll_unode_t *right_child = _current_rl.edge->back;
 
-  right_child->back = left_child;
-  left_child->back  = right_child;
+  _vroot = left_child->next != nullptr ? left_child : right_child;
+  if (_vroot->next == nullptr) {
+    throw std::runtime_error("unrooted to a tip");
+  }
+  _rooted = false;
+}
 
-  right_child->length = left_child->length = _current_rl.saved_brlen;
+bool rooted_tree_t::rooted() const { return _rooted; }
 
-  clean_root_unode(root_left);
-  clean_root_unode(root_right);
+/*
+ * Traverse the tree in postorder from the current root into _trav_buf, first
+ * the side of the root edge, then the other side. The root itself is left out.
+ * With tagged_only, only the tagged nodes are visited, and the subtrees below
+ * the untagged ones are skipped. The buffer only allocates the first time.
+ */
+unsigned int rooted_tree_t::traverse(bool tagged_only) {
+  _trav_buf.clear();
+  _trav_buf.reserve(tip_count() + inner_count());
+  traverse_subtree(_current_rl.edge, tagged_only);
+  traverse_subtree(_current_rl.edge->back, tagged_only);
+  return static_cast<unsigned int>(_trav_buf.size());
+}
 
-  _tree->vroot = left_child->next != nullptr ? left_child : right_child;
-  if (_tree->vroot->next == nullptr) {
-    throw std::runtime_error("unrooted to a tip");
+void rooted_tree_t::traverse_subtree(pll_unode_t *node, bool tagged_only) {
+  if (tagged_only && !_tagged[node->clv_index]) { return; }
+  if (node->next != nullptr) {
+    traverse_subtree(node->next->back, tagged_only);
+    traverse_subtree(node->next->next->back, tagged_only);
   }
+  _trav_buf.push_back(node);
+}
 
-  _tree->inner_count -= 1;
-  _tree->edge_count -= 1;
+/*
+ * The root sits on the edge of _current_rl. Its first child keeps the pmatrix
+ * of the edge, and the second child gets the one past the pmatrices of the
+ * unrooted tree.
+ */
+unsigned int rooted_tree_t::root_pmatrix_index() const {
+  return _tree->edge_count;
+}
 
-  right_child->pmatrix_index = left_child->pmatrix_index;
-  _rooted                    = false;
+unsigned int rooted_tree_t::pmatrix_index(const pll_unode_t *node) const {
+  if (node == _current_rl.edge->back) { return root_pmatrix_index(); }
+  return node->pmatrix_index;
 }
 
-bool rooted_tree_t::rooted() const {
-  return _tree->vroot->next->next == _tree->vroot;
+double rooted_tree_t::branch_length(const pll_unode_t *node) const {
+  if (node == _current_rl.edge) { return _current_rl.brlen(); }
+  if (node == _current_rl.edge->back) {
+    return _current_rl.brlen_compliment();
+  }
+  return node->length;
 }
 
-std::tuple<std::vector<pll_operation_t>,
-           std::vector<unsigned int>,
-           std::vector<double>>
-rooted_tree_t::generate_operations(const root_location_t &new_root) {
-  root_by(new_root);
-  auto trav_buf = full_traverse();
-  debug_string(EMIT_LEVEL_DEBUG, "traversal after root");
+void rooted_tree_t::fill_root_operation(pll_operation_t &op) const {
+  pll_unode_t *left  = _current_rl.edge;
+  pll_unode_t *right = _current_rl.edge->back;
 
-  for (auto node : trav_buf) {
-    debug_print(EMIT_LEVEL_DEBUG,
-                "traversal node label: %s, pmatrix index: %d, clv index: %d",
-                (node->label != nullptr ? node->label : "null"),
-                node->pmatrix_index,
-                node->clv_index);
-  }
+  op.parent_clv_index    = root_clv_index();
+  op.parent_scaler_index = root_scaler_index();
 
-  std::vector<pll_operation_t> ops(trav_buf.size());
-  std::vector<unsigned int>    pmatrix_indices(trav_buf.size());
-  std::vector<double>          branch_lengths(trav_buf.size());
+  op.child1_clv_index    = left->clv_index;
+  op.child1_scaler_index = left->scaler_index;
+  op.child1_matrix_index = pmatrix_index(left);
 
-  unsigned int op_count     = 0;
-  unsigned int matrix_count = 0;
+  op.child2_clv_index    = right->clv_index;
+  op.child2_scaler_index = right->scaler_index;
+  op.child2_matrix_index = pmatrix_index(right);
+}
 
-  pll_utree_create_operations(trav_buf.data(),
-                              static_cast<unsigned int>(trav_buf.size() - 1),
-                              branch_lengths.data(),
-                              pmatrix_indices.data(),
-                              ops.data(),
-                              &matrix_count,
-                              &op_count);
+/*
+ * Make the operations for the first trav_size nodes of _trav_buf, and the
+ * root. Every node gets the pmatrix of the edge above it.
+ */
+void rooted_tree_t::fill_plan(unsigned int      trav_size,
+                              operation_plan_t &plan) const {
+  plan.reserve(_trav_buf.capacity() + 1);
+  plan.resize(trav_size + 1, trav_size);
 
-  ops.resize(op_count + 1);
-  pmatrix_indices.resize(matrix_count);
-  branch_lengths.resize(matrix_count);
+  unsigned int op_count = 0;
+  for (unsigned int i = 0; i < trav_size; ++i) {
+    pll_unode_t *node       = _trav_buf[i];
+    plan.pmatrix_indices[i] = pmatrix_index(node);
+    plan.branch_lengths[i]  = branch_length(node);
+    if (node->next == nullptr) { continue; }
 
-  auto         root_op_it         = ops.end() - 1;
-  pll_unode_t *root_node          = *(trav_buf.end() - 1);
-  root_op_it->parent_clv_index    = root_node->clv_index;
-  root_op_it->parent_scaler_index = root_node->scaler_index;
+    pll_unode_t *child1 = node->next->back;
+    pll_unode_t *child2 = node->next->next->back;
+    auto &       op     = plan.ops[op_count++];
 
-  root_op_it->child1_clv_index    = root_node->back->clv_index;
-  root_op_it->child1_scaler_index = root_node->back->scaler_index;
-  root_op_it->child1_matrix_index = root_node->back->pmatrix_index;
+    op.parent_clv_index    = node->clv_index;
+    op.parent_scaler_index = node->scaler_index;
+    op.child1_clv_index    = child1->clv_index;
+    op.child1_scaler_index = child1->scaler_index;
+    op.child1_matrix_index = child1->pmatrix_index;
+    op.child2_clv_index    = child2->clv_index;
+    op.child2_scaler_index = child2->scaler_index;
+    op.child2_matrix_index = child2->pmatrix_index;
+  }
 
-  root_op_it->child2_clv_index    = root_node->next->back->clv_index;
-  root_op_it->child2_scaler_index = root_node->next->back->scaler_index;
-  root_op_it->child2_matrix_index = root_node->next->back->pmatrix_index;
+  plan.resize(op_count + 1, trav_size);
+  fill_root_operation(plan.ops.back());
+}
 
-  return std::make_tuple(ops, pmatrix_indices, branch_lengths);
+void rooted_tree_t::fill_operations(const root_location_t &new_root,
+                                    operation_plan_t &     plan) {
+  root_by(new_root);
+  fill_plan(traverse(false), plan);
 }
 
-std::tuple<pll_operation_t, std::vector<unsigned int>, std::vector<double>>
-rooted_tree_t::generate_derivative_operations(const root_location_t &root) {
+std::tuple<std::vector<pll_operation_t>,
+           std::vector<unsigned int>,
+           std::vector<double>>
+rooted_tree_t::generate_operations(const root_location_t &new_root) {
+  operation_plan_t plan;
+  fill_operations(new_root, plan);
+  return std::make_tuple(std::move(plan.ops),
+                         std::move(plan.pmatrix_indices),
+                         std::move(plan.branch_lengths));
+}
+
+void rooted_tree_t::fill_derivative_operations(const root_location_t &root,
+                                               operation_plan_t &     plan) {
   root_by(root);
+  plan.resize(1, 2);
 
-  pll_operation_t           op;
-  std::vector<unsigned int> pmatrix_indices(2);
-  std::vector<double>       branch_lengths(2);
+  fill_root_operation(plan.ops[0]);
 
-  pll_unode_t *vroot = _tree->vroot;
+  plan.pmatrix_indices[0] = pmatrix_index(root.edge);
+  plan.branch_lengths[0]  = branch_length(root.edge);
 
-  op.parent_clv_index    = root_clv_index();
-  op.parent_scaler_index = root_scaler_index();
+  plan.pmatrix_indices[1] = pmatrix_index(root.edge->back);
+  plan.branch_lengths[1]  = branch_length(root.edge->back);
+}
 
-  op.child1_clv_index    = vroot->back->clv_index;
-  op.child1_matrix_index = vroot->back->pmatrix_index;
-  op.child1_scaler_index = vroot->back->scaler_index;
-  pmatrix_indices[0]     = vroot->back->pmatrix_index;
-  branch_lengths[0]      = vroot->back->length;
+std::tuple<pll_operation_t, std::vector<unsigned int>, std::vector<double>>
+rooted_tree_t::generate_derivative_operations(const root_location_t &root) {
+  operation_plan_t plan;
+  fill_derivative_operations(root, plan);
+  return std::make_tuple(plan.ops[0],
+                         std::move(plan.pmatrix_indices),
+                         std::move(plan.branch_lengths));
+}
 
-  op.child2_clv_index    = vroot->next->back->clv_index;
-  op.child2_matrix_index = vroot->next->back->pmatrix_index;
-  op.child2_scaler_index = vroot->next->back->scaler_index;
-  pmatrix_indices[1]     = vroot->next->back->pmatrix_index;
-  branch_lengths[1]      = vroot->next->back->length;
+std::string rooted_tree_t::newick(bool annotations) const {
+  if (_rooted) { return rooted_newick(_current_rl, annotations); }
+  return unrooted_newick(_vroot, annotations);
+}
 
-  return std::make_tuple(op, pmatrix_indices, branch_lengths);
+std::string rooted_tree_t::rooted_newick(const root_location_t &root,
+                                         bool annotations) const {
+  std::string ret{"("};
+  append_newick(root.edge, root.brlen(), annotations, ret);
+  ret += ',';
+  append_newick(root.edge->back, root.brlen_compliment(), annotations, ret);
+  ret += "):0.0;";
+  return ret;
 }
 
-std::string rooted_tree_t::newick(bool annotations) const {
-  if (!_root_annotations.empty() && annotations) {
-    auto fold_operation = [](std::string                         a,
-                             std::pair<std::string, std::string> b) {
-      return std::move(a) + ':' + std::move(b.first) + '='
-             + std::move(b.second);
-    };
-
-    for (auto kv : _root_annotations) {
-      if (kv.second.size() == 0) { continue; }
-      debug_print(
-          EMIT_LEVEL_DEBUG, "number of annotation: %lu", kv.second.size());
-      auto        root_location = kv.first;
-      std::string start         = "[&&NHX";
-      std::string annotation    = std::accumulate(
-          kv.second.begin(), kv.second.end(), start, fold_operation);
-      annotation += ']';
-
-      if (root_location->data) {
-        debug_print(-1,
-                    "root_location->data: %p, int: %ld",
-                    root_location->data,
-                    (int64_t)root_location->data);
-
-        throw std::runtime_error("The node data was not empty when we tried to "
-                                 "put node annotations in");
-      }
+std::string rooted_tree_t::virtual_rooted_newick(const root_location_t &root,
+                                                 bool annotations) const {
+  /* This is the node that unroot() would leave as the vroot */
+  pll_unode_t *vroot = root.edge->next != nullptr ? root.edge : root.edge->back;
+  if (vroot->next == nullptr) {
+    throw std::runtime_error("unrooted to a tip");
+  }
+  return unrooted_newick(vroot, annotations);
+}
 
-      debug_print(
-          EMIT_LEVEL_DEBUG, "calculated annotation: %s", annotation.c_str());
-      char *new_label = (char *)calloc(sizeof(char), (annotation.size() + 1));
-      memcpy(new_label, annotation.data(), sizeof(char) * annotation.size());
-      debug_print(EMIT_LEVEL_DEBUG, "new label: %s", new_label);
+std::string rooted_tree_t::unrooted_newick(pll_unode_t *vroot,
+                                           bool         annotations) const {
+  std::string  ret{"("};
+  pll_unode_t *cur = vroot;
+  do {
+    if (cur != vroot) { ret += ','; }
+    append_newick(cur->back, cur->length, annotations, ret);
+    cur = cur->next;
+  } while (cur != vroot);
+  ret += ')';
+  if (vroot->label) { ret += vroot->label; }
+  ret += ":0.0;";
+  return ret;
+}
 
-      root_location->data = new_label;
+/*
+ * Write the subtree below node, which hangs from a branch of the given length.
+ * Children are written in the same order as pll_utree_export_newick does.
+ */
+void rooted_tree_t::append_newick(pll_unode_t *node,
+                                  double       length,
+                                  bool         annotations,
+                                  std::string &out) const {
+  if (node->next != nullptr) {
+    out += '(';
+    for (auto child = node->next; child != node; child = child->next) {
+      if (child != node->next) { out += ','; }
+      append_newick(child->back, child->length, annotations, out);
     }
+    out += ')';
   }
-  auto serialize_node = [](const pll_unode_t *n) {
-    auto tmp = (n->label ? std::string(n->label) : std::string()) + ':'
-               + std::to_string(n->length)
-               + (n->data ? std::string((char *)n->data) : std::string());
-    char *node_string = (char *)calloc(sizeof(char), tmp.size() + 1);
-    memcpy(node_string, tmp.data(), tmp.size());
-    return node_string;
-  };
-  char *newick_string = pll_utree_export_newick(_tree->vroot, serialize_node);
-  std::string ret{newick_string};
-  free(newick_string);
-  return ret;
+  if (node->label) { out += node->label; }
+  out += ':';
+  out += std::to_string(length);
+  if (annotations) { append_annotation(node, out); }
+}
+
+void rooted_tree_t::append_annotation(pll_unode_t *node,
+                                      std::string &out) const {
+  auto annotations = _root_annotations.find(node);
+  if (annotations == _root_annotations.end() || annotations->second.empty()) {
+    return;
+  }
+  out += "[&&NHX";
+  for (auto &kv : annotations->second) {
+    out += ':';
+    out += kv.first;
+    out += '=';
+    out += kv.second;
+  }
+  out += ']';
 }
 
 void rooted_tree_t::show_tree() const {
@@ -518,163 +467,221 @@ bool rooted_tree_t::sanity_check() const {
   return branch_length_sanity_check();
 }
 
-static void tag_nodes(pll_unode_t *n) {
-  pll_unode_t *start = n;
-  do {
-    n->data = (void *)0xdeadbeef;
-    n       = n->next;
-  } while (n != nullptr && n != start);
-}
-
-static void untag_nodes(pll_unode_t *n) {
-  pll_unode_t *start = n;
-  do {
-    n->data = (void *)nullptr;
-    n       = n->next;
-  } while (n != nullptr && n != start);
-}
-
-void rooted_tree_t::find_path(pll_unode_t *n1, pll_unode_t *n2) {
-  pll_unode_t *start   = n1;
-  pll_unode_t *current = n1;
-  do {
-    if (find_path_recurse(current->back, n2)) break;
-    current = current->next;
-  } while (current != nullptr && current != start);
-}
-
-bool rooted_tree_t::find_path_recurse(pll_unode_t *n1, pll_unode_t *n2) {
-  if (n1 == n2) {
-    tag_nodes(n1);
-    return true;
-  }
-  if (n1->next) {
-    pll_unode_t *start = n1;
-    n1                 = n1->next;
-    while (start != n1) {
-      if (n1 == n2) {
-        tag_nodes(n1);
-        return true;
-      } else if (find_path_recurse(n1->back, n2)) {
-        tag_nodes(n1);
-        return true;
-      }
-      n1 = n1->next;
-    }
-  } else {
-    if (n1 == n2) { tag_nodes(n1); }
-    return n1 == n2;
+/*
+ * Tag the nodes on the path from node down to the nearest end of the target
+ * edge. Returns whether the end was found below node.
+ */
+bool rooted_tree_t::tag_path(pll_unode_t *node, const root_location_t &target) {
+  bool found = node->clv_index == target.edge->clv_index
+               || node->clv_index == target.edge->back->clv_index;
+  if (!found && node->next != nullptr) {
+    found = tag_path(node->next->back, target)
+            || tag_path(node->next->next->back, target);
   }
-  return false;
+  if (found) { _tagged[node->clv_index] = true; }
+  return found;
 }
 
-std::tuple<std::vector<pll_operation_t>,
-           std::vector<unsigned int>,
-           std::vector<double>>
-rooted_tree_t::generate_root_update_operations(
-    const root_location_t &new_root) {
+/*
+ * Only the CLVs on the path between the old root and the new one change, so
+ * those nodes are tagged, along with the ends of both edges, and the traversal
+ * skips the rest.
+ */
+void rooted_tree_t::fill_root_update_operations(
+    const root_location_t &new_root, operation_plan_t &plan) {
 
   if (new_root.edge == _current_rl.edge
-      || new_root.edge == _current_rl.edge->back) {
-    return {};
+      || (_current_rl.edge != nullptr
+          && new_root.edge == _current_rl.edge->back)) {
+    plan.resize(0, 0);
+    return;
+  }
+  if (_current_rl.edge == nullptr) {
+    fill_operations(new_root, plan);
+    return;
   }
 
   auto old_root = _current_rl;
   root_by(new_root);
-  find_path(old_root.edge, _tree->vroot);
-  /* cover the old root */
-  tag_nodes(old_root.edge);
-  tag_nodes(old_root.edge->back);
-
-  tag_nodes(_tree->vroot->back);
-  tag_nodes(_tree->vroot->next->back);
-  std::vector<pll_unode_t *> trav_buf(inner_count() + tip_count());
-  unsigned int               trav_size = 0;
-
-  auto update_root_callback = [](pll_unode_t *n) -> int {
-    if (n->data == (void *)0xdeadbeef) {
-      n->data = nullptr;
-      return PLL_SUCCESS;
-    }
-    return PLL_FAILURE;
-  };
 
-  pll_utree_traverse(_tree->vroot,
-                     PLL_TREE_TRAVERSE_POSTORDER,
-                     update_root_callback,
-                     trav_buf.data(),
-                     &trav_size);
-  trav_buf.resize(trav_size);
+  _tagged.assign(tip_count() + inner_count(), false);
+  if (!tag_path(new_root.edge, old_root)) {
+    tag_path(new_root.edge->back, old_root);
+  }
+  for (auto node : {old_root.edge,
+                    old_root.edge->back,
+                    new_root.edge,
+                    new_root.edge->back}) {
+    _tagged[node->clv_index] = true;
+  }
 
-  std::vector<pll_operation_t> ops(trav_buf.size());
-  std::vector<unsigned int>    pmatrix_indices(trav_buf.size());
-  std::vector<double>          branch_lengths(trav_buf.size());
+  unsigned int trav_size = traverse(true);
 
-  assert_string(trav_buf.size() != 0,
+  assert_string(trav_size != 0,
                 "traversal buffer when updating the root had size zero");
 
-  unsigned int op_count     = 0;
-  unsigned int matrix_count = 0;
-
-  pll_utree_create_operations(trav_buf.data(),
-                              static_cast<unsigned int>(trav_buf.size() - 1),
-                              branch_lengths.data(),
-                              pmatrix_indices.data(),
-                              ops.data(),
-                              &matrix_count,
-                              &op_count);
-
-  ops.resize(op_count);
-  pmatrix_indices.resize(matrix_count);
-  branch_lengths.resize(matrix_count);
-
-  ops.resize(op_count + 1);
-  pmatrix_indices.resize(matrix_count);
-  branch_lengths.resize(matrix_count);
+  fill_plan(trav_size, plan);
+}
 
-  auto         root_op_it         = ops.end() - 1;
-  pll_unode_t *root_node          = _tree->vroot;
-  root_op_it->parent_clv_index    = root_node->clv_index;
-  root_op_it->parent_scaler_index = root_node->scaler_index;
+std::tuple<std::vector<pll_operation_t>,
+           std::vector<unsigned int>,
+           std::vector<double>>
+rooted_tree_t::generate_root_update_operations(
+    const root_location_t &new_root) {
+  operation_plan_t plan;
+  fill_root_update_operations(new_root, plan);
+  return std::make_tuple(std::move(plan.ops),
+                         std::move(plan.pmatrix_indices),
+                         std::move(plan.branch_lengths));
+}
 
-  root_op_it->child1_clv_index    = root_node->back->clv_index;
-  root_op_it->child1_scaler_index = root_node->back->scaler_index;
-  root_op_it->child1_matrix_index = root_node->back->pmatrix_index;
+unsigned int rooted_tree_t::directional_clv_count() const {
+  return 3 * (_tree->tip_count - 2);
+}
 
-  root_op_it->child2_clv_index    = root_node->next->back->clv_index;
-  root_op_it->child2_scaler_index = root_node->next->back->scaler_index;
-  root_op_it->child2_matrix_index = root_node->next->back->pmatrix_index;
+std::vector<std::vector<size_t>> rooted_tree_t::root_neighbors() const {
+  std::unordered_map<pll_unode_t *, size_t> edge_ids;
+  edge_ids.reserve(_roots.size() * 2);
+  for (size_t i = 0; i < _roots.size(); ++i) {
+    edge_ids[_roots[i].edge]                = i;
+    edge_ids[_roots[i].edge->back] = i;
+  }
 
-  clear_traversal_data();
-  untag_nodes(old_root.edge);
-  untag_nodes(old_root.edge->back);
+  std::vector<std::vector<size_t>> neighbors(_roots.size());
+  for (size_t i = 0; i < _roots.size(); ++i) {
+    for (auto end : {_roots[i].edge, _roots[i].edge->back}) {
+      if (end->next == nullptr) { continue; }
+      for (auto n = end->next; n != end; n = n->next) {
+        neighbors[i].push_back(edge_ids.at(n));
+      }
+    }
+  }
+  return neighbors;
+}
+
+/*
+ * Depth first search over the adjacency of the roots, only stepping on the
+ * roots we were given. Every root, except the first of each connected group,
+ * comes after one of its neighbors.
+ */
+std::vector<size_t>
+rooted_tree_t::adjacency_order(const std::vector<size_t> &root_ids) const {
+  auto              neighbors = root_neighbors();
+  std::vector<bool> wanted(_roots.size(), false);
+  std::vector<bool> visited(_roots.size(), false);
+  for (auto id : root_ids) { wanted.at(id) = true; }
+
+  std::vector<size_t> order;
+  std::vector<size_t> stack;
+  order.reserve(root_ids.size());
+  for (auto start : root_ids) {
+    if (visited[start]) { continue; }
+    visited[start] = true;
+    stack.push_back(start);
+    while (!stack.empty()) {
+      size_t id = stack.back();
+      stack.pop_back();
+      order.push_back(id);
+      for (auto n : neighbors[id]) {
+        if (wanted[n] && !visited[n]) {
+          visited[n] = true;
+          stack.push_back(n);
+        }
+      }
+    }
+  }
+  return order;
+}
+
+all_edge_operations_t
+rooted_tree_t::generate_all_edge_operations(unsigned int clv_base,
+                                            int          scaler_base,
+                                            unsigned int pmatrix_base) const {
+  all_edge_operations_t result;
+
+  std::unordered_map<pll_unode_t *, unsigned int> edge_ids;
+  edge_ids.reserve(_roots.size() * 2);
+  result.pmatrix_indices.reserve(_roots.size());
+  result.branch_lengths.reserve(_roots.size());
+  for (unsigned int i = 0; i < _roots.size(); ++i) {
+    edge_ids[_roots[i].edge]                = i;
+    edge_ids[_roots[i].edge->back] = i;
+    result.pmatrix_indices.push_back(pmatrix_base + i);
+    result.branch_lengths.push_back(_roots[i].saved_brlen);
+  }
+
+  /* Give every inner unode a slot for its directional CLV */
+  std::unordered_map<pll_unode_t *, unsigned int> slots;
+  unsigned int inner_count = _tree->inner_count;
+  slots.reserve(inner_count * 3);
+  for (unsigned int i = 0; i < inner_count; ++i) {
+    pll_unode_t *node = _tree->nodes[_tree->tip_count + i];
+    for (unsigned int k = 0; k < 3; ++k) {
+      slots[node] = 3 * i + k;
+      node        = node->next;
+    }
+  }
 
-  untag_nodes(_tree->vroot->back);
-  untag_nodes(_tree->vroot->next->back);
+  auto clv_index = [&](pll_unode_t *n) -> unsigned int {
+    return n->next == nullptr ? n->clv_index : clv_base + slots.at(n);
+  };
+  auto scaler_index = [&](pll_unode_t *n) -> int {
+    return n->next == nullptr ? n->scaler_index
+                              : scaler_base + static_cast<int>(slots.at(n));
+  };
 
-  return std::make_tuple(ops, pmatrix_indices, branch_lengths);
-}
+  /*
+   * Post order over the directed edges, using an explicit stack so that large
+   * caterpillar trees don't overflow the call stack. Every directed CLV is
+   * computed exactly once, which is the same work as two full traversals.
+   */
+  std::vector<bool>                           done(slots.size(), false);
+  std::vector<std::pair<pll_unode_t *, bool>> stack;
+  result.ops.reserve(slots.size());
+
+  for (auto &kv : slots) {
+    if (done[kv.second]) { continue; }
+    stack.emplace_back(kv.first, false);
+    while (!stack.empty()) {
+      auto top = stack.back();
+      stack.pop_back();
+      pll_unode_t *node = top.first;
+      if (node->next == nullptr || done[slots.at(node)]) { continue; }
+
+      pll_unode_t *child1 = node->next->back;
+      pll_unode_t *child2 = node->next->next->back;
+
+      if (!top.second) {
+        stack.emplace_back(node, true);
+        stack.emplace_back(child1, false);
+        stack.emplace_back(child2, false);
+        continue;
+      }
 
-void rooted_tree_t::clear_traversal_data() {
-  for (unsigned int i = 0; i < _tree->tip_count; ++i) {
-    _tree->nodes[i]->data = nullptr;
+      pll_operation_t op;
+      op.parent_clv_index    = clv_index(node);
+      op.parent_scaler_index = scaler_index(node);
+      op.child1_clv_index    = clv_index(child1);
+      op.child1_scaler_index = scaler_index(child1);
+      op.child1_matrix_index = pmatrix_base + edge_ids.at(node->next);
+      op.child2_clv_index    = clv_index(child2);
+      op.child2_scaler_index = scaler_index(child2);
+      op.child2_matrix_index = pmatrix_base + edge_ids.at(node->next->next);
+      result.ops.push_back(op);
+      done[slots.at(node)] = true;
+    }
   }
-  for (unsigned int i = _tree->tip_count;
-       i < _tree->tip_count + _tree->inner_count;
-       ++i) {
-    pll_unode_t *start = _tree->nodes[i];
-    pll_unode_t *node  = start;
-    do {
-      node->data = nullptr;
-      node       = node->next;
-    } while (node && node != start);
+
+  result.edges.reserve(_roots.size());
+  for (auto &rl : _roots) {
+    pll_unode_t *other = rl.edge->back;
+    result.edges.push_back({clv_index(rl.edge),
+                            scaler_index(rl.edge),
+                            clv_index(other),
+                            scaler_index(other)});
   }
-  pll_unode_t *start = _tree->vroot;
-  pll_unode_t *node  = start;
-  do {
-    node->data = nullptr;
-    node       = node->next;
-  } while (node && node != start);
+
+  return result;
 }
 
 root_location_t rooted_tree_t::current_root() const {
@@ -705,6 +712,8 @@ void rooted_tree_t::annotate_node(pll_unode_t *      node_id,
   _root_annotations[node_id].emplace_back(key, value);
 }
 
+void rooted_tree_t::clear_newick_annotations() { _root_annotations.clear(); }
+
 void rooted_tree_t::annotate_ratio(size_t node_id, double ratio) {
   annotate_ratio(_roots[node_id], ratio);
 }
@@ -740,64 +749,7 @@ void rooted_tree_t::annotate_branch(const root_location_t &rl,
                                     const std::string &    left_value,
                                     const std::string &    right_value) {
   annotate_node(rl.edge, key, left_value);
-  size_t       node_count = 0;
-  pll_unode_t *start      = rl.edge->back;
-  pll_unode_t *cur        = start;
-
-  if (cur->next) {
-    do {
-      node_count++;
-      cur = cur->next;
-    } while (start != cur);
-  } else {
-    node_count = 1;
-  }
-
-  if (node_count > 2) {
-    annotate_node(rl.edge->back, key, right_value);
-  } else { // We have a root in this case (or a "fake node")
-    annotate_node(rl.edge->back->next->back, key, right_value);
-  }
-}
-
-std::unordered_map<pll_unode_t *, pll_unode_t *>
-rooted_tree_t::make_node_bijection(const rooted_tree_t &other) {
-  std::unordered_map<pll_unode_t *, pll_unode_t *> bijection;
-  auto                                             our_nodes = full_traverse();
-  auto their_nodes = other.full_traverse();
-
-  if (our_nodes.size() != their_nodes.size()) {
-    throw std::runtime_error{
-        "Can't create a bijection between two different sized trees"};
-  }
-
-  for (size_t i = 0; i < our_nodes.size(); ++i) {
-    pll_unode_t *our_cur_node   = our_nodes[i];
-    pll_unode_t *their_cur_node = their_nodes[i];
-    do {
-      bijection[their_cur_node] = our_cur_node;
-      our_cur_node              = our_cur_node->next;
-      their_cur_node            = their_cur_node->next;
-      if (!(our_cur_node == nullptr && their_cur_node == nullptr)
-          && !(our_cur_node != nullptr && their_cur_node != nullptr)) {
-        throw std::runtime_error{"There is a difference in topology discoverd "
-                                 "when trying to make a bijective map"};
-      }
-    } while (our_cur_node != nullptr && their_cur_node != nullptr
-             && our_cur_node != our_nodes[i]
-             && their_cur_node != their_nodes[i]);
-  }
-  return bijection;
-}
-
-void rooted_tree_t::copy_annotations(const rooted_tree_t &other) {
-  auto bijection = make_node_bijection(other);
-
-  for (auto &kv : other._root_annotations) {
-    auto &node                            = kv.first;
-    auto &annotation                      = kv.second;
-    _root_annotations[bijection.at(node)] = annotation;
-  }
+  annotate_node(rl.edge->back, key, right_value);
 }
 
 void get_children_distance_recurse(pll_unode_t *        cur,
@@ -859,31 +811,87 @@ rooted_tree_t::apply_foreach_branch_map_reduce(
   return ret;
 }
 
-std::vector<root_location_t> rooted_tree_t::rank_midpoints() const {
-  auto midpoint_map_func =
-      [](double l_len, double r_len, double brlen) -> double {
-    if (l_len < r_len) { std::swap(l_len, r_len); }
-    double diff = l_len - r_len;
-    if (diff < brlen) {
-      r_len += diff;
-      double adj = (brlen - diff) / 2.0;
-      r_len += adj;
-      l_len += adj;
-    } else {
-      r_len += brlen;
-    }
+/*
+ * For every node, the distance to the farthest tip on its side of the tree,
+ * indexed by node_index. This is done in two passes from a tip, first down to
+ * get the nodes that point away from it, and then back up for the rest, so
+ * each value is computed once, in O(n) for the whole tree.
+ */
+std::vector<double> rooted_tree_t::farthest_tip_distances() const {
+  pll_unode_t *start = _tree->nodes[0];
+
+  std::vector<pll_unode_t *> order;
+  order.reserve(_tree->tip_count + _tree->inner_count);
+  std::vector<pll_unode_t *> stack{start->back};
+  unsigned int               max_index = start->node_index;
+  while (!stack.empty()) {
+    pll_unode_t *node = stack.back();
+    stack.pop_back();
+    order.push_back(node);
+    max_index = std::max(max_index, node->node_index);
+    if (node->next == nullptr) { continue; }
+    max_index = std::max(max_index, node->next->node_index);
+    max_index = std::max(max_index, node->next->next->node_index);
+    stack.push_back(node->next->back);
+    stack.push_back(node->next->next->back);
+  }
+
+  std::vector<double> far(max_index + 1, 0.0);
+  auto                down = [&far](pll_unode_t *node) -> double {
+    return node->length + far[node->back->node_index];
+  };
 
-    double d_tot = r_len + l_len;
+  for (auto it = order.rbegin(); it != order.rend(); ++it) {
+    pll_unode_t *node = *it;
+    if (node->next == nullptr) { continue; }
+    far[node->node_index] = std::max(down(node->next), down(node->next->next));
+  }
 
-    return (1 - (diff * diff) / d_tot) * d_tot;
-  };
+  for (auto node : order) {
+    if (node->next == nullptr) { continue; }
+    double up    = down(node);
+    double left  = down(node->next);
+    double right = down(node->next->next);
+    far[node->next->node_index]       = std::max(right, up);
+    far[node->next->next->node_index] = std::max(left, up);
+  }
 
-  auto midpoint_reduce_func = [](const std::vector<double> &vals) -> double {
-    return *std::max_element(vals.begin(), vals.end());
-  };
+  return far;
+}
 
-  auto midpoint_ranks =
-      apply_foreach_branch_map_reduce(midpoint_map_func, midpoint_reduce_func);
+/*
+ * The distance from the point on the branch closest to the middle of the
+ * longest path through it, to the farthest tip, negated so that the midpoint
+ * scores the highest. l_len and r_len are the distances from the ends of the
+ * branch to the farthest tip on each side. This only grows with l_len and
+ * r_len, so over the pairs of tips of a root, the farthest ones give the
+ * smallest score.
+ */
+double
+rooted_tree_t::midpoint_score(double l_len, double r_len, double brlen) {
+  if (std::abs(l_len - r_len) < brlen) {
+    return -(l_len + r_len + brlen) / 2.0;
+  }
+  return -std::max(l_len, r_len);
+}
+
+std::vector<std::pair<root_location_t, double>>
+rooted_tree_t::midpoint_scores() const {
+  auto far = farthest_tip_distances();
+
+  std::vector<std::pair<root_location_t, double>> ret(_roots.size());
+#pragma omp parallel for
+  for (size_t i = 0; i < _roots.size(); ++i) {
+    auto & rl    = _roots[i];
+    double front = far[rl.edge->node_index];
+    double back  = far[rl.edge->back->node_index];
+    ret[i] = std::make_pair(rl, midpoint_score(front, back, rl.saved_brlen));
+  }
+  return ret;
+}
+
+std::vector<root_location_t> rooted_tree_t::rank_midpoints() const {
+  auto midpoint_ranks = midpoint_scores();
 
   std::sort(midpoint_ranks.begin(),
             midpoint_ranks.end(),
@@ -903,26 +911,48 @@ root_location_t rooted_tree_t::midpoint() const {
   return *rank_midpoints().begin();
 }
 
-std::vector<root_location_t> rooted_tree_t::rank_modified_mad() const {
-  auto mad_map = [](double l_len, double r_len, double brlen) -> double {
-    double dt  = l_len + r_len + brlen;
-    double rho = std::min(std::max((dt - 2 * l_len) / (2 * brlen), 0.0), 1.0);
+double
+rooted_tree_t::mad_deviation(double l_len, double r_len, double brlen) {
+  double dt  = l_len + r_len + brlen;
+  double rho = std::min(std::max((dt - 2 * l_len) / (2 * brlen), 0.0), 1.0);
 
-    l_len    = l_len + rho * brlen;
-    double r = (l_len / dt - 1);
+  l_len    = l_len + rho * brlen;
+  double r = (l_len / dt - 1);
 
-    return r;
-  };
-  auto mad_reduce = [](const std::vector<double> &vals) -> double {
-    double acc = 0.0;
-    for (auto v : vals) { acc += v * v; }
-    acc /= static_cast<double>(vals.size());
+  return r;
+}
 
-    acc = std::sqrt(acc);
-    return acc;
-  };
+/*
+ * Each deviation is a ratio over the length of the path between the pair, so
+ * they don't break down into sums over each side, and moving the root to the
+ * next branch changes every one of them. So every pair still has to be
+ * visited. They are summed as they go, in the same order as
+ * apply_foreach_branch_map_reduce, instead of being stored first.
+ */
+std::vector<std::pair<root_location_t, double>>
+rooted_tree_t::modified_mad_scores() const {
+  std::vector<std::pair<root_location_t, double>> ret(_roots.size());
+#pragma omp parallel for schedule(dynamic)
+  for (size_t i = 0; i < _roots.size(); ++i) {
+    auto &rl              = _roots[i];
+    auto  forward_dists   = get_forward_children_distance(rl.edge);
+    auto  backwards_dists = get_backward_children_distance(rl.edge);
+
+    double acc = 0.0;
+    for (auto fd : forward_dists) {
+      for (auto bd : backwards_dists) {
+        double v = mad_deviation(fd, bd, rl.saved_brlen);
+        acc += v * v;
+      }
+    }
+    acc /= static_cast<double>(forward_dists.size() * backwards_dists.size());
+    ret[i] = std::make_pair(rl, std::sqrt(acc));
+  }
+  return ret;
+}
 
-  auto mad_ranks = apply_foreach_branch_map_reduce(mad_map, mad_reduce);
+std::vector<root_location_t> rooted_tree_t::rank_modified_mad() const {
+  auto mad_ranks = modified_mad_scores();
 
   std::sort(mad_ranks.begin(),
             mad_ranks.end(),
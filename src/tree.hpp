@@ -6,6 +6,7 @@ extern "C" {
 }
 #include "debug.h"
 #include <functional>
+#include <memory>
 #include <stdexcept>
 #include <string>
 #include <unordered_map>
@@ -49,35 +50,93 @@ struct root_location_t {
   }
 };
 
+/*
+ * Indices of the CLVs on either side of a root location. clv1 is the side of
+ * root_location_t::edge, which is the side that gets brlen(), and clv2 is the
+ * other side.
+ */
+struct edge_clv_indices_t {
+  unsigned int clv1;
+  int          scaler1;
+  unsigned int clv2;
+  int          scaler2;
+};
+
+/*
+ * Operations to compute a CLV for every direction of every edge in the tree.
+ * Edge i of the tree, in the order of roots(), uses the pmatrix at
+ * pmatrix_indices[i].
+ */
+struct all_edge_operations_t {
+  std::vector<pll_operation_t>    ops;
+  std::vector<unsigned int>       pmatrix_indices;
+  std::vector<double>             branch_lengths;
+  std::vector<edge_clv_indices_t> edges;
+};
+
+/*
+ * Operations, pmatrix indices and branch lengths to update the CLVs for a root,
+ * filled by the rooted_tree_t::fill_* functions. The vectors are resized to fit
+ * each plan, and keep their capacity, so that reusing a plan does not allocate
+ * once it has been filled for the whole tree.
+ */
+struct operation_plan_t {
+  std::vector<pll_operation_t> ops;
+  std::vector<unsigned int>    pmatrix_indices;
+  std::vector<double>          branch_lengths;
+
+  void reserve(size_t size) {
+    ops.reserve(size);
+    pmatrix_indices.reserve(size);
+    branch_lengths.reserve(size);
+  }
+
+  void resize(size_t ops_size, size_t matrix_size) {
+    ops.resize(ops_size);
+    pmatrix_indices.resize(matrix_size);
+    branch_lengths.resize(matrix_size);
+  }
+};
+
 pll_utree_t *parse_tree_file(const std::string &tree_filename);
 
+/*
+ * A tree with a root placed on one of its edges. The pll_utree_t is never
+ * written to after it is built, so copies of a tree share it, and only carry
+ * their own root placement, annotations and traversal buffers. The root is not
+ * spliced into the tree: its CLV, scaler and the pmatrix of its second child
+ * get the indices past the ones of the unrooted tree, and the operations are
+ * made as if it was there.
+ */
 class rooted_tree_t {
 public:
-  rooted_tree_t() : _tree{nullptr}, _roots{}, _rooted{false} {}
+  rooted_tree_t() :
+      _tree{nullptr},
+      _vroot{nullptr},
+      _current_rl{},
+      _roots{},
+      _rooted{false} {}
 
   rooted_tree_t(const std::string &tree_filename) :
-      _tree{parse_tree_file(tree_filename)}, _roots{}, _rooted{false} {
-    if (_tree == nullptr) {
-      throw std::invalid_argument("Tree file could not be parsed");
-    }
-    generate_root_locations();
-    add_root_space();
-    sort_root_locations();
-  }
+      rooted_tree_t{parse_tree_file(tree_filename),
+                    "Tree file could not be parsed"} {}
 
-  rooted_tree_t(rooted_tree_t &&other) :
-      _tree{std::move(other._tree)},
-      _roots{std::move(other._roots)},
-      _root_annotations{std::move(other._root_annotations)},
-      _rooted{other._rooted} {
-    other._tree = nullptr;
-  }
+  /*
+   * Take ownership of an unrooted tree which is already in memory, without
+   * copying it.
+   */
+  explicit rooted_tree_t(pll_utree_t *tree) :
+      rooted_tree_t{tree, "The tree is empty"} {}
+
+  /* Parse a tree from a newick string instead of a file */
+  static rooted_tree_t from_newick(const std::string &newick);
 
-  rooted_tree_t(const rooted_tree_t &);
-  ~rooted_tree_t();
+  rooted_tree_t(rooted_tree_t &&) = default;
+  rooted_tree_t(const rooted_tree_t &) = default;
+  ~rooted_tree_t() = default;
 
-  rooted_tree_t &operator=(rooted_tree_t &&);
-  rooted_tree_t &operator=(const rooted_tree_t &);
+  rooted_tree_t &operator=(rooted_tree_t &&) = default;
+  rooted_tree_t &operator=(const rooted_tree_t &) = default;
 
   root_location_t root_location(size_t) const;
   root_location_t root_location(const std::string &) const;
@@ -93,6 +152,9 @@ public:
   unsigned int inner_count() const;
   unsigned int branch_count() const;
 
+  /* Number of CLVs past the tips used by the inner nodes and the root */
+  unsigned int inner_clv_count() const;
+
   unsigned int root_clv_index() const;
   int          root_scaler_index() const;
 
@@ -105,6 +167,13 @@ public:
   std::unordered_map<std::string, unsigned int> label_map() const;
   std::unordered_set<std::string>               label_set() const;
 
+  /*
+   * The children of every inner node in postorder, as if the tree was rooted
+   * on the edge of the first tip, ignoring the root. A tip is its node index,
+   * and an inner node is the tip count plus its position in the list.
+   */
+  std::vector<std::pair<size_t, size_t>> inner_children() const;
+
   std::tuple<std::vector<pll_operation_t>,
              std::vector<unsigned int>,
              std::vector<double>>
@@ -118,6 +187,41 @@ public:
              std::vector<double>>
   generate_root_update_operations(const root_location_t &new_root);
 
+  /*
+   * Versions of the generate_* functions above which fill a plan owned by the
+   * caller. Together with the traversal buffers kept by the tree, these don't
+   * allocate after the first call, so they are the ones to use in loops.
+   */
+  void fill_operations(const root_location_t &new_root, operation_plan_t &);
+  void fill_derivative_operations(const root_location_t &root,
+                                  operation_plan_t &);
+  void fill_root_update_operations(const root_location_t &new_root,
+                                   operation_plan_t &);
+
+  /*
+   * Generate the operations for the directional CLVs of every inner node. The
+   * directional CLVs are stored starting at clv_base and scaler_base, and do
+   * not touch the CLVs used for the normal root, so the current root stays
+   * valid. Needs directional_clv_count() extra CLVs and scalers, and
+   * root_count() extra pmatrices starting at pmatrix_base.
+   */
+  all_edge_operations_t
+  generate_all_edge_operations(unsigned int clv_base,
+                               int          scaler_base,
+                               unsigned int pmatrix_base) const;
+
+  unsigned int directional_clv_count() const;
+
+  /* For every root, the ids of the roots on the edges which share a node */
+  std::vector<std::vector<size_t>> root_neighbors() const;
+
+  /*
+   * Order the given root ids so that neighboring roots come one after the
+   * other, as much as possible.
+   */
+  std::vector<size_t>
+  adjacency_order(const std::vector<size_t> &root_ids) const;
+
   void root_by(unsigned int root_id);
   void root_by(const root_location_t &);
   void update_root(root_location_t);
@@ -128,6 +232,17 @@ public:
 
   std::string newick(bool annotations = true) const;
 
+  /*
+   * Write the tree as if it was rooted by the given root location, or rooted
+   * and then unrooted, without copying or rerooting the tree. The strings are
+   * the same as the ones from newick() on a rerooted copy, but the node data
+   * is left alone, so the annotations are looked up as the tree is written.
+   */
+  std::string rooted_newick(const root_location_t &root,
+                            bool                   annotations = true) const;
+  std::string virtual_rooted_newick(const root_location_t &root,
+                                    bool annotations = true) const;
+
   void clear_newick_annotations();
 
   void show_tree() const;
@@ -164,40 +279,78 @@ public:
       const std::function<double(const std::vector<double> &)> &reduce_func)
       const;
 
+  /*
+   * The scores used to rank the roots, for every root in roots(). The midpoint
+   * score of a root is the midpoint_score of the farthest tips on either side
+   * of it, which is the smallest midpoint_score over the pairs of tips. The MAD
+   * score is the root mean square of the mad_deviation of the pairs. These give
+   * the same scores as running the functions through
+   * apply_foreach_branch_map_reduce, but the pairs are not stored.
+   */
+  std::vector<std::pair<root_location_t, double>> midpoint_scores() const;
+  std::vector<std::pair<root_location_t, double>> modified_mad_scores() const;
+
+  static double midpoint_score(double l_len, double r_len, double brlen);
+  static double mad_deviation(double l_len, double r_len, double brlen);
+
 private:
+  rooted_tree_t(pll_utree_t *tree, const char *error);
+
   void sort_root_locations();
   void generate_root_locations();
-  void copy_root_locations(const rooted_tree_t &);
-  void add_root_space();
 
   std::vector<pll_unode_t *> full_traverse() const;
   std::vector<pll_unode_t *> edge_traverse() const;
 
-  void find_path(pll_unode_t *n1, pll_unode_t *n2);
-  bool find_path_recurse(pll_unode_t *n1, pll_unode_t *n2);
+  unsigned int traverse(bool tagged_only);
+  void         traverse_subtree(pll_unode_t *node, bool tagged_only);
+  bool         tag_path(pll_unode_t *node, const root_location_t &target);
+
+  void fill_plan(unsigned int trav_size, operation_plan_t &plan) const;
+  void fill_root_operation(pll_operation_t &op) const;
 
-  void clear_traversal_data();
-  void clear_traversal_data(pll_unode_t *);
+  unsigned int root_pmatrix_index() const;
+  unsigned int pmatrix_index(const pll_unode_t *node) const;
+  double       branch_length(const pll_unode_t *node) const;
+
+  size_t inner_children_recurse(
+      pll_unode_t *                           node,
+      std::vector<std::pair<size_t, size_t>> &children) const;
+
+  std::string unrooted_newick(pll_unode_t *vroot, bool annotations) const;
+  void        append_newick(pll_unode_t *node,
+                            double       length,
+                            bool         annotations,
+                            std::string &out) const;
+  void append_annotation(pll_unode_t *node, std::string &out) const;
 
   void annotate_node(pll_unode_t *      node_id,
                      const std::string &key,
                      const std::string &value);
 
-  void copy_annotations(const rooted_tree_t &other);
-
-  std::unordered_map<pll_unode_t *, pll_unode_t *>
-  make_node_bijection(const rooted_tree_t &other);
-
   std::vector<double> get_forward_children_distance(pll_unode_t *rl) const;
   std::vector<double> get_backward_children_distance(pll_unode_t *rl) const;
-
-  pll_utree_t *                _tree;
-  root_location_t              _current_rl;
-  std::vector<root_location_t> _roots;
+  std::vector<double> farthest_tip_distances() const;
+
+  /*
+   * The shared topology. _vroot is the node that the unrooted newick string
+   * starts from, which moves to the side of the last root when it is unrooted.
+   */
+  std::shared_ptr<const pll_utree_t> _tree;
+  pll_unode_t *                      _vroot;
+  root_location_t                    _current_rl;
+  std::vector<root_location_t>       _roots;
   std::unordered_map<pll_unode_t *,
                      std::vector<std::pair<std::string, std::string>>>
        _root_annotations;
   bool _rooted;
+
+  /*
+   * Scratch space for the traversals. _tagged marks the nodes, by CLV index,
+   * that need to be recomputed when the root moves.
+   */
+  std::vector<pll_unode_t *> _trav_buf;
+  std::vector<bool>          _tagged;
 };
 
 #endif
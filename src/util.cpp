@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <cstddef>
 #include <fstream>
 #include <sstream>
 #include <thread>
@@ -10,6 +12,9 @@
 #endif
 #include "util.hpp"
 #include <omp.h>
+#if defined(__linux__)
+#include <sched.h>
+#endif
 #include <sys/stat.h>
 
 #ifdef _OPENMP
@@ -98,8 +103,148 @@ size_t sysutil_get_cpu_cores() {
   }
 }
 
+/*
+ * List the cpus of each NUMA node, using only the first hardware thread of
+ * each physical core.
+ */
+std::vector<std::vector<size_t>> sysutil_get_numa_cpus() {
+#if defined(__linux__)
+  auto                             lcores = std::thread::hardware_concurrency();
+  std::vector<std::vector<size_t>> nodes;
+  std::unordered_set<size_t>       cores;
+  for (size_t i = 0; i < lcores; ++i) {
+    std::string cpu_path     = build_path(i);
+    size_t      core_id      = get_core_id(cpu_path);
+    size_t      node_id      = get_numa_node_id(cpu_path);
+    size_t      uniq_core_id = (node_id << 16) + core_id;
+    if (!cores.insert(uniq_core_id).second) { continue; }
+    if (nodes.size() <= node_id) { nodes.resize(node_id + 1); }
+    nodes[node_id].push_back(i);
+  }
+  nodes.erase(std::remove_if(nodes.begin(),
+                             nodes.end(),
+                             [](const std::vector<size_t> &n) -> bool {
+                               return n.empty();
+                             }),
+              nodes.end());
+  return nodes;
+#else
+  throw std::runtime_error("This function only supports linux");
+#endif
+}
+
+/*
+ * Pick a cpu for each thread of a process, given the rank of the process among
+ * the processes on the same host. The processes are spread evenly over the
+ * NUMA nodes. If there are more processes than nodes, the processes on a node
+ * split its cores between them. Otherwise, each process gets all the cores of
+ * one or more nodes.
+ */
+std::vector<size_t>
+sysutil_get_thread_cpus(size_t local_rank, size_t local_size, size_t threads) {
+  auto nodes = sysutil_get_numa_cpus();
+  if (nodes.empty() || local_size == 0 || local_rank >= local_size) {
+    throw std::runtime_error("Failed to map the process to a NUMA node");
+  }
+
+  std::vector<size_t> cpus;
+  if (local_size >= nodes.size()) {
+    size_t node       = local_rank * nodes.size() / local_size;
+    size_t first_rank = (node * local_size + nodes.size() - 1) / nodes.size();
+    size_t node_ranks = ((node + 1) * local_size + nodes.size() - 1)
+                            / nodes.size()
+                        - first_rank;
+    auto & node_cpus  = nodes[node];
+    size_t chunk      = std::max<size_t>(1, node_cpus.size() / node_ranks);
+    size_t begin      = ((local_rank - first_rank) * chunk) % node_cpus.size();
+    size_t end        = std::min(begin + chunk, node_cpus.size());
+    cpus.assign(node_cpus.begin() + static_cast<std::ptrdiff_t>(begin),
+                node_cpus.begin() + static_cast<std::ptrdiff_t>(end));
+  } else {
+    size_t begin = local_rank * nodes.size() / local_size;
+    size_t end   = (local_rank + 1) * nodes.size() / local_size;
+    for (size_t node = begin; node < end; ++node) {
+      cpus.insert(cpus.end(), nodes[node].begin(), nodes[node].end());
+    }
+  }
+
+  std::vector<size_t> thread_cpus(threads);
+  for (size_t i = 0; i < threads; ++i) {
+    thread_cpus[i] = cpus[i % cpus.size()];
+  }
+  return thread_cpus;
+}
+
+/*
+ * The cpus the threads of this process were pinned to, so that the workers
+ * made later with std::thread can be pinned to their share of them.
+ */
+static std::vector<size_t> pinned_cpus;
+
+/*
+ * Pin the OpenMP threads of the calling thread to the given cpus, one cpu per
+ * thread.
+ */
+static bool pin_team(const std::vector<size_t> &cpus) {
+#if defined(__linux__)
+  bool pinned = true;
+#pragma omp parallel reduction(&& : pinned)
+  {
+    size_t    thread = static_cast<size_t>(omp_get_thread_num());
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpus[thread % cpus.size()], &set);
+    pinned = sched_setaffinity(0, sizeof(set), &set) == 0;
+  }
+  return pinned;
+#else
+  (void)(cpus);
+  return false;
+#endif
+}
+
+/*
+ * Pin each OpenMP thread to its cpu. The main thread is OpenMP thread 0, and
+ * keeps its cpu. Threads made later with std::thread inherit that cpu, so the
+ * workers have to call sysutil_pin_worker to get their own.
+ */
+bool sysutil_pin_threads(const std::vector<size_t> &cpus) {
+  if (cpus.empty()) { return false; }
+  if (!pin_team(cpus)) { return false; }
+  pinned_cpus = cpus;
+  return true;
+}
+
+/*
+ * Pin the calling worker thread, and its OpenMP threads, to an even share of
+ * the cpus given to sysutil_pin_threads. Does nothing if the process was not
+ * pinned.
+ */
+bool sysutil_pin_worker(size_t worker, size_t workers) {
+  if (pinned_cpus.empty() || workers == 0) { return false; }
+  size_t count = pinned_cpus.size();
+  size_t begin = worker * count / workers;
+  size_t end   = (worker + 1) * count / workers;
+  if (begin == end) {
+    begin = begin % count;
+    end   = begin + 1;
+  }
+  return pin_team(std::vector<size_t>(
+      pinned_cpus.begin() + static_cast<std::ptrdiff_t>(begin),
+      pinned_cpus.begin() + static_cast<std::ptrdiff_t>(end)));
+}
+
 #else
 size_t sysutil_get_cpu_cores() { return 1; }
+
+std::vector<size_t>
+sysutil_get_thread_cpus(size_t, size_t, size_t threads) {
+  return std::vector<size_t>(threads, 0);
+}
+
+bool sysutil_pin_threads(const std::vector<size_t> &) { return false; }
+
+bool sysutil_pin_worker(size_t, size_t) { return false; }
 #endif
 
 std::string combine_argv_argc(int argv, char **argc) {
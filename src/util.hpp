@@ -25,8 +25,24 @@ size_t get_physical_core_count(size_t n_cpu);
 bool ht_enabled();
 
 size_t sysutil_get_cpu_cores();
+
+std::vector<std::vector<size_t>> sysutil_get_numa_cpus();
+
+std::vector<size_t>
+sysutil_get_thread_cpus(size_t local_rank, size_t local_size, size_t threads);
+
+bool sysutil_pin_threads(const std::vector<size_t> &cpus);
+
+bool sysutil_pin_worker(size_t worker, size_t workers);
 #else
 size_t sysutil_get_cpu_cores();
+
+std::vector<size_t>
+sysutil_get_thread_cpus(size_t local_rank, size_t local_size, size_t threads);
+
+bool sysutil_pin_threads(const std::vector<size_t> &cpus);
+
+bool sysutil_pin_worker(size_t worker, size_t workers);
 #endif
 
 std::string combine_argv_argc(int argv, char **argc);
@@ -76,6 +92,10 @@ namespace asc_bias_type {
 enum asc_bias_type_e { lewis, fels, stam };
 }
 
+namespace tip_kernel {
+enum tip_kernel_e { automatic, site_repeats, pattern_tip };
+}
+
 struct initial_root_strategy_t {
   enum initial_root_strategy_e { random, midpoint, modified_mad };
   initial_root_strategy_e strategy;
@@ -175,22 +195,43 @@ struct cli_options_t {
   std::string                 partition_filename;
   std::string                 data_type;
   std::string                 model_string;
-  std::vector<ratehet_opts_t> rate_cats       = {1};
-  uint64_t                    seed            = std::random_device()();
-  size_t                      min_roots       = 1;
-  size_t                      threads         = 0;
-  double                      root_ratio      = 0.01;
-  double                      abs_tolerance   = 1e-7;
-  double                      factor          = 1e4;
-  double                      br_tolerance    = 1e-12;
-  double                      bfgs_tol        = 1e-7;
-  unsigned int                states          = 4;
-  bool                        silent          = false;
-  bool                        exhaustive      = false;
-  bool                        echo            = false;
-  bool                        invariant_sites = false;
-  bool                        clean           = false;
+  std::string                 msa_cache_filename;
+  std::string                 write_msa_cache_filename;
+  std::string                 batch_filename;
+  std::vector<ratehet_opts_t> rate_cats        = {1};
+  uint64_t                    seed             = std::random_device()();
+  size_t                      min_roots        = 1;
+  size_t                      threads          = 0;
+  size_t                      replicas         = 1;
+  size_t                      site_blocks      = 0;
+  size_t                      checkpoint_batch = 1;
+  size_t                      bootstraps       = 0;
+  size_t                      max_evals        = 0;
+  double                      root_ratio       = 0.01;
+  double                      abs_tolerance    = 1e-7;
+  double                      factor           = 1e4;
+  double                      br_tolerance     = 1e-12;
+  double                      bfgs_tol         = 1e-7;
+  double                      prune_threshold  = 0.0;
+  double                      checkpoint_delay = 0.0;
+  double                      time_limit       = 0.0;
+  unsigned int                states           = 4;
+  bool                        silent           = false;
+  bool                        exhaustive       = false;
+  bool                        echo             = false;
+  bool                        invariant_sites  = false;
+  bool                        clean            = false;
+  bool                        newton_alpha     = false;
+  bool                        joint_params     = false;
+  bool                        screen_roots     = false;
+  bool                        dynamic_schedule = true;
+  bool                        no_extra_clvs    = false;
+  bool                        warm_start       = false;
+  bool                        pin_threads      = false;
+  bool                        memory_estimate  = false;
+  bool                        profile          = false;
   initialized_flag_t          early_stop;
+  tip_kernel::tip_kernel_e    tip_kernel_mode  = tip_kernel::automatic;
 
   initial_root_strategy_t initial_root_strategy = {
       initial_root_strategy_t::modified_mad};
@@ -0,0 +1,50 @@
+#include "warm_start.hpp"
+#include <stdexcept>
+
+warm_start_cache_t::warm_start_cache_t(
+    std::vector<std::vector<size_t>> neighbors) :
+    _neighbors{std::move(neighbors)} {}
+
+void warm_start_cache_t::insert(
+    size_t                                     root_id,
+    double                                     lh,
+    const std::vector<partition_parameters_t> &params) {
+  if (root_id >= _neighbors.size()) {
+    throw std::out_of_range("Root id is out of range for the warm start cache");
+  }
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  auto it = _entries.find(root_id);
+  if (it == _entries.end()) {
+    _entries.emplace(root_id, entry_t{lh, params});
+  } else if (lh > it->second.lh) {
+    it->second = {lh, params};
+  }
+}
+
+bool warm_start_cache_t::lookup(
+    size_t root_id, std::vector<partition_parameters_t> &params) const {
+  if (root_id >= _neighbors.size()) {
+    throw std::out_of_range("Root id is out of range for the warm start cache");
+  }
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  const entry_t *best     = nullptr;
+  auto           consider = [&](size_t id) {
+    auto it = _entries.find(id);
+    if (it == _entries.end()) { return; }
+    if (best == nullptr || it->second.lh > best->lh) { best = &it->second; }
+  };
+
+  consider(root_id);
+  for (auto n : _neighbors[root_id]) { consider(n); }
+
+  if (best == nullptr) { return false; }
+  params = best->params;
+  return true;
+}
+
+size_t warm_start_cache_t::size() const {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _entries.size();
+}
@@ -0,0 +1,45 @@
+#ifndef RD_WARM_START_HPP_
+#define RD_WARM_START_HPP_
+
+#include "util.hpp"
+#include <cstddef>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Keeps the best optimized parameters found so far for each root, so that the
+ * optimization of a root can start from the parameters of an adjacent root,
+ * which are usually very close to the optimum. The cache is shared by the
+ * threads of a process, so all of the methods lock.
+ */
+class warm_start_cache_t {
+public:
+  /* neighbors[i] are the ids of the roots adjacent to root i */
+  explicit warm_start_cache_t(std::vector<std::vector<size_t>> neighbors);
+
+  void insert(size_t                                     root_id,
+              double                                     lh,
+              const std::vector<partition_parameters_t> &params);
+
+  /*
+   * Copy the parameters of the best finished root out of root_id and the roots
+   * adjacent to it into params. Returns false, and leaves params alone, if
+   * none of them are finished.
+   */
+  bool lookup(size_t root_id, std::vector<partition_parameters_t> &params) const;
+
+  size_t size() const;
+
+private:
+  struct entry_t {
+    double                              lh;
+    std::vector<partition_parameters_t> params;
+  };
+
+  std::vector<std::vector<size_t>>    _neighbors;
+  std::unordered_map<size_t, entry_t> _entries;
+  mutable std::mutex                  _mutex;
+};
+
+#endif
@@ -0,0 +1,186 @@
+#include "work_queue.hpp"
+#include "profile.hpp"
+#include <algorithm>
+#include <string>
+
+work_queue_t::work_queue_t(const std::vector<size_t> &work,
+                           bool                       dynamic,
+                           size_t                     workers,
+                           bool                       local) :
+    _work{work},
+    _position{0},
+    _completed{0},
+    _dynamic{dynamic && !local},
+    _local{local},
+    _stopped{false},
+    _start_time{clock_t::now()},
+    _busy(std::max<size_t>(workers, 1), false),
+    _busy_start(std::max<size_t>(workers, 1)),
+    _busy_time(std::max<size_t>(workers, 1), 0.0) {
+#ifdef MPI_VERSION
+  _window  = MPI_WIN_NULL;
+  _counter = nullptr;
+  if (_dynamic) {
+    MPI_Aint window_size = __MPI_RANK__ == 0 ? sizeof(uint64_t) : 0;
+    MPI_Win_allocate(window_size,
+                     sizeof(uint64_t),
+                     MPI_INFO_NULL,
+                     MPI_COMM_WORLD,
+                     &_counter,
+                     &_window);
+    if (__MPI_RANK__ == 0) {
+      MPI_Win_lock(MPI_LOCK_EXCLUSIVE, 0, 0, _window);
+      *_counter = 0;
+      MPI_Win_unlock(0, _window);
+    }
+    profile::mpi_barrier();
+  }
+#else
+  _dynamic = false;
+#endif
+}
+
+work_queue_t::~work_queue_t() {
+#ifdef MPI_VERSION
+  if (_dynamic) { MPI_Win_free(&_window); }
+#endif
+}
+
+uint64_t work_queue_t::fetch_next_position() {
+#ifdef MPI_VERSION
+  if (_dynamic) {
+    const uint64_t one = 1;
+    uint64_t       pos = 0;
+    MPI_Win_lock(MPI_LOCK_SHARED, 0, 0, _window);
+    MPI_Fetch_and_op(&one, &pos, MPI_UINT64_T, 0, 0, MPI_SUM, _window);
+    MPI_Win_unlock(0, _window);
+    return pos;
+  }
+#endif
+  return _position;
+}
+
+bool work_queue_t::next(size_t &work_item, size_t worker) {
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  auto now = clock_t::now();
+  if (_busy[worker]) {
+    _busy_time[worker] +=
+        std::chrono::duration<double>(now - _busy_start[worker]).count();
+    _completed++;
+  }
+
+  if (_stopped) {
+    _busy[worker] = false;
+    return false;
+  }
+
+  uint64_t pos = fetch_next_position();
+  if (pos >= _work.size()) {
+    _busy[worker] = false;
+    _position     = _work.size();
+    return false;
+  }
+
+  _position           = std::max(_position, static_cast<size_t>(pos + 1));
+  work_item           = _work[pos];
+  _busy[worker]       = true;
+  _busy_start[worker] = now;
+  return true;
+}
+
+void work_queue_t::stop() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_stopped) { return; }
+  _stopped = true;
+#ifdef MPI_VERSION
+  /*
+   * This is a sum like the fetches, so that only one kind of atomic operation
+   * is used on the counter. Adding the size puts it past the end for good.
+   */
+  if (_dynamic) {
+    const uint64_t end = _work.size();
+    uint64_t       pos = 0;
+    MPI_Win_lock(MPI_LOCK_SHARED, 0, 0, _window);
+    MPI_Fetch_and_op(&end, &pos, MPI_UINT64_T, 0, 0, MPI_SUM, _window);
+    MPI_Win_unlock(0, _window);
+  }
+#endif
+}
+
+bool work_queue_t::stopped() const {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _stopped;
+}
+
+double work_queue_t::utilization() const {
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  auto   now       = clock_t::now();
+  double wall_time = std::chrono::duration<double>(now - _start_time).count();
+  if (wall_time <= 0.0) { return 1.0; }
+
+  double total = 0.0;
+  for (size_t i = 0; i < _busy_time.size(); ++i) {
+    double busy_time = _busy_time[i];
+    if (_busy[i]) {
+      busy_time +=
+          std::chrono::duration<double>(now - _busy_start[i]).count();
+    }
+    total += std::min(busy_time / wall_time, 1.0);
+  }
+  return total / static_cast<double>(_busy_time.size());
+}
+
+void work_queue_t::report_utilization() const {
+  std::vector<double>   utilizations{utilization()};
+  std::vector<uint64_t> completed{_completed};
+
+#ifdef MPI_VERSION
+  if (_local) {
+    debug_print(EMIT_LEVEL_INFO,
+                "%lu roots, utilization: %.2f%%",
+                completed[0],
+                utilizations[0] * 100.0);
+    return;
+  }
+  double   local_utilization = utilizations[0];
+  uint64_t local_completed   = completed[0];
+  if (__MPI_RANK__ == 0) {
+    utilizations.resize(static_cast<size_t>(__MPI_NUM_TASKS__));
+    completed.resize(static_cast<size_t>(__MPI_NUM_TASKS__));
+  }
+  MPI_Gather(&local_utilization,
+             1,
+             MPI_DOUBLE,
+             utilizations.data(),
+             1,
+             MPI_DOUBLE,
+             0,
+             MPI_COMM_WORLD);
+  MPI_Gather(&local_completed,
+             1,
+             MPI_UINT64_T,
+             completed.data(),
+             1,
+             MPI_UINT64_T,
+             0,
+             MPI_COMM_WORLD);
+#endif
+
+  if (__MPI_RANK__ != 0) { return; }
+
+  double total = 0.0;
+  for (size_t i = 0; i < utilizations.size(); ++i) {
+    debug_print(EMIT_LEVEL_INFO,
+                "Rank %lu: %lu roots, utilization: %.2f%%",
+                i,
+                completed[i],
+                utilizations[i] * 100.0);
+    total += utilizations[i];
+  }
+  debug_print(EMIT_LEVEL_PROGRESS,
+              "Mean process utilization (%s scheduling): %.2f%%",
+              _dynamic ? "dynamic" : "static",
+              total / static_cast<double>(utilizations.size()) * 100.0);
+}
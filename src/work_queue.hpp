@@ -0,0 +1,95 @@
+#ifndef RD_WORK_QUEUE_HPP_
+#define RD_WORK_QUEUE_HPP_
+
+#include "debug.h"
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#ifdef MPI_BUILD
+#include <mpi.h>
+#endif
+#include <vector>
+
+/*
+ * Hands out root indices to the processes. In the static mode, each process
+ * simply walks over the list it was given. In the dynamic mode, all processes
+ * are given the same list, and the next position in the list is kept in a
+ * shared counter on rank 0, which is incremented with a one-sided atomic
+ * fetch-and-add. This way, processes which get cheap roots just take more
+ * roots, instead of waiting at the barrier for the slow ones.
+ *
+ * Construction and destruction are collective when dynamic is set, as is
+ * report_utilization. A local queue is only used by this process, even in an
+ * MPI run, so it is never dynamic, and nothing about it is collective.
+ *
+ * Within a process, several workers (threads) can take work from the same
+ * queue. Each worker gets its own busy time accounting.
+ *
+ * A queue can be stopped early, when the search runs out of budget. Stopping a
+ * dynamic queue uses up the shared counter, so the other processes get no more
+ * work either, and stop at their next call to next.
+ */
+class work_queue_t {
+public:
+  work_queue_t(const std::vector<size_t> &work,
+               bool                       dynamic,
+               size_t                     workers = 1,
+               bool                       local   = false);
+  ~work_queue_t();
+
+  work_queue_t(const work_queue_t &) = delete;
+  work_queue_t &operator=(const work_queue_t &) = delete;
+
+  /*
+   * Get the next piece of work. Returns false when there is no work left. The
+   * time between calls to next is accounted as busy time.
+   */
+  bool next(size_t &work_item) { return next(work_item, 0); }
+  bool next(size_t &work_item, size_t worker);
+
+  /* Work which was already handed out is not affected */
+  void stop();
+
+  size_t size() const { return _work.size(); }
+  size_t position() const { return _position; }
+  size_t completed() const { return _completed; }
+  bool   dynamic() const { return _dynamic; }
+  bool   stopped() const;
+
+  /*
+   * Fraction of the wall time since construction spent doing work, averaged
+   * over the workers.
+   */
+  double utilization() const;
+
+  /*
+   * Print the number of roots done and the utilization for each rank. Should
+   * be called after all processes are done, so that the idle time at the end
+   * is counted.
+   */
+  void report_utilization() const;
+
+private:
+  typedef std::chrono::high_resolution_clock clock_t;
+
+  uint64_t fetch_next_position();
+
+  std::vector<size_t>              _work;
+  size_t                           _position;
+  size_t                           _completed;
+  bool                             _dynamic;
+  bool                             _local;
+  bool                             _stopped;
+  clock_t::time_point              _start_time;
+  std::vector<bool>                _busy;
+  std::vector<clock_t::time_point> _busy_start;
+  std::vector<double>              _busy_time;
+  mutable std::mutex               _mutex;
+#ifdef MPI_VERSION
+  MPI_Win   _window;
+  uint64_t *_counter;
+#endif
+};
+
+#endif
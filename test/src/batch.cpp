@@ -0,0 +1,105 @@
+#include <algorithm>
+#include <batch.hpp>
+#include <catch2/catch.hpp>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+TEST_CASE("batch parse job", "[batch]") {
+  batch_job_t job;
+
+  SECTION("all columns") {
+    CHECK(parse_batch_job("a.fasta a.tree a.part out/a", job));
+    CHECK(job.msa_filename == "a.fasta");
+    CHECK(job.tree_filename == "a.tree");
+    CHECK(job.partition_filename == "a.part");
+    CHECK(job.prefix == "out/a");
+  }
+
+  SECTION("no partition file") {
+    CHECK(parse_batch_job("  a.fasta\ta.tree   -  out/a ", job));
+    CHECK(job.partition_filename.empty());
+    CHECK(job.prefix == "out/a");
+  }
+
+  SECTION("default prefix") {
+    CHECK(parse_batch_job("a.fasta a.tree", job));
+    CHECK(job.partition_filename.empty());
+    CHECK(job.prefix == "a.tree");
+  }
+
+  SECTION("lines without a job") {
+    CHECK_FALSE(parse_batch_job("", job));
+    CHECK_FALSE(parse_batch_job("   \t", job));
+    CHECK_FALSE(parse_batch_job("# a.fasta a.tree", job));
+  }
+
+  SECTION("malformed lines") {
+    CHECK_THROWS_AS(parse_batch_job("a.fasta", job), std::runtime_error);
+    CHECK_THROWS_AS(parse_batch_job("a b c d e", job), std::runtime_error);
+  }
+}
+
+TEST_CASE("batch parse file", "[batch]") {
+  std::string filename = "/tmp/rd_test.batch";
+
+  SECTION("jobs in order") {
+    {
+      std::ofstream outfile{filename};
+      outfile << "# msa tree partition prefix\n"
+              << "a.fasta a.tree\n"
+              << "\n"
+              << "b.fasta b.tree b.part b\n";
+    }
+    auto jobs = parse_batch_file(filename);
+    REQUIRE(jobs.size() == 2);
+    CHECK(jobs[0].prefix == "a.tree");
+    CHECK(jobs[1].partition_filename == "b.part");
+    CHECK(jobs[1].prefix == "b");
+  }
+
+  SECTION("duplicate prefixes") {
+    {
+      std::ofstream outfile{filename};
+      outfile << "a.fasta a.tree - out\n"
+              << "b.fasta b.tree - out\n";
+    }
+    CHECK_THROWS_AS(parse_batch_file(filename), std::runtime_error);
+  }
+
+  CHECK_THROWS(parse_batch_file("/nonexistent/rd.batch"));
+}
+
+TEST_CASE("batch assign jobs", "[batch]") {
+  std::vector<double> costs{1.0, 10.0, 4.0, 6.0, 3.0, 3.0};
+
+  SECTION("one rank gets everything, biggest first") {
+    auto jobs = assign_batch_jobs(costs, 0, 1);
+    CHECK(jobs == std::vector<size_t>{1, 3, 2, 4, 5, 0});
+  }
+
+  SECTION("ranks split the jobs") {
+    size_t              num_tasks = 3;
+    std::vector<size_t> seen;
+    std::vector<double> loads;
+    for (size_t rank = 0; rank < num_tasks; ++rank) {
+      auto   jobs = assign_batch_jobs(costs, rank, num_tasks);
+      double load = 0.0;
+      for (auto j : jobs) {
+        seen.push_back(j);
+        load += costs[j];
+      }
+      loads.push_back(load);
+    }
+    std::sort(seen.begin(), seen.end());
+    CHECK(seen == std::vector<size_t>{0, 1, 2, 3, 4, 5});
+    CHECK(*std::max_element(loads.begin(), loads.end()) == 10.0);
+  }
+
+  SECTION("more ranks than jobs") {
+    CHECK(assign_batch_jobs(costs, 7, 8).empty());
+  }
+
+  CHECK_THROWS_AS(assign_batch_jobs(costs, 3, 3), std::invalid_argument);
+  CHECK_THROWS_AS(assign_batch_jobs(costs, 0, 0), std::invalid_argument);
+}
@@ -0,0 +1,96 @@
+#include "data.hpp"
+#include "test_util.hpp"
+#include <bootstrap.hpp>
+#include <catch2/catch.hpp>
+#include <checkpoint.hpp>
+#include <numeric>
+#include <random>
+#include <root_digger.hpp>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+TEST_CASE("bootstrap weights", "[bootstrap]") {
+  std::minstd_rand engine{1234};
+
+  SECTION("the total weight is kept") {
+    std::vector<unsigned int> weights{3, 1, 7, 2, 1};
+    for (size_t i = 0; i < 10; ++i) {
+      auto sampled = bootstrap_weights(weights.data(), weights.size(), engine);
+      REQUIRE(sampled.size() == weights.size());
+      CHECK(std::accumulate(sampled.begin(), sampled.end(), 0u) == 14u);
+    }
+  }
+
+  SECTION("patterns without weight are never picked") {
+    std::vector<unsigned int> weights{0, 5, 0, 5};
+    auto sampled = bootstrap_weights(weights.data(), weights.size(), engine);
+    CHECK(sampled[0] == 0);
+    CHECK(sampled[2] == 0);
+    CHECK(sampled[1] + sampled[3] == 10);
+  }
+
+  SECTION("patterns are picked by weight") {
+    std::vector<unsigned int> weights{1000, 9000};
+    auto sampled = bootstrap_weights(weights.data(), weights.size(), engine);
+    CHECK(sampled[0] > 700);
+    CHECK(sampled[0] < 1300);
+  }
+
+  SECTION("the same seed gives the same weights") {
+    std::vector<unsigned int> weights{3, 1, 7, 2, 1};
+    std::minstd_rand          a{42}, b{42};
+    CHECK(bootstrap_weights(weights.data(), weights.size(), a)
+          == bootstrap_weights(weights.data(), weights.size(), b));
+  }
+
+  CHECK(bootstrap_weights(nullptr, 0, engine).empty());
+}
+
+TEST_CASE("bootstrap root support", "[bootstrap]") {
+  CHECK(root_support({2, 0, 2, 2}, 4)
+        == std::vector<double>{0.25, 0.0, 0.75, 0.0});
+  CHECK(root_support({}, 2) == std::vector<double>{0.0, 0.0});
+  CHECK_THROWS_AS(root_support({4}, 4), std::out_of_range);
+}
+
+TEST_CASE("bootstrap support with checkpoint files", "[bootstrap]") {
+  auto &             ds = data_files_dna["10.fasta"];
+  std::vector<msa_t> msa;
+  msa.emplace_back(ds.first);
+  rooted_tree_t tree{ds.second};
+
+  std::random_device rd;
+  uint64_t           nonce =
+      (static_cast<uint64_t>(rd()) << 32) | static_cast<uint64_t>(rd());
+  cli_options_t options;
+  options.seed       = 1234;
+  options.exhaustive = true;
+  options.bootstraps = 2;
+  options.prefix = std::string("/tmp/bootstrap_test_") + base_58_encode(nonce);
+
+  auto model = make_model(tree, msa, options, options.seed);
+  model->set_local(true);
+  auto support =
+      bootstrap_support(*model, msa, options, tree.root_count(), 0, 1, true);
+  REQUIRE(support.size() == tree.root_count());
+  CHECK(std::accumulate(support.begin(), support.end(), 0.0) == Approx(1.0));
+
+  for (size_t r = 0; r < options.bootstraps; ++r) {
+    checkpoint_t checkpoint(options.prefix + ".bs" + std::to_string(r));
+    REQUIRE(checkpoint.existing_checkpoint());
+    cli_options_t saved;
+    checkpoint.load_options(saved);
+    CHECK(saved.bootstraps == options.bootstraps);
+    checkpoint.reload();
+    CHECK(checkpoint.completed_indicies().size() == tree.root_count());
+  }
+
+  SECTION("a resumed run reads the replicates back") {
+    auto resumed = make_model(tree, msa, options, options.seed);
+    resumed->set_local(true);
+    CHECK(bootstrap_support(
+              *resumed, msa, options, tree.root_count(), 0, 1, true)
+          == support);
+  }
+}
@@ -5,6 +5,7 @@
 #include <checkpoint.hpp>
 #include <debug.h>
 #include <random>
+#include <thread>
 #include <unistd.h>
 #include <vector>
 
@@ -113,3 +114,159 @@ TEST_CASE("checkpoint_t checking indicies", "[checkpoint_t]") {
     }
   }
 }
+
+TEST_CASE("checkpoint_t sharded results", "[checkpoint_t]") {
+  checkpoint_t ckp = make_and_init_checkpoint();
+  for (size_t i = 0; i < 10; ++i) {
+    ckp.write(rd_result_t{i, 0.0, 0.0}, std::vector<partition_parameters_t>{});
+  }
+  REQUIRE(access(ckp.get_shard_filename().c_str(), F_OK) != -1);
+  CHECK(ckp.shard_filenames().size() == 1);
+
+  SECTION("merging") {
+    auto results = ckp.merge();
+    CHECK(results.size() == 10);
+    CHECK(access(ckp.get_shard_filename().c_str(), F_OK) == -1);
+    CHECK(ckp.shard_filenames().empty());
+    CHECK(ckp.read_results().size() == 10);
+    CHECK_FALSE(ckp.needs_cleaning());
+
+    ckp.write(rd_result_t{10, 0.0, 0.0},
+              std::vector<partition_parameters_t>{});
+    CHECK(ckp.read_results().size() == 11);
+  }
+}
+
+TEST_CASE("checkpoint_t reading single file checkpoints", "[checkpoint_t]") {
+  std::string checkpoint_filename = make_checkpoint_filename();
+  {
+    int fd = open((checkpoint_filename + ".ckp").c_str(),
+                  O_RDWR | O_APPEND | O_CREAT,
+                  0640);
+    REQUIRE(fd != -1);
+    cli_options_t cli_options;
+    write_with_success(fd, cli_options);
+    for (size_t i = 0; i < 5; ++i) {
+      write_with_checksum(fd, rd_result_t{i, 0.0, 0.0});
+      write_with_checksum(fd, std::vector<partition_parameters_t>{});
+    }
+    close(fd);
+  }
+  checkpoint_t ckp(checkpoint_filename);
+  CHECK(ckp.existing_checkpoint());
+  CHECK(ckp.completed_indicies().size() == 5);
+
+  ckp.write(rd_result_t{5, 0.0, 0.0}, std::vector<partition_parameters_t>{});
+  CHECK(ckp.read_results().size() == 6);
+  CHECK(ckp.merge().size() == 6);
+  CHECK(ckp.read_results().size() == 6);
+}
+
+TEST_CASE("checkpoint_t batched writes", "[checkpoint_t]") {
+  checkpoint_t        ckp = make_and_init_checkpoint();
+  checkpoint_policy_t policy;
+
+  SECTION("every result is read back after a flush") {
+    policy.max_records = 16;
+    ckp.set_policy(policy);
+    for (size_t i = 0; i < 100; ++i) {
+      ckp.write(rd_result_t{i, 0.0, 0.0},
+                std::vector<partition_parameters_t>{});
+    }
+    CHECK(ckp.read_results().size() == 100);
+  }
+
+  SECTION("results are written after the delay") {
+    policy.max_records = 1000;
+    policy.max_delay   = 0.01;
+    ckp.set_policy(policy);
+    ckp.write(rd_result_t{0, 0.0, 0.0}, std::vector<partition_parameters_t>{});
+    usleep(200000);
+    CHECK(ckp.read_results().size() == 1);
+  }
+
+  SECTION("threads share the queue") {
+    policy.max_records = 4;
+    policy.max_queued  = 8;
+    ckp.set_policy(policy);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < 4; ++t) {
+      threads.emplace_back([&ckp, t]() {
+        for (size_t i = 0; i < 50; ++i) {
+          ckp.write(rd_result_t{t * 50 + i, 0.0, 0.0},
+                    std::vector<partition_parameters_t>{});
+        }
+      });
+    }
+    for (auto &t : threads) { t.join(); }
+    auto idx = ckp.completed_indicies();
+    std::sort(idx.begin(), idx.end());
+    REQUIRE(idx.size() == 200);
+    for (size_t i = 0; i < idx.size(); ++i) { CHECK(idx[i] == i); }
+  }
+
+  SECTION("a partial record at the end is skipped") {
+    for (size_t i = 0; i < 5; ++i) {
+      ckp.write(rd_result_t{i, 0.0, 0.0},
+                std::vector<partition_parameters_t>{});
+    }
+    ckp.flush(true);
+    {
+      int fd = open(ckp.get_shard_filename().c_str(), O_WRONLY | O_APPEND);
+      REQUIRE(fd != -1);
+      rd_result_t partial{5, 0.0, 0.0};
+      REQUIRE(::write(fd, &partial, sizeof(partial) / 2) > 0);
+      close(fd);
+    }
+    CHECK(ckp.read_results().size() == 5);
+    CHECK(ckp.needs_cleaning());
+  }
+}
+
+TEST_CASE("checkpoint_t merging queued results from another rank",
+          "[checkpoint_t]") {
+  std::string  checkpoint_filename = make_checkpoint_filename();
+  checkpoint_t ckp(checkpoint_filename);
+  ckp.save_options(cli_options_t{});
+
+  /* Stands in for the checkpoint of rank 1, which writes its own shard */
+  checkpoint_t        other(checkpoint_filename);
+  checkpoint_policy_t policy;
+  policy.max_records = 1000;
+  other.set_policy(policy);
+  __MPI_RANK__ = 1;
+  for (size_t i = 0; i < 3; ++i) {
+    other.write(rd_result_t{i, 0.0, 0.0},
+                std::vector<partition_parameters_t>{});
+  }
+  __MPI_RANK__ = 0;
+  other.flush();
+
+  REQUIRE(ckp.shard_filenames().size() == 1);
+  CHECK(ckp.shard_filenames()[0] == checkpoint_filename + ".ckp.1");
+  auto results = ckp.merge();
+  CHECK(results.size() == 3);
+  CHECK(ckp.shard_filenames().empty());
+}
+
+TEST_CASE("checkpoint_t in memory", "[checkpoint_t]") {
+  checkpoint_t ckp;
+  CHECK(ckp.in_memory());
+  CHECK_FALSE(ckp.existing_checkpoint());
+  CHECK_FALSE(ckp.needs_cleaning());
+
+  for (size_t i = 0; i < 10; ++i) {
+    ckp.write(rd_result_t{i, -1.0 * i, 0.5},
+              std::vector<partition_parameters_t>{});
+  }
+  auto results = ckp.read_results();
+  REQUIRE(results.size() == 10);
+  CHECK(results[3].first.root_id == 3);
+  CHECK(results[3].first.lh == -3.0);
+  CHECK(ckp.merge().size() == 10);
+  CHECK(ckp.completed_indicies().size() == 10);
+
+  checkpoint_t moved{std::move(ckp)};
+  CHECK(moved.in_memory());
+  CHECK(moved.read_results().size() == 10);
+}
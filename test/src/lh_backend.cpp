@@ -0,0 +1,9 @@
+#include <catch2/catch.hpp>
+#include <lh_backend.hpp>
+#include <string>
+
+TEST_CASE("lh backend", "[lh_backend]") {
+  auto backend = make_lh_backend();
+  REQUIRE(backend);
+  CHECK(std::string(backend->name()) == "CPU");
+}
@@ -0,0 +1,47 @@
+#include <catch2/catch.hpp>
+#include <lh_bound.hpp>
+#include <vector>
+
+static std::vector<partition_parameters_t> make_params(double value) {
+  partition_parameters_t pp;
+  pp.subst_rates = {value};
+  pp.freqs       = {value};
+  return {pp};
+}
+
+TEST_CASE("lh_bound_t prune", "[lh_bound_t]") {
+  lh_bound_t bound{10.0};
+
+  std::vector<partition_parameters_t> params = make_params(0.0);
+  CHECK_FALSE(bound.params(params));
+  CHECK(params[0].subst_rates[0] == 0.0);
+  CHECK_FALSE(bound.prune(-1e6));
+
+  bound.update(-100.0, make_params(1.0));
+  CHECK(bound.best() == -100.0);
+  CHECK(bound.params(params));
+  CHECK(params[0].subst_rates[0] == 1.0);
+
+  CHECK(bound.prune(-111.0));
+  CHECK_FALSE(bound.prune(-109.0));
+  CHECK_FALSE(bound.prune(-50.0));
+
+  SECTION("only better results replace the best") {
+    bound.update(-200.0, make_params(2.0));
+    CHECK(bound.best() == -100.0);
+    CHECK(bound.params(params));
+    CHECK(params[0].subst_rates[0] == 1.0);
+
+    bound.update(-95.0, make_params(3.0));
+    CHECK(bound.best() == -95.0);
+    CHECK(bound.params(params));
+    CHECK(params[0].subst_rates[0] == 3.0);
+    CHECK(bound.prune(-106.0));
+  }
+}
+
+TEST_CASE("lh_bound_t threshold", "[lh_bound_t]") {
+  CHECK_THROWS(lh_bound_t{0.0});
+  CHECK_THROWS(lh_bound_t{-1.0});
+  CHECK(lh_bound_t{2.5}.threshold() == 2.5);
+}
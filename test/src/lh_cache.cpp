@@ -0,0 +1,87 @@
+#include <algorithm>
+#include <catch2/catch.hpp>
+#include <lh_cache.hpp>
+#include <random>
+#include <utility>
+#include <vector>
+
+TEST_CASE("lh cache lookup", "[lh_cache]") {
+  lh_cache_t       cache{4};
+  lh_cache_entry_t entry;
+
+  CHECK_FALSE(cache.lookup(0, 0.5, 1, entry));
+
+  SECTION("lh only") {
+    cache.insert_lh(0, 0.5, 1, -10.0);
+    REQUIRE(cache.lookup(0, 0.5, 1, entry));
+    CHECK(entry.lh == -10.0);
+    CHECK_FALSE(entry.has_dlh);
+    CHECK_FALSE(cache.lookup(0, 0.25, 1, entry));
+    CHECK_FALSE(cache.lookup(1, 0.5, 1, entry));
+  }
+
+  SECTION("the derivative is kept") {
+    cache.insert_dlh(0, 0.5, 1, -10.0, 2.0);
+    cache.insert_lh(0, 0.5, 1, -10.0);
+    REQUIRE(cache.lookup(0, 0.5, 1, entry));
+    CHECK(entry.has_dlh);
+    CHECK(entry.dlh == 2.0);
+    CHECK(cache.size() == 1);
+  }
+
+  SECTION("a new version drops everything") {
+    cache.insert_lh(0, 0.5, 1, -10.0);
+    cache.insert_lh(1, 0.5, 1, -11.0);
+    CHECK_FALSE(cache.lookup(0, 0.5, 2, entry));
+    CHECK(cache.size() == 0);
+    CHECK_FALSE(cache.lookup(0, 0.5, 1, entry));
+  }
+}
+
+TEST_CASE("lh cache eviction", "[lh_cache]") {
+  lh_cache_entry_t entry;
+
+  SECTION("the least recently used entry is dropped") {
+    lh_cache_t cache{2};
+    cache.insert_lh(0, 0.5, 1, -10.0);
+    cache.insert_lh(1, 0.5, 1, -11.0);
+    CHECK(cache.lookup(0, 0.5, 1, entry));
+    cache.insert_lh(2, 0.5, 1, -12.0);
+    CHECK(cache.size() == 2);
+    CHECK(cache.lookup(0, 0.5, 1, entry));
+    CHECK(cache.lookup(2, 0.5, 1, entry));
+    CHECK_FALSE(cache.lookup(1, 0.5, 1, entry));
+  }
+
+  SECTION("no capacity") {
+    lh_cache_t cache{0};
+    cache.insert_dlh(0, 0.5, 1, -10.0, 1.0);
+    CHECK(cache.size() == 0);
+    CHECK_FALSE(cache.lookup(0, 0.5, 1, entry));
+  }
+}
+
+TEST_CASE("lh cache matches a list of the recently used keys", "[lh_cache]") {
+  lh_cache_t                             cache{8};
+  std::vector<std::pair<size_t, double>> recent;
+  std::minstd_rand                       engine{7};
+  std::uniform_int_distribution<size_t>  root_dist{0, 15};
+  std::uniform_int_distribution<int>     ratio_dist{0, 3};
+  lh_cache_entry_t                       entry;
+
+  for (size_t i = 0; i < 2000; ++i) {
+    std::pair<size_t, double> key{root_dist(engine), ratio_dist(engine) / 4.0};
+    auto it = std::find(recent.begin(), recent.end(), key);
+    bool hit = cache.lookup(key.first, key.second, 1, entry);
+    CHECK(hit == (it != recent.end()));
+    if (hit) {
+      CHECK(entry.lh == -static_cast<double>(key.first) - key.second);
+      recent.erase(it);
+    } else {
+      cache.insert_lh(key.first, key.second, 1, -(key.first + key.second));
+      if (recent.size() == cache.capacity()) { recent.pop_back(); }
+    }
+    recent.insert(recent.begin(), key);
+    CHECK(cache.size() == recent.size());
+  }
+}
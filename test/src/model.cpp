@@ -4,7 +4,12 @@
 #include <catch2/catch.hpp>
 #include <cmath>
 #include <debug.h>
+#include <memory>
 #include <model.hpp>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include <profile.hpp>
 #include <random>
 #include <unordered_set>
 
@@ -126,6 +131,115 @@ TEST_CASE("model_t compute dlh/da, all data",
   }
 }
 
+TEST_CASE("model_t compute d2lh/da", "[model_t][opt]") {
+  auto &             ds = data_files_dna["10.fasta"];
+  std::vector<msa_t> msa;
+  msa.emplace_back(ds.first);
+  rooted_tree_t tree{ds.second};
+  uint64_t      seed = std::rand();
+  model_t       model{tree, msa, {1}, true, seed, false};
+  model.initialize_partitions_uniform_freqs(msa);
+  for (size_t i = 0; i < tree.root_count(); ++i) {
+    auto rl = tree.root_location(i);
+    if (rl.edge->back == nullptr) { continue; }
+    model.compute_lh(rl);
+    auto d2lh = model.compute_d2lh(rl);
+    CHECK(std::isfinite(d2lh.lh));
+    CHECK(std::isfinite(d2lh.dlh));
+    CHECK(std::isfinite(d2lh.d2lh));
+    CHECK(d2lh.lh == Approx(model.compute_lh_root(rl)));
+
+    auto dlh = model.compute_dlh(rl);
+    CHECK(d2lh.dlh == Approx(dlh.dlh).epsilon(1e-3).margin(1e-2));
+  }
+}
+
+TEST_CASE("model_t d2lh/da matches a finite difference of the lh",
+          "[model_t][opt]") {
+  auto &             ds = data_files_dna["10.fasta"];
+  std::vector<msa_t> msa;
+  msa.emplace_back(ds.first);
+  rooted_tree_t tree{ds.second};
+  uint64_t      seed = std::rand();
+  model_t       model{tree, msa, {4}, true, seed, false};
+  model.initialize_partitions(msa);
+  model.set_subst_rates(0, params[3]);
+
+  constexpr double h = 1e-3;
+  for (size_t i = 0; i < tree.root_count(); ++i) {
+    auto rl = tree.root_location(i);
+    if (rl.edge->back == nullptr) { continue; }
+    model.compute_lh(rl);
+    for (double ratio : {0.1, 0.5, 0.8}) {
+      rl.brlen_ratio = ratio;
+      auto d2lh      = model.compute_d2lh(rl);
+
+      auto shifted        = rl;
+      shifted.brlen_ratio = ratio + h;
+      double lh_up        = model.compute_lh_root(shifted);
+      shifted.brlen_ratio = ratio - h;
+      double lh_down      = model.compute_lh_root(shifted);
+      double lh           = model.compute_lh_root(rl);
+
+      CHECK(d2lh.lh == Approx(lh));
+      CHECK(d2lh.dlh == Approx((lh_up - lh_down) / (2.0 * h))
+                            .epsilon(1e-4)
+                            .margin(1e-3));
+      CHECK(d2lh.d2lh
+            == Approx((lh_up - 2.0 * lh + lh_down) / (h * h))
+                   .epsilon(1e-3)
+                   .margin(1e-1));
+    }
+  }
+}
+
+TEST_CASE("model_t compute batched dlh/da", "[model_t][opt]") {
+  auto &             ds = data_files_dna["10.fasta"];
+  std::vector<msa_t> msa;
+  msa.emplace_back(ds.first);
+  rooted_tree_t tree{ds.second};
+  uint64_t      seed = std::rand();
+  model_t       model{tree, msa, {4}, true, seed, false};
+  model.initialize_partitions_uniform_freqs(msa);
+
+  std::vector<double> ratios;
+  for (size_t i = 0; i <= 20; ++i) { ratios.push_back(i / 20.0); }
+
+  for (size_t i = 0; i < tree.root_count(); ++i) {
+    auto rl = tree.root_location(i);
+    if (rl.edge->back == nullptr) { continue; }
+    model.compute_lh(rl);
+    auto batch = model.compute_dlh_batch(rl, ratios);
+    REQUIRE(batch.size() == ratios.size());
+    for (size_t k = 0; k < ratios.size(); ++k) {
+      auto ratio        = rl;
+      ratio.brlen_ratio = ratios[k];
+      auto dlh          = model.compute_dlh(ratio);
+      CHECK(batch[k].lh == Approx(dlh.lh));
+      CHECK(batch[k].dlh == Approx(dlh.dlh).epsilon(1e-2).margin(1e-1));
+    }
+  }
+}
+
+TEST_CASE("model_t optimize root locations with newton", "[model_t][opt]") {
+  auto &             ds = data_files_dna["10.fasta"];
+  std::vector<msa_t> msa;
+  msa.emplace_back(ds.first);
+  rooted_tree_t tree{ds.second};
+  uint64_t      seed = std::rand();
+  model_t       model{tree, msa, {1}, true, seed, false};
+  model.initialize_partitions_uniform_freqs(msa);
+  for (size_t i = 0; i < tree.root_count(); ++i) {
+    auto rl = tree.root_location(i);
+    if (rl.edge->back == nullptr) { continue; }
+    model.compute_lh(rl);
+    auto newton_rl = model.optimize_alpha_newton(rl, 1e-7);
+    auto brents_rl = model.optimize_alpha(rl, 1e-7);
+    CHECK(model.compute_lh_root(newton_rl)
+          >= Approx(model.compute_lh_root(brents_rl)).margin(1e-4));
+  }
+}
+
 TEST_CASE("model_t optimize root locations on individual roots",
           "[model_t][opt]") {
   auto &             ds = data_files_dna["10.fasta"];
@@ -383,6 +497,391 @@ TEST_CASE("model_t move root", "[model_t]") {
   }
 }
 
+TEST_CASE("model_t all edge lh matches the root sweep", "[model_t]") {
+  auto &             ds = data_files_dna["10.fasta"];
+  std::vector<msa_t> msa;
+  msa.emplace_back(ds.first);
+  rooted_tree_t tree{ds.second};
+  uint64_t      seed = std::rand();
+  model_t       model{tree, msa, {1}, true, seed, false};
+  model.initialize_partitions_uniform_freqs(msa);
+  model.set_subst_rates(0, params[3]);
+  model.compute_lh(tree.root_location(0));
+
+  auto all_edge_lh = model.compute_all_edge_lh();
+  REQUIRE(all_edge_lh.size() == tree.root_count());
+
+  for (size_t i = 0; i < tree.root_count(); ++i) {
+    auto rl = tree.root_location(i);
+    CHECK(all_edge_lh[i] == Approx(model.compute_lh(rl)));
+  }
+}
+
+TEST_CASE("model_t without all edge clvs", "[model_t]") {
+  auto &             ds = data_files_dna["10.fasta"];
+  std::vector<msa_t> msa;
+  msa.emplace_back(ds.first);
+  rooted_tree_t tree{ds.second};
+  uint64_t      seed = std::rand();
+  model_t       model{tree, msa, {1}, true, seed, false, false};
+  model.initialize_partitions_uniform_freqs(msa);
+  model.compute_lh(tree.root_location(0));
+  CHECK_THROWS(model.compute_all_edge_lh());
+  CHECK(model.compute_all_root_lh().size() == tree.root_count());
+}
+
+TEST_CASE("model_t site blocks match a single block", "[model_t]") {
+  auto &             ds = data_files_dna["10.fasta"];
+  std::vector<msa_t> msa;
+  msa.emplace_back(ds.first);
+  rooted_tree_t tree{ds.second};
+  uint64_t      seed = std::rand();
+  model_t       single{tree, msa, {4}, true, seed, false, true, 1};
+  model_t       blocked{tree, msa, {4}, true, seed, false, true, 4};
+  REQUIRE(single.block_count() == 1);
+  REQUIRE(blocked.block_count() == 4);
+  REQUIRE(blocked.partition_count() == 1);
+
+  for (auto m : {&single, &blocked}) {
+    m->initialize_partitions(msa);
+    m->set_subst_rates(0, params[3]);
+  }
+
+  for (size_t i = 0; i < tree.root_count(); ++i) {
+    auto rl = tree.root_location(i);
+    CHECK(blocked.compute_lh(rl) == Approx(single.compute_lh(rl)));
+  }
+
+  auto all_edge_lh = blocked.compute_all_edge_lh();
+  auto expected_lh = single.compute_all_edge_lh();
+  for (size_t i = 0; i < tree.root_count(); ++i) {
+    CHECK(all_edge_lh[i] == Approx(expected_lh[i]));
+  }
+}
+
+TEST_CASE("model_t pmatrix cache", "[model_t]") {
+  auto &             ds = data_files_dna["10.fasta"];
+  std::vector<msa_t> msa;
+  msa.emplace_back(ds.first);
+  rooted_tree_t tree{ds.second};
+  uint64_t      seed = std::rand();
+  model_t       cached{tree, msa, {4}, true, seed, false};
+  model_t       fresh{tree, msa, {4}, true, seed, false};
+  cached.initialize_partitions_uniform_freqs(msa);
+  fresh.initialize_partitions_uniform_freqs(msa);
+
+  auto rl = tree.root_location(0);
+  cached.set_subst_rates(0, params[0]);
+  cached.compute_lh(rl);
+
+  SECTION("repeated lengths are not recomputed") {
+    profile::enable();
+    cached.compute_lh(rl);
+    cached.compute_lh_root(rl);
+    CHECK(profile::counter_value(profile::pmatrix_updates) == 0);
+    CHECK(profile::counter_value(profile::pmatrix_cache_hits) > 0);
+    profile::disable();
+  }
+
+  SECTION("parameter changes invalidate the cache") {
+    cached.set_subst_rates(0, params[3]);
+    fresh.set_subst_rates(0, params[3]);
+    for (size_t i = 0; i < tree.root_count(); ++i) {
+      auto cur_rl = tree.root_location(i);
+      CHECK(cached.compute_lh(cur_rl) == Approx(fresh.compute_lh(cur_rl)));
+    }
+
+    cached.set_freqs(0, {0.1, 0.2, 0.3, 0.4});
+    fresh.set_freqs(0, {0.1, 0.2, 0.3, 0.4});
+    for (double ratio : {0.1, 0.5, 0.9, 0.5}) {
+      rl.brlen_ratio = ratio;
+      CHECK(cached.compute_lh_root(rl) == Approx(fresh.compute_lh_root(rl)));
+    }
+  }
+}
+
+TEST_CASE("model_t gradient lanes match serial gradients", "[model_t]") {
+  auto &             ds = data_files_dna["10.fasta"];
+  std::vector<msa_t> msa;
+  msa.emplace_back(ds.first);
+  rooted_tree_t tree{ds.second};
+  uint64_t      seed = std::rand();
+#ifdef _OPENMP
+  int threads = omp_get_max_threads();
+  omp_set_num_threads(4);
+#endif
+  model_t serial{tree, msa, {4}, true, seed, false, false};
+  model_t lanes{tree, msa, {4}, true, seed, false, true};
+#ifdef _OPENMP
+  omp_set_num_threads(threads);
+  REQUIRE(lanes.gradient_lane_count() == 4);
+#endif
+  REQUIRE(serial.gradient_lane_count() == 0);
+
+  /* exhaustive_search is the path that reaches optimize_params */
+  std::vector<std::pair<root_location_t, double>> results;
+  for (auto m : {&serial, &lanes}) {
+    auto checkpoint = make_dummy_checkpoint("10.fasta");
+    m->initialize_partitions_uniform_freqs(msa);
+    m->compute_lh(tree.root_location(0));
+    m->assign_indicies(std::vector<size_t>{3});
+    results.push_back(
+        m->exhaustive_search(1e-3, 1e-3, 1e-3, 1e12, checkpoint));
+  }
+  CHECK(results[1].first.id == results[0].first.id);
+  CHECK(results[1].second == Approx(results[0].second).epsilon(1e-4));
+}
+
+#ifdef _OPENMP
+TEST_CASE("model_t gradient lanes are capped at the free parameters",
+          "[model_t]") {
+  auto &             ds = data_files_dna["10.fasta"];
+  std::vector<msa_t> msa;
+  msa.emplace_back(ds.first);
+  rooted_tree_t tree{ds.second};
+  uint64_t      seed    = std::rand();
+  int           threads = omp_get_max_threads();
+  omp_set_num_threads(64);
+  model_t model{tree, msa, {4}, true, seed, false, true};
+  omp_set_num_threads(threads);
+  /* 12 rates, 4 freqs, and 4 free rates with their weights */
+  CHECK(model.gradient_lane_count() == 4 * 4 + 2 * 4);
+}
+#endif
+
+TEST_CASE("model_t joint parameter optimization", "[model_t][opt]") {
+  auto &             ds = data_files_dna["10.fasta"];
+  std::vector<msa_t> msa;
+  msa.emplace_back(ds.first);
+  rooted_tree_t tree{ds.second};
+  uint64_t      seed = std::rand();
+  model_t       alternating{tree, msa, {4}, true, seed, false};
+  model_t       joint{tree, msa, {4}, true, seed, false};
+  joint.set_joint_params(true);
+
+  /* exhaustive_search is the path that reaches optimize_params */
+  double                                          initial_lh = 0.0;
+  std::vector<std::pair<root_location_t, double>> results;
+  std::vector<uint64_t>                           joint_runs;
+  std::vector<uint64_t>                           bfgs_steps;
+  for (auto m : {&alternating, &joint}) {
+    auto checkpoint = make_dummy_checkpoint("10.fasta");
+    m->initialize_partitions_uniform_freqs(msa);
+    initial_lh = m->compute_lh(tree.root_location(3));
+    m->assign_indicies(std::vector<size_t>{3});
+    profile::enable();
+    results.push_back(
+        m->exhaustive_search(1e-3, 1e-3, 1e-3, 1e12, checkpoint));
+    joint_runs.push_back(
+        profile::counter_value(profile::joint_optimizations));
+    bfgs_steps.push_back(profile::counter_value(profile::bfgs_iterations));
+    profile::disable();
+  }
+
+  CHECK(joint_runs[0] == 0);
+  CHECK(joint_runs[1] > 0);
+  CHECK(bfgs_steps[1] > 0);
+  CHECK(bfgs_steps[1] != bfgs_steps[0]);
+
+  auto &expected = results[0];
+  auto &result   = results[1];
+  CHECK(result.second > initial_lh);
+  CHECK(result.second == Approx(expected.second).epsilon(1e-2));
+}
+
+TEST_CASE("model_t screening ranks roots with one rate category",
+          "[model_t]") {
+  auto &             ds = data_files_dna["10.fasta"];
+  std::vector<msa_t> msa;
+  msa.emplace_back(ds.first);
+  rooted_tree_t tree{ds.second};
+  uint64_t      seed = std::rand();
+  model_t       screened{tree, msa, {4}, true, seed, false, false, 0, true};
+  model_t       single{tree, msa, {1}, true, seed, false, false};
+  model_t       full{tree, msa, {4}, true, seed, false, false};
+
+  for (auto m : {&screened, &single, &full}) {
+    m->initialize_partitions_uniform_freqs(msa);
+    m->set_subst_rates(0, params[3]);
+    m->compute_lh(tree.root_location(0));
+  }
+
+  auto expected = single.suggest_roots_lh(1, 0.3);
+  auto result   = screened.suggest_roots_lh(1, 0.3);
+  REQUIRE(result.size() == expected.size());
+  for (size_t i = 0; i < result.size(); ++i) {
+    CHECK(result[i].id == expected[i].id);
+  }
+
+  SECTION("the full model is left on its root") {
+    auto best = screened.optimize_root_location(1, 0.3);
+    CHECK(full.compute_lh(best.first) == Approx(best.second));
+  }
+}
+
+TEST_CASE("model_t tip patterns match site repeats", "[model_t]") {
+  auto &             ds = data_files_dna["10.fasta"];
+  std::vector<msa_t> msa;
+  msa.emplace_back(ds.first);
+  rooted_tree_t tree{ds.second};
+  uint64_t      seed = std::rand();
+  model_t       repeats{tree,
+                        msa,
+                        {4},
+                        true,
+                        seed,
+                        false,
+                        true,
+                        0,
+                        false,
+                        tip_kernel::site_repeats};
+  model_t       tips{tree,
+                     msa,
+                     {4},
+                     true,
+                     seed,
+                     false,
+                     true,
+                     0,
+                     false,
+                     tip_kernel::pattern_tip};
+  REQUIRE(repeats.tip_kernels()
+          == std::vector<tip_kernel::tip_kernel_e>{tip_kernel::site_repeats});
+  REQUIRE(tips.tip_kernels()
+          == std::vector<tip_kernel::tip_kernel_e>{tip_kernel::pattern_tip});
+
+  for (auto m : {&repeats, &tips}) {
+    m->initialize_partitions(msa);
+    m->set_subst_rates(0, params[3]);
+  }
+
+  for (size_t i = 0; i < tree.root_count(); ++i) {
+    auto rl = tree.root_location(i);
+    CHECK(tips.compute_lh(rl) == Approx(repeats.compute_lh(rl)));
+  }
+
+  auto all_edge_lh = tips.compute_all_edge_lh();
+  auto expected_lh = repeats.compute_all_edge_lh();
+  for (size_t i = 0; i < tree.root_count(); ++i) {
+    CHECK(all_edge_lh[i] == Approx(expected_lh[i]));
+  }
+
+  SECTION("optimizing a root") {
+    auto best     = tips.optimize_root_location(1, 0.3);
+    auto expected = repeats.optimize_root_location(1, 0.3);
+    CHECK(best.first.id == expected.first.id);
+    CHECK(best.second == Approx(expected.second));
+  }
+}
+
+TEST_CASE("model_t pattern weights", "[model_t]") {
+  auto &             ds = data_files_dna["101.phy"];
+  std::vector<msa_t> msa;
+  msa.emplace_back(ds.first);
+  rooted_tree_t tree{ds.second};
+  uint64_t      seed = std::rand();
+  model_t       model{tree, msa, {4}, true, seed, false, true, 2};
+  model.initialize_partitions(msa);
+  model.set_subst_rates(0, params[3]);
+
+  std::vector<double> expected_lh;
+  for (size_t i = 0; i < tree.root_count(); ++i) {
+    expected_lh.push_back(model.compute_lh(tree.root_location(i)));
+  }
+
+  std::vector<std::vector<unsigned int>> weights{
+      {msa[0].weights(), msa[0].weights() + msa[0].length()}};
+
+  SECTION("doubling the weights doubles the lh") {
+    for (auto &w : weights[0]) { w *= 2; }
+    model.set_pattern_weights(weights);
+    for (size_t i = 0; i < tree.root_count(); ++i) {
+      CHECK(model.compute_lh(tree.root_location(i))
+            == Approx(2.0 * expected_lh[i]));
+    }
+  }
+
+  SECTION("the original weights give the original lh") {
+    for (auto &w : weights[0]) { w += 1; }
+    model.set_pattern_weights(weights);
+    weights[0].assign(msa[0].weights(), msa[0].weights() + msa[0].length());
+    model.set_pattern_weights(weights);
+    for (size_t i = 0; i < tree.root_count(); ++i) {
+      CHECK(model.compute_lh(tree.root_location(i)) == Approx(expected_lh[i]));
+    }
+  }
+
+  SECTION("bad weights") {
+    CHECK_THROWS(model.set_pattern_weights({}));
+    weights[0].pop_back();
+    CHECK_THROWS(model.set_pattern_weights(weights));
+  }
+}
+
+TEST_CASE("model_t lh cache", "[model_t]") {
+  auto &             ds = data_files_dna["101.phy"];
+  std::vector<msa_t> msa;
+  msa.emplace_back(ds.first);
+  rooted_tree_t tree{ds.second};
+  uint64_t      seed = std::rand();
+  model_t       model{tree, msa, {4}, true, seed, false};
+  model.initialize_partitions(msa);
+  model.set_subst_rates(0, params[3]);
+
+  auto rl   = tree.root_location(1);
+  auto low  = rl;
+  auto high = rl;
+
+  low.brlen_ratio  = 0.25;
+  high.brlen_ratio = 0.75;
+  model.compute_lh(rl);
+  double low_lh  = model.compute_lh_root(low);
+  double high_lh = model.compute_lh_root(high);
+  CHECK(low_lh != high_lh);
+
+  SECTION("cached roots give the same results") {
+    profile::enable();
+    CHECK(model.compute_lh_root(low) == low_lh);
+    auto d = model.compute_dlh(high);
+    CHECK(model.compute_dlh(high).dlh == d.dlh);
+    CHECK(profile::counter_value(profile::lh_cache_hits) == 3);
+    profile::disable();
+  }
+
+  SECTION("the root CLVs are recomputed after a cached lh") {
+    /* The root CLVs are left on high, and the weights don't change them */
+    model.compute_lh_root(low);
+    std::vector<std::vector<unsigned int>> weights{
+        {msa[0].weights(), msa[0].weights() + msa[0].length()}};
+    model.set_pattern_weights(weights);
+    CHECK(model.compute_lh(low) == Approx(low_lh));
+  }
+
+  SECTION("changing the parameters drops the cache") {
+    model.set_subst_rates(0, params[2]);
+    model.compute_lh(rl);
+    CHECK(model.compute_lh_root(low) != low_lh);
+  }
+}
+
+TEST_CASE("model_t memory estimate", "[model_t]") {
+  auto &             ds = data_files_dna["10.fasta"];
+  std::vector<msa_t> msa;
+  msa.emplace_back(ds.first);
+  rooted_tree_t tree{ds.second};
+
+  auto full   = model_t::estimate_memory(tree, msa, {4}, true, 1);
+  auto low    = model_t::estimate_memory(tree, msa, {4}, false, 1);
+  auto single = model_t::estimate_memory(tree, msa, {1}, false, 1);
+  CHECK(low > 0);
+  CHECK(low < full);
+  CHECK(single < low);
+
+  auto tips = model_t::estimate_memory(
+      tree, msa, {4}, true, 1, false, tip_kernel::pattern_tip);
+  CHECK(tips < full);
+}
+
 TEST_CASE("model_t exhaustive search", "[model_t]") {
   auto               ds = data_files_dna["10.fasta"];
   std::vector<msa_t> msa;
@@ -397,6 +896,125 @@ TEST_CASE("model_t exhaustive search", "[model_t]") {
   model.exhaustive_search(1e-3, 1e-3, 1e-3, 1e12, checkpoint);
 }
 
+TEST_CASE("model_t exhaustive search with warm start", "[model_t]") {
+  auto               ds = data_files_dna["10.fasta"];
+  std::vector<msa_t> msa;
+  msa.emplace_back(ds.first);
+  rooted_tree_t tree{ds.second};
+  uint64_t      seed       = std::rand();
+  auto          checkpoint = make_dummy_checkpoint("10.fasta");
+  model_t       model{tree, msa, {1}, true, seed, false};
+  model.initialize_partitions(msa);
+  model.compute_lh(tree.root_location(0));
+  model.set_warm_start(true);
+  model.assign_indicies_by_rank_exhaustive(0, 1, checkpoint);
+
+  auto assigned = model.assigned_indicies();
+  REQUIRE(assigned.size() == tree.root_count());
+  CHECK(assigned == tree.adjacency_order(assigned));
+
+  auto best = model.exhaustive_search(1e-3, 1e-3, 1e-3, 1e12, checkpoint);
+  CHECK(std::isfinite(best.second));
+  CHECK(checkpoint.read_results().size() == tree.root_count());
+}
+
+TEST_CASE("model_t exhaustive search with replicas", "[model_t]") {
+  auto               ds = data_files_dna["10.fasta"];
+  std::vector<msa_t> msa;
+  msa.emplace_back(ds.first);
+  rooted_tree_t tree{ds.second};
+  uint64_t      seed       = std::rand();
+  auto          checkpoint = make_dummy_checkpoint("10.fasta");
+  model_t       model{tree, msa, {1}, true, seed, false};
+  model.initialize_partitions(msa);
+  model.compute_lh(tree.root_location(0));
+
+  std::vector<std::unique_ptr<model_t>> replicas;
+  for (size_t i = 0; i < 2; ++i) {
+    replicas.emplace_back(new model_t{tree, msa, {1}, true, seed + i, false});
+    replicas.back()->initialize_partitions(msa);
+    replicas.back()->compute_lh(tree.root_location(0));
+  }
+  model.set_replicas(std::move(replicas));
+  CHECK(model.replica_count() == 2);
+
+  model.assign_indicies_by_rank_exhaustive(0, 1, checkpoint);
+  model.exhaustive_search(1e-3, 1e-3, 1e-3, 1e12, checkpoint);
+
+  auto results = checkpoint.read_results();
+  CHECK(results.size() == tree.root_count());
+
+  std::unordered_set<size_t> root_ids;
+  for (auto &r : results) { root_ids.insert(r.first.root_id); }
+  CHECK(root_ids.size() == tree.root_count());
+}
+
+TEST_CASE("model_t exhaustive search with pruning", "[model_t]") {
+  auto               ds = data_files_dna["10.fasta"];
+  std::vector<msa_t> msa;
+  msa.emplace_back(ds.first);
+  rooted_tree_t tree{ds.second};
+  uint64_t      seed       = std::rand();
+  auto          checkpoint = make_dummy_checkpoint("10.fasta");
+  model_t       model{tree, msa, {1}, true, seed, false};
+  model.initialize_partitions(msa);
+  model.compute_lh(tree.root_location(0));
+  model.set_prune_threshold(1e-6);
+  model.assign_indicies_by_rank_exhaustive(0, 1, checkpoint);
+  auto best = model.exhaustive_search(1e-3, 1e-3, 1e-3, 1e12, checkpoint);
+
+  /* Pruned roots are written with their screening lh and no parameters */
+  auto                results = checkpoint.read_results();
+  std::vector<size_t> pruned;
+  REQUIRE(results.size() == tree.root_count());
+  for (auto &r : results) {
+    if (r.second.empty()) { pruned.push_back(r.first.root_id); }
+  }
+  REQUIRE(pruned.size() > 0);
+  REQUIRE(pruned.size() < tree.root_count());
+
+  auto   newick = model.virtual_rooted_newick(best.first);
+  size_t marked = 0;
+  for (size_t pos = newick.find("pruned=true"); pos != std::string::npos;
+       pos        = newick.find("pruned=true", pos + 1)) {
+    marked++;
+  }
+  CHECK(marked == pruned.size());
+
+  SECTION("a resumed search skips the pruned roots") {
+    /* Keep the optimized roots and half of the pruned ones */
+    auto                resumed = make_dummy_checkpoint("10.fasta");
+    std::vector<size_t> kept;
+    size_t              pruned_seen = 0;
+    for (auto &r : results) {
+      if (r.second.empty() && pruned_seen++ % 2 == 1) { continue; }
+      resumed.write(r.first, r.second);
+      kept.push_back(r.first.root_id);
+    }
+
+    model_t resumed_model{tree, msa, {1}, true, seed, false};
+    resumed_model.initialize_partitions(msa);
+    resumed_model.compute_lh(tree.root_location(0));
+    resumed_model.set_prune_threshold(1e-6);
+    resumed_model.set_warm_start(true);
+    resumed_model.assign_indicies_by_rank_exhaustive(0, 1, resumed);
+
+    auto assigned = resumed_model.assigned_indicies();
+    CHECK(assigned.size() == tree.root_count() - kept.size());
+    for (auto id : assigned) {
+      CHECK(std::find(kept.begin(), kept.end(), id) == kept.end());
+    }
+
+    CHECK_NOTHROW(
+        resumed_model.exhaustive_search(1e-3, 1e-3, 1e-3, 1e12, resumed));
+    std::unordered_set<size_t> root_ids;
+    auto                       resumed_results = resumed.read_results();
+    for (auto &r : resumed_results) { root_ids.insert(r.first.root_id); }
+    CHECK(resumed_results.size() == tree.root_count());
+    CHECK(root_ids.size() == tree.root_count());
+  }
+}
+
 TEST_CASE("model_t different rate categories", "[model_t]") {
   auto               ds = data_files_dna["10.fasta"];
   std::vector<msa_t> msa;
@@ -488,6 +1106,19 @@ TEST_CASE("assign indicies test", "[model_t]") {
       REQUIRE_THROWS(model.assign_indicies_by_rank_search(1, 0.0, 0, 1, ckp));
     }
   }
+  SECTION("dynamic search") {
+    auto root_assignment = GENERATE(8lu, 9lu, 12lu);
+    model.set_dynamic_schedule(true);
+    REQUIRE_NOTHROW(
+        model.assign_indicies_by_rank_search(root_assignment, 0.0, 0, 2, ckp));
+    auto assigned_idx = model.assigned_indicies();
+    REQUIRE(assigned_idx.size() == root_assignment - dummy_results_count);
+    for (size_t j = 0; j < assigned_idx.size(); ++j) {
+      for (size_t i = 0; i < dummy_results_count; ++i) {
+        CHECK(assigned_idx[j] != possible_idx[i]);
+      }
+    }
+  }
   SECTION("exhaustive") {
     int expected_size = std::max(17 - static_cast<int>(dummy_results_count), 0);
     REQUIRE_NOTHROW(model.assign_indicies_by_rank_exhaustive(0, 1, ckp));
@@ -500,3 +1131,147 @@ TEST_CASE("assign indicies test", "[model_t]") {
     }
   }
 }
+
+TEST_CASE("model_t exhaustive search with a budget", "[model_t]") {
+  auto               ds = data_files_dna["10.fasta"];
+  std::vector<msa_t> msa;
+  msa.emplace_back(ds.first);
+  rooted_tree_t tree{ds.second};
+  uint64_t      seed       = std::rand();
+  auto          checkpoint = make_dummy_checkpoint("10.fasta");
+  model_t       model{tree, msa, {1}, true, seed, false};
+  model.initialize_partitions(msa);
+  model.compute_lh(tree.root_location(0));
+
+  SECTION("the budget is not reached") {
+    model.set_budget(std::make_shared<search_budget_t>(3600.0, 0));
+    model.assign_indicies_by_rank_exhaustive(0, 1, checkpoint);
+    REQUIRE(model.assigned_indicies().size() == tree.root_count());
+
+    auto best = model.exhaustive_search(1e-3, 1e-3, 1e-3, 1e12, checkpoint);
+    CHECK(std::isfinite(best.second));
+    CHECK(checkpoint.read_results().size() == tree.root_count());
+  }
+
+  SECTION("the budget runs out part way, and the search is resumed") {
+    /* Count the evaluations of a whole search, and of the ranking before it */
+    auto    full_checkpoint = make_dummy_checkpoint("10.fasta");
+    model_t full{tree, msa, {1}, true, seed, false};
+    full.initialize_partitions(msa);
+    full.compute_lh(tree.root_location(0));
+    auto full_budget = std::make_shared<search_budget_t>(3600.0, 0);
+    full.set_budget(full_budget);
+    full.assign_indicies_by_rank_exhaustive(0, 1, full_checkpoint);
+    uint64_t ranking_evals = full_budget->evaluations();
+    full.exhaustive_search(1e-3, 1e-3, 1e-3, 1e12, full_checkpoint);
+    uint64_t total_evals = full_budget->evaluations();
+    REQUIRE(total_evals > ranking_evals);
+
+    model.set_budget(std::make_shared<search_budget_t>(
+        3600.0, ranking_evals + (total_evals - ranking_evals) / 2));
+    model.assign_indicies_by_rank_exhaustive(0, 1, checkpoint);
+    model.exhaustive_search(1e-3, 1e-3, 1e-3, 1e12, checkpoint);
+    CHECK(model.budget_exhausted());
+
+    std::unordered_set<size_t> finished;
+    for (auto &r : checkpoint.merge()) {
+      CHECK(finished.insert(r.first.root_id).second);
+    }
+    CHECK(finished.size() > 0);
+    CHECK(finished.size() < tree.root_count());
+
+    /* Resume from the same checkpoint file without a budget */
+    std::string prefix = checkpoint.get_filename();
+    prefix.resize(prefix.size() - std::string(".ckp").size());
+    checkpoint_t resumed_checkpoint(prefix);
+    resumed_checkpoint.reload();
+    model_t resumed{tree, msa, {1}, true, seed, false};
+    resumed.initialize_partitions(msa);
+    resumed.compute_lh(tree.root_location(0));
+    resumed.assign_indicies_by_rank_exhaustive(0, 1, resumed_checkpoint);
+    CHECK(resumed.assigned_indicies().size()
+          == tree.root_count() - finished.size());
+    for (auto i : resumed.assigned_indicies()) {
+      CHECK(finished.find(i) == finished.end());
+    }
+    resumed.exhaustive_search(1e-3, 1e-3, 1e-3, 1e12, resumed_checkpoint);
+
+    std::vector<size_t> times_finished(tree.root_count(), 0);
+    for (auto &r : resumed_checkpoint.merge()) {
+      REQUIRE(r.first.root_id < tree.root_count());
+      times_finished[r.first.root_id]++;
+    }
+    for (auto count : times_finished) { CHECK(count == 1); }
+  }
+
+  SECTION("the budget runs out before any root") {
+    model.set_budget(std::make_shared<search_budget_t>(0.0, 1));
+    model.assign_indicies_by_rank_exhaustive(0, 1, checkpoint);
+    CHECK(model.budget_exhausted());
+    CHECK_THROWS_AS(
+        model.exhaustive_search(1e-3, 1e-3, 1e-3, 1e12, checkpoint),
+        std::runtime_error);
+  }
+}
+
+TEST_CASE("model_t search with a budget starts from the best ranked roots",
+          "[model_t]") {
+  auto               ds = data_files_dna["10.fasta"];
+  std::vector<msa_t> msa;
+  msa.emplace_back(ds.first);
+  rooted_tree_t tree{ds.second};
+  uint64_t      seed       = std::rand();
+  auto          checkpoint = make_dummy_checkpoint("10.fasta");
+  model_t       model{tree, msa, {1}, true, seed, false};
+  model.initialize_partitions(msa);
+  model.compute_lh(tree.root_location(0));
+
+  std::vector<size_t> rank(tree.root_count());
+  auto                ranked = model.suggest_root_indicies_lh();
+  REQUIRE(ranked.size() == tree.root_count());
+  for (size_t i = 0; i < ranked.size(); ++i) { rank[ranked[i]] = i; }
+
+  /* Count the evaluations of the ranking, and check the order it gives */
+  auto          ranking_checkpoint = make_dummy_checkpoint("10.fasta");
+  rooted_tree_t ranking_tree{ds.second};
+  model_t       ranking{ranking_tree, msa, {1}, true, seed, false};
+  ranking.initialize_partitions(msa);
+  ranking.compute_lh(ranking_tree.root_location(0));
+  auto ranking_budget = std::make_shared<search_budget_t>(3600.0, 0);
+  ranking.set_budget(ranking_budget);
+  ranking.assign_indicies_by_rank_search(6, 0.0, 0, 1, ranking_checkpoint);
+  uint64_t ranking_evals = ranking_budget->evaluations();
+
+  auto assigned = ranking.assigned_indicies();
+  REQUIRE(assigned.size() == 6);
+  for (size_t i = 1; i < assigned.size(); ++i) {
+    CHECK(rank[assigned[i - 1]] < rank[assigned[i]]);
+  }
+
+  /* Count the evaluations of a search from the best ranked root alone */
+  auto          single_checkpoint = make_dummy_checkpoint("10.fasta");
+  rooted_tree_t single_tree{ds.second};
+  model_t       single{single_tree, msa, {1}, true, seed, false};
+  single.initialize_partitions(msa);
+  single.compute_lh(single_tree.root_location(0));
+  auto single_budget = std::make_shared<search_budget_t>(3600.0, 0);
+  single.set_budget(single_budget);
+  single.assign_indicies(std::vector<size_t>{assigned[0]});
+  single.search(6, 0.0, 1e-3, 1e-3, 1e-3, 1e12, single_checkpoint);
+  uint64_t first_root_evals = single_budget->evaluations();
+  auto     expected         = single_checkpoint.merge();
+  REQUIRE(expected.size() == 1);
+
+  /* With the budget for about one root, only the best ranked one finishes */
+  model.set_budget(std::make_shared<search_budget_t>(
+      3600.0, ranking_evals + first_root_evals + first_root_evals / 2));
+  model.assign_indicies_by_rank_search(6, 0.0, 0, 1, checkpoint);
+  CHECK(model.assigned_indicies() == assigned);
+  model.search(6, 0.0, 1e-3, 1e-3, 1e-3, 1e12, checkpoint);
+  CHECK(model.budget_exhausted());
+
+  auto results = checkpoint.merge();
+  REQUIRE(results.size() == 1);
+  CHECK(results[0].first.root_id == expected[0].first.root_id);
+  CHECK(results[0].first.lh == Approx(expected[0].first.lh));
+}
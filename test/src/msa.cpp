@@ -3,7 +3,10 @@ extern "C" {
 }
 #include "data.hpp"
 #include <catch2/catch.hpp>
+#include <fstream>
 #include <msa.hpp>
+#include <string>
+#include <vector>
 
 TEST_CASE("msa_t parse msa", "[msa_t]") {
   for (auto &kv : data_files_dna) {
@@ -14,6 +17,51 @@ TEST_CASE("msa_t parse msa", "[msa_t]") {
   }
 }
 
+TEST_CASE("msa_t from memory", "[msa_t]") {
+  std::vector<std::string> labels{"a", "b", "c"};
+  std::vector<std::string> sequences{"ACGTAC", "ACGTAA", "AGGTAC"};
+
+  SECTION("compressed") {
+    msa_t msa{labels, sequences};
+    CHECK(msa.count() == 3);
+    CHECK(msa.length() == 4);
+    CHECK(msa.total_weight() == 6);
+    CHECK(std::string{msa.label(1)} == "b");
+  }
+
+  SECTION("uncompressed") {
+    msa_t msa{labels, sequences, pll_map_nt, 4, false};
+    CHECK(msa.length() == 6);
+    CHECK(std::string{msa.sequence(2)} == "AGGTAC");
+  }
+
+  SECTION("matches the file") {
+    auto &                   ds = data_files_dna["10.fasta"];
+    msa_t                    file_msa{ds.first};
+    msa_t                    uncompressed{ds.first, pll_map_nt, 4, false};
+    std::vector<std::string> file_labels, file_sequences;
+    for (int i = 0; i < uncompressed.count(); ++i) {
+      file_labels.emplace_back(uncompressed.label(i));
+      file_sequences.emplace_back(uncompressed.sequence(i));
+    }
+    msa_t msa{file_labels, file_sequences};
+    REQUIRE(msa.length() == file_msa.length());
+    for (unsigned int i = 0; i < msa.length(); ++i) {
+      CHECK(msa.weights()[i] == file_msa.weights()[i]);
+    }
+  }
+
+  SECTION("taking a pll msa") {
+    msa_t msa{make_msa(labels, sequences)};
+    CHECK(msa.length() == 4);
+  }
+
+  CHECK_THROWS_AS((msa_t{{"a"}, sequences}), std::invalid_argument);
+  CHECK_THROWS_AS((msa_t{labels, {"ACGT", "ACG", "ACGT"}}),
+                  std::invalid_argument);
+  CHECK_THROWS_AS((msa_t{{}, {}}), std::invalid_argument);
+}
+
 TEST_CASE("msa_t parse partition line", "[msa_t]") {
   SECTION("no errors") {
     std::string line{"DNA, PART_0 = 123-4123"};
@@ -279,4 +327,76 @@ TEST_CASE("msa_t partition datafile", "[msa_t]") {
     CHECK(parted_msa[0].length() == 121);
     CHECK(parted_msa[1].length() == 202);
   }
+  SECTION("partitions share the labels") {
+    msa_t            msa{ds.first, pll_map_nt, 4, false};
+    msa_partitions_t parts{parse_partition_info("DNA, PART_0 = 1-100"),
+                           parse_partition_info("DNA, PART_1 = 101-200"),
+                           parse_partition_info("DNA, PART_2 = 201-300")};
+    auto parted_msa = msa.partition(parts);
+    REQUIRE(parted_msa.size() == parts.size());
+    for (auto &m : parted_msa) {
+      CHECK(m.total_weight() == 100);
+      CHECK(m.label(0) == parted_msa[0].label(0));
+      CHECK(std::string(m.label(0)) == std::string(msa.label(0)));
+      CHECK_THROWS(m.compress());
+    }
+  }
+  SECTION("range outside of the msa") {
+    msa_t            msa{ds.first, pll_map_nt, 4, false};
+    msa_partitions_t parts{parse_partition_info("DNA, PART_0 = 1-100000000")};
+    CHECK_THROWS(msa.partition(parts));
+  }
+}
+
+static void check_same_msa(const msa_t &a, const msa_t &b) {
+  REQUIRE(a.count() == b.count());
+  REQUIRE(a.length() == b.length());
+  CHECK(a.states() == b.states());
+  CHECK(a.total_weight() == b.total_weight());
+  for (int i = 0; i < a.count(); ++i) {
+    CHECK(std::string(a.label(i)) == std::string(b.label(i)));
+    CHECK(std::string(a.sequence(i), a.length())
+          == std::string(b.sequence(i), b.length()));
+  }
+  for (unsigned int i = 0; i < a.length(); ++i) {
+    CHECK(a.weights()[i] == b.weights()[i]);
+  }
+}
+
+TEST_CASE("msa_t binary cache", "[msa_t]") {
+  auto        ds       = data_files_dna["101.phy"];
+  std::string filename = "/tmp/rd_test.msa.cache";
+  SECTION("single partition") {
+    std::vector<msa_t> msa;
+    msa.emplace_back(ds.first);
+    msa_t::write_cache(filename, msa);
+    auto cached = msa_t::read_cache(filename);
+    REQUIRE(cached.size() == 1);
+    check_same_msa(msa[0], cached[0]);
+    CHECK(cached[0].map() == pll_map_nt);
+    CHECK_NOTHROW(cached[0].valid_data());
+    CHECK_THROWS(cached[0].compress());
+  }
+  SECTION("multiple partitions") {
+    msa_t            msa{ds.first, pll_map_nt, 4, false};
+    msa_partitions_t parts{
+        parse_partition_info("DNA, PART_0 = 1-100, 500-520"),
+        parse_partition_info("DNA, PART_1 = 200-300, 400-500")};
+    auto parted_msa = msa.partition(parts);
+    msa_t::write_cache(filename, parted_msa);
+    auto cached = msa_t::read_cache(filename);
+    REQUIRE(cached.size() == parted_msa.size());
+    for (size_t i = 0; i < cached.size(); ++i) {
+      check_same_msa(parted_msa[i], cached[i]);
+    }
+  }
+  SECTION("errors") {
+    CHECK_THROWS(msa_t::read_cache("/nonexistent/rd_test.msa.cache"));
+    {
+      std::ofstream outfile{filename};
+      outfile << "not a cache";
+    }
+    CHECK_THROWS(msa_t::read_cache(filename));
+    CHECK_THROWS(msa_t::read_cache(ds.first));
+  }
 }
@@ -0,0 +1,49 @@
+#include <catch2/catch.hpp>
+#include <partition_schedule.hpp>
+#include <stdexcept>
+#include <vector>
+
+TEST_CASE("partition schedule cost", "[partition_schedule]") {
+  CHECK(partition_cost(100, 4, 4) == 6400.0);
+  CHECK(partition_cost(100, 20, 1) == partition_cost(2500, 4, 1));
+}
+
+TEST_CASE("partition schedule site blocks", "[partition_schedule]") {
+  SECTION("a single partition is split over the threads") {
+    auto blocks = partition_site_blocks({100.0}, {10000}, 0, 4, 1000);
+    CHECK(blocks == std::vector<size_t>{4});
+  }
+
+  SECTION("small partitions are not split") {
+    auto blocks = partition_site_blocks({100.0}, {1500}, 0, 4, 1000);
+    CHECK(blocks == std::vector<size_t>{1});
+  }
+
+  SECTION("equal partitions are not split by rounding") {
+    std::vector<double> costs(4, 1.0 / 3.0);
+    std::vector<size_t> sites(4, 100000);
+    auto                blocks = partition_site_blocks(costs, sites, 0, 4, 1);
+    CHECK(blocks == std::vector<size_t>{1, 1, 1, 1});
+  }
+
+  SECTION("one big partition is split even with many partitions") {
+    std::vector<double> costs{1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 8.0};
+    std::vector<size_t> sites(costs.size(), 100000);
+    auto                blocks = partition_site_blocks(costs, sites, 0, 4, 1);
+    CHECK(blocks.back() == 2);
+    for (size_t i = 0; i + 1 < blocks.size(); ++i) { CHECK(blocks[i] == 1); }
+  }
+
+  SECTION("the number of blocks can be given") {
+    auto blocks = partition_site_blocks({1.0, 100.0}, {10, 5}, 8, 2, 1000);
+    CHECK(blocks == std::vector<size_t>{8, 5});
+  }
+
+  CHECK_THROWS_AS(partition_site_blocks({1.0}, {}, 0, 1, 1),
+                  std::invalid_argument);
+}
+
+TEST_CASE("partition schedule longest first", "[partition_schedule]") {
+  CHECK(longest_first({1.0, 5.0, 3.0, 5.0}) == std::vector<size_t>{1, 3, 2, 0});
+  CHECK(longest_first({}).empty());
+}
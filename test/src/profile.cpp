@@ -0,0 +1,101 @@
+#include <catch2/catch.hpp>
+#include <fstream>
+#include <profile.hpp>
+#include <string>
+#include <thread>
+#include <vector>
+
+TEST_CASE("profile counters", "[profile]") {
+  profile::enable();
+  CHECK(profile::enabled());
+  CHECK(profile::counter_value(profile::lh_evaluations) == 0);
+
+  profile::count(profile::lh_evaluations);
+  profile::count(profile::partial_updates, 5);
+
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < 4; ++i) {
+    threads.emplace_back([]() {
+      for (size_t j = 0; j < 100; ++j) {
+        profile::count(profile::bfgs_iterations);
+      }
+    });
+  }
+  for (auto &t : threads) { t.join(); }
+
+  CHECK(profile::counter_value(profile::lh_evaluations) == 1);
+  CHECK(profile::counter_value(profile::partial_updates) == 5);
+  CHECK(profile::counter_value(profile::bfgs_iterations) == 400);
+
+  profile::disable();
+  profile::count(profile::lh_evaluations);
+  CHECK(profile::counter_value(profile::lh_evaluations) == 1);
+}
+
+TEST_CASE("profile hit rate", "[profile]") {
+  profile::enable();
+  CHECK(profile::hit_rate(profile::lh_cache_hits, profile::lh_cache_misses)
+        == 0.0);
+  profile::count(profile::lh_cache_hits);
+  profile::count(profile::lh_cache_misses, 3);
+  CHECK(profile::hit_rate(profile::lh_cache_hits, profile::lh_cache_misses)
+        == 0.25);
+  profile::disable();
+}
+
+TEST_CASE("profile phase timers", "[profile]") {
+  SECTION("nested phases are timed once") {
+    profile::enable();
+    {
+      profile::phase_timer_t outer{profile::alpha_optimization};
+      profile::phase_timer_t inner{profile::alpha_optimization};
+      profile::phase_timer_t other{profile::root_ranking};
+    }
+    CHECK(profile::phase_calls(profile::alpha_optimization) == 1);
+    CHECK(profile::phase_calls(profile::root_ranking) == 1);
+    CHECK(profile::phase_seconds(profile::alpha_optimization) >= 0.0);
+    profile::disable();
+  }
+
+  SECTION("nothing is timed when disabled") {
+    profile::enable();
+    profile::disable();
+    { profile::phase_timer_t timer{profile::checkpoint_io}; }
+    CHECK(profile::phase_calls(profile::checkpoint_io) == 0);
+  }
+}
+
+TEST_CASE("profile report", "[profile]") {
+  profile::enable();
+  profile::count(profile::newton_steps, 3);
+  profile::count(profile::lh_cache_hits, 3);
+  profile::count(profile::lh_cache_misses, 1);
+  { profile::phase_timer_t timer{profile::param_optimization}; }
+  profile::disable();
+
+  std::string filename = "/tmp/rd_test.profile.tsv";
+  profile::write_report(filename, 2);
+
+  std::ifstream infile{filename};
+  std::string   line;
+  std::getline(infile, line);
+  CHECK(line == "rank\tkind\tname\tvalue");
+
+  size_t lines      = 0;
+  bool   found_step = false;
+  bool   found_call = false;
+  bool   found_rate = false;
+  while (std::getline(infile, line)) {
+    lines++;
+    CHECK(line.substr(0, 2) == "2\t");
+    if (line == "2\tcounter\tnewton_steps\t3") { found_step = true; }
+    if (line == "2\tcalls\tparam_optimization\t1") { found_call = true; }
+    if (line == "2\trate\tlh_cache_hits\t0.75") { found_rate = true; }
+  }
+  CHECK(lines == profile::counter_count + 2 * profile::phase_count + 1);
+  CHECK(found_step);
+  CHECK(found_call);
+  CHECK(found_rate);
+
+  CHECK_THROWS(profile::write_report("/nonexistent/rd.profile.tsv", 0));
+}
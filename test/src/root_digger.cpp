@@ -0,0 +1,52 @@
+#include "data.hpp"
+#include <catch2/catch.hpp>
+#include <cmath>
+#include <numeric>
+#include <root_digger.hpp>
+#include <vector>
+
+TEST_CASE("root_digger search in memory", "[root_digger]") {
+  auto &             ds = data_files_dna["10.fasta"];
+  std::vector<msa_t> msa;
+  msa.emplace_back(ds.first);
+  rooted_tree_t tree{ds.second};
+
+  cli_options_t options;
+  options.seed      = 1234;
+  options.min_roots = 2;
+
+  SECTION("search") {
+    auto result = root_search(tree, msa, options);
+    CHECK(result.best.root_id < tree.root_count());
+    CHECK(std::isfinite(result.best.lh));
+    CHECK_FALSE(result.rooted_newick.empty());
+    CHECK(result.lwr.empty());
+    REQUIRE_FALSE(result.roots.empty());
+    for (auto &r : result.roots) { CHECK(r.lh <= result.best.lh); }
+  }
+
+  SECTION("exhaustive") {
+    options.exhaustive = true;
+    auto result        = root_search(tree, msa, options);
+    REQUIRE(result.roots.size() == tree.root_count());
+    REQUIRE(result.lwr.size() == tree.root_count());
+    for (size_t i = 0; i < result.roots.size(); ++i) {
+      CHECK(result.roots[i].root_id == i);
+      CHECK(result.roots[i].lh <= result.best.lh);
+    }
+    CHECK(std::accumulate(result.lwr.begin(), result.lwr.end(), 0.0)
+          == Approx(1.0));
+    CHECK(result.lwr_newick.find("LWR") != std::string::npos);
+  }
+
+  SECTION("the tree from a newick string") {
+    auto string_tree = rooted_tree_t::from_newick(tree.newick(false));
+    auto result      = root_search(string_tree, msa, options);
+    auto expected    = root_search(tree, msa, options);
+    CHECK(result.best.root_id == expected.best.root_id);
+    CHECK(result.best.lh == Approx(expected.best.lh));
+  }
+
+  options.min_roots = tree.root_count() + 1;
+  CHECK_THROWS(root_search(tree, msa, options));
+}
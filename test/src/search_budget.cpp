@@ -0,0 +1,46 @@
+#include <catch2/catch.hpp>
+#include <chrono>
+#include <search_budget.hpp>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+TEST_CASE("search budget evaluations", "[search_budget]") {
+  SECTION("no limit") {
+    search_budget_t budget{0.0, 0};
+    budget.count(1000000);
+    CHECK_FALSE(budget.exhausted());
+  }
+
+  SECTION("the evaluations run out") {
+    search_budget_t budget{0.0, 10};
+    budget.count(9);
+    CHECK_FALSE(budget.exhausted());
+    budget.count();
+    CHECK(budget.exhausted());
+    CHECK(budget.evaluations() == 10);
+  }
+
+  SECTION("threads share the count") {
+    search_budget_t          budget{0.0, 400};
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < 4; ++i) {
+      threads.emplace_back([&budget]() {
+        for (size_t j = 0; j < 100; ++j) { budget.count(); }
+      });
+    }
+    for (auto &t : threads) { t.join(); }
+    CHECK(budget.evaluations() == 400);
+    CHECK(budget.exhausted());
+  }
+}
+
+TEST_CASE("search budget time limit", "[search_budget]") {
+  search_budget_t budget{0.01, 0};
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  CHECK(budget.elapsed() >= 0.01);
+  CHECK(budget.exhausted());
+
+  CHECK_FALSE(search_budget_t(3600.0, 0).exhausted());
+  CHECK_THROWS_AS(search_budget_t(-1.0, 0), std::invalid_argument);
+}
@@ -0,0 +1,79 @@
+#include <catch2/catch.hpp>
+#include <set>
+#include <string>
+#include <tip_kernel.hpp>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+TEST_CASE("tip kernel site repeats ratio", "[tip_kernel]") {
+  /* Tips 0 to 3, with ((0,1),(2,3)) as inner nodes 4 and 5 */
+  std::vector<std::pair<size_t, size_t>> children{{2, 3}, {1, 4}};
+
+  SECTION("identical sequences") {
+    const char *seq = "AAAACCCC";
+    double      ratio = site_repeats_ratio({seq, seq, seq, seq}, children, 8);
+    CHECK(ratio == Approx(2.0 / 8.0));
+    CHECK(select_tip_kernel(tip_kernel::automatic, ratio)
+          == tip_kernel::site_repeats);
+  }
+
+  SECTION("no repeats at any node") {
+    double ratio =
+        site_repeats_ratio({"ACGT", "AAAA", "AACC", "ACGT"}, children, 4);
+    CHECK(ratio == Approx(1.0));
+    CHECK(select_tip_kernel(tip_kernel::automatic, ratio)
+          == tip_kernel::pattern_tip);
+  }
+
+  SECTION("repeats at a cherry are lost above it") {
+    double ratio =
+        site_repeats_ratio({"AAAA", "AAAA", "ACGT"}, {{0, 1}, {2, 3}}, 4);
+    CHECK(ratio == Approx((0.25 + 1.0) / 2.0));
+    CHECK(select_tip_kernel(tip_kernel::automatic, ratio)
+          == tip_kernel::pattern_tip);
+  }
+
+  SECTION("more classes than fit in a table") {
+    const unsigned int       sites = 1 << 17;
+    std::vector<std::string> seqs(4, std::string(sites, 'A'));
+    for (unsigned int site = 0; site < sites; ++site) {
+      for (size_t tip = 0; tip < seqs.size(); ++tip) {
+        seqs[tip][site] = static_cast<char>((site * (2 * tip + 1)) >> tip);
+      }
+    }
+
+    std::set<std::pair<char, char>>              left_pairs, right_pairs;
+    std::set<std::tuple<char, char, char, char>> top;
+    for (unsigned int site = 0; site < sites; ++site) {
+      left_pairs.emplace(seqs[0][site], seqs[1][site]);
+      right_pairs.emplace(seqs[2][site], seqs[3][site]);
+      top.emplace(seqs[0][site], seqs[1][site], seqs[2][site], seqs[3][site]);
+    }
+
+    std::vector<const char *> tips;
+    for (auto &seq : seqs) { tips.push_back(seq.c_str()); }
+    double expected = (left_pairs.size() + right_pairs.size() + top.size())
+                      / (3.0 * sites);
+    CHECK(site_repeats_ratio(tips, {{0, 1}, {2, 3}, {4, 5}}, sites)
+          == Approx(expected));
+  }
+
+  SECTION("nothing to count") {
+    CHECK(site_repeats_ratio({"A", "A"}, {}, 1) == 1.0);
+    CHECK(site_repeats_ratio({"A", "A"}, {{0, 1}}, 0) == 1.0);
+  }
+}
+
+TEST_CASE("tip kernel selection", "[tip_kernel]") {
+  CHECK(select_tip_kernel(tip_kernel::automatic, 0.2)
+        == tip_kernel::site_repeats);
+  CHECK(select_tip_kernel(tip_kernel::automatic, 0.9)
+        == tip_kernel::pattern_tip);
+  CHECK(select_tip_kernel(tip_kernel::automatic, 0.9, 0.95)
+        == tip_kernel::site_repeats);
+  CHECK(select_tip_kernel(tip_kernel::site_repeats, 0.9)
+        == tip_kernel::site_repeats);
+  CHECK(select_tip_kernel(tip_kernel::pattern_tip, 0.1)
+        == tip_kernel::pattern_tip);
+}
@@ -2,8 +2,11 @@ extern "C" {
 #include <libpll/pll.h>
 }
 #include "data.hpp"
+#include <algorithm>
 #include <catch2/catch.hpp>
+#include <cmath>
 #include <debug.h>
+#include <numeric>
 #include <tree.hpp>
 #include <utility>
 
@@ -66,6 +69,30 @@ TEST_CASE("rooted_tree_t string constructor", "[rooted_tree_t]") {
   }
 }
 
+TEST_CASE("rooted_tree_t from newick", "[rooted_tree_t]") {
+  for (auto &kv : data_files_dna) {
+    auto &        ds = kv.second;
+    rooted_tree_t file_tree{ds.second};
+    rooted_tree_t tree = rooted_tree_t::from_newick(file_tree.newick(false));
+    REQUIRE(tree.root_count() == file_tree.root_count());
+    for (size_t i = 0; i < tree.root_count(); ++i) {
+      CHECK(tree.root_location(i).edge->length
+            == Approx(file_tree.root_location(i).edge->length));
+    }
+  }
+
+  SECTION("taking a pll tree") {
+    auto &        ds = data_files_dna["10.fasta"];
+    rooted_tree_t tree{parse_tree_file(ds.second)};
+    CHECK(tree.root_count() == rooted_tree_t{ds.second}.root_count());
+  }
+
+  CHECK_THROWS_AS(rooted_tree_t::from_newick("((a,b);"),
+                  std::invalid_argument);
+  CHECK_THROWS_AS(rooted_tree_t{static_cast<pll_utree_t *>(nullptr)},
+                  std::invalid_argument);
+}
+
 TEST_CASE("rooted_tree string constructor no file", "[rooted_tree_t]") {
   REQUIRE_THROWS(rooted_tree_t{"not_a_tree_file"});
 }
@@ -110,6 +137,25 @@ TEST_CASE("rooted_tree move asignment constructor", "[rooted_tree_t]") {
   }
 }
 
+TEST_CASE("rooted_tree copies share the topology", "[rooted_tree_t]") {
+  auto          ds = GENERATE(as<std::string>{}, "single", "10.fasta");
+  rooted_tree_t tree1{data_files_dna[ds].second};
+  std::string   unrooted = tree1.newick(false);
+
+  rooted_tree_t tree2{tree1};
+  for (size_t i = 0; i < tree1.root_count(); ++i) {
+    CHECK(tree1.root_location(i).edge == tree2.root_location(i).edge);
+  }
+
+  auto rl = tree1.root_location(tree1.root_count() / 2);
+  tree2.root_by(rl);
+  CHECK(tree2.rooted());
+  CHECK(tree2.current_root().id == rl.id);
+  CHECK_FALSE(tree1.rooted());
+  CHECK(tree1.newick(false) == unrooted);
+  CHECK(tree2.newick(false) == tree1.rooted_newick(rl, false));
+}
+
 TEST_CASE("rooted_tree_t label map", "[rooted_tree_t]") {
   for (auto &kv : data_files_dna) {
     auto &        ds = kv.second;
@@ -407,6 +453,66 @@ TEST_CASE("rooted_tree_t annotations, all roots", "[rooted_tree_t]") {
            "foo=bar:fizz=buzz]):0.0;");
 }
 
+TEST_CASE("rooted_tree_t inner children", "[rooted_tree_t]") {
+  auto ds = GENERATE(as<std::string>{}, "single", "10.fasta", "101.phy");
+  rooted_tree_t t1(data_files_dna[ds].second);
+
+  auto check_children = [](const rooted_tree_t &tree) {
+    auto children = tree.inner_children();
+    REQUIRE(children.size() == tree.tip_count() - 2);
+
+    /* Every node is the child of exactly one later node, except the last
+     * inner node and the tip that the tree is rooted on */
+    std::vector<size_t> parents(tree.tip_count() + children.size(), 0);
+    for (size_t i = 0; i < children.size(); ++i) {
+      CHECK(children[i].first < tree.tip_count() + i);
+      CHECK(children[i].second < tree.tip_count() + i);
+      parents[children[i].first]++;
+      parents[children[i].second]++;
+    }
+    CHECK(std::count(parents.begin(), parents.begin() + tree.tip_count(), 0)
+          == 1);
+    CHECK(parents.back() == 0);
+    CHECK(std::count(parents.begin() + tree.tip_count(), parents.end(), 1)
+          == static_cast<long>(children.size() - 1));
+  };
+
+  check_children(t1);
+  t1.root_by(t1.roots()[t1.root_count() / 2]);
+  check_children(t1);
+}
+
+TEST_CASE("rooted_tree_t newick without copies", "[rooted_tree_t]") {
+  auto ds = GENERATE(as<std::string>{}, "single", "10.fasta", "101.phy");
+  rooted_tree_t t1(data_files_dna[ds].second);
+  for (auto rl : t1.roots()) { t1.annotate_lh(rl, 1.0); }
+
+  std::vector<std::string> rooted_strings;
+  std::vector<std::string> virtual_strings;
+  for (auto rl : t1.roots()) {
+    rooted_tree_t t2(t1);
+    t2.root_by(rl.id);
+    rooted_strings.push_back(t2.newick(false));
+    t2.unroot();
+    virtual_strings.push_back(t2.newick());
+  }
+
+  SECTION("unrooted tree") {
+    for (auto rl : t1.roots()) {
+      CHECK(t1.rooted_newick(rl, false) == rooted_strings[rl.id]);
+      CHECK(t1.virtual_rooted_newick(rl) == virtual_strings[rl.id]);
+    }
+  }
+
+  SECTION("rooted tree") {
+    t1.root_by(t1.roots()[t1.root_count() / 2]);
+    for (auto rl : t1.roots()) {
+      CHECK(t1.rooted_newick(rl, false) == rooted_strings[rl.id]);
+      CHECK(t1.virtual_rooted_newick(rl) == virtual_strings[rl.id]);
+    }
+  }
+}
+
 TEST_CASE("rooted_tree_t generate update root operations", "[rooted_tree_t]") {
   SECTION("Basic move root") {
     rooted_tree_t t1(data_files_dna["single"].second);
@@ -430,6 +536,23 @@ TEST_CASE("rooted_tree_t generate update root operations", "[rooted_tree_t]") {
     CHECK(pmats.size() == 0);
     CHECK(brlens.size() == 0);
   }
+  SECTION("Reusing a plan") {
+    rooted_tree_t t1(data_files_dna["single"].second);
+    rooted_tree_t t2(data_files_dna["single"].second);
+    t1.root_by(t1.root_location("a"));
+    t2.root_by(t2.root_location("a"));
+    operation_plan_t plan;
+    t1.fill_root_update_operations(t1.root_location("d"), plan);
+    auto results = t2.generate_root_update_operations(t2.root_location("d"));
+    CHECK(plan.ops.size() == std::get<0>(results).size());
+    CHECK(plan.pmatrix_indices == std::get<1>(results));
+    CHECK(plan.branch_lengths == std::get<2>(results));
+
+    auto capacity = plan.ops.capacity();
+    t1.fill_root_update_operations(t1.root_location("d"), plan);
+    CHECK(plan.ops.size() == 0);
+    CHECK(plan.ops.capacity() == capacity);
+  }
 }
 
 TEST_CASE("rooted_tree_t midpoint rooting", "[rooted_tree_t]") {
@@ -441,3 +564,94 @@ TEST_CASE("rooted_tree_t midpoint rooting", "[rooted_tree_t]") {
       "602800,b:0.445900):0.099300,d:0.639600):0.825200):0.223050):0.0;";
   CHECK(t1.newick(false) == correct_string);
 }
+
+TEST_CASE("rooted_tree_t root scores match the pairwise scores",
+          "[rooted_tree_t]") {
+  auto min_reduce = [](const std::vector<double> &vals) -> double {
+    return *std::min_element(vals.begin(), vals.end());
+  };
+  auto rms_reduce = [](const std::vector<double> &vals) -> double {
+    double acc = 0.0;
+    for (auto v : vals) { acc += v * v; }
+    return std::sqrt(acc / static_cast<double>(vals.size()));
+  };
+
+  for (auto &kv : data_files_dna) {
+    rooted_tree_t tree{kv.second.second};
+
+    auto expected_midpoint = tree.apply_foreach_branch_map_reduce(
+        rooted_tree_t::midpoint_score, min_reduce);
+    auto midpoint = tree.midpoint_scores();
+    REQUIRE(midpoint.size() == expected_midpoint.size());
+    for (size_t i = 0; i < midpoint.size(); ++i) {
+      CHECK(midpoint[i].first.id == expected_midpoint[i].first.id);
+      CHECK(midpoint[i].second
+            == Approx(expected_midpoint[i].second).epsilon(1e-12));
+    }
+
+    /* Rooting the tree doesn't change the midpoint scores */
+    tree.root_by(tree.root_location(tree.root_count() / 2));
+    auto rooted_midpoint = tree.midpoint_scores();
+    REQUIRE(rooted_midpoint.size() == midpoint.size());
+    for (size_t i = 0; i < midpoint.size(); ++i) {
+      CHECK(rooted_midpoint[i].second
+            == Approx(midpoint[i].second).epsilon(1e-12));
+    }
+    tree.unroot();
+
+    auto expected_mad = tree.apply_foreach_branch_map_reduce(
+        rooted_tree_t::mad_deviation, rms_reduce);
+    auto mad = tree.modified_mad_scores();
+    REQUIRE(mad.size() == expected_mad.size());
+    for (size_t i = 0; i < mad.size(); ++i) {
+      CHECK(mad[i].first.id == expected_mad[i].first.id);
+      CHECK(mad[i].second == expected_mad[i].second);
+    }
+  }
+}
+
+TEST_CASE("rooted_tree_t root neighbors", "[rooted_tree_t]") {
+  for (auto &kv : data_files_dna) {
+    auto &        ds = kv.second;
+    rooted_tree_t tree{ds.second};
+    auto          neighbors = tree.root_neighbors();
+    REQUIRE(neighbors.size() == tree.root_count());
+    for (size_t i = 0; i < neighbors.size(); ++i) {
+      auto rl = tree.root_location(i);
+      CHECK(neighbors[i].size() == (rl.is_internal() ? 4 : 2));
+      for (auto n : neighbors[i]) {
+        CHECK(n != i);
+        auto &back = neighbors[n];
+        CHECK(std::find(back.begin(), back.end(), i) != back.end());
+      }
+    }
+  }
+}
+
+TEST_CASE("rooted_tree_t adjacency order", "[rooted_tree_t]") {
+  auto &              ds = data_files_dna["10.fasta"];
+  rooted_tree_t       tree{ds.second};
+  auto                neighbors = tree.root_neighbors();
+  std::vector<size_t> ids(tree.root_count());
+  std::iota(ids.begin(), ids.end(), 0);
+  std::reverse(ids.begin(), ids.end());
+
+  auto order = tree.adjacency_order(ids);
+  REQUIRE(order.size() == ids.size());
+  CHECK(order.front() == ids.front());
+
+  std::vector<size_t> sorted_order{order};
+  std::sort(sorted_order.begin(), sorted_order.end());
+  std::sort(ids.begin(), ids.end());
+  CHECK(sorted_order == ids);
+
+  /* Every root after the first has a neighbor which came before it */
+  for (size_t i = 1; i < order.size(); ++i) {
+    bool found = false;
+    for (size_t j = 0; j < i; ++j) {
+      auto &n = neighbors[order[i]];
+      found   = found || std::find(n.begin(), n.end(), order[j]) != n.end();
+    }
+    CHECK(found);
+  }
+}
@@ -1,8 +1,17 @@
 #include "data.hpp"
 #include "test_util.hpp"
+#include <algorithm>
 #include <catch2/catch.hpp>
 #include <random>
+#include <thread>
+#include <unordered_set>
 #include <util.hpp>
+#if defined(__linux__)
+#include <sched.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 TEST_CASE("cli_options_t comparison operators", "[cli_options_t]"){
   cli_options_t cli1;
@@ -19,3 +28,66 @@ TEST_CASE("cli_options_t comparison operators", "[cli_options_t]"){
     CHECK(cli1 != cli2);
   }
 }
+
+#if defined(_OPENMP) && defined(__linux__)
+TEST_CASE("sysutil_get_thread_cpus", "[util]") {
+  auto   nodes   = sysutil_get_numa_cpus();
+  size_t threads = 4;
+  REQUIRE(nodes.size() > 0);
+
+  SECTION("one process uses every node") {
+    auto cpus = sysutil_get_thread_cpus(0, 1, threads);
+    CHECK(cpus.size() == threads);
+    CHECK(cpus[0] == nodes[0][0]);
+  }
+
+  SECTION("processes on the same node don't share cores") {
+    size_t local_size = nodes.size() * 2;
+    for (size_t node = 0; node < nodes.size(); ++node) {
+      if (nodes[node].size() < 2) { continue; }
+      auto first  = sysutil_get_thread_cpus(node * 2, local_size, threads);
+      auto second = sysutil_get_thread_cpus(node * 2 + 1, local_size, threads);
+      for (auto cpu : first) {
+        CHECK(std::find(nodes[node].begin(), nodes[node].end(), cpu)
+              != nodes[node].end());
+        CHECK(std::find(second.begin(), second.end(), cpu) == second.end());
+      }
+    }
+  }
+
+  SECTION("bad rank") {
+    CHECK_THROWS(sysutil_get_thread_cpus(2, 2, threads));
+  }
+}
+
+TEST_CASE("sysutil_pin_threads", "[util]") {
+  cpu_set_t original;
+  REQUIRE(sched_getaffinity(0, sizeof(original), &original) == 0);
+
+  auto cpus = sysutil_get_thread_cpus(0, 1, 4);
+  REQUIRE(sysutil_pin_threads(cpus));
+
+  /* The main thread keeps the cpu of OpenMP thread 0 */
+  cpu_set_t main_set;
+  REQUIRE(sched_getaffinity(0, sizeof(main_set), &main_set) == 0);
+  CHECK(CPU_COUNT(&main_set) == 1);
+  CHECK(CPU_ISSET(cpus[0], &main_set));
+
+  /* Each worker gets its own share of the cpus */
+  for (size_t worker = 0; worker < 2; ++worker) {
+    cpu_set_t worker_set;
+    CPU_ZERO(&worker_set);
+    bool pinned = false;
+    std::thread([&]() {
+      omp_set_num_threads(1);
+      pinned = sysutil_pin_worker(worker, 2);
+      sched_getaffinity(0, sizeof(worker_set), &worker_set);
+    }).join();
+    CHECK(pinned);
+    CHECK(CPU_COUNT(&worker_set) == 1);
+    CHECK(CPU_ISSET(cpus[worker * cpus.size() / 2], &worker_set));
+  }
+
+  sched_setaffinity(0, sizeof(original), &original);
+}
+#endif
@@ -0,0 +1,47 @@
+#include <catch2/catch.hpp>
+#include <vector>
+#include <warm_start.hpp>
+
+static std::vector<partition_parameters_t> make_params(double value) {
+  partition_parameters_t pp;
+  pp.subst_rates = {value};
+  pp.freqs       = {value};
+  return {pp};
+}
+
+TEST_CASE("warm_start_cache_t lookup", "[warm_start_cache_t]") {
+  /* A path of roots, 0 - 1 - 2 - 3 */
+  warm_start_cache_t cache{{{1}, {0, 2}, {1, 3}, {2}}};
+
+  std::vector<partition_parameters_t> params = make_params(0.0);
+  CHECK_FALSE(cache.lookup(1, params));
+  CHECK(params[0].subst_rates[0] == 0.0);
+
+  cache.insert(0, -100.0, make_params(1.0));
+  CHECK(cache.lookup(1, params));
+  CHECK(params[0].subst_rates[0] == 1.0);
+  CHECK_FALSE(cache.lookup(3, params));
+
+  SECTION("the best neighbor is picked") {
+    cache.insert(2, -50.0, make_params(2.0));
+    CHECK(cache.lookup(1, params));
+    CHECK(params[0].subst_rates[0] == 2.0);
+  }
+
+  SECTION("only better results replace old ones") {
+    cache.insert(0, -200.0, make_params(3.0));
+    CHECK(cache.lookup(1, params));
+    CHECK(params[0].subst_rates[0] == 1.0);
+    cache.insert(0, -10.0, make_params(4.0));
+    CHECK(cache.lookup(1, params));
+    CHECK(params[0].subst_rates[0] == 4.0);
+    CHECK(cache.size() == 1);
+  }
+
+  SECTION("a root is its own neighbor") {
+    CHECK(cache.lookup(0, params));
+    CHECK(params[0].subst_rates[0] == 1.0);
+  }
+
+  CHECK_THROWS(cache.lookup(4, params));
+}
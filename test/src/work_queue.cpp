@@ -0,0 +1,77 @@
+#include <algorithm>
+#include <catch2/catch.hpp>
+#include <numeric>
+#include <thread>
+#include <vector>
+#include <work_queue.hpp>
+
+TEST_CASE("work_queue_t hands out all the work in order", "[work_queue_t]") {
+  std::vector<size_t> work{5, 3, 9, 1, 0};
+
+  for (bool dynamic : {false, true}) {
+    work_queue_t        queue{work, dynamic};
+    std::vector<size_t> received;
+    size_t              item = 0;
+    while (queue.next(item)) {
+      received.push_back(item);
+      CHECK(queue.position() == received.size());
+    }
+    CHECK(received == work);
+    CHECK(queue.completed() == work.size());
+    CHECK(queue.position() == queue.size());
+    CHECK_FALSE(queue.next(item));
+  }
+}
+
+TEST_CASE("work_queue_t with no work", "[work_queue_t]") {
+  work_queue_t queue{{}, true};
+  size_t       item = 0;
+  CHECK_FALSE(queue.next(item));
+  CHECK(queue.completed() == 0);
+  CHECK(queue.utilization() >= 0.0);
+  CHECK(queue.utilization() <= 1.0);
+}
+
+TEST_CASE("work_queue_t shared between threads", "[work_queue_t]") {
+  std::vector<size_t> work(100);
+  std::iota(work.begin(), work.end(), 0);
+
+  constexpr size_t                 workers = 4;
+  work_queue_t                     queue{work, false, workers};
+  std::vector<std::vector<size_t>> received(workers);
+  std::vector<std::thread>         threads;
+  for (size_t i = 0; i < workers; ++i) {
+    threads.emplace_back([&queue, &received, i]() {
+      size_t item = 0;
+      while (queue.next(item, i)) { received[i].push_back(item); }
+    });
+  }
+  for (auto &t : threads) { t.join(); }
+
+  std::vector<size_t> all;
+  for (auto &r : received) { all.insert(all.end(), r.begin(), r.end()); }
+  std::sort(all.begin(), all.end());
+  CHECK(all == work);
+  CHECK(queue.completed() == work.size());
+  CHECK(queue.utilization() >= 0.0);
+  CHECK(queue.utilization() <= 1.0);
+}
+
+TEST_CASE("work_queue_t stopped early", "[work_queue_t]") {
+  std::vector<size_t> work{5, 3, 9, 1, 0};
+
+  for (bool dynamic : {false, true}) {
+    work_queue_t queue{work, dynamic};
+    size_t       item = 0;
+    REQUIRE(queue.next(item));
+    REQUIRE(queue.next(item));
+    CHECK_FALSE(queue.stopped());
+    queue.stop();
+    CHECK(queue.stopped());
+    CHECK_FALSE(queue.next(item));
+    CHECK(queue.completed() == 2);
+    CHECK(queue.position() == 2);
+    queue.stop();
+    CHECK_FALSE(queue.next(item));
+  }
+}